@@ -0,0 +1,612 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cxxopts.hpp>
+#include <fftw3.h>
+#include <fmt/core.h>
+#include <fstream>
+#include <iostream>
+#include <omp.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "gbptrees.hpp"
+#include "grid.hpp"
+#include "options.hpp"
+#include "profile.hpp"
+#include "synthetic.hpp"
+#include "utils.hpp"
+#include "velociraptor.hpp"
+
+/** Return the number of seconds taken to call `fn` `n_reps` times.
+ */
+template <typename Fn>
+static double time_reps(const int n_reps, Fn fn)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int ii = 0; ii < n_reps; ++ii) {
+    fn();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+/** Return the number of seconds taken by each of `n_reps` calls to `fn`, calling `setup` (untimed) before each.
+ */
+template <typename Setup, typename Fn>
+static std::vector<double> time_each(const int n_reps, Setup setup, Fn fn)
+{
+  std::vector<double> seconds;
+  for (int ii = 0; ii < n_reps; ++ii) {
+    setup();
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    seconds.push_back(elapsed.count());
+  }
+  return seconds;
+}
+
+/** The timing of one stage at one grid size and thread count.
+ */
+struct StageResult
+{
+  std::string stage; //< The name of the stage
+  int dim;           //< The grid dimension
+  int n_threads;     //< The number of OpenMP threads
+  int n_reps;        //< The number of timed repetitions
+  double best;       //< The fastest repetition, in seconds
+  double mean;       //< The mean time per repetition, in seconds
+  double cells;      //< The number of full resolution cells processed per repetition
+  double bytes;      //< The nominal number of bytes read and written per repetition
+};
+
+/** Fill the first `n_logical` elements of a grid with a deterministic field of order unity, in real ordering.
+ */
+static void fill_grid(Grid<float>& grid)
+{
+  auto grid_ = grid.get();
+  const int n_logical = grid.n_logical;
+#pragma omp parallel for schedule(static) default(none) firstprivate(grid_, n_logical)
+  for (int ii = 0; ii < n_logical; ++ii) {
+    grid_[ii] = 1.0f + 0.5f * std::sin(0.001f * (float)(((uint32_t)ii * 2654435761u) >> 12));
+  }
+  grid.flag_padded = false;
+}
+
+/** Time each stage of the FFT method for one grid size, using the current number of OpenMP threads.
+ *
+ * Every repetition starts from the same state, which is restored outside of the timed region, so that the filters
+ * are applied to a realistic spectrum rather than to their own output.
+ *
+ * @param dim The grid dimension
+ * @param ratio The ratio of the input and output dimensions (which also sets the filter radius, in cells)
+ * @param n_reps The number of repetitions of each stage
+ * @return The timing of each stage
+ */
+static std::vector<StageResult> bench_stages_dim(const int dim, const int ratio, const int n_reps)
+{
+  const std::array<int, 3> n_cell = { dim, dim, dim };
+  const std::array<int, 3> new_n_cell = { dim / ratio, dim / ratio, dim / ratio };
+  const std::array<double, 3> box_size = { (double)dim, (double)dim, (double)dim };
+
+  GridOptions options;
+  options.first_touch = true;
+  Grid<float> grid(n_cell, box_size, options);
+  grid.wait_for_plans();
+
+  const double n_logical = grid.n_logical;
+  const double n_padded = grid.n_padded;
+  const double n_sampled = (double)new_n_cell[0] * new_n_cell[1] * new_n_cell[2];
+  const double scalar = sizeof(float);
+  const double complex = sizeof(std::complex<float>);
+  const int n_threads = omp_get_max_threads();
+
+  std::vector<StageResult> results;
+  auto record = [&](const std::string stage, const std::vector<double>& seconds, const double bytes) {
+    double total = 0;
+    for (const auto s : seconds) {
+      total += s;
+    }
+    results.push_back(
+      { stage, dim, n_threads, n_reps, *std::min_element(seconds.begin(), seconds.end()), total / n_reps, n_logical,
+        bytes });
+  };
+
+  auto reset = [&]() {
+    grid.update_properties(n_cell);
+    fill_grid(grid);
+  };
+  auto transformed = [&]() {
+    reset();
+    grid.forward_fft();
+  };
+
+  // Warm up the plans and the pages of the buffer
+  transformed();
+  grid.reverse_fft();
+
+  record("real_to_padded_order",
+         time_each(n_reps, reset, [&]() { grid.real_to_padded_order(); }),
+         2 * n_logical * scalar);
+
+  record("forward_fft", time_each(n_reps, reset, [&]() { grid.forward_fft(); }), 2 * n_padded * scalar);
+
+  for (const auto type : { GridBase::filter_type::real_top_hat,
+                           GridBase::filter_type::k_top_hat,
+                           GridBase::filter_type::gaussian }) {
+    record(fmt::format("convolve_{}", filter_name(type)),
+           time_each(n_reps, transformed, [&]() { grid.convolve(type, (double)ratio); }),
+           2 * grid.n_complex * complex);
+  }
+
+  record("reverse_fft",
+         time_each(n_reps, transformed, [&]() { grid.reverse_fft(); }),
+         2 * n_padded * scalar + 2 * n_logical * scalar);
+
+  record("padded_to_real_order",
+         time_each(
+           n_reps,
+           [&]() {
+             reset();
+             grid.flag_padded = true;
+           },
+           [&]() { grid.padded_to_real_order(); }),
+         2 * n_logical * scalar);
+
+  record("sample", time_each(n_reps, reset, [&]() { grid.sample(new_n_cell); }), 3 * n_sampled * scalar);
+
+  // The whole of `Grid::filter` with each engine, for the real space top-hat
+  const auto filter_type = GridBase::filter_type::real_top_hat;
+  record("filter_fftw_3d",
+         time_each(n_reps, reset, [&]() { grid.filter(filter_type, (double)ratio); }),
+         4 * n_logical * scalar + 4 * n_padded * scalar + 2 * grid.n_complex * complex);
+
+  options.engine = fft_engine::out_of_place;
+  Grid<float> out_of_place(n_cell, box_size, options);
+  auto reset_out_of_place = [&]() { fill_grid(out_of_place); };
+  reset_out_of_place();
+  out_of_place.filter(filter_type, (double)ratio);
+  record("filter_out_of_place",
+         time_each(n_reps, reset_out_of_place, [&]() { out_of_place.filter(filter_type, (double)ratio); }),
+         2 * n_logical * scalar + 2 * n_padded * scalar + 2 * grid.n_complex * complex);
+
+  options.engine = fft_engine::fused;
+  Grid<float> fused(n_cell, box_size, options);
+  auto reset_fused = [&]() { fill_grid(fused); };
+  reset_fused();
+  fused.filter(filter_type, (double)ratio);
+  record("filter_fused",
+         time_each(n_reps, reset_fused, [&]() { fused.filter(filter_type, (double)ratio); }),
+         2 * n_logical * scalar + 2 * n_padded * scalar + 2 * grid.n_complex * complex);
+
+  return results;
+}
+
+/** Time each stage of the FFT method over a range of grid sizes and thread counts.
+ *
+ * The FFT stages are timed as called by `Grid::filter`, so `forward_fft` includes `real_to_padded_order` and
+ * `reverse_fft` includes `padded_to_real_order`.  Throughput is given in cells of the full resolution grid per second
+ * and in GB/s of the nominal traffic (each element read and written once per pass).
+ *
+ * @param dims The grid dimensions
+ * @param threads The thread counts
+ * @param ratio The ratio of the input and output dimensions
+ * @param n_reps The number of repetitions of each stage
+ * @param json_fname If not empty, the results are also written to this file as JSON
+ */
+static void bench_stages(const std::vector<int>& dims,
+                         const std::vector<int>& threads,
+                         const int ratio,
+                         const int n_reps,
+                         const std::string json_fname)
+{
+  std::vector<StageResult> results;
+  const auto row = "{:<22} {:>5} {:>7} {:>11} {:>11} {:>12} {:>8}\n";
+
+  for (const auto n_threads : threads) {
+    omp_set_num_threads(n_threads);
+    for (const auto dim : dims) {
+      if (dim % ratio != 0) {
+        throw std::runtime_error(fmt::format("The dimension {} is not divisible by the ratio {}", dim, ratio));
+      }
+      fmt::print("{}^3 grid, {} thread(s), {} rep(s)\n", dim, n_threads, n_reps);
+      for (const auto& result : bench_stages_dim(dim, ratio, n_reps)) {
+        results.push_back(result);
+      }
+    }
+  }
+
+  fmt::print("\n");
+  fmt::print(row, "stage", "dim", "threads", "best (s)", "mean (s)", "Mcells/s", "GB/s");
+  for (const auto& result : results) {
+    fmt::print(row,
+               result.stage,
+               result.dim,
+               result.n_threads,
+               fmt::format("{:.4e}", result.best),
+               fmt::format("{:.4e}", result.mean),
+               fmt::format("{:.1f}", result.cells / result.best * 1e-6),
+               fmt::format("{:.2f}", result.bytes / result.best * 1e-9));
+  }
+
+  if (!json_fname.empty()) {
+    std::ofstream ofs(json_fname);
+    if (!ofs) {
+      throw std::runtime_error(fmt::format("Failed to open {} to write the results", json_fname));
+    }
+
+    ofs << "{\n  \"benchmark\": \"stages\",\n  \"precision\": \"float\",\n";
+    ofs << fmt::format("  \"fftw\": \"{}\",\n  \"ratio\": {},\n  \"results\": [\n", fftwf_version, ratio);
+    for (size_t ii = 0; ii < results.size(); ++ii) {
+      const auto& result = results[ii];
+      ofs << fmt::format("    {{\"stage\": \"{}\", \"dim\": {}, \"threads\": {}, \"reps\": {}, "
+                         "\"best_seconds\": {:.6e}, \"mean_seconds\": {:.6e}, \"cells_per_second\": {:.6e}, "
+                         "\"gb_per_second\": {:.6e}}}{}\n",
+                         result.stage,
+                         result.dim,
+                         result.n_threads,
+                         result.n_reps,
+                         result.best,
+                         result.mean,
+                         result.cells / result.best,
+                         result.bytes / result.best * 1e-9,
+                         ii + 1 < results.size() ? "," : "");
+    }
+    ofs << "  ]\n}\n";
+    fmt::print("\nResults written to {}\n", json_fname);
+  }
+}
+
+/** Compare the FFT throughput of a grid first touched by a single thread with one first touched in parallel.
+ *
+ * Without `GridOptions::first_touch` the buffer is zeroed by the main thread, as happens when a grid is read from
+ * disk, so on a multi-socket node all of its pages land on one NUMA node.  Run with `OMP_PROC_BIND=spread
+ * OMP_PLACES=cores` so that the threads stay on their sockets.
+ *
+ * @param dim The grid dimension
+ * @param n_reps The number of forward + reverse transform pairs to time
+ */
+static void bench_first_touch(const int dim, const int n_reps)
+{
+  const std::array<int, 3> n_cell = { dim, dim, dim };
+  const std::array<double, 3> box_size = { (double)dim, (double)dim, (double)dim };
+  const double n_logical = (double)dim * dim * dim;
+  const double flops = 5.0 * n_logical * std::log2(n_logical);
+
+  fmt::print("{}^3 grid, {} thread(s), {} rep(s)\n", dim, omp_get_max_threads(), n_reps);
+
+  for (const bool first_touch : { false, true }) {
+    GridOptions options;
+    options.first_touch = first_touch;
+    Grid<float> grid(n_cell, box_size, options);
+    if (!first_touch) {
+      std::memset(grid.get(), 0, sizeof(float) * grid.n_padded);
+    }
+
+    // Warm up
+    grid.forward_fft();
+    grid.reverse_fft();
+
+    const double seconds = time_reps(n_reps, [&]() {
+      grid.forward_fft();
+      grid.reverse_fft();
+    });
+    fmt::print("first touch {:<8} {:8.3f} s per pair {:8.2f} Gflop/s\n",
+               first_touch ? "parallel" : "serial",
+               seconds / n_reps,
+               n_reps * flops / seconds * 1e-9);
+  }
+}
+
+/** The timing of one end-to-end regridding run.
+ */
+struct ScalingResult
+{
+  int dim;                             //< The input grid dimension
+  int n_threads;                       //< The number of OpenMP threads
+  double seconds;                      //< The wall clock time of the whole run
+  std::array<double, n_phases> phases; //< The time spent in each phase
+  double speedup;                      //< The speedup relative to the first run of the series
+  double efficiency;                   //< The parallel efficiency relative to the first run of the series
+
+  /** Time spent reading and writing (excluding streaming, which interleaves reading and downsampling).
+   */
+  double io() const { return phases[(int)phase::read] + phases[(int)phase::write]; }
+
+  /** Time spent allocating and planning.
+   */
+  double plan() const { return phases[(int)phase::setup]; }
+
+  /** Time spent filtering, sampling and streaming.
+   */
+  double compute() const
+  {
+    return phases[(int)phase::filter] + phases[(int)phase::sample] + phases[(int)phase::stream];
+  }
+};
+
+/** Return a cheap, deterministic field for synthetic inputs: an order unity density and velocities of order 100.
+ */
+static plane_filler synthetic_field(const std::array<int, 3> n_cell, const int i_density)
+{
+  return [n_cell, i_density](const int i_grid, const int i, float* plane) {
+    const int ny = n_cell[1];
+    const int nz = n_cell[2];
+    const float offset = i_grid == i_density ? 1.0f : 0.0f;
+    const float amplitude = i_grid == i_density ? 0.5f : 100.0f;
+    const uint32_t seed = (uint32_t)i_grid * 0x9e3779b9u + (uint32_t)i * (uint32_t)ny * (uint32_t)nz;
+#pragma omp parallel for schedule(static) default(none) firstprivate(plane, ny, nz, offset, amplitude, seed)
+    for (int jj = 0; jj < ny; ++jj) {
+      for (int kk = 0; kk < nz; ++kk) {
+        const uint32_t hash = ((seed + (uint32_t)(jj * nz + kk)) * 2654435761u) >> 12;
+        plane[(size_t)jj * nz + kk] = offset + amplitude * std::sin(0.001f * (float)hash);
+      }
+    }
+  };
+}
+
+/** Run `regrider` end to end on synthetic input over a sweep of thread counts.
+ *
+ * In strong scaling mode each input dimension is regridded with every thread count.  In weak scaling mode the input
+ * dimension grows with the cube root of the thread count (rounded to a multiple of `ratio`), so that the work per
+ * thread stays roughly constant.  The time of each run is split into I/O (reading and writing), planning (setup) and
+ * compute (filtering, sampling and streaming) using the phase measurements of the run.
+ *
+ * @param format The input format: gbptrees or velociraptor
+ * @param mode The kind of scaling: strong or weak
+ * @param dims The input grid dimensions (the starting dimensions in weak scaling mode)
+ * @param threads The thread counts
+ * @param ratio The ratio of the input and output dimensions
+ * @param options Options passed on to the regridding
+ * @param dir The directory the synthetic files are written to
+ * @param json_fname If not empty, the results are also written to this file as JSON
+ */
+static void bench_scaling(const std::string format,
+                          const std::string mode,
+                          const std::vector<int>& dims,
+                          const std::vector<int>& threads,
+                          const int ratio,
+                          const RegridOptions& options,
+                          const std::string dir,
+                          const std::string json_fname)
+{
+  const bool velociraptor = format == "velociraptor";
+  const bool weak = mode == "weak";
+  if (!velociraptor && format != "gbptrees") {
+    throw std::runtime_error(fmt::format("Unrecognised input format '{}'", format));
+  }
+  if (!weak && mode != "strong") {
+    throw std::runtime_error(fmt::format("Unrecognised scaling mode '{}'", mode));
+  }
+
+  const std::string suffix = velociraptor ? ".h5" : ".gbp";
+  const std::string fname_in = dir + "/regrider_scaling_in" + suffix;
+  const std::string fname_out = dir + "/regrider_scaling_out" + suffix;
+
+  auto write_input = [&](const int dim) {
+    const std::array<int, 3> n_cell = { dim, dim, dim };
+    const std::array<double, 3> box_size = { 100.0, 100.0, 100.0 };
+    fmt::print("Writing a synthetic {}^3 {} file to {}... ", dim, format, fname_in);
+    std::cout << std::flush;
+    if (velociraptor) {
+      write_synthetic_velociraptor(fname_in, n_cell, box_size, synthetic_field(n_cell, 3));
+    } else {
+      write_synthetic_gbptrees(fname_in, n_cell, box_size, { "density", "vx" }, synthetic_field(n_cell, 0));
+    }
+    print_done();
+  };
+
+  auto run = [&](const int dim, const int n_threads) {
+    omp_set_num_threads(n_threads);
+    if (velociraptor) {
+      create_velociraptor_output(fname_out, dim);
+    }
+    reset_phase_stats();
+
+    auto start = std::chrono::steady_clock::now();
+    if (velociraptor) {
+      regrid_velociraptor<float>(fname_in, fname_out, dim / ratio, options);
+    } else {
+      regrid_gbptrees<float>(fname_in, fname_out, dim / ratio, options);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    ScalingResult result = { dim, n_threads, elapsed.count(), {}, 1, 1 };
+    for (int ii = 0; ii < n_phases; ++ii) {
+      result.phases[ii] = phase_stats()[ii].seconds;
+    }
+    std::remove(fname_out.c_str());
+    std::remove((fname_out + ".stats").c_str());
+    return result;
+  };
+
+  std::vector<ScalingResult> results;
+  for (const auto base_dim : dims) {
+    if (!weak) {
+      write_input(base_dim);
+    }
+
+    const size_t first = results.size();
+    for (const auto n_threads : threads) {
+      int dim = base_dim;
+      if (weak) {
+        const double scaled = base_dim * std::cbrt((double)n_threads / threads[0]) / ratio;
+        dim = ratio * std::max(1, (int)std::lround(scaled));
+        write_input(dim);
+      }
+      if (dim % ratio != 0) {
+        throw std::runtime_error(fmt::format("The dimension {} is not divisible by the ratio {}", dim, ratio));
+      }
+
+      fmt::print("\n{} scaling: {}^3 grid, {} thread(s)\n", mode, dim, n_threads);
+      auto result = run(dim, n_threads);
+
+      // Weak scaling is ideal when the time is constant, strong scaling when it falls in proportion to the threads
+      const auto& base = results.size() > first ? results[first] : result;
+      const double work = weak ? std::pow((double)dim / base.dim, 3) : 1.0;
+      result.speedup = base.seconds / result.seconds * work;
+      result.efficiency = result.speedup * base.n_threads / n_threads;
+      results.push_back(result);
+    }
+  }
+  std::remove(fname_in.c_str());
+
+  const auto row = "{:>5} {:>7} {:>9} {:>9} {:>9} {:>9} {:>8} {:>10}\n";
+  fmt::print("\n{} scaling of {} input (ratio {}, method {})\n", mode, format, ratio, method_name(options.method));
+  fmt::print(row, "dim", "threads", "total (s)", "io (s)", "plan (s)", "comp (s)", "speedup", "efficiency");
+  for (const auto& result : results) {
+    fmt::print(row,
+               result.dim,
+               result.n_threads,
+               fmt::format("{:.3f}", result.seconds),
+               fmt::format("{:.3f}", result.io()),
+               fmt::format("{:.3f}", result.plan()),
+               fmt::format("{:.3f}", result.compute()),
+               fmt::format("{:.2f}", result.speedup),
+               fmt::format("{:.2f}", result.efficiency));
+  }
+
+  if (!json_fname.empty()) {
+    std::ofstream ofs(json_fname);
+    if (!ofs) {
+      throw std::runtime_error(fmt::format("Failed to open {} to write the results", json_fname));
+    }
+
+    const char* bind = getenv("OMP_PROC_BIND");
+    ofs << fmt::format("{{\n  \"benchmark\": \"scaling\",\n  \"format\": \"{}\",\n  \"mode\": \"{}\",\n", format, mode);
+    ofs << fmt::format("  \"method\": \"{}\",\n  \"ratio\": {},\n  \"omp_proc_bind\": \"{}\",\n  \"results\": [\n",
+                       method_name(options.method),
+                       ratio,
+                       bind != nullptr ? bind : "");
+    for (size_t ii = 0; ii < results.size(); ++ii) {
+      const auto& result = results[ii];
+      ofs << fmt::format("    {{\"dim\": {}, \"threads\": {}, \"seconds\": {:.6e}, \"io_seconds\": {:.6e}, "
+                         "\"plan_seconds\": {:.6e}, \"compute_seconds\": {:.6e}",
+                         result.dim,
+                         result.n_threads,
+                         result.seconds,
+                         result.io(),
+                         result.plan(),
+                         result.compute());
+      for (int jj = 0; jj < n_phases; ++jj) {
+        ofs << fmt::format(", \"{}_seconds\": {:.6e}", phase_name(static_cast<phase>(jj)), result.phases[jj]);
+      }
+      ofs << fmt::format(", \"speedup\": {:.6e}, \"efficiency\": {:.6e}}}{}\n",
+                         result.speedup,
+                         result.efficiency,
+                         ii + 1 < results.size() ? "," : "");
+    }
+    ofs << "  ]\n}\n";
+    fmt::print("\nResults written to {}\n", json_fname);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  cxxopts::Options options("regrider_bench", "Micro-benchmarks for regrider");
+
+  options.add_options() // clang-format off
+        ("b,benchmark", "benchmark to run: first-touch, stages or scaling", cxxopts::value<std::string>()->default_value("first-touch"))
+        ("d,dim", "grid dimension (first-touch)", cxxopts::value<int>()->default_value("256"))
+        ("dims", "grid dimensions (stages, scaling)", cxxopts::value<std::vector<int>>()->default_value("64,128,256"))
+        ("threads", "thread counts (stages, scaling; default: powers of two up to the maximum)", cxxopts::value<std::vector<int>>())
+        ("ratio", "ratio of the input and output dimensions (stages, scaling)", cxxopts::value<int>()->default_value("4"))
+        ("json", "also write the results to this file as JSON (stages, scaling)", cxxopts::value<std::string>())
+        ("format", "synthetic input format: gbptrees or velociraptor (scaling)", cxxopts::value<std::string>()->default_value("gbptrees"))
+        ("mode", "strong or weak scaling (scaling)", cxxopts::value<std::string>()->default_value("strong"))
+        ("method", "downsampling method: auto, fft, block-average or gaussian (scaling)", cxxopts::value<std::string>()->default_value("fft"))
+        ("dir", "directory for the synthetic files (scaling)", cxxopts::value<std::string>()->default_value("."))
+        ("reps", "number of repetitions", cxxopts::value<int>()->default_value("5"))
+        ("h,help", "show help", cxxopts::value<bool>());
+
+    // Parsing consumes the arguments, but we may need them to re-execute
+    std::vector<char*> args(argv, argv + argc + 1);
+
+    auto vm = options.parse(argc, argv);
+
+    if (vm.count("help")) {
+        fmt::print(options.help());
+        return 0;
+    }
+
+    const auto benchmark = vm["benchmark"].as<std::string>();
+
+    // Scaling runs pin their threads, and the OpenMP runtime only reads its affinity settings when it is loaded
+    if (benchmark == "scaling" && getenv("OMP_PROC_BIND") == nullptr) {
+        setenv("OMP_PROC_BIND", "close", 1);
+        setenv("OMP_PLACES", "cores", 0);
+        execv("/proc/self/exe", args.data());
+        fmt::print(stderr, "Unable to re-execute with OpenMP affinity set, continuing without it...\n");
+    }
+
+    std::vector<int> threads;
+    if (vm.count("threads")) {
+        threads = vm["threads"].as<std::vector<int>>();
+    } else {
+        const int max_threads = omp_get_max_threads();
+        for (int n_threads = 1; n_threads < max_threads; n_threads *= 2) {
+            threads.push_back(n_threads);
+        }
+        threads.push_back(max_threads);
+    }
+    const auto dims = vm["dims"].as<std::vector<int>>();
+    const auto ratio = vm["ratio"].as<int>();
+    const auto json_fname = vm.count("json") ? vm["json"].as<std::string>() : std::string();
+
+    fftwf_init_threads();
+
+    int status = 0;
+    try {
+        if (benchmark == "first-touch") {
+            bench_first_touch(vm["dim"].as<int>(), vm["reps"].as<int>());
+        } else if (benchmark == "stages") {
+            bench_stages(dims, threads, ratio, vm["reps"].as<int>(), json_fname);
+        } else if (benchmark == "scaling") {
+            RegridOptions regrid_options;
+            regrid_options.method = parse_method(vm["method"].as<std::string>());
+            bench_scaling(vm["format"].as<std::string>(),
+                          vm["mode"].as<std::string>(),
+                          dims,
+                          threads,
+                          ratio,
+                          regrid_options,
+                          vm["dir"].as<std::string>(),
+                          json_fname);
+        } else {
+            fmt::print(stderr, "Unrecognised benchmark '{}'\n", benchmark);
+            status = 1;
+        }
+    } catch (const std::runtime_error& e) {
+        fmt::print(stderr, "Error: {}\n", e.what());
+        status = 1;
+    }
+
+    fftwf_cleanup_threads();
+
+    return status;
+}
@@ -22,12 +22,22 @@ find_library(FFTW_LIBRARY NAME fftw3f
     PATHS "${FFTW_ROOT}/lib"
     HINTS ${PC_FFTW_LIBDIR} ${PC_FFTW_LIBRARY_DIRS})
 
-set(FFTW_LIBRARIES ${FFTW_OMP_LIBRARY} ${FFTW_LIBRARY})
+# Double precision, for Grid<double>
+find_library(FFTW_DOUBLE_OMP_LIBRARY NAME fftw3_omp
+    PATHS "${FFTW_ROOT}/lib"
+    HINTS ${PC_FFTW_LIBDIR} ${PC_FFTW_LIBRARY_DIRS})
+
+find_library(FFTW_DOUBLE_LIBRARY NAME fftw3
+    PATHS "${FFTW_ROOT}/lib"
+    HINTS ${PC_FFTW_LIBDIR} ${PC_FFTW_LIBRARY_DIRS})
+
+set(FFTW_LIBRARIES ${FFTW_OMP_LIBRARY} ${FFTW_LIBRARY} ${FFTW_DOUBLE_OMP_LIBRARY} ${FFTW_DOUBLE_LIBRARY})
 set(FFTW_INCLUDE_DIRS ${FFTW_INCLUDE_DIR})
 
 include(FindPackageHandleStandardArgs)
 # handle the QUIETLY and REQUIRED arguments and set FFTW_FOUND to TRUE
 # if all listed variables are TRUE
-find_package_handle_standard_args(FFTW DEFAULT_MSG FFTW_LIBRARY FFTW_OMP_LIBRARY FFTW_INCLUDE_DIR)
+find_package_handle_standard_args(FFTW DEFAULT_MSG
+    FFTW_LIBRARY FFTW_OMP_LIBRARY FFTW_DOUBLE_LIBRARY FFTW_DOUBLE_OMP_LIBRARY FFTW_INCLUDE_DIR)
 
-mark_as_advanced(FFTW_INCLUDE_DIR FFTW_LIBRARY FFTW_OMP_LIBRARY)
+mark_as_advanced(FFTW_INCLUDE_DIR FFTW_LIBRARY FFTW_OMP_LIBRARY FFTW_DOUBLE_LIBRARY FFTW_DOUBLE_OMP_LIBRARY)
@@ -0,0 +1,131 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2019 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <array>
+#include <complex>
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <stdexcept>
+
+#include "grid.hpp"
+
+namespace py = pybind11;
+
+/** Downsample the grid in place in the same way as the gbpTrees and VELOCIraptor paths.
+ *
+ * @param grid The grid to downsample
+ * @param new_dim The new size of the grid (assuming cubic dimensions)
+ * @param type The filter type to use
+ */
+template <typename T>
+static void downsample(Grid<T>& grid, const int new_dim, const GridBase::filter_type type)
+{
+  const double radius = grid.box_size[0] / (double)new_dim * 0.5;
+  grid.filter(type, radius);
+  grid.sample({ new_dim, new_dim, new_dim });
+}
+
+/** Bind `Grid<T>` under the given Python class name.
+ *
+ * @param m The module to add the class to
+ * @param name The Python class name
+ */
+template <typename T>
+static void bind_grid(py::module& m, const char* name)
+{
+  py::class_<Grid<T>> grid(m, name, py::buffer_protocol(), R"doc(
+    A 3D grid backed by an FFTW allocation.
+
+    The grid supports the buffer protocol, so ``numpy.asarray(grid)`` returns a
+    writable view of the logical cells with no copy.  Fill this view, then call
+    ``filter``/``sample``/``downsample``.  Note that ``sample`` and
+    ``downsample`` change the logical shape, so take a new view afterwards.
+  )doc");
+
+  grid.attr("FilterType") = m.attr("FilterType");
+
+  // The GIL is held during construction, as planning and the wisdom calls go through the (non thread safe) FFTW
+  // planner and the global planner thread count
+  grid
+    .def(py::init<const std::array<int32_t, 3>, const std::array<double, 3>>(), py::arg("n_cell"), py::arg("box_size"))
+    .def_readonly("n_cell", &Grid<T>::n_cell)
+    .def_readonly("box_size", &Grid<T>::box_size)
+    .def_readonly("flag_padded", &Grid<T>::flag_padded)
+    .def_buffer([](Grid<T>& self) -> py::buffer_info {
+      if (self.flag_padded) {
+        throw std::runtime_error("Grid is in padded (k-space) order; call reverse_fft first");
+      }
+      const auto& n = self.n_cell;
+      const auto size = static_cast<py::ssize_t>(sizeof(T));
+      return py::buffer_info(self.get(),
+                             size,
+                             py::format_descriptor<T>::format(),
+                             3,
+                             { n[0], n[1], n[2] },
+                             { size * n[1] * n[2], size * n[2], size });
+    })
+    .def(
+      "spectrum",
+      [](py::object self_obj) {
+        auto& self = self_obj.cast<Grid<T>&>();
+        if (!self.flag_padded) {
+          throw std::runtime_error("Grid is in real order; call forward_fft first");
+        }
+        const auto& n = self.n_cell;
+        const auto size = static_cast<py::ssize_t>(sizeof(std::complex<T>));
+        const py::ssize_t n_herm = n[2] / 2 + 1;
+        return py::array_t<std::complex<T>>({ n[0], n[1], static_cast<int32_t>(n_herm) },
+                                            { size * n[1] * n_herm, size * n_herm, size },
+                                            self.get_complex(),
+                                            self_obj);
+      },
+      "Zero-copy complex view of the Hermitian half-spectrum (valid between forward_fft and reverse_fft).")
+    .def("forward_fft", &Grid<T>::forward_fft, py::call_guard<py::gil_scoped_release>())
+    .def("reverse_fft", &Grid<T>::reverse_fft, py::call_guard<py::gil_scoped_release>())
+    .def("filter",
+         [](Grid<T>& self, GridBase::filter_type type, const double R) { self.filter(type, R); },
+         py::arg("type"),
+         py::arg("R"),
+         py::call_guard<py::gil_scoped_release>(),
+         "Filter the grid in place with the given filter type and size.")
+    .def("sample",
+         [](Grid<T>& self, const std::array<int32_t, 3> new_n_cell) { self.sample(new_n_cell); },
+         py::arg("new_n_cell"),
+         py::call_guard<py::gil_scoped_release>(),
+         "Subsample the grid in place to the requested logical size.")
+    .def("downsample",
+         &downsample<T>,
+         py::arg("new_dim"),
+         py::arg("type") = GridBase::filter_type::real_top_hat,
+         py::call_guard<py::gil_scoped_release>(),
+         "Filter and subsample the grid in place to new_dim^3, as done for gbpTrees and VELOCIraptor files.");
+}
+
+PYBIND11_MODULE(regrider, m)
+{
+  m.doc() = "Downsample 3D cartesian grids using FFTW";
+
+  py::enum_<GridBase::filter_type>(m, "FilterType")
+    .value("real_top_hat", GridBase::filter_type::real_top_hat)
+    .value("k_top_hat", GridBase::filter_type::k_top_hat)
+    .value("gaussian", GridBase::filter_type::gaussian);
+
+  bind_grid<float>(m, "Grid");
+  bind_grid<double>(m, "GridDouble");
+}
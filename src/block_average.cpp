@@ -0,0 +1,83 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "block_average.hpp"
+
+BlockAverager::BlockAverager(const std::array<int, 3> n_cell_, const std::array<int, 3> new_n_cell_)
+  : StreamingDownsampler(n_cell_, new_n_cell_)
+{
+}
+
+void BlockAverager::add_slab(const float* slab, const int i_out)
+{
+  average_slab(slab, i_out);
+}
+
+void BlockAverager::add_slab(const double* slab, const int i_out)
+{
+  average_slab(slab, i_out);
+}
+
+template <typename In>
+void BlockAverager::average_slab(const In* slab, const int i_out)
+{
+  const int ny = n_cell[1];
+  const int nz = n_cell[2];
+  const int new_ny = new_n_cell[1];
+  const int new_nz = new_n_cell[2];
+  const int r0 = ratio[0];
+  const int r1 = ratio[1];
+  const int r2 = ratio[2];
+  const double norm = 1.0 / ((double)r0 * r1 * r2);
+  float* plane = output.data() + (size_t)i_out * new_ny * new_nz;
+
+  // Each output row is owned by one thread, which sums the r0 x r1 input rows contributing to it
+#pragma omp parallel default(none) firstprivate(slab, plane, ny, nz, new_ny, new_nz, r0, r1, r2, norm)
+  {
+    std::vector<double> acc(new_nz);
+
+#pragma omp for schedule(static)
+    for (int j_out = 0; j_out < new_ny; ++j_out) {
+      std::fill(acc.begin(), acc.end(), 0.0);
+
+      for (int ii = 0; ii < r0; ++ii) {
+        for (int jj = j_out * r1; jj < (j_out + 1) * r1; ++jj) {
+          const In* row = slab + ((size_t)ii * ny + jj) * nz;
+          double* acc_ = acc.data();
+          for (int k_out = 0; k_out < new_nz; ++k_out) {
+            double sum = 0;
+#pragma omp simd reduction(+ : sum)
+            for (int kk = 0; kk < r2; ++kk) {
+              sum += row[k_out * r2 + kk];
+            }
+            acc_[k_out] += sum;
+          }
+        }
+      }
+
+      float* out_row = plane + (size_t)j_out * new_nz;
+#pragma omp simd
+      for (int k_out = 0; k_out < new_nz; ++k_out) {
+        out_row[k_out] = static_cast<float>(acc[k_out] * norm);
+      }
+    }
+  }
+}
@@ -0,0 +1,60 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCK_AVERAGE_H
+#define BLOCK_AVERAGE_H
+
+#include <array>
+
+#include "streaming.hpp"
+
+/** Downsample a grid by averaging blocks of cells, streaming the input one slab at a time.
+ *
+ * Each output cell is the mean of the block of input cells it covers, so the mean of the grid is conserved exactly.
+ * No FFTs are required.
+ *
+ * Note that output cell `i` is centred on the middle of its block, whereas the FFT based method samples the filtered
+ * grid at the first cell of each block.
+ */
+class BlockAverager : public StreamingDownsampler
+{
+public:
+  /** Constructor.
+   *
+   * @param n_cell_ The number of input cells in each dimension
+   * @param new_n_cell_ The number of output cells in each dimension (each must divide the input dimension exactly)
+   */
+  BlockAverager(const std::array<int, 3> n_cell_, const std::array<int, 3> new_n_cell_);
+
+  /** Average a slab of input values into the corresponding plane of the output.
+   *
+   * @param slab Pointer to `slab_size()` values, in C order
+   * @param i_out The index of the output plane (i.e. the slab number)
+   */
+  void add_slab(const float* slab, const int i_out) override;
+
+  /** @copydoc add_slab(const float*, const int)
+   */
+  void add_slab(const double* slab, const int i_out) override;
+
+private:
+  template <typename In>
+  void average_slab(const In* slab, const int i_out);
+};
+
+#endif
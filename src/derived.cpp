@@ -0,0 +1,263 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <fmt/core.h>
+#include <omp.h>
+#include <sstream>
+#include <stdexcept>
+
+#include "derived.hpp"
+#include "fftw_traits.hpp"
+
+DerivedOptions parse_derived(const std::string names)
+{
+  DerivedOptions options;
+  std::istringstream iss(names);
+  std::string name;
+  while (std::getline(iss, name, ',')) {
+    if (name == "divergence") {
+      options.divergence = true;
+    } else if (name == "vorticity") {
+      options.vorticity = true;
+    } else if (name == "density-gradient") {
+      options.density_gradient = true;
+    } else {
+      throw std::runtime_error(fmt::format("Unrecognised derived field '{}'", name));
+    }
+  }
+  return options;
+}
+
+/** The number of elements in the Hermitian half-spectrum of a real grid.
+ */
+static size_t n_half(const std::array<int, 3> n_cell)
+{
+  return (size_t)n_cell[0] * n_cell[1] * (n_cell[2] / 2 + 1);
+}
+
+DerivedFields::DerivedFields(const std::array<int, 3> n_cell_,
+                             const std::array<int, 3> new_n_cell_,
+                             const DerivedOptions options_)
+  : n_cell{ n_cell_ }
+  , new_n_cell{ new_n_cell_ }
+  , options{ options_ }
+{
+  for (int ii = 0; ii < 3; ++ii) {
+    if (new_n_cell[ii] <= 0 || n_cell[ii] % new_n_cell[ii] != 0) {
+      throw std::runtime_error(fmt::format("Derived fields require integer ratios (dimension {}: {} -> {})",
+                                           ii,
+                                           n_cell[ii],
+                                           new_n_cell[ii]));
+    }
+  }
+
+  std::vector<component> needed;
+  if (options.divergence) {
+    needed.push_back(divergence);
+  }
+  if (options.vorticity) {
+    needed.push_back(vorticity_x);
+    needed.push_back(vorticity_y);
+    needed.push_back(vorticity_z);
+  }
+  if (options.density_gradient) {
+    needed.push_back(gradient_x);
+    needed.push_back(gradient_y);
+    needed.push_back(gradient_z);
+  }
+  for (const auto c : needed) {
+    spectra[c].assign(n_half(new_n_cell), std::complex<double>(0));
+  }
+}
+
+size_t DerivedFields::estimate_bytes(const std::array<int, 3> new_n_cell, const DerivedOptions options)
+{
+  const int n_spectra = (options.divergence ? 1 : 0) + (options.vorticity ? 3 : 0) + (options.density_gradient ? 3 : 0);
+  const int n_fields = (options.divergence ? 1 : 0) + (options.vorticity ? 1 : 0) + (options.density_gradient ? 3 : 0);
+  const size_t n_out = (size_t)new_n_cell[0] * new_n_cell[1] * new_n_cell[2];
+  return n_spectra * n_half(new_n_cell) * sizeof(std::complex<double>) + n_fields * n_out * sizeof(float);
+}
+
+void DerivedFields::start(const source field_)
+{
+  field = field_;
+}
+
+bool DerivedFields::active() const
+{
+  if (field == source::density) {
+    return options.density_gradient;
+  }
+  return options.divergence || options.vorticity;
+}
+
+void DerivedFields::fold(const component c, const std::array<int, 3> n, const std::complex<double> value)
+{
+  auto& spectrum = spectra[c];
+  if (spectrum.empty()) {
+    return;
+  }
+
+  const int half = new_n_cell[2] / 2 + 1;
+
+  // The mode itself...
+  {
+    const int m_x = n[0] % new_n_cell[0];
+    const int m_y = n[1] % new_n_cell[1];
+    const int m_z = n[2] % new_n_cell[2];
+    if (m_z < half) {
+      auto target = reinterpret_cast<double*>(&spectrum[((size_t)m_x * new_n_cell[1] + m_y) * half + m_z]);
+#pragma omp atomic
+      target[0] += value.real();
+#pragma omp atomic
+      target[1] += value.imag();
+    }
+  }
+
+  // ...and its conjugate, which isn't stored unless it is in the k_z = 0 or Nyquist planes
+  if (n[2] != 0 && 2 * n[2] != n_cell[2]) {
+    const int m_x = (n_cell[0] - n[0]) % new_n_cell[0];
+    const int m_y = (n_cell[1] - n[1]) % new_n_cell[1];
+    const int m_z = (n_cell[2] - n[2]) % new_n_cell[2];
+    if (m_z < half) {
+      auto target = reinterpret_cast<double*>(&spectrum[((size_t)m_x * new_n_cell[1] + m_y) * half + m_z]);
+#pragma omp atomic
+      target[0] += value.real();
+#pragma omp atomic
+      target[1] -= value.imag();
+    }
+  }
+}
+
+void DerivedFields::add(const std::array<int, 3> n, const std::array<double, 3> k, const std::complex<double> value)
+{
+  // The derivative of the Nyquist mode is ill defined (and isn't real), so it is dropped
+  for (int ii = 0; ii < 3; ++ii) {
+    if (2 * n[ii] == n_cell[ii]) {
+      return;
+    }
+  }
+
+  const std::complex<double> i(0, 1);
+  const std::complex<double> d_x = i * k[0] * value;
+  const std::complex<double> d_y = i * k[1] * value;
+  const std::complex<double> d_z = i * k[2] * value;
+
+  switch (field) {
+    case source::density:
+      fold(gradient_x, n, d_x);
+      fold(gradient_y, n, d_y);
+      fold(gradient_z, n, d_z);
+      break;
+    case source::vx:
+      fold(divergence, n, d_x);
+      fold(vorticity_y, n, d_z);
+      fold(vorticity_z, n, -d_y);
+      break;
+    case source::vy:
+      fold(divergence, n, d_y);
+      fold(vorticity_z, n, d_x);
+      fold(vorticity_x, n, -d_z);
+      break;
+    case source::vz:
+      fold(divergence, n, d_z);
+      fold(vorticity_x, n, d_y);
+      fold(vorticity_y, n, -d_x);
+      break;
+  }
+}
+
+void DerivedFields::finish()
+{
+  typedef fftw_traits<double> fftw;
+
+  const size_t n_out = (size_t)new_n_cell[0] * new_n_cell[1] * new_n_cell[2];
+  std::vector<double> real(n_out);
+  std::array<std::vector<float>, n_components> values;
+
+  for (int c = 0; c < n_components; ++c) {
+    if (spectra[c].empty()) {
+      continue;
+    }
+
+    // The folded spectra already carry the 1 / N normalisation of the forward transform
+    fftw::plan plan;
+    {
+      ScopedPlanner<double> scoped_planner(omp_get_max_threads());
+      plan = fftw::plan_dft_c2r_3d(new_n_cell[0],
+                                   new_n_cell[1],
+                                   new_n_cell[2],
+                                   reinterpret_cast<fftw::complex*>(spectra[c].data()),
+                                   real.data(),
+                                   FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    fftw::execute(plan);
+    {
+      std::lock_guard<std::mutex> lock(fftw_planner_mutex());
+      fftw::destroy_plan(plan);
+    }
+
+    values[c].assign(real.begin(), real.end());
+    std::vector<std::complex<double>>().swap(spectra[c]);
+  }
+
+  field_names.clear();
+  fields.clear();
+
+  if (options.divergence) {
+    field_names.push_back("VelocityDivergence");
+    fields.push_back(values[divergence]);
+  }
+
+  if (options.vorticity) {
+    std::vector<float> magnitude(n_out);
+    const auto& w_x = values[vorticity_x];
+    const auto& w_y = values[vorticity_y];
+    const auto& w_z = values[vorticity_z];
+    for (size_t ii = 0; ii < n_out; ++ii) {
+      magnitude[ii] = std::sqrt(w_x[ii] * w_x[ii] + w_y[ii] * w_y[ii] + w_z[ii] * w_z[ii]);
+    }
+    field_names.push_back("VorticityMagnitude");
+    fields.push_back(magnitude);
+  }
+
+  if (options.density_gradient) {
+    field_names.push_back("DensityGradientX");
+    fields.push_back(values[gradient_x]);
+    field_names.push_back("DensityGradientY");
+    fields.push_back(values[gradient_y]);
+    field_names.push_back("DensityGradientZ");
+    fields.push_back(values[gradient_z]);
+  }
+}
+
+std::vector<std::string> DerivedFields::names() const
+{
+  return field_names;
+}
+
+std::vector<float>& DerivedFields::get(const std::string name)
+{
+  for (size_t ii = 0; ii < field_names.size(); ++ii) {
+    if (field_names[ii] == name) {
+      return fields[ii];
+    }
+  }
+  throw std::runtime_error(fmt::format("Derived field {} has not been computed", name));
+}
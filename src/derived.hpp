@@ -0,0 +1,142 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DERIVED_H
+#define DERIVED_H
+
+#include <array>
+#include <complex>
+#include <string>
+#include <vector>
+
+/** The derived fields to compute from the VELOCIraptor grids.
+ */
+struct DerivedOptions
+{
+  bool divergence = false;       //< The divergence of the velocity field
+  bool vorticity = false;        //< The magnitude of the curl of the velocity field
+  bool density_gradient = false; //< The three components of the gradient of the density field
+
+  /** Is any derived field requested?
+   */
+  bool any() const { return divergence || vorticity || density_gradient; }
+};
+
+/** Parse a comma separated list of derived fields (divergence, vorticity and density-gradient).
+ *
+ * @param names The list of fields
+ * @return The corresponding options
+ */
+DerivedOptions parse_derived(const std::string names);
+
+/** Compute derivatives of the filtered grids at the target resolution, from their full resolution spectra.
+ *
+ * `Grid::filter` adds each filtered mode, multiplied by the relevant `i k`, to spectra with the target dimensions.
+ * Every full resolution mode is folded onto the target mode it aliases to, so that after the inverse transform at
+ * the target resolution the derived fields are exactly the derivatives of the filtered fields evaluated at the points
+ * kept by `Grid::sample`.  The derivatives at the Nyquist frequency are set to zero.
+ *
+ * One Hermitian half-spectrum of the target size is kept per derived component, so the memory needed is small
+ * compared with the full resolution `Grid`.
+ */
+class DerivedFields
+{
+public:
+  /** The field whose modes are being added.
+   */
+  enum class source
+  {
+    density,
+    vx,
+    vy,
+    vz
+  };
+
+  /** Constructor.
+   *
+   * @param n_cell_ The number of input cells in each dimension
+   * @param new_n_cell_ The number of output cells in each dimension (each must divide the input dimension exactly)
+   * @param options_ The fields to compute
+   */
+  DerivedFields(const std::array<int, 3> n_cell_, const std::array<int, 3> new_n_cell_, const DerivedOptions options_);
+
+  /** Start adding the modes of a field.
+   */
+  void start(const source field_);
+
+  /** Does the current field contribute to any of the requested derived fields?
+   */
+  bool active() const;
+
+  /** Add a filtered mode.
+   *
+   * This may be called concurrently for different modes.
+   *
+   * @param n The indices of the mode in the full resolution Hermitian half-spectrum
+   * @param k The wavevector of the mode
+   * @param value The filtered, normalised Fourier coefficient
+   */
+  void add(const std::array<int, 3> n, const std::array<double, 3> k, const std::complex<double> value);
+
+  /** Inverse transform the derived fields (once all of the required fields have been added).
+   */
+  void finish(void);
+
+  /** Return the names of the computed fields.
+   */
+  std::vector<std::string> names() const;
+
+  /** Return a computed field, in C order with the output dimensions.
+   *
+   * @param name One of the names returned by `names()`
+   */
+  std::vector<float>& get(const std::string name);
+
+  /** Return the number of bytes needed to compute the given fields.
+   */
+  static size_t estimate_bytes(const std::array<int, 3> new_n_cell, const DerivedOptions options);
+
+private:
+  /** The spectra being accumulated.
+   */
+  enum component
+  {
+    divergence,
+    vorticity_x,
+    vorticity_y,
+    vorticity_z,
+    gradient_x,
+    gradient_y,
+    gradient_z,
+    n_components
+  };
+
+  std::array<int, 3> n_cell;                                           //< The number of input cells in each dimension
+  std::array<int, 3> new_n_cell;                                       //< The number of output cells in each dimension
+  DerivedOptions options;                                              //< The fields to compute
+  source field = source::density;                                      //< The field whose modes are being added
+  std::array<std::vector<std::complex<double>>, n_components> spectra; //< The target resolution spectra (if needed)
+  std::vector<std::string> field_names;                                //< The names of the computed fields
+  std::vector<std::vector<float>> fields;                              //< The computed fields
+
+  /** Fold a contribution `value` at full resolution mode `n` (and its conjugate) into a target spectrum.
+   */
+  void fold(const component c, const std::array<int, 3> n, const std::complex<double> value);
+};
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <fmt/core.h>
+#include <stdexcept>
+
+#include "encoding.hpp"
+
+// The conversions below are written without data dependent branches so that the loops in `encode` vectorise.
+
+static inline uint32_t as_bits(const float value)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static inline float as_float(const uint32_t bits)
+{
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// See F. Giesen, "float->half variants" (https://gist.github.com/rygorous/2156668)
+static inline uint16_t to_half(const float value)
+{
+  const uint32_t sign = as_bits(value) & 0x80000000u;
+  const uint32_t f = as_bits(value) ^ sign;
+
+  // Overflow to infinity, or a NaN
+  const uint32_t inf_nan = f > 0x7f800000u ? 0x7e00u : 0x7c00u;
+
+  // Subnormal (or zero) results: let the FPU do the rounding by adding a magic number
+  const float denorm_magic = as_float(((127 - 15) + (23 - 10) + 1) << 23);
+  const uint32_t denorm = as_bits(as_float(f) + denorm_magic) - as_bits(denorm_magic);
+
+  // Normal results: rebias the exponent and round the mantissa to nearest even
+  const uint32_t mant_odd = (f >> 13) & 1u;
+  const uint32_t normal = (f + ((uint32_t)(15 - 127) << 23) + 0xfffu + mant_odd) >> 13;
+
+  const uint32_t out = f >= 0x47800000u ? inf_nan : (f < 0x38800000u ? denorm : normal);
+  return static_cast<uint16_t>(out | (sign >> 16));
+}
+
+static inline float from_half(const uint16_t value)
+{
+  const float magic = as_float(113u << 23);
+  const uint32_t shifted_exp = 0x7c00u << 13;
+
+  uint32_t o = ((uint32_t)value & 0x7fffu) << 13;
+  const uint32_t exp = shifted_exp & o;
+  o += (uint32_t)(127 - 15) << 23;
+
+  const uint32_t inf_nan = o + ((uint32_t)(128 - 16) << 23);
+  const uint32_t denorm = as_bits(as_float(o + (1u << 23)) - magic);
+  o = exp == shifted_exp ? inf_nan : (exp == 0 ? denorm : o);
+
+  return as_float(o | (((uint32_t)value & 0x8000u) << 16));
+}
+
+static inline uint16_t to_bfloat16(const float value)
+{
+  const uint32_t f = as_bits(value);
+  const uint32_t rounded = (f + 0x7fffu + ((f >> 16) & 1u)) >> 16;
+  const uint32_t nan = (f >> 16) | 0x40u;
+  return static_cast<uint16_t>((f & 0x7fffffffu) > 0x7f800000u ? nan : rounded);
+}
+
+static inline float from_bfloat16(const uint16_t value)
+{
+  return as_float((uint32_t)value << 16);
+}
+
+static inline float round_mantissa(const float value, const int keep_bits)
+{
+  const uint32_t f = as_bits(value);
+  const int shift = 23 - keep_bits;
+  const uint32_t half_ulp = (1u << shift) >> 1;
+  const uint32_t mask = ~((1u << shift) - 1u);
+  const uint32_t rounded = (f + half_ulp - 1u + ((f >> shift) & 1u)) & mask;
+
+  // Leave infinities and NaNs alone
+  return as_float((f & 0x7f800000u) == 0x7f800000u ? f : rounded);
+}
+
+uint16_t float_to_half(const float value)
+{
+  return to_half(value);
+}
+
+float half_to_float(const uint16_t value)
+{
+  return from_half(value);
+}
+
+uint16_t float_to_bfloat16(const float value)
+{
+  return to_bfloat16(value);
+}
+
+float bfloat16_to_float(const uint16_t value)
+{
+  return from_bfloat16(value);
+}
+
+float bitround(const float value, const int keep_bits)
+{
+  return keep_bits >= 23 ? value : round_mantissa(value, keep_bits < 0 ? 0 : keep_bits);
+}
+
+output_encoding parse_encoding(const std::string name)
+{
+  if (name == "float32") {
+    return output_encoding::float32;
+  } else if (name == "float16") {
+    return output_encoding::float16;
+  } else if (name == "bfloat16") {
+    return output_encoding::bfloat16;
+  } else if (name == "bitround") {
+    return output_encoding::bitround;
+  }
+  throw std::runtime_error(fmt::format("Unrecognised output encoding '{}'", name));
+}
+
+const char* encoding_name(const output_encoding encoding)
+{
+  switch (encoding) {
+    case output_encoding::float16:
+      return "float16";
+    case output_encoding::bfloat16:
+      return "bfloat16";
+    case output_encoding::bitround:
+      return "bitround";
+    default:
+      return "float32";
+  }
+}
+
+size_t encoded_size(const output_encoding encoding)
+{
+  switch (encoding) {
+    case output_encoding::float16:
+    case output_encoding::bfloat16:
+      return sizeof(uint16_t);
+    default:
+      return sizeof(float);
+  }
+}
+
+void print_encoding_error(const output_encoding encoding, const EncodingError error)
+{
+  if (encoding != output_encoding::float32) {
+    fmt::print("{} encoding error: max = {:.3e}, rms = {:.3e}\n", encoding_name(encoding), error.max_abs, error.rms);
+  }
+}
+
+EncodingError encode(const float* in, void* out, const size_t n, const output_encoding encoding, const int keep_bits)
+{
+  double max_abs = 0;
+  double sum_sq = 0;
+  const long n_ = static_cast<long>(n);
+
+  switch (encoding) {
+    case output_encoding::float16: {
+      auto out_ = static_cast<uint16_t*>(out);
+#pragma omp parallel for simd reduction(max : max_abs) reduction(+ : sum_sq)
+      for (long ii = 0; ii < n_; ++ii) {
+        out_[ii] = to_half(in[ii]);
+        const double err = std::fabs((double)from_half(out_[ii]) - (double)in[ii]);
+        max_abs = err > max_abs ? err : max_abs;
+        sum_sq += err * err;
+      }
+      break;
+    }
+
+    case output_encoding::bfloat16: {
+      auto out_ = static_cast<uint16_t*>(out);
+#pragma omp parallel for simd reduction(max : max_abs) reduction(+ : sum_sq)
+      for (long ii = 0; ii < n_; ++ii) {
+        out_[ii] = to_bfloat16(in[ii]);
+        const double err = std::fabs((double)from_bfloat16(out_[ii]) - (double)in[ii]);
+        max_abs = err > max_abs ? err : max_abs;
+        sum_sq += err * err;
+      }
+      break;
+    }
+
+    case output_encoding::bitround: {
+      auto out_ = static_cast<float*>(out);
+      const int bits = keep_bits < 0 ? 0 : (keep_bits > 23 ? 23 : keep_bits);
+#pragma omp parallel for simd reduction(max : max_abs) reduction(+ : sum_sq)
+      for (long ii = 0; ii < n_; ++ii) {
+        const float value = in[ii];
+        out_[ii] = bits == 23 ? value : round_mantissa(value, bits);
+        const double err = std::fabs((double)out_[ii] - (double)value);
+        max_abs = err > max_abs ? err : max_abs;
+        sum_sq += err * err;
+      }
+      break;
+    }
+
+    default:
+      if (out != in) {
+        std::memcpy(out, in, n * sizeof(float));
+      }
+      break;
+  }
+
+  EncodingError error;
+  error.max_abs = max_abs;
+  error.rms = n > 0 ? std::sqrt(sum_sq / (double)n) : 0.0;
+  return error;
+}
@@ -0,0 +1,103 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/** The encoding used for the values of the output grids.
+ */
+enum class output_encoding
+{
+  float32,  //< Unmodified IEEE single precision
+  float16,  //< IEEE half precision (round to nearest even)
+  bfloat16, //< Truncated single precision with 8 bit exponent and 7 bit mantissa (round to nearest even)
+  bitround  //< Single precision with the mantissa rounded to a number of kept bits (compresses well with deflate)
+};
+
+/** Precision lost when encoding, measured against the float32 values.
+ */
+struct EncodingError
+{
+  double max_abs = 0; //< The maximum absolute error
+  double rms = 0;     //< The root mean square error
+};
+
+/** Parse an encoding name (float32, float16, bfloat16 or bitround).
+ *
+ * @param name The name of the encoding
+ * @return The corresponding encoding
+ */
+output_encoding parse_encoding(const std::string name);
+
+/** Return the name of an encoding.
+ */
+const char* encoding_name(const output_encoding encoding);
+
+/** Return the number of bytes used to store each value with the given encoding.
+ */
+size_t encoded_size(const output_encoding encoding);
+
+/** Convert a float to IEEE half precision, rounding to nearest even.
+ */
+uint16_t float_to_half(const float value);
+
+/** Convert an IEEE half precision value to float.
+ */
+float half_to_float(const uint16_t value);
+
+/** Convert a float to bfloat16, rounding to nearest even.
+ */
+uint16_t float_to_bfloat16(const float value);
+
+/** Convert a bfloat16 value to float.
+ */
+float bfloat16_to_float(const uint16_t value);
+
+/** Round the mantissa of a float to the given number of bits, rounding to nearest even.
+ *
+ * @param value The value to round
+ * @param keep_bits The number of explicit mantissa bits to keep (0-23)
+ * @return The rounded value
+ */
+float bitround(const float value, const int keep_bits);
+
+/** Print the precision lost by an encoding (nothing is printed for `output_encoding::float32`).
+ *
+ * @param encoding The encoding used
+ * @param error The precision lost, as returned by `encode`
+ */
+void print_encoding_error(const output_encoding encoding, const EncodingError error);
+
+/** Encode an array of floats.
+ *
+ * `out` must hold `n * encoded_size(encoding)` bytes and may alias `in` for the 4 byte encodings.
+ *
+ * @param in The float32 values to be encoded
+ * @param out The destination of the encoded values
+ * @param n The number of values
+ * @param encoding The encoding to use
+ * @param keep_bits The number of mantissa bits to keep (only used for `output_encoding::bitround`)
+ * @return The precision lost relative to the input
+ */
+EncodingError encode(const float* in, void* out, const size_t n, const output_encoding encoding, const int keep_bits);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FFTW_TRAITS_H
+#define FFTW_TRAITS_H
+
+#include <cstddef>
+#include <fftw3.h>
+#include <mutex>
+
+/** Compile time dispatch to the single (`fftwf_*`) or double (`fftw_*`) precision FFTW API.
+ *
+ * Only the subset of the API used by regrider is wrapped.
+ */
+template <typename T>
+struct fftw_traits;
+
+template <>
+struct fftw_traits<float>
+{
+  typedef fftwf_plan plan;
+  typedef fftwf_complex complex;
+
+  static const char* wisdom_prefix() { return "fftw3f"; }
+
+  static float* alloc_real(size_t n) { return fftwf_alloc_real(n); }
+  static void free(void* p) { fftwf_free(p); }
+  static void plan_with_nthreads(int n) { fftwf_plan_with_nthreads(n); }
+  static int import_wisdom_from_filename(const char* f) { return fftwf_import_wisdom_from_filename(f); }
+  static int export_wisdom_to_filename(const char* f) { return fftwf_export_wisdom_to_filename(f); }
+  static void forget_wisdom() { fftwf_forget_wisdom(); }
+  static plan plan_dft_r2c_3d(int n0, int n1, int n2, float* in, complex* out, unsigned flags)
+  {
+    return fftwf_plan_dft_r2c_3d(n0, n1, n2, in, out, flags);
+  }
+  static plan plan_dft_c2r_3d(int n0, int n1, int n2, complex* in, float* out, unsigned flags)
+  {
+    return fftwf_plan_dft_c2r_3d(n0, n1, n2, in, out, flags);
+  }
+  static plan plan_dft_r2c_2d(int n0, int n1, float* in, complex* out, unsigned flags)
+  {
+    return fftwf_plan_dft_r2c_2d(n0, n1, in, out, flags);
+  }
+  static plan plan_dft_c2r_2d(int n0, int n1, complex* in, float* out, unsigned flags)
+  {
+    return fftwf_plan_dft_c2r_2d(n0, n1, in, out, flags);
+  }
+  static plan plan_dft_r2c_1d(int n, float* in, complex* out, unsigned flags)
+  {
+    return fftwf_plan_dft_r2c_1d(n, in, out, flags);
+  }
+  static plan plan_dft_c2r_1d(int n, complex* in, float* out, unsigned flags)
+  {
+    return fftwf_plan_dft_c2r_1d(n, in, out, flags);
+  }
+  static plan plan_dft_1d(int n, complex* in, complex* out, int sign, unsigned flags)
+  {
+    return fftwf_plan_dft_1d(n, in, out, sign, flags);
+  }
+  static plan plan_many_dft(int rank,
+                            const int* n,
+                            int howmany,
+                            complex* in,
+                            const int* inembed,
+                            int istride,
+                            int idist,
+                            complex* out,
+                            const int* onembed,
+                            int ostride,
+                            int odist,
+                            int sign,
+                            unsigned flags)
+  {
+    return fftwf_plan_many_dft(
+      rank, n, howmany, in, inembed, istride, idist, out, onembed, ostride, odist, sign, flags);
+  }
+  static void execute(const plan p) { fftwf_execute(p); }
+  static void execute_dft(const plan p, complex* in, complex* out) { fftwf_execute_dft(p, in, out); }
+  static void execute_dft_r2c(const plan p, float* in, complex* out) { fftwf_execute_dft_r2c(p, in, out); }
+  static void execute_dft_c2r(const plan p, complex* in, float* out) { fftwf_execute_dft_c2r(p, in, out); }
+  static void destroy_plan(plan p) { fftwf_destroy_plan(p); }
+};
+
+template <>
+struct fftw_traits<double>
+{
+  typedef fftw_plan plan;
+  typedef fftw_complex complex;
+
+  static const char* wisdom_prefix() { return "fftw3"; }
+
+  static double* alloc_real(size_t n) { return fftw_alloc_real(n); }
+  static void free(void* p) { fftw_free(p); }
+  static void plan_with_nthreads(int n) { fftw_plan_with_nthreads(n); }
+  static int import_wisdom_from_filename(const char* f) { return fftw_import_wisdom_from_filename(f); }
+  static int export_wisdom_to_filename(const char* f) { return fftw_export_wisdom_to_filename(f); }
+  static void forget_wisdom() { fftw_forget_wisdom(); }
+  static plan plan_dft_r2c_3d(int n0, int n1, int n2, double* in, complex* out, unsigned flags)
+  {
+    return fftw_plan_dft_r2c_3d(n0, n1, n2, in, out, flags);
+  }
+  static plan plan_dft_c2r_3d(int n0, int n1, int n2, complex* in, double* out, unsigned flags)
+  {
+    return fftw_plan_dft_c2r_3d(n0, n1, n2, in, out, flags);
+  }
+  static plan plan_dft_r2c_2d(int n0, int n1, double* in, complex* out, unsigned flags)
+  {
+    return fftw_plan_dft_r2c_2d(n0, n1, in, out, flags);
+  }
+  static plan plan_dft_c2r_2d(int n0, int n1, complex* in, double* out, unsigned flags)
+  {
+    return fftw_plan_dft_c2r_2d(n0, n1, in, out, flags);
+  }
+  static plan plan_dft_r2c_1d(int n, double* in, complex* out, unsigned flags)
+  {
+    return fftw_plan_dft_r2c_1d(n, in, out, flags);
+  }
+  static plan plan_dft_c2r_1d(int n, complex* in, double* out, unsigned flags)
+  {
+    return fftw_plan_dft_c2r_1d(n, in, out, flags);
+  }
+  static plan plan_dft_1d(int n, complex* in, complex* out, int sign, unsigned flags)
+  {
+    return fftw_plan_dft_1d(n, in, out, sign, flags);
+  }
+  static plan plan_many_dft(int rank,
+                            const int* n,
+                            int howmany,
+                            complex* in,
+                            const int* inembed,
+                            int istride,
+                            int idist,
+                            complex* out,
+                            const int* onembed,
+                            int ostride,
+                            int odist,
+                            int sign,
+                            unsigned flags)
+  {
+    return fftw_plan_many_dft(rank, n, howmany, in, inembed, istride, idist, out, onembed, ostride, odist, sign, flags);
+  }
+  static void execute(const plan p) { fftw_execute(p); }
+  static void execute_dft(const plan p, complex* in, complex* out) { fftw_execute_dft(p, in, out); }
+  static void execute_dft_r2c(const plan p, double* in, complex* out) { fftw_execute_dft_r2c(p, in, out); }
+  static void execute_dft_c2r(const plan p, complex* in, double* out) { fftw_execute_dft_c2r(p, in, out); }
+  static void destroy_plan(plan p) { fftw_destroy_plan(p); }
+};
+
+/** Return the lock which serialises the FFTW planner.
+ *
+ * Creating and destroying plans, importing, exporting and forgetting wisdom, and the number of threads used by new
+ * plans are all global state in FFTW, so every such call must be made while this lock is held.
+ */
+inline std::mutex& fftw_planner_mutex()
+{
+  static std::mutex mutex;
+  return mutex;
+}
+
+/** Hold the FFTW planner lock for the lifetime of the object, with new plans using a given number of threads.
+ *
+ * The thread count is global, so it is set every time the lock is taken rather than being restored afterwards.
+ */
+template <typename T>
+class ScopedPlanner
+{
+public:
+  /** Take the planner lock and set the number of threads used by the plans created while it is held.
+   *
+   * @param n_threads The number of threads each new plan executes with
+   */
+  explicit ScopedPlanner(const int n_threads = 1)
+    : lock(fftw_planner_mutex())
+  {
+    fftw_traits<T>::plan_with_nthreads(n_threads);
+  }
+
+  ScopedPlanner(const ScopedPlanner&) = delete;
+  ScopedPlanner& operator=(const ScopedPlanner&) = delete;
+
+private:
+  std::lock_guard<std::mutex> lock; //< The planner lock
+};
+
+#endif
@@ -0,0 +1,398 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fmt/core.h>
+#include <omp.h>
+#include <stdexcept>
+
+#include "gaussian.hpp"
+
+// Equates the integrated volume of the Gaussian to the real space top-hat (as in `Grid::filter`)
+static const double gaussian_volume_factor = 0.643;
+
+// Kernel taps smaller than this fraction of the central tap are dropped from the direct convolution
+static const double tap_tolerance = 1e-10;
+
+GaussianSmoother::GaussianSmoother(const std::array<int, 3> n_cell_,
+                                   const std::array<int, 3> new_n_cell_,
+                                   const std::array<double, 3> box_size,
+                                   const double R,
+                                   const convolution mode)
+  : StreamingDownsampler(n_cell_, new_n_cell_)
+{
+  {
+    // The pencil plans are executed concurrently by the OpenMP threads, so they must not be threaded themselves
+    ScopedPlanner<double> scoped_planner(1);
+    for (int ii = 0; ii < 3; ++ii) {
+      sigma[ii] = gaussian_volume_factor * R * (double)n_cell[ii] / box_size[ii];
+      init_pass(passes[ii], ii, sigma[ii], mode);
+      use_fft[ii] = passes[ii].use_fft;
+      half_width[ii] = passes[ii].hi;
+    }
+  }
+
+  // The threads each reuse their own scratch for every pencil of every plane
+  const size_t max_n = *std::max_element(n_cell.begin(), n_cell.end());
+  size_t max_taps = 0;
+  for (const auto& pass : passes) {
+    max_taps = std::max(max_taps, pass.taps.size());
+  }
+  scratches.resize(omp_get_max_threads());
+  for (auto& thread_scratch : scratches) {
+    thread_scratch.pencil.resize(max_n);
+    thread_scratch.extended.resize(max_n + max_taps);
+    thread_scratch.modes.resize(max_n / 2 + 1);
+    thread_scratch.gathered.resize(max_n);
+    thread_scratch.smoothed.resize(max_n);
+  }
+
+  rows.resize((size_t)n_cell[1] * new_n_cell[2]);
+  const size_t plane_out = (size_t)new_n_cell[1] * new_n_cell[2];
+  if (use_fft[0]) {
+    reduced.resize(n_cell[0] * plane_out);
+  } else {
+    reduced.resize(plane_out);
+    accumulated.resize(output.size());
+  }
+}
+
+GaussianSmoother::~GaussianSmoother()
+{
+  std::lock_guard<std::mutex> lock(fftw_planner_mutex());
+  for (auto& pass : passes) {
+    fftw::destroy_plan(pass.reverse_plan);
+    fftw::destroy_plan(pass.forward_plan);
+  }
+}
+
+void GaussianSmoother::build_kernel(Pass& pass, const int n, const int n_out, const double sigma_cells)
+{
+  pass.n = n;
+  pass.n_out = n_out;
+  pass.stride = n / n_out;
+
+  // The k-space window, exactly as applied by `Grid::filter`
+  const int n_modes = n / 2 + 1;
+  pass.window.resize(n_modes);
+  for (int m = 0; m < n_modes; ++m) {
+    const double kR = 2.0 * M_PI * m * sigma_cells / (double)n;
+    pass.window[m] = std::exp(-kR * kR / 2.0) / (double)n;
+  }
+
+  // The real space kernel is the inverse DFT of the (real and even) window
+  std::vector<double> kernel(n / 2 + 1);
+  for (int x = 0; x <= n / 2; ++x) {
+    double sum = pass.window[0];
+    for (int m = 1; m < n_modes; ++m) {
+      const double weight = (2 * m == n) ? 1.0 : 2.0;
+      sum += weight * pass.window[m] * std::cos(2.0 * M_PI * (double)m * x / (double)n);
+    }
+    kernel[x] = sum;
+  }
+
+  int width = n / 2;
+  while (width > 0 && std::fabs(kernel[width]) < tap_tolerance * std::fabs(kernel[0])) {
+    --width;
+  }
+
+  if (2 * width + 1 >= n) {
+    // The kernel covers the whole period, so take each offset exactly once
+    pass.lo = -(n / 2);
+    pass.hi = n - 1 - n / 2;
+  } else {
+    pass.lo = -width;
+    pass.hi = width;
+  }
+  pass.taps.resize(pass.hi - pass.lo + 1);
+  for (int m = pass.lo; m <= pass.hi; ++m) {
+    pass.taps[m - pass.lo] = kernel[std::abs(m)];
+  }
+
+  // Rough operation counts for one pencil: the direct convolution is only evaluated at the subsampled points,
+  // whereas the r2c + c2r pair costs ~5 n log2(n) flops
+  pass.direct_flops = 2.0 * pass.n_out * pass.taps.size();
+  pass.fft_flops = 5.0 * n * std::log2((double)std::max(n, 2)) + 2.0 * n_modes;
+}
+
+void GaussianSmoother::init_pass(Pass& pass, const int dim, const double sigma_cells, const convolution mode)
+{
+  build_kernel(pass, n_cell[dim], new_n_cell[dim], sigma_cells);
+
+  switch (mode) {
+    case convolution::direct:
+      pass.use_fft = false;
+      break;
+    case convolution::fft:
+      pass.use_fft = true;
+      break;
+    default:
+      pass.use_fft = pass.direct_flops > pass.fft_flops;
+      break;
+  }
+
+  const int n = pass.n;
+  const int n_modes = n / 2 + 1;
+  std::vector<double> pencil(n);
+  std::vector<std::complex<double>> modes(n_modes);
+  auto modes_ = reinterpret_cast<fftw::complex*>(modes.data());
+  pass.forward_plan = fftw::plan_dft_r2c_1d(n, pencil.data(), modes_, FFTW_ESTIMATE | FFTW_UNALIGNED);
+  pass.reverse_plan = fftw::plan_dft_c2r_1d(n, modes_, pencil.data(), FFTW_ESTIMATE | FFTW_UNALIGNED);
+}
+
+double GaussianSmoother::estimate_flops(const std::array<int, 3> n_cell,
+                                        const std::array<int, 3> new_n_cell,
+                                        const std::array<double, 3> box_size,
+                                        const double R)
+{
+  // The number of pencils processed by the pass along each dimension
+  const std::array<double, 3> n_pencils = { (double)new_n_cell[1] * new_n_cell[2],
+                                            (double)n_cell[0] * new_n_cell[2],
+                                            (double)n_cell[0] * n_cell[1] };
+
+  double flops = 0;
+  for (int ii = 0; ii < 3; ++ii) {
+    Pass pass;
+    build_kernel(pass, n_cell[ii], new_n_cell[ii], gaussian_volume_factor * R * (double)n_cell[ii] / box_size[ii]);
+    flops += n_pencils[ii] * std::min(pass.direct_flops, pass.fft_flops);
+  }
+  return flops;
+}
+
+size_t GaussianSmoother::estimate_bytes(const std::array<int, 3> n_cell,
+                                        const std::array<int, 3> new_n_cell,
+                                        const std::array<double, 3> box_size,
+                                        const double R,
+                                        const int n_threads)
+{
+  const size_t plane_out = (size_t)new_n_cell[1] * new_n_cell[2];
+  const size_t n_out = new_n_cell[0] * plane_out;
+  const size_t ratio = (size_t)(n_cell[0] / new_n_cell[0]);
+
+  Pass pass;
+  build_kernel(pass, n_cell[0], new_n_cell[0], gaussian_volume_factor * R * (double)n_cell[0] / box_size[0]);
+
+  // The output, then either every reduced input plane (for the FFT pass along the 1st dimension) or one reduced
+  // plane and the double precision accumulator (for the direct pass)
+  size_t bytes = n_out * sizeof(float);
+  if (pass.direct_flops > pass.fft_flops) {
+    bytes += n_cell[0] * plane_out * sizeof(double);
+  } else {
+    bytes += (plane_out + n_out) * sizeof(double);
+  }
+
+  // The rows, the input slab and the scratch of each thread
+  const size_t max_n = *std::max_element(n_cell.begin(), n_cell.end());
+  bytes += (size_t)n_cell[1] * new_n_cell[2] * sizeof(double);
+  bytes += ratio * (size_t)n_cell[1] * n_cell[2] * sizeof(float);
+  bytes += (size_t)n_threads * 6 * max_n * sizeof(double);
+  return bytes;
+}
+
+void GaussianSmoother::apply(const Pass& pass,
+                             const double* in,
+                             double* out,
+                             const int out_stride,
+                             Scratch& scratch) const
+{
+  const int n = pass.n;
+
+  if (pass.use_fft) {
+    auto pencil = scratch.pencil.data();
+    auto modes = scratch.modes.data();
+    std::copy(in, in + n, pencil);
+    fftw::execute_dft_r2c(pass.forward_plan, pencil, reinterpret_cast<fftw::complex*>(modes));
+    const int n_modes = n / 2 + 1;
+    for (int m = 0; m < n_modes; ++m) {
+      modes[m] *= pass.window[m];
+    }
+    fftw::execute_dft_c2r(pass.reverse_plan, reinterpret_cast<fftw::complex*>(modes), pencil);
+    for (int ii = 0; ii < pass.n_out; ++ii) {
+      out[ii * out_stride] = pencil[ii * pass.stride];
+    }
+    return;
+  }
+
+  // Unroll the periodic boundary into a contiguous buffer so that each output is a simple dot product
+  const int n_taps = static_cast<int>(pass.taps.size());
+  const int n_extended = n + n_taps - 1;
+  auto extended = scratch.extended.data();
+  for (int ii = 0; ii < n_extended; ++ii) {
+    int jj = (ii + pass.lo) % n;
+    extended[ii] = in[jj < 0 ? jj + n : jj];
+  }
+
+  const double* taps = pass.taps.data();
+  for (int ii = 0; ii < pass.n_out; ++ii) {
+    const double* window = extended + ii * pass.stride;
+    double sum = 0;
+#pragma omp simd reduction(+ : sum)
+    for (int tt = 0; tt < n_taps; ++tt) {
+      sum += taps[tt] * window[tt];
+    }
+    out[ii * out_stride] = sum;
+  }
+}
+
+void GaussianSmoother::add_slab(const float* slab, const int i_out)
+{
+  smooth_slab(slab, i_out);
+}
+
+void GaussianSmoother::add_slab(const double* slab, const int i_out)
+{
+  smooth_slab(slab, i_out);
+}
+
+template <typename In>
+void GaussianSmoother::smooth_slab(const In* slab, const int i_out)
+{
+  if (i_out == 0) {
+    n_planes = 0;
+    std::fill(accumulated.begin(), accumulated.end(), 0.0);
+  }
+  if (i_out * ratio[0] != n_planes) {
+    throw std::runtime_error(fmt::format("Gaussian smoothing expected slab {} but got slab {}",
+                                         n_planes / ratio[0], i_out));
+  }
+
+  const int ny = n_cell[1];
+  const int nz = n_cell[2];
+  const int new_ny = new_n_cell[1];
+  const int new_nz = new_n_cell[2];
+  const size_t plane_out = (size_t)new_ny * new_nz;
+
+  const int n_threads = static_cast<int>(scratches.size());
+
+  for (int i_plane = 0; i_plane < ratio[0]; ++i_plane, ++n_planes) {
+    const In* plane = slab + (size_t)i_plane * ny * nz;
+    double* rows_ = rows.data();
+    double* reduced_ = use_fft[0] ? reduced.data() + (size_t)n_planes * plane_out : reduced.data();
+
+    // The output planes which this input plane contributes to in the direct pass along the 1st dimension
+    std::vector<std::pair<int, double>> contributions;
+    if (!use_fft[0]) {
+      const Pass& pass = passes[0];
+      for (int ii = 0; ii < new_n_cell[0]; ++ii) {
+        int offset = (n_planes - ii * pass.stride - pass.lo) % pass.n;
+        offset = (offset < 0 ? offset + pass.n : offset) + pass.lo;
+        if (offset <= pass.hi) {
+          contributions.emplace_back(ii, pass.taps[offset - pass.lo]);
+        }
+      }
+    }
+
+#pragma omp parallel default(shared) num_threads(n_threads)
+    {
+      Scratch& thread_scratch = scratches[omp_get_thread_num()];
+      double* gathered = thread_scratch.gathered.data();
+
+      // Pass along the (contiguous) 3rd dimension, one row at a time
+#pragma omp for schedule(static)
+      for (int jj = 0; jj < ny; ++jj) {
+        const In* row = plane + (size_t)jj * nz;
+        std::copy(row, row + nz, gathered);
+        apply(passes[2], gathered, rows_ + (size_t)jj * new_nz, 1, thread_scratch);
+      }
+
+      // Pass along the 2nd dimension
+      const Pass& pass = passes[1];
+      if (pass.use_fft) {
+#pragma omp for schedule(static)
+        for (int kk = 0; kk < new_nz; ++kk) {
+          for (int jj = 0; jj < ny; ++jj) {
+            gathered[jj] = rows_[(size_t)jj * new_nz + kk];
+          }
+          apply(pass, gathered, reduced_ + kk, new_nz, thread_scratch);
+        }
+      } else {
+        // Accumulate whole (contiguous) rows so that the inner loop vectorises
+#pragma omp for schedule(static)
+        for (int jj = 0; jj < new_ny; ++jj) {
+          double* out_row = reduced_ + (size_t)jj * new_nz;
+          std::fill(out_row, out_row + new_nz, 0.0);
+          for (int tt = 0; tt < (int)pass.taps.size(); ++tt) {
+            int j_in = (jj * pass.stride + pass.lo + tt) % ny;
+            const double* in_row = rows_ + (size_t)(j_in < 0 ? j_in + ny : j_in) * new_nz;
+            const double tap = pass.taps[tt];
+#pragma omp simd
+            for (int kk = 0; kk < new_nz; ++kk) {
+              out_row[kk] += tap * in_row[kk];
+            }
+          }
+        }
+      }
+
+      // Direct pass along the 1st dimension: scatter this plane into every output plane it contributes to
+      if (!use_fft[0]) {
+        double* accumulated_ = accumulated.data();
+        const long n_plane_out = static_cast<long>(plane_out);
+#pragma omp for schedule(static)
+        for (long ii = 0; ii < n_plane_out; ++ii) {
+          for (const auto& contribution : contributions) {
+            accumulated_[contribution.first * plane_out + ii] += contribution.second * reduced_[ii];
+          }
+        }
+      }
+    }
+  }
+}
+
+float* GaussianSmoother::get()
+{
+  if (n_planes != n_cell[0]) {
+    throw std::runtime_error(
+      fmt::format("Gaussian smoothing has only received {} of {} input planes", n_planes, n_cell[0]));
+  }
+
+  const long n_plane_out = static_cast<long>(new_n_cell[1]) * new_n_cell[2];
+  float* output_ = output.data();
+
+  if (use_fft[0]) {
+    // FFT pass along the 1st dimension over the stored reduced planes
+    const Pass& pass = passes[0];
+    const double* reduced_ = reduced.data();
+#pragma omp parallel default(shared) num_threads(static_cast<int>(scratches.size()))
+    {
+      Scratch& thread_scratch = scratches[omp_get_thread_num()];
+      double* column = thread_scratch.gathered.data();
+      double* smoothed = thread_scratch.smoothed.data();
+
+#pragma omp for schedule(static)
+      for (long ii = 0; ii < n_plane_out; ++ii) {
+        for (int xx = 0; xx < pass.n; ++xx) {
+          column[xx] = reduced_[xx * n_plane_out + ii];
+        }
+        apply(pass, column, smoothed, 1, thread_scratch);
+        for (int xx = 0; xx < pass.n_out; ++xx) {
+          output_[xx * n_plane_out + ii] = static_cast<float>(smoothed[xx]);
+        }
+      }
+    }
+  } else {
+    const double* accumulated_ = accumulated.data();
+    const long n_out = static_cast<long>(output.size());
+#pragma omp parallel for simd default(none) firstprivate(n_out, output_, accumulated_)
+    for (long ii = 0; ii < n_out; ++ii) {
+      output_[ii] = static_cast<float>(accumulated_[ii]);
+    }
+  }
+
+  return output_;
+}
@@ -0,0 +1,171 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GAUSSIAN_H
+#define GAUSSIAN_H
+
+#include <array>
+#include <complex>
+#include <vector>
+
+#include "fftw_traits.hpp"
+#include "streaming.hpp"
+
+/** Smooth a grid with a periodic Gaussian and subsample it, streaming the input one slab at a time.
+ *
+ * The result is identical to `Grid::filter` with `GridBase::filter_type::gaussian` followed by `Grid::sample`, but as
+ * the Gaussian is separable it is applied as three 1D periodic passes rather than a 3D FFT.  Each pass only evaluates
+ * the points which survive the subsampling, so every input plane is reduced to its subsampled `new_n_cell[1] x
+ * new_n_cell[2]` footprint as soon as it arrives and the full resolution grid is never held in memory.
+ *
+ * Each pass is done either as a direct convolution with the (truncated) kernel or, when the kernel is wide enough
+ * that it is cheaper, by batched 1D FFTs of each pencil.  The kernel is the inverse DFT of the same k-space window
+ * used by `Grid::filter`, so both forms match the 3D FFT result to rounding error.
+ */
+class GaussianSmoother : public StreamingDownsampler
+{
+public:
+  /** How each 1D pass is done.
+   */
+  enum class convolution
+  {
+    automatic, //< Pick the cheapest of `direct` and `fft` for each dimension
+    direct,    //< Direct convolution with the truncated real space kernel
+    fft        //< Multiply by the window after a 1D FFT of each pencil
+  };
+
+  std::array<double, 3> sigma;   //< The standard deviation of the Gaussian in units of input cells
+  std::array<bool, 3> use_fft;   //< Is each dimension done with 1D FFTs (otherwise by direct convolution)?
+  std::array<int, 3> half_width; //< The number of kernel taps either side of the centre for the direct convolution
+
+  /** Constructor.
+   *
+   * @param n_cell_ The number of input cells in each dimension
+   * @param new_n_cell_ The number of output cells in each dimension (each must divide the input dimension exactly)
+   * @param box_size The size of the simulation volume in input units
+   * @param R The filter radius in input units (as passed to `Grid::filter`)
+   * @param mode How the 1D passes are done
+   */
+  GaussianSmoother(const std::array<int, 3> n_cell_,
+                   const std::array<int, 3> new_n_cell_,
+                   const std::array<double, 3> box_size,
+                   const double R,
+                   const convolution mode = convolution::automatic);
+
+  /** Estimate the number of floating point operations needed to smooth and subsample one grid.
+   *
+   * @param n_cell The number of input cells in each dimension
+   * @param new_n_cell The number of output cells in each dimension
+   * @param box_size The size of the simulation volume in input units
+   * @param R The filter radius in input units
+   * @return The estimated number of flops
+   */
+  static double estimate_flops(const std::array<int, 3> n_cell,
+                               const std::array<int, 3> new_n_cell,
+                               const std::array<double, 3> box_size,
+                               const double R);
+
+  /** Estimate the memory allocated by a smoother, including a single float32 input slab.
+   *
+   * When the pass along the 1st dimension is done with FFTs (as picked by `convolution::automatic`), every input
+   * plane is held after the other two passes, so the kernel width is needed.
+   *
+   * @param n_cell The number of input cells in each dimension
+   * @param new_n_cell The number of output cells in each dimension
+   * @param box_size The size of the simulation volume in input units
+   * @param R The filter radius in input units
+   * @param n_threads The number of OpenMP threads, each of which has its own scratch space
+   * @return The estimated number of bytes
+   */
+  static size_t estimate_bytes(const std::array<int, 3> n_cell,
+                               const std::array<int, 3> new_n_cell,
+                               const std::array<double, 3> box_size,
+                               const double R,
+                               const int n_threads);
+
+  /** Destructor.
+   * This will free the fftw plans created during initialisation.
+   */
+  ~GaussianSmoother();
+
+  GaussianSmoother(const GaussianSmoother&) = delete;
+  GaussianSmoother& operator=(const GaussianSmoother&) = delete;
+
+  /** Smooth a slab of input values, accumulating it into the output.
+   *
+   * @param slab Pointer to `slab_size()` values, in C order
+   * @param i_out The index of the slab (slabs must be added in order)
+   */
+  void add_slab(const float* slab, const int i_out) override;
+
+  /** @copydoc add_slab(const float*, const int)
+   */
+  void add_slab(const double* slab, const int i_out) override;
+
+  /** Return the pointer to the smoothed and subsampled output grid, once all of the slabs have been added.
+   */
+  float* get() override;
+
+private:
+  typedef fftw_traits<double> fftw;
+
+  /** A periodic 1D pass along one dimension.
+   */
+  struct Pass
+  {
+    int n;                      //< The number of input points along the pencil
+    int n_out;                  //< The number of points kept after subsampling
+    int stride;                 //< The subsampling stride
+    bool use_fft;               //< Use 1D FFTs rather than direct convolution?
+    int lo;                     //< The offset of the first kernel tap
+    int hi;                     //< The offset of the last kernel tap
+    std::vector<double> taps;   //< The real space kernel for offsets lo..hi
+    std::vector<double> window; //< The k-space window (including the 1/n normalisation) for the FFTs
+    double direct_flops;        //< Estimated cost of one pencil by direct convolution
+    double fft_flops;           //< Estimated cost of one pencil by FFT
+    fftw::plan forward_plan;    //< The forward (r2c) pencil plan
+    fftw::plan reverse_plan;    //< The reverse (c2r) pencil plan
+  };
+
+  /** Per thread working space for the passes, allocated once for the lifetime of the smoother.
+   */
+  struct Scratch
+  {
+    std::vector<double> pencil;              //< The pencil transformed by the FFT passes
+    std::vector<double> extended;            //< The pencil unrolled over the periodic boundary by the direct passes
+    std::vector<std::complex<double>> modes; //< The modes of the pencil for the FFT passes
+    std::vector<double> gathered;            //< A pencil gathered from the grid before a pass
+    std::vector<double> smoothed;            //< The subsampled result of a pass, before it is scattered
+  };
+
+  std::array<Pass, 3> passes;      //< The passes along each dimension
+  std::vector<double> rows;        //< The rows of the current plane after the pass along the 3rd dimension
+  std::vector<double> reduced;     //< Input planes after the passes along the 2nd and 3rd dimensions
+  std::vector<double> accumulated; //< The output accumulated by the direct pass along the 1st dimension
+  std::vector<Scratch> scratches;  //< The working space of each OpenMP thread
+  int n_planes = 0;                //< The number of input planes added so far for the current grid
+
+  static void build_kernel(Pass& pass, const int n, const int n_out, const double sigma_cells);
+  void init_pass(Pass& pass, const int dim, const double sigma_cells, const convolution mode);
+  void apply(const Pass& pass, const double* in, double* out, const int out_stride, Scratch& scratch) const;
+
+  template <typename In>
+  void smooth_slab(const In* slab, const int i_out);
+};
+
+#endif
@@ -16,95 +16,281 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <array>
 #include <fmt/color.h>
 #include <fmt/core.h>
 #include <fmt/ostream.h>
 #include <fstream>
+#include <limits>
+#include <memory>
+#include <omp.h>
+#include <stdexcept>
 #include <vector>
 
 #include "gbptrees.hpp"
+#include "journal.hpp"
+#include "planner.hpp"
+#include "power_spectrum.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include "streaming.hpp"
 #include "utils.hpp"
 
-void regrid_gbptrees(const std::string fname_in, const std::string fname_out, const int new_dim)
+/** Return the number of grids recorded by a journal which are intact in the output file.
+ *
+ * @param fname_out The output file
+ * @param journal The journal
+ * @param header_bytes The size of the file header
+ * @param grid_bytes The size of each grid, including its identifier
+ * @return The number of leading entries whose grid is where it should be and matches the checksum
+ */
+static int count_intact_grids(const std::string fname_out,
+                              const Journal& journal,
+                              const size_t header_bytes,
+                              const size_t grid_bytes)
+{
+  std::ifstream ifs(fname_out, std::ios::binary | std::ios::in);
+  std::vector<char> buffer(grid_bytes);
+  int n_intact = 0;
+  for (const auto& entry : journal.entries) {
+    if (entry.offset != header_bytes + n_intact * grid_bytes || entry.bytes != grid_bytes) {
+      break;
+    }
+    ifs.seekg(entry.offset);
+    if (!ifs.read(buffer.data(), grid_bytes) || checksum(buffer.data(), grid_bytes) != entry.checksum) {
+      break;
+    }
+    ++n_intact;
+  }
+  return n_intact;
+}
+
+template <typename T>
+void regrid_gbptrees(const std::string fname_in,
+                     const std::string fname_out,
+                     const int new_dim,
+                     const RegridOptions& options)
 {
+  if (encoded_size(options.encoding) != sizeof(float)) {
+    throw std::runtime_error(
+      fmt::format("gbpTrees grids are stored as float32 and can't be {} encoded (try bitround)",
+                  encoding_name(options.encoding)));
+  }
+
   fmt::print("Regridding gbpTrees file {}\n", fname_in);
   std::ifstream ifs(fname_in, std::ios::binary | std::ios::in);
-  std::ofstream ofs(fname_out, std::ios::binary | std::ios::out);
+  if (!ifs) {
+    throw std::runtime_error(fmt::format("Failed to open {}", fname_in));
+  }
 
   std::array<int, 3> n_cell;
   std::array<int, 3> new_n_cell = { new_dim, new_dim, new_dim };
   ifs.read((char*)(n_cell.data()), sizeof(int) * 3);
   fmt::print("n_cell = [{}] --> [{}]\n", fmt::join(n_cell, ", "), fmt::join(new_n_cell, ", "));
-  ofs.write((char*)(new_n_cell.data()), sizeof(int) * 3);
 
   std::array<double, 3> box_size;
   ifs.read((char*)(box_size.data()), sizeof(double) * 3);
   fmt::print("box_size = {}\n", fmt::join(box_size, ","));
-  ofs.write((char*)(box_size.data()), sizeof(double) * 3);
 
   int32_t n_grids;
   ifs.read((char*)(&n_grids), sizeof(int));
   fmt::print("n_grids = {}\n", n_grids);
-  ofs.write((char*)(&n_grids), sizeof(int));
 
   int32_t ma_scheme;
   ifs.read((char*)(&ma_scheme), sizeof(int));
   fmt::print("ma_scheme = {}\n", ma_scheme);
+
+  const double radius = box_size[0] / (double)new_dim * 0.5;
+
+  RegridProblem problem = {
+    n_cell, new_n_cell, box_size, radius, n_grids, sizeof(T), omp_get_max_threads(), memory_budget(options), 0
+  };
+  const auto plan = plan_method(problem, options);
+  const auto method = plan.method;
+  if (options.dry_run) {
+    return;
+  }
+
+  // Each grid is journalled once written, so that a killed run can resume after the last intact one.  The power
+  // spectra need every grid, so can't be resumed.
+  const size_t header_bytes = sizeof(int) * 3 + sizeof(double) * 3 + sizeof(int) * 2;
+  const size_t ident_bytes = 32;
+  const size_t in_grid_bytes = ident_bytes + sizeof(float) * n_cell[0] * n_cell[1] * n_cell[2];
+  const size_t out_grid_bytes = ident_bytes + sizeof(float) * new_n_cell[0] * new_n_cell[1] * new_n_cell[2];
+  std::unique_ptr<Journal> journal;
+  int first_grid = 0;
+  if (!options.power_spectrum) {
+    journal.reset(new Journal(fname_out, job_signature(fname_in, new_dim, method, options, sizeof(T))));
+    if (!journal->entries.empty()) {
+      ScopedPhase scope(phase::read);
+      fmt::print("Verifying {} journalled grids... ", journal->entries.size());
+      first_grid = std::min(count_intact_grids(fname_out, *journal, header_bytes, out_grid_bytes), n_grids);
+      print_done();
+    }
+    journal->start(first_grid);
+  }
+
+  auto mode = std::ios::binary | std::ios::out;
+  if (first_grid > 0) {
+    fmt::print("Resuming from grid {} of {}\n", first_grid + 1, n_grids);
+    mode |= std::ios::in; // Don't truncate the grids already written
+  }
+  std::ofstream ofs(fname_out, mode);
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to open {} to write the output", fname_out));
+  }
+  ofs.write((char*)(new_n_cell.data()), sizeof(int) * 3);
+  ofs.write((char*)(box_size.data()), sizeof(double) * 3);
+  ofs.write((char*)(&n_grids), sizeof(int));
   ofs.write((char*)(&ma_scheme), sizeof(int));
 
-  auto grid = Grid(n_cell, box_size);
-  const double radius = (double)grid.box_size[0] / (double)new_dim * 0.5;
+  // Only one of these is allocated, depending on the method
+  std::unique_ptr<Grid<T>> grid;
+  std::unique_ptr<StreamingDownsampler> streamer;
+  std::vector<float> slab;
+  std::unique_ptr<SpectrumAccumulator> spectra;
+  if (method == regrid_method::fft) {
+    grid = acquire_grid<T>(n_cell, box_size, plan.grid);
+    if (options.power_spectrum) {
+      spectra.reset(new SpectrumAccumulator(n_cell, box_size));
+    }
+  } else {
+    ScopedPhase scope(phase::setup);
+    streamer = make_streaming_downsampler(method, n_cell, new_n_cell, box_size, radius);
+    slab.resize(streamer->slab_size());
+  }
+
+  std::vector<std::string> names;
+  std::vector<GridStats> all_stats;
+  for (int ii = 0; ii < first_grid; ++ii) {
+    names.push_back(journal->entries[ii].name);
+    all_stats.push_back(journal->entries[ii].stats);
+  }
+  ifs.seekg(header_bytes + first_grid * in_grid_bytes);
+  ofs.seekp(header_bytes + first_grid * out_grid_bytes);
 
-  for (int ii = 0; ii < n_grids; ++ii) {
+  for (int ii = first_grid; ii < n_grids; ++ii) {
 
-    std::string ident(32, '\0');
-    ifs.read((char*)(ident.data()), sizeof(ident));
-    ofs.write((char*)(ident.data()), sizeof(ident));
+    const size_t offset = ofs.tellp();
+    std::string ident(ident_bytes, '\0');
+    ifs.read((char*)(ident.data()), ident_bytes);
+    ofs.write((char*)(ident.data()), ident_bytes);
+    auto sum = checksum(ident.data(), ident_bytes);
 
     ident.resize(strlen(ident.c_str()));
     fmt::print("\nGrid {}\n=================\n", ident);
+    TraceSpan grid_span("grid", ident);
 
-    // We do this here as the Grid may have already been subsampled in a
-    // previous iteration.
-    grid.update_properties(n_cell);
+    float* values = nullptr;
+    size_t n_values = 0;
+    GridStats stats;
 
-    fmt::print("Reading grid... ");
-    ifs.read((char*)grid.get(), sizeof(float) * grid.n_logical);
-    print_done();
+    if (streamer) {
+      ScopedPhase scope(phase::stream);
+      fmt::print("Streaming grid through {}... ", method_name(method));
+      for (int i_out = 0; i_out < streamer->new_n_cell[0]; ++i_out) {
+        ifs.read((char*)slab.data(), sizeof(float) * slab.size());
+        streamer->add_slab(slab.data(), i_out);
+      }
+      print_done();
+
+      values = streamer->get();
+      n_values = streamer->n_logical();
+      stats = compute_stats(values, n_values, std::numeric_limits<double>::quiet_NaN());
+    } else {
+      // We do this here as the Grid may have already been subsampled in a
+      // previous iteration.
+      grid->update_properties(n_cell);
+
+      {
+        ScopedPhase scope(phase::read);
+        fmt::print("Reading grid... ");
+        ifs.read((char*)grid->get(), sizeof(float) * grid->n_logical);
+        widen_in_place(grid->get(), grid->n_logical);
+        print_done();
+      }
 
 #ifdef DEBUG
-    {
-      std::vector<float> subset(grid.get(), grid.get() + 10);
-      fmt::print("First 10 elements = {}\n", fmt::join(subset, ","));
-    }
+      {
+        std::vector<T> subset(grid->get(), grid->get() + 10);
+        fmt::print("First 10 elements = {}\n", fmt::join(subset, ","));
+      }
 #endif
 
-    grid.filter(Grid::filter_type::real_top_hat, radius);
+      if (spectra) {
+        spectra->start(ident);
+      }
+      grid->filter(options.filter, radius, spectra.get());
 
 #ifdef DEBUG
-    {
-      std::vector<float> subset(grid.get(), grid.get() + 10);
-      fmt::print("First 10 elements = {}\n", fmt::join(subset, ","));
-    }
+      {
+        std::vector<T> subset(grid->get(), grid->get() + 10);
+        fmt::print("First 10 elements = {}\n", fmt::join(subset, ","));
+      }
 #endif
 
-    grid.sample(new_n_cell);
+      grid->sample(new_n_cell, &stats);
 
 #ifdef DEBUG
+      {
+        std::vector<T> subset(grid->get(), grid->get() + 10);
+        fmt::print("First 10 elements = {}\n", fmt::join(subset, ","));
+      }
+#endif
+
+      values = narrow_in_place(grid->get(), grid->n_logical);
+      n_values = grid->n_logical;
+    }
+
+    print_stats(stats);
+    names.push_back(ident);
+    all_stats.push_back(stats);
+
     {
-      std::vector<float> subset(grid.get(), grid.get() + 10);
-      fmt::print("First 10 elements = {}\n", fmt::join(subset, ","));
+      ScopedPhase scope(phase::write);
+      fmt::print("Writing subsampled grid... ");
+      auto error = encode(values, values, n_values, options.encoding, options.keep_bits);
+      ofs.write((char*)values, sizeof(float) * n_values);
+      print_done();
+      print_encoding_error(options.encoding, error);
+      sum = checksum(values, sizeof(float) * n_values, sum);
     }
-#endif
 
-    fmt::print("Writing subsampled grid... ");
-    ofs.write((char*)grid.get(), sizeof(float) * grid.n_logical);
-    print_done();
+    if (journal) {
+      JournalEntry entry;
+      entry.name = ident;
+      entry.offset = offset;
+      entry.bytes = out_grid_bytes;
+      entry.checksum = sum;
+      entry.stats = stats;
+      ofs.flush();
+      journal->record(entry);
+    }
   }
 
   ofs.close();
   ifs.close();
+  release_grid(grid);
 
   print_done();
+
+  {
+    ScopedPhase scope(phase::write);
+    write_stats(fname_out + ".stats", names, all_stats);
+  }
+
+  if (spectra) {
+    ScopedPhase scope(phase::write);
+    fmt::print("Writing power spectra to {}.pk... ", fname_out);
+    spectra->write(fname_out + ".pk");
+    print_done();
+  }
+
+  if (journal) {
+    journal->remove();
+  }
 }
+
+template void regrid_gbptrees<float>(const std::string, const std::string, const int, const RegridOptions&);
+template void regrid_gbptrees<double>(const std::string, const std::string, const int, const RegridOptions&);
@@ -20,14 +20,23 @@
 #define GBPTREES_H
 
 #include "grid.hpp"
+#include "options.hpp"
 #include <string>
 
 /** Regrid a gbptrees file.
  *
+ * The file always stores float32 values; with `T = double` these are converted on read and write.
+ *
+ * @tparam T The scalar type used for the in-memory grid (`float` or `double`)
  * @param fname_in The path to the input file to be regridded
  * @param fname_out The path to the new output file to be created
  * @param new_dim The new size of the grid (assuming cubic dimensions)
+ * @param options Options controlling the regridding (only float32 and bitround encodings are supported)
  */
-void regrid_gbptrees(const std::string fname_in, const std::string fname_out, const int new_dim);
+template <typename T>
+void regrid_gbptrees(const std::string fname_in,
+                     const std::string fname_out,
+                     const int new_dim,
+                     const RegridOptions& options);
 
 #endif
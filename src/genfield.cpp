@@ -0,0 +1,284 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fmt/core.h>
+#include <fstream>
+#include <omp.h>
+#include <sstream>
+#include <stdexcept>
+
+#include "genfield.hpp"
+
+power_function power_law(const double amplitude, const double index)
+{
+  return [amplitude, index](const double k) { return k > 0 ? amplitude * std::pow(k, index) : 0.0; };
+}
+
+power_function read_power_spectrum(const std::string fname, const int column)
+{
+  std::ifstream ifs(fname);
+  if (!ifs) {
+    throw std::runtime_error(fmt::format("Failed to open the power spectrum {}", fname));
+  }
+  if (column < 2) {
+    throw std::runtime_error("The power spectrum column must be 2 or greater (k is the first column)");
+  }
+
+  std::vector<double> ks;
+  std::vector<double> ps;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream iss(line);
+    std::vector<double> values;
+    double value;
+    while (iss >> value) {
+      values.push_back(value);
+    }
+    if (values.empty()) {
+      continue;
+    }
+    if ((int)values.size() < column) {
+      throw std::runtime_error(fmt::format("The power spectrum {} has fewer than {} columns", fname, column));
+    }
+    if (!ks.empty() && values[0] <= ks.back()) {
+      throw std::runtime_error(fmt::format("The values of k in the power spectrum {} must increase", fname));
+    }
+    ks.push_back(values[0]);
+    ps.push_back(values[column - 1]);
+  }
+
+  if (ks.size() < 2) {
+    throw std::runtime_error(fmt::format("The power spectrum {} must have at least two rows", fname));
+  }
+
+  return [ks, ps](const double k) {
+    if (k < ks.front() || k > ks.back()) {
+      return 0.0;
+    }
+    const size_t hi = std::max<size_t>(1, std::upper_bound(ks.begin(), ks.end(), k) - ks.begin());
+    const size_t lo = std::min(hi, ks.size() - 1) - 1;
+    const size_t up = lo + 1;
+    if (ks[lo] > 0 && ps[lo] > 0 && ps[up] > 0) {
+      const double t = std::log(k / ks[lo]) / std::log(ks[up] / ks[lo]);
+      return ps[lo] * std::pow(ps[up] / ps[lo], t);
+    }
+    const double t = (k - ks[lo]) / (ks[up] - ks[lo]);
+    return ps[lo] + t * (ps[up] - ps[lo]);
+  };
+}
+
+/** The SplitMix64 mixing function (see Steele, Lea & Flood 2014), used as a counter based random number generator.
+ */
+static inline uint64_t splitmix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+/** Map 64 random bits to a uniform deviate in (0, 1).
+ */
+static inline double to_unit(const uint64_t bits)
+{
+  return ((double)(bits >> 11) + 0.5) / 9007199254740992.0;
+}
+
+GaussianRandomField::GaussianRandomField(const std::array<int, 3> n_cell_,
+                                         const std::array<double, 3> box_size_,
+                                         const power_function power_,
+                                         const uint64_t seed_,
+                                         const std::string scratch_fname_)
+  : n_cell{ n_cell_ }
+  , box_size{ box_size_ }
+  , power{ power_ }
+  , seed{ seed_ }
+  , scratch_fname{ scratch_fname_ }
+  , n_z{ n_cell_[2] / 2 + 1 }
+{
+  if (scratch_fname.empty()) {
+    memory.resize(scratch_bytes(n_cell) / sizeof(complex));
+    scratch = memory.data();
+  } else {
+    mapped.reset(new MappedFile(scratch_fname, scratch_bytes(n_cell)));
+    scratch = reinterpret_cast<complex*>(mapped->data());
+  }
+
+  // The pencil plans are executed concurrently by the OpenMP threads, so they must not be threaded themselves
+  ScopedPlanner<float> scoped_planner(1);
+  std::vector<complex> pencil(std::max(n_cell[0], std::max(n_cell[1], n_z)));
+  std::vector<float> row(n_cell[2]);
+  auto pencil_ = reinterpret_cast<fftw::complex*>(pencil.data());
+  x_plan = fftw::plan_dft_1d(n_cell[0], pencil_, pencil_, FFTW_BACKWARD, FFTW_ESTIMATE | FFTW_UNALIGNED);
+  y_plan = fftw::plan_dft_1d(n_cell[1], pencil_, pencil_, FFTW_BACKWARD, FFTW_ESTIMATE | FFTW_UNALIGNED);
+  z_plan = fftw::plan_dft_c2r_1d(n_cell[2], pencil_, row.data(), FFTW_ESTIMATE | FFTW_UNALIGNED);
+
+  if (x_plan == nullptr || y_plan == nullptr || z_plan == nullptr) {
+    throw std::runtime_error("Failed to create the FFTW plans for the random field");
+  }
+}
+
+GaussianRandomField::~GaussianRandomField()
+{
+  {
+    std::lock_guard<std::mutex> lock(fftw_planner_mutex());
+    fftw::destroy_plan(z_plan);
+    fftw::destroy_plan(y_plan);
+    fftw::destroy_plan(x_plan);
+  }
+  if (mapped) {
+    mapped.reset();
+    std::remove(scratch_fname.c_str());
+  }
+}
+
+size_t GaussianRandomField::scratch_bytes(const std::array<int, 3> n_cell)
+{
+  return (size_t)n_cell[0] * n_cell[1] * (n_cell[2] / 2 + 1) * sizeof(complex);
+}
+
+GaussianRandomField::complex GaussianRandomField::mode(const int i_grid, const int ix, const int iy, const int iz) const
+{
+  if (ix == 0 && iy == 0 && iz == 0) {
+    return 0;
+  }
+
+  // In the k_z = 0 and k_z = N/2 planes mode -k is stored too, and must be the conjugate of mode k
+  int jx = ix;
+  int jy = iy;
+  bool conjugate = false;
+  bool real = false;
+  if (iz == 0 || 2 * iz == n_cell[2]) {
+    const int px = (n_cell[0] - ix) % n_cell[0];
+    const int py = (n_cell[1] - iy) % n_cell[1];
+    if (px == ix && py == iy) {
+      real = true;
+    } else if (px < ix || (px == ix && py < iy)) {
+      jx = px;
+      jy = py;
+      conjugate = true;
+    }
+  }
+
+  const double k_x = (jx > n_cell[0] / 2 ? jx - n_cell[0] : jx) * 2.0 * M_PI / box_size[0];
+  const double k_y = (jy > n_cell[1] / 2 ? jy - n_cell[1] : jy) * 2.0 * M_PI / box_size[1];
+  const double k_z = iz * 2.0 * M_PI / box_size[2];
+  const double volume = box_size[0] * box_size[1] * box_size[2];
+  const double variance = power(std::sqrt(k_x * k_x + k_y * k_y + k_z * k_z)) / volume;
+  if (!(variance > 0)) {
+    return 0;
+  }
+
+  // Box-Muller transform of two uniform deviates drawn from the counter for this mode
+  const uint64_t stream = splitmix64(seed + splitmix64((uint64_t)i_grid));
+  const uint64_t counter = 2 * (((uint64_t)jx * n_cell[1] + jy) * n_z + iz);
+  const double radius = std::sqrt(-2.0 * std::log(to_unit(splitmix64(stream + counter))));
+  const double theta = 2.0 * M_PI * to_unit(splitmix64(stream + counter + 1));
+
+  if (real) {
+    return complex((float)(std::sqrt(variance) * radius * std::cos(theta)), 0.0f);
+  }
+  const double amplitude = std::sqrt(variance / 2.0) * radius;
+  const complex value((float)(amplitude * std::cos(theta)), (float)(amplitude * std::sin(theta)));
+  return conjugate ? std::conj(value) : value;
+}
+
+void GaussianRandomField::transform_x(const int i_grid)
+{
+  const int n_x = n_cell[0];
+  const int n_y = n_cell[1];
+  const int n_z_ = n_z;
+  auto scratch_ = scratch;
+  auto x_plan_ = x_plan;
+
+#pragma omp parallel default(none) firstprivate(i_grid, n_x, n_y, n_z_, scratch_, x_plan_)
+  {
+    std::vector<complex> pencil(n_x);
+    std::vector<complex> rows((size_t)n_x * n_z_);
+    auto pencil_ = reinterpret_cast<fftw::complex*>(pencil.data());
+
+#pragma omp for schedule(static)
+    for (int iy = 0; iy < n_y; ++iy) {
+      for (int iz = 0; iz < n_z_; ++iz) {
+        for (int ix = 0; ix < n_x; ++ix) {
+          pencil[ix] = mode(i_grid, ix, iy, iz);
+        }
+        fftw::execute_dft(x_plan_, pencil_, pencil_);
+        for (int ix = 0; ix < n_x; ++ix) {
+          rows[(size_t)ix * n_z_ + iz] = pencil[ix];
+        }
+      }
+
+      for (int ix = 0; ix < n_x; ++ix) {
+        std::memcpy(scratch_ + ((size_t)ix * n_y + iy) * n_z_, rows.data() + (size_t)ix * n_z_, sizeof(complex) * n_z_);
+      }
+    }
+  }
+
+  current_grid = i_grid;
+}
+
+void GaussianRandomField::fill(const int i_grid, const int i, float* plane)
+{
+  if (i_grid != current_grid) {
+    transform_x(i_grid);
+  }
+
+  const int n_y = n_cell[1];
+  const int n_z_ = n_z;
+  const int nz = n_cell[2];
+  const size_t plane_size = (size_t)n_y * n_z;
+  std::vector<complex> modes(scratch + i * plane_size, scratch + (i + 1) * plane_size);
+  if (mapped) {
+    mapped->release(i * plane_size * sizeof(complex), plane_size * sizeof(complex));
+  }
+
+  auto modes_ = modes.data();
+  auto y_plan_ = y_plan;
+  auto z_plan_ = z_plan;
+
+#pragma omp parallel default(none) firstprivate(plane, n_y, n_z_, nz, modes_, y_plan_, z_plan_)
+  {
+    std::vector<complex> pencil(n_y);
+    auto pencil_ = reinterpret_cast<fftw::complex*>(pencil.data());
+
+#pragma omp for schedule(static)
+    for (int iz = 0; iz < n_z_; ++iz) {
+      for (int iy = 0; iy < n_y; ++iy) {
+        pencil[iy] = modes_[(size_t)iy * n_z_ + iz];
+      }
+      fftw::execute_dft(y_plan_, pencil_, pencil_);
+      for (int iy = 0; iy < n_y; ++iy) {
+        modes_[(size_t)iy * n_z_ + iz] = pencil[iy];
+      }
+    }
+
+#pragma omp for schedule(static)
+    for (int iy = 0; iy < n_y; ++iy) {
+      fftw::execute_dft_c2r(
+        z_plan_, reinterpret_cast<fftw::complex*>(modes_ + (size_t)iy * n_z_), plane + (size_t)iy * nz);
+    }
+  }
+}
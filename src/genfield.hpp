@@ -0,0 +1,134 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GENFIELD_H
+#define GENFIELD_H
+
+#include <array>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fftw_traits.hpp"
+#include "npy.hpp"
+
+/** A power spectrum P(k), with k in inverse box units and P in box units cubed.
+ */
+typedef std::function<double(const double k)> power_function;
+
+/** Return the power law P(k) = amplitude * k^index.
+ */
+power_function power_law(const double amplitude, const double index);
+
+/** Read a tabulated power spectrum from a whitespace separated text file (lines starting with # are ignored).
+ *
+ * P(k) is interpolated linearly in log k and log P (or linearly where P isn't positive), and is zero outside of the
+ * tabulated range.  The `.pk` files written by `--power-spectrum` can be read with `column = 3`.
+ *
+ * @param fname The name of the file
+ * @param column The (1-based) column holding P(k); k is always the first column
+ * @return The interpolated power spectrum
+ */
+power_function read_power_spectrum(const std::string fname, const int column = 2);
+
+/** Generate periodic Gaussian random fields with a given power spectrum, one plane at a time.
+ *
+ * The Fourier modes follow the convention of `Grid` and `SpectrumAccumulator`: mode k of the DFT divided by the
+ * number of cells has variance P(k) / V, so measuring the power spectrum of the output recovers P(k).  The zero mode
+ * is zero.  Each mode is drawn from a counter based random number generator keyed on the seed, the grid number and
+ * the mode itself, and each 1D transform is done in full by one thread with an `FFTW_ESTIMATE` plan, so the output
+ * is bitwise identical for any number of threads.
+ *
+ * The inverse FFT is done as two passes of pencils.  The first transforms along the 1st dimension and stores the
+ * result, in x-major order, in a scratch array the size of the complex grid.  The second transforms each plane along
+ * the remaining dimensions when it is requested.  The scratch array can be a memory mapped file, so fields larger
+ * than memory can be generated.
+ */
+class GaussianRandomField
+{
+public:
+  /** Constructor.
+   *
+   * @param n_cell_ The number of cells in each dimension
+   * @param box_size_ The size of the periodic volume
+   * @param power_ The power spectrum of the fields
+   * @param seed_ The random seed
+   * @param scratch_fname_ The file used for the scratch array (kept in memory if empty)
+   */
+  GaussianRandomField(const std::array<int, 3> n_cell_,
+                      const std::array<double, 3> box_size_,
+                      const power_function power_,
+                      const uint64_t seed_,
+                      const std::string scratch_fname_ = "");
+
+  /** Destructor, removing any scratch file.
+   */
+  ~GaussianRandomField(void);
+
+  GaussianRandomField(const GaussianRandomField&) = delete;
+  GaussianRandomField& operator=(const GaussianRandomField&) = delete;
+
+  /** Return the size of the scratch array in bytes.
+   *
+   * @param n_cell The number of cells in each dimension
+   */
+  static size_t scratch_bytes(const std::array<int, 3> n_cell);
+
+  /** Fill one plane of constant first index of a field (see `plane_filler`).
+   *
+   * Each grid is an independent realisation.  Any plane of the current grid can be requested, but moving on to
+   * another grid repeats the first pass, so the planes of each grid should be requested together.
+   *
+   * @param i_grid The grid number
+   * @param i The index of the plane in the first dimension
+   * @param plane The n_cell[1] * n_cell[2] values of the plane, in C order
+   */
+  void fill(const int i_grid, const int i, float* plane);
+
+private:
+  typedef fftw_traits<float> fftw;
+  typedef std::complex<float> complex;
+
+  std::array<int, 3> n_cell;          //< The number of cells in each dimension
+  std::array<double, 3> box_size;     //< The size of the periodic volume
+  power_function power;               //< The power spectrum
+  uint64_t seed;                      //< The random seed
+  std::string scratch_fname;          //< The scratch file (empty if the scratch array is in memory)
+  int n_z;                            //< The number of stored modes in the 3rd dimension
+  int current_grid = -1;              //< The grid held in the scratch array
+  std::vector<complex> memory;        //< The scratch array, if it is held in memory
+  std::unique_ptr<MappedFile> mapped; //< The scratch array, if it is held in a file
+  complex* scratch = nullptr;         //< The scratch array, indexed [x][k_y][k_z]
+  fftw::plan x_plan = nullptr;        //< The in-place backward transform along the 1st dimension
+  fftw::plan y_plan = nullptr;        //< The in-place backward transform along the 2nd dimension
+  fftw::plan z_plan = nullptr;        //< The complex to real transform along the 3rd dimension
+
+  /** Return a Fourier mode, enforcing the Hermitian symmetry of the planes with k_z = 0 and k_z = N/2.
+   */
+  complex mode(const int i_grid, const int ix, const int iy, const int iz) const;
+
+  /** The first pass: generate the modes of a grid and transform them along the 1st dimension into the scratch array.
+   */
+  void transform_x(const int i_grid);
+};
+
+#endif
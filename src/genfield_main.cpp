@@ -0,0 +1,174 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cxxopts.hpp>
+#include <fftw3.h>
+#include <fmt/core.h>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "genfield.hpp"
+#include "options.hpp"
+#include "planner.hpp"
+#include "synthetic.hpp"
+#include "utils.hpp"
+
+/** Split a comma separated list.
+ */
+static std::vector<std::string> split_names(const std::string list)
+{
+  std::vector<std::string> names;
+  std::istringstream iss(list);
+  std::string name;
+  while (std::getline(iss, name, ',')) {
+    if (!name.empty()) {
+      names.push_back(name);
+    }
+  }
+  return names;
+}
+
+static int run(const cxxopts::ParseResult& vm)
+{
+  const int dim = vm["dim"].as<int>();
+  const std::array<int, 3> n_cell = { dim, dim, dim };
+  const double box = vm["box-size"].as<double>();
+  const std::array<double, 3> box_size = { box, box, box };
+  const auto fname_out = vm["output"].as<std::string>();
+  const auto format = vm["format"].as<std::string>();
+  const auto mean = vm["mean"].as<double>();
+
+  power_function power;
+  if (vm.count("pk")) {
+    power = read_power_spectrum(vm["pk"].as<std::string>(), vm["pk-column"].as<int>());
+  } else {
+    power = power_law(vm["amplitude"].as<double>(), vm["index"].as<double>());
+  }
+
+  std::vector<std::string> names;
+  if (format == "gbptrees") {
+    names = split_names(vm["grids"].as<std::string>());
+  } else if (format == "velociraptor") {
+    names = velociraptor_grid_names();
+  } else if (format == "npy") {
+    names = { "density" };
+  } else {
+    throw std::runtime_error(fmt::format("Unrecognised output format '{}'", format));
+  }
+
+  // The scratch array is as large as the output grid, so keep it in memory only if that leaves plenty to spare
+  const size_t budget = vm.count("max-memory") ? parse_memory_size(vm["max-memory"].as<std::string>())
+                                               : available_memory();
+  const size_t scratch_bytes = GaussianRandomField::scratch_bytes(n_cell);
+  std::string scratch_fname;
+  if (scratch_bytes > budget / 2) {
+    scratch_fname = vm.count("scratch") ? vm["scratch"].as<std::string>() : fname_out + ".scratch";
+    fmt::print("Using the scratch file {} ({:.1f} MiB)\n", scratch_fname, scratch_bytes / (1024.0 * 1024.0));
+  }
+
+  const auto seed = vm["seed"].as<uint64_t>();
+  fmt::print("Generating {}^3 Gaussian random field(s) in a box of size {} with seed {}\n", dim, box, seed);
+  GaussianRandomField field(n_cell, box_size, power, seed, scratch_fname);
+
+  // The mean is only added to the density grids, leaving the velocities with zero mean
+  auto fill = [&](const int i_grid, const int i, float* plane) {
+    std::string name = names[i_grid];
+    if (i == 0) {
+      fmt::print("Generating {}... ", name);
+      std::cout << std::flush;
+    }
+
+    field.fill(i_grid, i, plane);
+
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name == "density" && mean != 0) {
+      const long n_plane = (long)n_cell[1] * n_cell[2];
+#pragma omp parallel for simd default(none) firstprivate(plane, n_plane, mean)
+      for (long ii = 0; ii < n_plane; ++ii) {
+        plane[ii] += (float)mean;
+      }
+    }
+
+    if (i == n_cell[0] - 1) {
+      print_done();
+    }
+  };
+
+  if (format == "gbptrees") {
+    write_synthetic_gbptrees(fname_out, n_cell, box_size, names, fill);
+  } else if (format == "velociraptor") {
+    write_synthetic_velociraptor(fname_out, n_cell, box_size, fill);
+  } else {
+    write_synthetic_npy(fname_out, n_cell, fill);
+  }
+
+  fmt::print("Written to {}\n", fname_out);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  cxxopts::Options options("regrider-genfield", "Generate Gaussian random field test inputs for regrider");
+
+  options.add_options() // clang-format off
+        ("d,dim", "grid dimension", cxxopts::value<int>())
+        ("o,output", "output file name", cxxopts::value<std::string>())
+        ("f,format", "output format: gbptrees, velociraptor or npy", cxxopts::value<std::string>()->default_value("gbptrees"))
+        ("grids", "comma separated names of the gbpTrees grids", cxxopts::value<std::string>()->default_value("density"))
+        ("box-size", "size of the periodic box", cxxopts::value<double>()->default_value("100"))
+        ("seed", "random seed", cxxopts::value<uint64_t>()->default_value("1"))
+        ("pk", "tabulated power spectrum file (k in the first column)", cxxopts::value<std::string>())
+        ("pk-column", "column of the power spectrum file holding P(k) (3 for regrider .pk files)", cxxopts::value<int>()->default_value("2"))
+        ("amplitude", "amplitude A of the power law P(k) = A k^n used without --pk", cxxopts::value<double>()->default_value("1"))
+        ("index", "index n of the power law P(k) = A k^n used without --pk", cxxopts::value<double>()->default_value("-2"))
+        ("mean", "mean added to the density grids", cxxopts::value<double>()->default_value("0"))
+        ("max-memory", "memory budget, e.g. 16G (default: the memory available on the node)", cxxopts::value<std::string>())
+        ("scratch", "scratch file used when the field doesn't fit in memory (default: <output>.scratch)", cxxopts::value<std::string>())
+        ("h,help", "show help", cxxopts::value<bool>());
+
+    auto vm = options.parse(argc, argv);
+
+    if (vm.count("help")) {
+        fmt::print(options.help());
+        return 0;
+    }
+
+    if (!vm.count("dim") || !vm.count("output")) {
+        fmt::print(stderr, "Must specify the grid dimension and output file...\n");
+        return 1;
+    }
+
+    fftwf_init_threads();
+
+    int status = 0;
+    try {
+        status = run(vm);
+    } catch (const std::runtime_error& e) {
+        fmt::print(stderr, "Error: {}\n", e.what());
+        status = 1;
+    }
+
+    fftwf_cleanup_threads();
+
+    return status;
+}
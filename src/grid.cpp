@@ -16,89 +16,302 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cassert>
-#include <fftw3.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <fmt/core.h>
 #include <fmt/ostream.h>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <omp.h>
+#include <stdexcept>
 #include <vector>
 
+#include "derived.hpp"
 #include "grid.hpp"
+#include "kernels.hpp"
+#include "power_spectrum.hpp"
+#include "profile.hpp"
+#include "report.hpp"
+#include "stats.hpp"
 #include "utils.hpp"
 
-Grid::Grid(const std::array<int32_t, 3> n_cell_, const std::array<double, 3> box_size_)
+/** Return the number of adjacent pencils along x which `fft_engine::fused` transforms together.
+ *
+ * Eight complex values fill at least one cache line of each row they are gathered from, while a batch of pencils
+ * stays well within L2 for any realistic grid.
+ */
+static int x_batch_size(const std::array<int32_t, 3> n_cell)
+{
+  return std::min(8, n_cell[2] / 2 + 1);
+}
+
+/** Return the wavenumber of mode `n`, where modes above `middle` are negative.
+ */
+static inline double wavenumber(const int n, const int n_cell, const int middle, const double delta_k)
+{
+  return n > middle ? (n - n_cell) * delta_k : n * delta_k;
+}
+
+template <typename T>
+Grid<T>::Grid(const std::array<int32_t, 3> n_cell_,
+              const std::array<double, 3> box_size_,
+              const GridOptions& options_)
   : n_cell{ n_cell_ }
   , box_size{ box_size_ }
   , n_logical{ n_cell[0] * n_cell[1] * n_cell[2] }
   , n_padded{ n_cell[0] * n_cell[1] * 2 * (n_cell[2] / 2 + 1) }
   , n_complex{ n_cell[0] * n_cell[1] * (n_cell[2] / 2 + 1) }
-  , grid(fftwf_alloc_real(n_padded), [](float* grid) { fftwf_free(grid); })
+  , mean{ std::numeric_limits<double>::quiet_NaN() }
+  , grid(allocate(n_padded, options_))
+  , modes(options_.engine == fft_engine::out_of_place ? allocate(2 * n_complex, options_) : nullptr)
+  , options{ options_ }
 {
-  auto n_threads = omp_get_max_threads();
-  fftwf_plan_with_nthreads(n_threads);
-  sprintf(wisdom_fname, "fftw3f-inplace_dft_3d-%dx%dx%d-threads_%d.wisdom", n_cell[0], n_cell[1], n_cell[2], n_threads);
-  auto save_wisdom = false;
-  if (fftwf_import_wisdom_from_filename(wisdom_fname)) {
+  ScopedPhase scope(phase::setup);
+
+  // This must happen before planning, which writes to the buffer
+  if (options.first_touch) {
+    first_touch();
+  }
+
+  if (options.engine == fft_engine::fused) {
+    // The plans only cover one plane or batch of pencils, so they are quick to measure on scratch buffers.  They are
+    // executed concurrently by the OpenMP threads, so they must not be threaded themselves.
+    ScopedPlanner<T> scoped_planner(1);
+    make_fused_plans();
+    return;
+  }
+
+  const int n_threads = omp_get_max_threads();
+  snprintf(wisdom_fname, sizeof(wisdom_fname), "%s", wisdom_filename(n_cell, n_threads, options.engine).c_str());
+
+  ScopedPlanner<T> scoped_planner(n_threads);
+  if (fftw::import_wisdom_from_filename(wisdom_fname)) {
     fmt::print("Loaded wisdom from {}\n", wisdom_fname);
+    run_record().wisdom_hits += 1;
+    make_plans(get(), modes ? modes.get() : get());
+    fftw::forget_wisdom();
   } else {
-    fmt::print("Generating wisdom...");
-    save_wisdom = true;
+    // FFTW_PATIENT planning can take minutes and overwrites the array it is given, so do it on a scratch buffer in
+    // the background while the caller reads the first grid into this one
+    fmt::print("Generating wisdom in the background\n");
+    run_record().wisdom_misses += 1;
+    planner = std::thread([this, n_threads]() {
+      set_trace_thread_name("fftw planner");
+      ScopedPlanner<T> scoped_planner(n_threads);
+      auto free_scratch = [](T* buffer) { fftw::free(buffer); };
+      std::unique_ptr<T, void (*)(T*)> scratch(fftw::alloc_real(n_padded), free_scratch);
+      std::unique_ptr<T, void (*)(T*)> scratch_modes(modes ? fftw::alloc_real(2 * n_complex) : nullptr, free_scratch);
+      if (scratch && (scratch_modes || !modes)) {
+        make_plans(scratch.get(), modes ? scratch_modes.get() : scratch.get());
+        fftw::export_wisdom_to_filename(wisdom_fname);
+        fftw::forget_wisdom();
+      }
+    });
   }
+}
 
-  forward_plan =
-    fftwf_plan_dft_r2c_3d(n_cell[0], n_cell[1], n_cell[2], (float*)get(), (fftwf_complex*)get(), FFTW_PATIENT);
-  reverse_plan =
-    fftwf_plan_dft_c2r_3d(n_cell[0], n_cell[1], n_cell[2], (fftwf_complex*)get(), (float*)get(), FFTW_PATIENT);
+template <typename T>
+void Grid<T>::make_plans(T* buffer, T* complex_buffer)
+{
+  TraceSpan span("plan");
+  forward_plan = fftw::plan_dft_r2c_3d(
+    n_cell[0], n_cell[1], n_cell[2], buffer, (typename fftw::complex*)complex_buffer, FFTW_PATIENT);
+  reverse_plan = fftw::plan_dft_c2r_3d(
+    n_cell[0], n_cell[1], n_cell[2], (typename fftw::complex*)complex_buffer, buffer, FFTW_PATIENT);
+  planned = true;
+}
 
-  if (save_wisdom) {
-    fftwf_export_wisdom_to_filename(wisdom_fname);
-    print_done();
+template <typename T>
+void Grid<T>::make_fused_plans()
+{
+  TraceSpan span("plan");
+  int nx = n_cell[0];
+  const int ny = n_cell[1];
+  const int nz = n_cell[2];
+  const int batch = x_batch_size(n_cell);
+  std::vector<T> plane((size_t)ny * nz);
+  std::vector<std::complex<T>> modes((size_t)ny * (nz / 2 + 1));
+  std::vector<std::complex<T>> pencils((size_t)nx * batch);
+  auto modes_ = reinterpret_cast<typename fftw::complex*>(modes.data());
+  auto pencils_ = reinterpret_cast<typename fftw::complex*>(pencils.data());
+
+  const unsigned flags = FFTW_MEASURE | FFTW_UNALIGNED;
+  plane_forward_plan = fftw::plan_dft_r2c_2d(ny, nz, plane.data(), modes_, flags);
+  plane_reverse_plan = fftw::plan_dft_c2r_2d(ny, nz, modes_, plane.data(), flags);
+
+  // Element x of pencil b of a batch is stored at x * batch + b, so that each row contributes a contiguous run
+  x_forward_plan = fftw::plan_many_dft(
+    1, &nx, batch, pencils_, nullptr, batch, 1, pencils_, nullptr, batch, 1, FFTW_FORWARD, flags);
+  x_reverse_plan = fftw::plan_many_dft(
+    1, &nx, batch, pencils_, nullptr, batch, 1, pencils_, nullptr, batch, 1, FFTW_BACKWARD, flags);
+
+  if (plane_forward_plan == nullptr || plane_reverse_plan == nullptr || x_forward_plan == nullptr ||
+      x_reverse_plan == nullptr) {
+    throw std::runtime_error("Failed to create the FFTW plans");
+  }
+  planned = true;
+}
+
+template <typename T>
+void Grid<T>::wait_for_plans()
+{
+  if (options.engine == fft_engine::fused) {
+    throw std::runtime_error("A grid using the fused FFT engine has no 3D plans, so only filter can transform it");
+  }
+
+  if (planner.joinable()) {
+    ScopedPhase scope(phase::setup);
+    if (!planned) {
+      fmt::print("Waiting for FFTW planning... ");
+      std::cout << std::flush;
+      planner.join();
+      print_done();
+    } else {
+      planner.join();
+    }
+  }
+
+  if (forward_plan == nullptr || reverse_plan == nullptr) {
+    throw std::runtime_error("Failed to create the FFTW plans");
   }
+}
+
+template <typename T>
+std::string Grid<T>::wisdom_filename(const std::array<int32_t, 3> n_cell,
+                                     const int n_threads,
+                                     const fft_engine engine)
+{
+  char fname[256];
+  snprintf(fname,
+           sizeof(fname),
+           "%s-%s_dft_3d-%dx%dx%d-threads_%d.wisdom",
+           fftw::wisdom_prefix(),
+           engine == fft_engine::out_of_place ? "outofplace" : "inplace",
+           n_cell[0],
+           n_cell[1],
+           n_cell[2],
+           n_threads);
+  return fname;
+}
 
-  fftwf_forget_wisdom();
+template <typename T>
+size_t Grid<T>::fused_scratch_bytes(const std::array<int32_t, 3> n_cell, const int n_threads)
+{
+  const size_t plane_bytes = sizeof(T) * n_cell[1] * n_cell[2];
+  const size_t pencil_bytes = sizeof(std::complex<T>) * n_cell[0] * x_batch_size(n_cell);
+  return (plane_bytes + pencil_bytes) * std::max(n_threads, 1);
 }
 
-Grid::~Grid()
+template <typename T>
+std::unique_ptr<T, std::function<void(T*)>> Grid<T>::allocate(const int n_padded, const GridOptions& options)
 {
-  fftwf_destroy_plan(reverse_plan);
-  fftwf_destroy_plan(forward_plan);
+  const size_t bytes = sizeof(T) * n_padded;
+  huge_page_mode used;
+  void* ptr = allocate_huge(bytes, options.huge_pages, used);
+
+  if (ptr != nullptr) {
+    fmt::print("Grid buffer backed by {} huge pages\n", huge_pages_name(used));
+    return std::unique_ptr<T, std::function<void(T*)>>(static_cast<T*>(ptr),
+                                                       [bytes, used](T* grid) { free_huge(grid, bytes, used); });
+  }
+
+  if (options.huge_pages != huge_page_mode::off) {
+    fmt::print("Huge pages unavailable, falling back to normal pages\n");
+  }
+  return std::unique_ptr<T, std::function<void(T*)>>(fftw::alloc_real(n_padded),
+                                                     [](T* grid) { fftw_traits<T>::free(grid); });
+}
+
+template <typename T>
+Grid<T>::~Grid()
+{
+  if (planner.joinable()) {
+    planner.join();
+  }
+  std::lock_guard<std::mutex> lock(fftw_planner_mutex());
+  if (reverse_plan != nullptr) {
+    fftw::destroy_plan(reverse_plan);
+  }
+  if (forward_plan != nullptr) {
+    fftw::destroy_plan(forward_plan);
+  }
+  for (auto plan : { plane_forward_plan, plane_reverse_plan, x_forward_plan, x_reverse_plan }) {
+    if (plan != nullptr) {
+      fftw::destroy_plan(plan);
+    }
+  }
 }
 
-Grid::Grid(const Grid& other)
-  : Grid(other.n_cell, other.box_size)
+template <typename T>
+Grid<T>::Grid(const Grid& other)
+  : Grid<T>(other.n_cell, other.box_size, other.options)
 {
-  std::memcpy(grid.get(), other.grid.get(), sizeof(float) * n_padded);
+  std::memcpy(grid.get(), other.grid.get(), sizeof(T) * n_padded);
 }
 
-Grid& Grid::operator=(const Grid& other)
+template <typename T>
+Grid<T>& Grid<T>::operator=(const Grid& other)
 {
   if (this == &other) {
     return *this;
   }
-  std::memcpy(grid.get(), other.grid.get(), sizeof(float) * n_padded);
+  std::memcpy(grid.get(), other.grid.get(), sizeof(T) * n_padded);
   return *this;
 }
 
-void Grid::update_properties(const std::array<int32_t, 3> n_cell_)
+template <typename T>
+void Grid<T>::first_touch()
+{
+  // FFTW's threaded transforms, and the loops in `filter`, split the first dimension into one contiguous block of
+  // planes per thread, so a static schedule over the planes places each page on the NUMA node of the thread which
+  // will work on it
+  TraceSpan span("first touch");
+  auto grid_ = get();
+  const int n_planes = n_cell[0];
+  const size_t plane_size = (size_t)n_padded / n_planes;
+#pragma omp parallel for schedule(static) default(none) firstprivate(grid_, n_planes, plane_size)
+  for (int ii = 0; ii < n_planes; ++ii) {
+    std::memset(grid_ + ii * plane_size, 0, sizeof(T) * plane_size);
+  }
+
+  if (modes) {
+    auto modes_ = modes.get();
+    const size_t modes_plane_size = (size_t)2 * n_complex / n_planes;
+#pragma omp parallel for schedule(static) default(none) firstprivate(modes_, n_planes, modes_plane_size)
+    for (int ii = 0; ii < n_planes; ++ii) {
+      std::memset(modes_ + ii * modes_plane_size, 0, sizeof(T) * modes_plane_size);
+    }
+  }
+}
+
+template <typename T>
+void Grid<T>::update_properties(const std::array<int32_t, 3> n_cell_)
 {
   n_cell = n_cell_;
   n_logical = n_cell[0] * n_cell[1] * n_cell[2];
   n_padded = n_cell[0] * n_cell[1] * 2 * (n_cell[2] / 2 + 1);
   n_complex = n_cell[0] * n_cell[1] * (n_cell[2] / 2 + 1);
+  mean = std::numeric_limits<double>::quiet_NaN();
 }
 
-float* Grid::get()
+template <typename T>
+T* Grid<T>::get()
 {
   return grid.get();
 }
 
-std::complex<float>* Grid::get_complex()
+template <typename T>
+std::complex<T>* Grid<T>::get_complex()
 {
-  return (std::complex<float>*)grid.get();
+  return (std::complex<T>*)(modes ? modes.get() : grid.get());
 }
 
-int Grid::index(const int i, const int j, const int k, const index_type type, const std::array<int, 3> shape)
+template <typename T>
+int Grid<T>::index(const int i, const int j, const int k, const index_type type, const std::array<int, 3> shape)
 {
   int index = 0;
 
@@ -120,48 +333,44 @@ int Grid::index(const int i, const int j, const int k, const index_type type, co
   return index;
 }
 
-int Grid::index(const int i, const int j, const int k, const index_type type)
+template <typename T>
+int Grid<T>::index(const int i, const int j, const int k, const index_type type)
 {
-  return Grid::index(i, j, k, type, n_cell);
+  return index(i, j, k, type, n_cell);
 }
 
-void Grid::real_to_padded_order()
+template <typename T>
+void Grid<T>::real_to_padded_order()
 {
-  auto grid_ = get();
-  // std::vector<bool> used(n_padded, false);
-  for (int ii = n_cell[0] - 1; ii >= 0; --ii)
-    for (int jj = n_cell[1] - 1; jj >= 0; --jj)
-      for (int kk = n_cell[2] - 1; kk >= 0; --kk) {
-        auto to = index(ii, jj, kk, index_type::padded);
-        auto from = index(ii, jj, kk, index_type::real);
-        // assert(!used[from]);
-        // used[to] = true;
-        grid_[to] = grid_[from];
-      }
+  TraceSpan span("real_to_padded_order");
+  ScopedCounters counters("real_to_padded_order");
+  pad_rows(get(), (size_t)n_cell[0] * n_cell[1], n_cell[2], 2 * (n_cell[2] / 2 + 1));
   flag_padded = true;
 }
 
-void Grid::padded_to_real_order()
+template <typename T>
+void Grid<T>::padded_to_real_order()
 {
-  auto grid_ = get();
-  // std::vector<bool> used(n_padded, false);
-  for (int ii = 0; ii < n_cell[0]; ++ii)
-    for (int jj = 0; jj < n_cell[1]; ++jj)
-      for (int kk = 0; kk < n_cell[2]; ++kk) {
-        auto to = index(ii, jj, kk, index_type::real);
-        auto from = index(ii, jj, kk, index_type::padded);
-        // assert(!used[from]);
-        // used[to] = true;
-        grid_[to] = grid_[from];
-      }
+  TraceSpan span("padded_to_real_order");
+  ScopedCounters counters("padded_to_real_order");
+  unpad_rows(get(), (size_t)n_cell[0] * n_cell[1], n_cell[2], 2 * (n_cell[2] / 2 + 1));
   flag_padded = false;
 }
 
-void Grid::forward_fft()
+template <typename T>
+void Grid<T>::forward_fft()
 {
-  real_to_padded_order();
+  wait_for_plans();
+  if (!modes) {
+    real_to_padded_order();
+  }
 
-  fftwf_execute(forward_plan);
+  TraceSpan span("forward_fft");
+  ScopedCounters counters("forward_fft");
+  auto start = std::chrono::steady_clock::now();
+  fftw::execute_dft_r2c(forward_plan, get(), (typename fftw::complex*)get_complex());
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  record_fft(n_logical, elapsed.count());
 
   // Remember to multiply by VOLUME/TOT_NUM_PIXELS when converting from
   // real space to k-space.  Note: we will leave off factor of VOLUME, in
@@ -169,18 +378,59 @@ void Grid::forward_fft()
   auto complex_grid = get_complex();
 #pragma omp parallel for default(none) firstprivate(n_logical) shared(complex_grid)
   for (int ii = 0; ii < n_complex; ++ii)
-    complex_grid[ii] /= (float)n_logical;
+    complex_grid[ii] /= (T)n_logical;
+
+  mean = complex_grid[0].real();
 }
 
-void Grid::reverse_fft()
+template <typename T>
+void Grid<T>::reverse_fft()
 {
-  fftwf_execute(reverse_plan);
+  wait_for_plans();
+  {
+    TraceSpan span("reverse_fft");
+    ScopedCounters counters("reverse_fft");
+    auto start = std::chrono::steady_clock::now();
+    fftw::execute_dft_c2r(reverse_plan, (typename fftw::complex*)get_complex(), get());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    record_fft(n_logical, elapsed.count());
+  }
 
-  padded_to_real_order();
+  // The out-of-place plans read and write the grid in logical order
+  if (!modes) {
+    padded_to_real_order();
+  }
 }
 
-void Grid::filter(filter_type type, const double R)
+template <typename T>
+void Grid<T>::filter(filter_type type, const double R, SpectrumAccumulator* spectrum, DerivedFields* derived)
 {
+  if (options.engine == fft_engine::fused) {
+    ScopedPhase scope(phase::filter);
+    auto start = std::chrono::steady_clock::now();
+    fmt::print("Filtering grid: doing forward plane ffts... ");
+    std::cout << std::flush;
+    forward_planes();
+
+    fmt::print("filtering pencils... ");
+    std::cout << std::flush;
+    filter_pencils(type, R, spectrum, derived);
+
+    fmt::print("doing inverse plane ffts... ");
+    std::cout << std::flush;
+    reverse_planes();
+
+    // The normalisation and filter can't be separated from the transforms, so they are included in the FFT time
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    record_fft(n_logical, elapsed.count() / 2);
+    record_fft(n_logical, elapsed.count() / 2);
+    print_done();
+    return;
+  }
+
+  // Any time spent waiting for the plans is counted as setup
+  wait_for_plans();
+  ScopedPhase scope(phase::filter);
 
   fmt::print("Filtering grid: ");
   std::cout << std::flush;
@@ -190,83 +440,250 @@ void Grid::filter(filter_type type, const double R)
 
   forward_fft();
 
+  fmt::print("applying convolution... ");
+  std::cout << std::flush;
+
+  convolve(type, R, spectrum, derived);
+
+  fmt::print("doing inverse fft... ");
+  std::cout << std::flush;
+
+  reverse_fft();
+
+  print_done();
+}
+
+template <typename T>
+void Grid<T>::convolve(filter_type type, const double R, SpectrumAccumulator* spectrum, DerivedFields* derived)
+{
   const int middle = n_cell[2] / 2;
   std::array<double, 3> delta_k = { 0 };
+  ScopedCounters counters("convolve");
 
   for (int ii = 0; ii < 3; ++ii) {
     delta_k[ii] = (2.0 * M_PI / box_size[ii]);
   }
 
   // Loop through k-box
-  fmt::print("applying convolution... ");
-  std::cout << std::flush;
-
   auto complex_grid = get_complex();
+  if (derived != nullptr && !derived->active()) {
+    derived = nullptr;
+  }
+
+#pragma omp parallel default(none) firstprivate(delta_k, middle, R, spectrum, derived) shared(complex_grid, type)
+  {
+    TraceSpan span("convolve");
+    SpectrumAccumulator::Shells shells;
+    if (spectrum != nullptr) {
+      shells = spectrum->shells();
+    }
+
+#pragma omp for
+    for (int n_x = 0; n_x < n_cell[0]; ++n_x) {
+      const double k_x = wavenumber(n_x, n_cell[0], middle, delta_k[0]);
+
+      for (int n_y = 0; n_y < n_cell[1]; ++n_y) {
+        const double k_y = wavenumber(n_y, n_cell[1], middle, delta_k[1]);
+        const double k_xy2 = k_x * k_x + k_y * k_y;
+        const int row = index(n_x, n_y, 0, index_type::complex_herm);
+
+        // The modes with 0 < n_z < n_cell[2] / 2 also stand in for their (unstored) conjugates
+        if (spectrum != nullptr) {
+          for (int n_z = 0; n_z <= middle; ++n_z) {
+            const double k_z = n_z * delta_k[2];
+            const double k_mag = sqrt(k_xy2 + k_z * k_z);
+            const int weight = (n_z == 0 || 2 * n_z == n_cell[2]) ? 1 : 2;
+            spectrum->add(shells, row + n_z, k_mag, weight, complex_grid[row + n_z]);
+          }
+        }
+
+        filter_row(complex_grid + row, middle + 1, k_xy2, delta_k[2], R, type);
 
-#pragma omp parallel for default(none) firstprivate(delta_k, middle, R) shared(complex_grid, stderr, type)
-  for (int n_x = 0; n_x < n_cell[0]; ++n_x) {
-    double k_x = 0;
-
-    if (n_x > middle)
-      k_x = (n_x - n_cell[0]) * delta_k[0];
-    else
-      k_x = n_x * delta_k[0];
-
-    for (int n_y = 0; n_y < n_cell[1]; ++n_y) {
-      double k_y = 0;
-
-      if (n_y > middle)
-        k_y = (n_y - n_cell[1]) * delta_k[1];
-      else
-        k_y = n_y * delta_k[1];
-
-      for (int n_z = 0; n_z <= middle; ++n_z) {
-        double k_z = n_z * delta_k[2];
-
-        double k_mag = sqrt(k_x * k_x + k_y * k_y + k_z * k_z);
-
-        double kR = k_mag * R;
-
-        switch (type) {
-          case filter_type::real_top_hat: // Real space top-hat
-            if (kR > 1e-4) {
-              complex_grid[index(n_x, n_y, n_z, index_type::complex_herm)] *=
-                3.0 * (sin(kR) / pow(kR, 3) - cos(kR) / pow(kR, 2));
-            }
-            break;
-
-          case filter_type::k_top_hat: // k-space top hat
-            kR *= 0.413566994;         // Equates integrated volume to the real space top-hat (9pi/2)^(-1/3)
-            if (kR > 1) {
-              complex_grid[index(n_x, n_y, n_z, index_type::complex_herm)] = 0.0;
-            }
-            break;
-
-          case filter_type::gaussian: // Gaussian
-            kR *= 0.643;              // Equates integrated volume to the real space top-hat
-            complex_grid[index(n_x, n_y, n_z, index_type::complex_herm)] *= pow(M_E, -kR * kR / 2.0);
-            break;
-
-          default:
-            if ((n_x == 0) && (n_y == 0) && (n_z == 0)) {
-              fmt::print(stderr, "Error: filter type {} is undefined!", (int)type);
-            }
-            break;
+        if (derived != nullptr) {
+          for (int n_z = 0; n_z <= middle; ++n_z) {
+            derived->add({ { n_x, n_y, n_z } }, { { k_x, k_y, n_z * delta_k[2] } }, complex_grid[row + n_z]);
+          }
         }
       }
+    } // End looping through k box
+
+    if (spectrum != nullptr) {
+#pragma omp critical
+      spectrum->merge(shells);
     }
-  } // End looping through k box
+  }
 
-  fmt::print("doing inverse fft... ");
-  std::cout << std::flush;
+  if (spectrum != nullptr) {
+    spectrum->finish();
+  }
+}
 
-  reverse_fft();
+template <typename T>
+void Grid<T>::forward_planes()
+{
+  TraceSpan span("forward_planes");
+  ScopedCounters counters("forward_planes");
+  const int n_planes = n_cell[0];
+  const size_t plane_real = (size_t)n_cell[1] * n_cell[2];
+  const size_t plane_padded = (size_t)n_cell[1] * 2 * (n_cell[2] / 2 + 1);
+  std::vector<T> scratch(plane_real * omp_get_max_threads());
+  auto grid_ = get();
 
-  print_done();
+  // A padded plane is larger than a logical one, so the planes are moved in blocks of one per thread, starting from
+  // the last block.  Each block copies out all of its logical planes before writing any padded ones, which only
+  // overlap the logical planes of this block and the ones already transformed.
+#pragma omp parallel default(none) firstprivate(n_planes, plane_real, plane_padded, grid_) shared(scratch)
+  {
+    const int n_threads = omp_get_num_threads();
+    T* plane = scratch.data() + plane_real * omp_get_thread_num();
+
+    for (int block_end = n_planes; block_end > 0; block_end -= n_threads) {
+      const int ii = block_end - 1 - omp_get_thread_num();
+      if (ii >= 0) {
+        std::memcpy(plane, grid_ + ii * plane_real, sizeof(T) * plane_real);
+      }
+#pragma omp barrier
+      if (ii >= 0) {
+        fftw::execute_dft_r2c(plane_forward_plan, plane, (typename fftw::complex*)(grid_ + ii * plane_padded));
+      }
+    }
+  }
+  flag_padded = true;
+}
+
+template <typename T>
+void Grid<T>::reverse_planes()
+{
+  TraceSpan span("reverse_planes");
+  ScopedCounters counters("reverse_planes");
+  const int n_planes = n_cell[0];
+  const size_t plane_real = (size_t)n_cell[1] * n_cell[2];
+  const size_t plane_padded = (size_t)n_cell[1] * 2 * (n_cell[2] / 2 + 1);
+  std::vector<T> scratch(plane_real * omp_get_max_threads());
+  auto grid_ = get();
+
+  // The reverse of `forward_planes`: blocks start from the first plane, and each transforms all of its padded planes
+  // before writing any logical ones
+#pragma omp parallel default(none) firstprivate(n_planes, plane_real, plane_padded, grid_) shared(scratch)
+  {
+    const int n_threads = omp_get_num_threads();
+    T* plane = scratch.data() + plane_real * omp_get_thread_num();
+
+    for (int block_start = 0; block_start < n_planes; block_start += n_threads) {
+      const int ii = block_start + omp_get_thread_num();
+      if (ii < n_planes) {
+        fftw::execute_dft_c2r(plane_reverse_plan, (typename fftw::complex*)(grid_ + ii * plane_padded), plane);
+      }
+#pragma omp barrier
+      if (ii < n_planes) {
+        std::memcpy(grid_ + ii * plane_real, plane, sizeof(T) * plane_real);
+      }
+    }
+  }
+  flag_padded = false;
+}
+
+template <typename T>
+void Grid<T>::filter_pencils(filter_type type, const double R, SpectrumAccumulator* spectrum, DerivedFields* derived)
+{
+  TraceSpan span("filter_pencils");
+  ScopedCounters counters("filter_pencils");
+  const int middle = n_cell[2] / 2;
+  const int n_x = n_cell[0];
+  const int n_y = n_cell[1];
+  const int n_z = middle + 1;
+  const int batch = x_batch_size(n_cell);
+  const int n_batches = (n_z + batch - 1) / batch;
+  std::array<double, 3> delta_k = { 0 };
+
+  for (int ii = 0; ii < 3; ++ii) {
+    delta_k[ii] = (2.0 * M_PI / box_size[ii]);
+  }
+
+  auto complex_grid = get_complex();
+  if (derived != nullptr && !derived->active()) {
+    derived = nullptr;
+  }
+
+#pragma omp parallel default(none)                                                                                     \
+  firstprivate(delta_k, middle, n_x, n_y, n_z, batch, n_batches, R, spectrum, derived) shared(complex_grid, type)
+  {
+    TraceSpan thread_span("filter_pencils");
+    SpectrumAccumulator::Shells shells;
+    if (spectrum != nullptr) {
+      shells = spectrum->shells();
+    }
+    std::vector<std::complex<T>> pencils((size_t)n_x * batch);
+    auto pencils_ = reinterpret_cast<typename fftw::complex*>(pencils.data());
+
+#pragma omp for schedule(static)
+    for (int job = 0; job < n_y * n_batches; ++job) {
+      const int i_y = job / n_batches;
+      const int z_start = (job % n_batches) * batch;
+      const int width = std::min(batch, n_z - z_start);
+      const double k_y = wavenumber(i_y, n_cell[1], middle, delta_k[1]);
+
+      // Any columns beyond `width` in the last batch are transformed too, but never written back
+      for (int i_x = 0; i_x < n_x; ++i_x) {
+        std::memcpy(&pencils[(size_t)i_x * batch],
+                    &complex_grid[index(i_x, i_y, z_start, index_type::complex_herm)],
+                    sizeof(std::complex<T>) * width);
+      }
+
+      fftw::execute_dft(x_forward_plan, pencils_, pencils_);
+
+      for (int i_x = 0; i_x < n_x; ++i_x) {
+        const double k_x = wavenumber(i_x, n_cell[0], middle, delta_k[0]);
+
+        for (int ii = 0; ii < width; ++ii) {
+          const int i_z = z_start + ii;
+          const double k_z = i_z * delta_k[2];
+          const double k_mag = sqrt(k_x * k_x + k_y * k_y + k_z * k_z);
+          auto& value = pencils[(size_t)i_x * batch + ii];
+          value /= (T)n_logical;
+
+          if (i_x == 0 && i_y == 0 && i_z == 0) {
+            mean = value.real();
+          }
+
+          // The modes with 0 < i_z < n_cell[2] / 2 also stand in for their (unstored) conjugates
+          if (spectrum != nullptr) {
+            const int weight = (i_z == 0 || 2 * i_z == n_cell[2]) ? 1 : 2;
+            spectrum->add(shells, index(i_x, i_y, i_z, index_type::complex_herm), k_mag, weight, value);
+          }
+
+          apply_filter(value, type, k_mag * R);
+
+          if (derived != nullptr) {
+            derived->add({ { i_x, i_y, i_z } }, { { k_x, k_y, k_z } }, value);
+          }
+        }
+      }
+
+      fftw::execute_dft(x_reverse_plan, pencils_, pencils_);
+
+      for (int i_x = 0; i_x < n_x; ++i_x) {
+        std::memcpy(&complex_grid[index(i_x, i_y, z_start, index_type::complex_herm)],
+                    &pencils[(size_t)i_x * batch],
+                    sizeof(std::complex<T>) * width);
+      }
+    }
+
+    if (spectrum != nullptr) {
+#pragma omp critical
+      spectrum->merge(shells);
+    }
+  }
+
+  if (spectrum != nullptr) {
+    spectrum->finish();
+  }
 }
 
-void Grid::sample(const std::array<int, 3> new_n_cell)
+template <typename T>
+void Grid<T>::sample(const std::array<int, 3> new_n_cell, GridStats* stats)
 {
+  ScopedPhase scope(phase::sample);
   fmt::print("Subsampling grid... ");
 
   std::array<int, 3> n_every = { 0 };
@@ -276,16 +693,151 @@ void Grid::sample(const std::array<int, 3> new_n_cell)
 
   auto grid_ = grid.get();
 
-  // TODO: I need to check to make sure this is valid
-  for (int ii = 0, ii_lo = 0; ii < n_cell[0]; ii += n_every[0], ++ii_lo) {
-    for (int jj = 0, jj_lo = 0; jj < n_cell[1]; jj += n_every[1], ++jj_lo) {
-      for (int kk = 0, kk_lo = 0; kk < n_cell[2]; kk += n_every[2], ++kk_lo) {
-        grid_[index(ii_lo, jj_lo, kk_lo, index_type::real, new_n_cell)] = grid_[index(ii, jj, kk, index_type::real)];
+  // The mean is only known if the grid has been transformed since it was filled
+  double input_mean = mean;
+  if (stats != nullptr && !std::isfinite(input_mean)) {
+    double sum = 0;
+    const int n_logical_ = n_logical;
+#pragma omp parallel for default(none) firstprivate(grid_, n_logical_) reduction(+ : sum)
+    for (int ii = 0; ii < n_logical_; ++ii) {
+      sum += grid_[ii];
+    }
+    input_mean = sum / n_logical;
+  }
+
+  std::vector<T> sampled((size_t)new_n_cell[0] * new_n_cell[1] * new_n_cell[2]);
+  auto sampled_ = sampled.data();
+  StatsAccumulator total(input_mean, input_mean);
+
+#pragma omp parallel default(none) firstprivate(grid_, sampled_, n_every, new_n_cell, input_mean, stats) shared(total)
+  {
+    TraceSpan span("sample rows");
+    StatsAccumulator local(input_mean, input_mean);
+
+#pragma omp for schedule(static)
+    for (int ii_lo = 0; ii_lo < new_n_cell[0]; ++ii_lo) {
+      for (int jj_lo = 0; jj_lo < new_n_cell[1]; ++jj_lo) {
+        const T* row = grid_ + index(ii_lo * n_every[0], jj_lo * n_every[1], 0, index_type::real);
+        T* out_row = sampled_ + index(ii_lo, jj_lo, 0, index_type::real, new_n_cell);
+        sample_row(row, out_row, new_n_cell[2], n_every[2]);
+        if (stats != nullptr) {
+          for (int kk_lo = 0; kk_lo < new_n_cell[2]; ++kk_lo) {
+            local.add(out_row[kk_lo]);
+          }
+        }
       }
     }
+
+    if (stats != nullptr) {
+#pragma omp critical
+      total.merge(local);
+    }
   }
 
+  std::memcpy(grid_, sampled.data(), sizeof(T) * sampled.size());
   update_properties(new_n_cell);
 
+  if (stats != nullptr) {
+    *stats = total.result();
+  }
+
   print_done();
 }
+
+template class Grid<float>;
+template class Grid<double>;
+
+/** A grid released into the pool, along with what it was constructed with.
+ */
+template <typename T>
+struct PooledGrid
+{
+  std::unique_ptr<Grid<T>> grid; //< The grid (null if the pool is empty)
+  const Grid<T>* lent = nullptr; //< The grid most recently returned by `acquire_grid`
+  std::array<int32_t, 3> n_cell; //< The logical size the buffers and plans of `lent` were made for
+  GridOptions options;           //< The options `lent` was constructed with
+};
+
+static bool grid_pool_enabled = false;
+
+/** Return the pool of grids with scalar type `T`, which holds at most one grid.
+ */
+template <typename T>
+static PooledGrid<T>& grid_pool()
+{
+  static PooledGrid<T> pool;
+  return pool;
+}
+
+/** Return the number of bytes held by the pooled grid with scalar type `T`.
+ */
+template <typename T>
+static size_t pooled_bytes()
+{
+  const auto& pool = grid_pool<T>();
+  if (!pool.grid) {
+    return 0;
+  }
+  const size_t n_complex = (size_t)pool.n_cell[0] * pool.n_cell[1] * (pool.n_cell[2] / 2 + 1);
+  return sizeof(T) * 2 * n_complex * (pool.options.engine == fft_engine::out_of_place ? 2 : 1);
+}
+
+void enable_grid_pool(const bool enable)
+{
+  grid_pool_enabled = enable;
+  if (!enable) {
+    grid_pool<float>().grid.reset();
+    grid_pool<double>().grid.reset();
+  }
+}
+
+size_t pooled_grid_bytes()
+{
+  return pooled_bytes<float>() + pooled_bytes<double>();
+}
+
+template <typename T>
+std::unique_ptr<Grid<T>> acquire_grid(const std::array<int32_t, 3> n_cell_,
+                                      const std::array<double, 3> box_size_,
+                                      const GridOptions& options_)
+{
+  auto& pool = grid_pool<T>();
+  if (pool.grid && pool.n_cell == n_cell_ && pool.options.first_touch == options_.first_touch &&
+      pool.options.huge_pages == options_.huge_pages && pool.options.engine == options_.engine) {
+    fmt::print("Reusing the grid and FFTW plans of the previous job\n");
+    std::unique_ptr<Grid<T>> grid(std::move(pool.grid));
+    grid->update_properties(n_cell_);
+    grid->box_size = box_size_;
+    grid->flag_padded = false;
+    pool.lent = grid.get();
+    return grid;
+  }
+
+  // Free the pooled grid first, so that both are never allocated at once
+  pool.grid.reset();
+  std::unique_ptr<Grid<T>> grid(new Grid<T>(n_cell_, box_size_, options_));
+  pool.lent = grid.get();
+  pool.n_cell = n_cell_;
+  pool.options = options_;
+  return grid;
+}
+
+template <typename T>
+void release_grid(std::unique_ptr<Grid<T>>& grid)
+{
+  auto& pool = grid_pool<T>();
+  if (grid_pool_enabled && grid && grid.get() == pool.lent) {
+    pool.grid = std::move(grid);
+  }
+  pool.lent = nullptr;
+  grid.reset();
+}
+
+template std::unique_ptr<Grid<float>> acquire_grid<float>(const std::array<int32_t, 3>,
+                                                          const std::array<double, 3>,
+                                                          const GridOptions&);
+template std::unique_ptr<Grid<double>> acquire_grid<double>(const std::array<int32_t, 3>,
+                                                            const std::array<double, 3>,
+                                                            const GridOptions&);
+template void release_grid<float>(std::unique_ptr<Grid<float>>&);
+template void release_grid<double>(std::unique_ptr<Grid<double>>&);
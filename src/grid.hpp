@@ -19,32 +19,22 @@
 #ifndef GRID_H
 #define GRID_H
 
-#include "fftw3.h"
 #include <array>
+#include <atomic>
 #include <complex>
 #include <cstring>
+#include <functional>
 #include <memory>
+#include <string>
+#include <thread>
 
-/** A 3D grid class to handle input independent functionality.
+#include "fftw_traits.hpp"
+#include "huge_pages.hpp"
+
+/** Precision independent types shared by all `Grid` instantiations.
  */
-class Grid
+class GridBase
 {
-public:
-  std::array<int32_t, 3> n_cell;  //< The number of cells in each dimension
-  std::array<double, 3> box_size; //< The box size in input units (typically h^-1 Mpc)
-  int n_logical;                  //< The total number of cells
-  int n_padded;                   //< Number of elements in the padded array
-  int n_complex;                  //< The number of complex elements in the FFTd array
-  bool flag_padded = false;       //< Has the indexing been reorder to be padded for an inplace FFT?
-
-private:
-  std::unique_ptr<float, void (*)(float*)> grid; /**< A pointer to the grid data, allowing it to be
-                                                     automatically freed when this Grid object goes out
-                                                     of scope. */
-  char wisdom_fname[256];                        //< The filename of the wisdom file
-  fftwf_plan forward_plan;                       //< The forward (r2c) transform plan
-  fftwf_plan reverse_plan;                       //< The reverse (c2r) transform plan
-
 public:
   /** The indexing type required for an `Grid::index` function call.
    */
@@ -63,14 +53,149 @@ public:
     k_top_hat,
     gaussian
   };
+};
+
+class SpectrumAccumulator;
+struct GridStats;
+class DerivedFields;
+
+/** How `Grid::filter` transforms the grid.
+ */
+enum class fft_engine
+{
+  automatic,    //< Let the planner choose `out_of_place` if it fits in the memory budget, otherwise `fftw_3d`
+  fftw_3d,      //< In-place 3D plans (FFTW_PATIENT), with separate passes to reorder, normalise and filter the grid
+  out_of_place, //< Out-of-place 3D plans into a separate complex buffer, so the grid is never reordered
+  fused         //< 2D plans for each plane, then batches of pencils along x which are filtered and inverted in cache
+};
+
+/** Options controlling how a `Grid` allocates its buffer and transforms it.
+ */
+struct GridOptions
+{
+  bool first_touch = false;                        //< Zero the buffer in parallel before planning (NUMA)
+  huge_page_mode huge_pages = huge_page_mode::off; //< The largest huge pages to back the buffer with
+  fft_engine engine = fft_engine::fftw_3d;         //< How `Grid::filter` transforms the grid
+};
+
+/** A 3D grid class to handle input independent functionality.
+ *
+ * The grid is templated on its scalar type (`float` or `double`), which selects the corresponding FFTW API at compile
+ * time.
+ */
+template <typename T>
+class Grid : public GridBase
+{
+public:
+  std::array<int32_t, 3> n_cell;  //< The number of cells in each dimension
+  std::array<double, 3> box_size; //< The box size in input units (typically h^-1 Mpc)
+  int n_logical;                  //< The total number of cells
+  int n_padded;                   //< Number of elements in the padded array
+  int n_complex;                  //< The number of complex elements in the FFTd array
+  bool flag_padded = false;       //< Has the indexing been reorder to be padded for an inplace FFT?
+  double mean;                    //< The mean of the grid, as measured by the last `forward_fft` (or NaN)
+
+private:
+  typedef fftw_traits<T> fftw;
+
+  std::unique_ptr<T, std::function<void(T*)>> grid;  /**< A pointer to the grid data, allowing it to be
+                                                         automatically freed when this Grid object goes out
+                                                         of scope. */
+  std::unique_ptr<T, std::function<void(T*)>> modes; //< The separate complex buffer (`out_of_place` only)
+  char wisdom_fname[256];                            //< The filename of the wisdom file
+  typename fftw::plan forward_plan = nullptr;        //< The forward (r2c) transform plan
+  typename fftw::plan reverse_plan = nullptr;        //< The reverse (c2r) transform plan
+  GridOptions options;                               //< How the buffer was allocated and is transformed
+  std::thread planner;                               //< Makes the plans in the background if there is no wisdom
+  std::atomic<bool> planned{ false };                //< Have the plans been created?
+  typename fftw::plan plane_forward_plan = nullptr;  //< The 2D r2c plan for one plane (`fused` only)
+  typename fftw::plan plane_reverse_plan = nullptr;  //< The 2D c2r plan for one plane (`fused` only)
+  typename fftw::plan x_forward_plan = nullptr;      //< The forward plan for a batch of pencils along x (`fused` only)
+  typename fftw::plan x_reverse_plan = nullptr;      //< The reverse plan for a batch of pencils along x (`fused` only)
+
+  /** Allocate the buffer, from huge pages if requested and available, otherwise with FFTW's allocator.
+   *
+   * @param n_padded The number of elements
+   * @param options How to allocate the buffer
+   * @return The buffer, along with the matching deleter
+   */
+  static std::unique_ptr<T, std::function<void(T*)>> allocate(const int n_padded, const GridOptions& options);
+
+  /** Create the forward and reverse plans.
+   *
+   * The plans are only ever executed with the new-array interface, so the buffers need not be the grid itself, but
+   * they must have the same sizes and alignment.  The plans are in-place if `buffer` and `complex_buffer` are the same.
+   * The caller must hold a `ScopedPlanner`.
+   *
+   * @param buffer The real array to plan with (this is overwritten unless FFTW has wisdom for the transform)
+   * @param complex_buffer The complex array to plan with (likewise)
+   */
+  void make_plans(T* buffer, T* complex_buffer);
+
+  /** Zero the buffer in parallel so that each plane is first touched by the thread that will transform it.
+   */
+  void first_touch(void);
 
+  /** Create the plane and pencil plans used by `fft_engine::fused`.
+   *
+   * These are planned on scratch buffers, so the grid is untouched.  The caller must hold a single threaded
+   * `ScopedPlanner`.
+   */
+  void make_fused_plans(void);
+
+  /** Transform every plane of the grid with the 2D r2c plan, moving it from logical to padded order on the way.
+   */
+  void forward_planes(void);
+
+  /** Transform every plane of the grid with the 2D c2r plan, moving it from padded to logical order on the way.
+   */
+  void reverse_planes(void);
+
+  /** Complete the forward transform along x, normalise and filter each mode, and transform back along x.
+   *
+   * Each batch of pencils is gathered into a buffer which stays in cache for the whole round trip.
+   *
+   * @param type The filter type to use
+   * @param R the size (typically radius) of the filter
+   * @param spectrum If not null, the unfiltered modes are also added to this (see `SpectrumAccumulator::start`)
+   * @param derived If not null, the filtered modes are also added to this (see `DerivedFields::start`)
+   */
+  void filter_pencils(filter_type type, const double R, SpectrumAccumulator* spectrum, DerivedFields* derived);
+
+public:
   /** Basic constructor.
    * This will allocate the grid array, and store the corresponding size in various forms.
    *
+   * If there is no stored wisdom for the transforms, they are planned in a background thread using a separate scratch
+   * buffer, so that the grid can be filled while planning.  Call `wait_for_plans` (or any of the FFT functions, which
+   * do so) before using the plans.
+   *
    * @param n_cell_ The number of logical cells in each dimension
    * @param box_size_ The size of the simulation volume in input units
+   * @param options_ Options controlling the allocation
+   */
+  Grid(const std::array<int32_t, 3> n_cell_,
+       const std::array<double, 3> box_size_,
+       const GridOptions& options_ = GridOptions());
+
+  /** Return the name of the file used to store the FFTW wisdom for a grid.
+   *
+   * @param n_cell The number of logical cells in each dimension
+   * @param n_threads The number of threads the plans are made for
+   * @param engine The engine the plans are made for (`fft_engine::out_of_place` plans are stored separately)
+   * @return The filename
    */
-  Grid(const std::array<int32_t, 3> n_cell_, const std::array<double, 3> box_size_);
+  static std::string wisdom_filename(const std::array<int32_t, 3> n_cell,
+                                     const int n_threads,
+                                     const fft_engine engine = fft_engine::fftw_3d);
+
+  /** Return the scratch which `fft_engine::fused` allocates while filtering, beyond the grid itself.
+   *
+   * @param n_cell The number of logical cells in each dimension
+   * @param n_threads The number of threads filtering
+   * @return One logical plane and one batch of pencils per thread (bytes)
+   */
+  static size_t fused_scratch_bytes(const std::array<int32_t, 3> n_cell, const int n_threads);
 
   /** Basic desctructor.
    * This will free the fftw plans created during initialisation.
@@ -94,15 +219,17 @@ public:
 
   /** Return the pointer to the grid data.
    *
-   * @return Float pointer to the grid data.
+   * @return Pointer to the grid data.
    */
-  float* get();
+  T* get();
 
   /** Return the pointer to the grid data, cast as a complex array.
+   *
+   * With `fft_engine::out_of_place` this is the separate buffer which `forward_fft` writes the modes to.
    *
    * @return Complex pointer to the grid data
    */
-  std::complex<float>* get_complex();
+  std::complex<T>* get_complex();
 
   /** Indexing function for arbitrary grid of any 3D size.
    *
@@ -131,28 +258,98 @@ public:
    */
   void padded_to_real_order(void);
 
-  /** Do the forward FFT
+  /** Block until the FFTW plans are ready.
+   *
+   * This throws with `fft_engine::fused`, which has no 3D plans.
+   */
+  void wait_for_plans(void);
+
+  /** Do the forward FFT (`fft_engine::fftw_3d` and `fft_engine::out_of_place` only)
+   *
+   * A grid using `fft_engine::fused` can only be transformed by `filter`, so this throws for one.
+   *
+   * With `fft_engine::out_of_place` the grid is left in logical order and untouched, so the unfiltered field can
+   * still be read with `get` until `reverse_fft` overwrites it.
    */
   void forward_fft(void);
 
-  /** Do the reverse FFT
+  /** Do the reverse FFT (`fft_engine::fftw_3d` and `fft_engine::out_of_place` only, as for `forward_fft`)
    */
   void reverse_fft(void);
 
   /** Filter the grid using a given filter type and size.
+   *
+   * With `fft_engine::fused` this doesn't use `forward_fft`, `convolve` or `reverse_fft`, and the grid is never held
+   * in k-space as a whole.
+   *
+   * @param type The filter type to use
+   * @param R the size (typically radius) of the filter
+   * @param spectrum If not null, the unfiltered modes are also added to this (see `SpectrumAccumulator::start`)
+   * @param derived If not null, the filtered modes are also added to this (see `DerivedFields::start`)
+   */
+  void filter(filter_type type,
+              const double R,
+              SpectrumAccumulator* spectrum = nullptr,
+              DerivedFields* derived = nullptr);
+
+  /** Apply a filter to the grid in k-space, i.e. the convolution step of `filter`.
+   *
+   * The grid must already have been transformed with `forward_fft`.
    *
    * @param type The filter type to use
    * @param R the size (typically radius) of the filter
+   * @param spectrum If not null, the unfiltered modes are also added to this (see `SpectrumAccumulator::start`)
+   * @param derived If not null, the filtered modes are also added to this (see `DerivedFields::start`)
    */
-  void filter(filter_type type, const double R);
+  void convolve(filter_type type,
+                const double R,
+                SpectrumAccumulator* spectrum = nullptr,
+                DerivedFields* derived = nullptr);
 
   /** Subsample the grid to provide a new one with the requested dimensions.
    *
-   * Note that the parameters of the Grid object will be updated correspondingly.
+   * Note that the parameters of the Grid object will be updated correspondingly.  The samples are gathered in parallel
+   * into a small buffer, which is then copied to the start of the grid, so that no thread can overwrite values that
+   * another has yet to read.
    *
    * @param new_n_cell The new logical size of the grid.
+   * @param stats If not null, the statistics of the sampled values are accumulated in the same pass and stored here
+   * (with the histogram relative to the mean of the full resolution grid)
    */
-  void sample(const std::array<int, 3> new_n_cell);
+  void sample(const std::array<int, 3> new_n_cell, GridStats* stats = nullptr);
 };
 
+/** Keep the last `Grid` of each precision when it is released, so that a later job of the same size can reuse its
+ * buffers and FFTW plans (see `acquire_grid`).  Pooling is off by default, since a one-off run frees its grid on exit.
+ *
+ * @param enable Should released grids be kept?
+ */
+void enable_grid_pool(const bool enable);
+
+/** Return the number of bytes held by grids which have been released into the pool.
+ */
+size_t pooled_grid_bytes();
+
+/** Return a grid with the given size, reusing the pooled grid (and its plans) if it was made with the same size and
+ * options, and constructing a new one otherwise.
+ *
+ * The grid holds the logical size `n_cell_`, whatever size it was released with.  Its contents are undefined.
+ *
+ * @param n_cell_ The number of logical cells in each dimension
+ * @param box_size_ The size of the simulation volume in input units
+ * @param options_ Options controlling the allocation
+ * @return The grid
+ */
+template <typename T>
+std::unique_ptr<Grid<T>> acquire_grid(const std::array<int32_t, 3> n_cell_,
+                                      const std::array<double, 3> box_size_,
+                                      const GridOptions& options_ = GridOptions());
+
+/** Return a grid from `acquire_grid`, keeping it in the pool if pooling is enabled and freeing it otherwise.
+ *
+ * @param grid The grid, which is reset
+ */
+template <typename T>
+void release_grid(std::unique_ptr<Grid<T>>& grid);
+
 #endif
@@ -0,0 +1,137 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <fmt/core.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+
+#include "huge_pages.hpp"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static const size_t size_2m = (size_t)1 << 21;
+static const size_t size_1g = (size_t)1 << 30;
+
+huge_page_mode parse_huge_pages(const std::string name)
+{
+  if (name == "off") {
+    return huge_page_mode::off;
+  } else if (name == "thp") {
+    return huge_page_mode::transparent;
+  } else if (name == "2M") {
+    return huge_page_mode::huge_2m;
+  } else if (name == "1G") {
+    return huge_page_mode::huge_1g;
+  }
+  throw std::runtime_error(fmt::format("Unrecognised huge page mode '{}'", name));
+}
+
+const char* huge_pages_name(const huge_page_mode mode)
+{
+  switch (mode) {
+    case huge_page_mode::transparent:
+      return "thp";
+    case huge_page_mode::huge_2m:
+      return "2M";
+    case huge_page_mode::huge_1g:
+      return "1G";
+    default:
+      return "off";
+  }
+}
+
+/** Round `bytes` up to a multiple of `page`.
+ */
+static size_t round_up(const size_t bytes, const size_t page)
+{
+  return (bytes + page - 1) / page * page;
+}
+
+/** Map anonymous memory from the hugetlbfs pool with pages of `1 << log2_page` bytes.
+ */
+static void* map_hugetlb(const size_t bytes, const int log2_page)
+{
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2_page << MAP_HUGE_SHIFT);
+  void* ptr = mmap(nullptr, round_up(bytes, (size_t)1 << log2_page), PROT_READ | PROT_WRITE, flags, -1, 0);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+/** Is transparent huge page support enabled in the kernel (either always or on madvise)?
+ */
+static bool transparent_available()
+{
+  std::ifstream ifs("/sys/kernel/mm/transparent_hugepage/enabled");
+  std::string setting;
+  std::getline(ifs, setting);
+  return !setting.empty() && setting.find("[never]") == std::string::npos;
+}
+
+void* allocate_huge(const size_t bytes, const huge_page_mode mode, huge_page_mode& used)
+{
+  used = huge_page_mode::off;
+  void* ptr = nullptr;
+
+  if (mode == huge_page_mode::huge_1g) {
+    ptr = map_hugetlb(bytes, 30);
+    if (ptr) {
+      used = huge_page_mode::huge_1g;
+      return ptr;
+    }
+  }
+
+  if (mode == huge_page_mode::huge_1g || mode == huge_page_mode::huge_2m) {
+    ptr = map_hugetlb(bytes, 21);
+    if (ptr) {
+      used = huge_page_mode::huge_2m;
+      return ptr;
+    }
+  }
+
+  if (mode != huge_page_mode::off && transparent_available()) {
+    if (posix_memalign(&ptr, size_2m, round_up(bytes, size_2m)) == 0) {
+      if (madvise(ptr, round_up(bytes, size_2m), MADV_HUGEPAGE) == 0) {
+        used = huge_page_mode::transparent;
+        return ptr;
+      }
+      free(ptr);
+    }
+  }
+
+  return nullptr;
+}
+
+void free_huge(void* ptr, const size_t bytes, const huge_page_mode used)
+{
+  switch (used) {
+    case huge_page_mode::huge_1g:
+      munmap(ptr, round_up(bytes, size_1g));
+      break;
+    case huge_page_mode::huge_2m:
+      munmap(ptr, round_up(bytes, size_2m));
+      break;
+    case huge_page_mode::transparent:
+      free(ptr);
+      break;
+    default:
+      break;
+  }
+}
@@ -0,0 +1,66 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HUGE_PAGES_H
+#define HUGE_PAGES_H
+
+#include <cstddef>
+#include <string>
+
+/** The kind of huge pages backing a buffer.
+ */
+enum class huge_page_mode
+{
+  off,         //< Normal pages (allocated by FFTW)
+  transparent, //< Transparent huge pages, requested with madvise(MADV_HUGEPAGE)
+  huge_2m,     //< 2 MiB pages from the hugetlbfs pool (mmap with MAP_HUGETLB)
+  huge_1g      //< 1 GiB pages from the hugetlbfs pool (mmap with MAP_HUGETLB)
+};
+
+/** Parse a huge page mode (off, thp, 2M or 1G).
+ *
+ * @param name The name of the mode
+ * @return The corresponding mode
+ */
+huge_page_mode parse_huge_pages(const std::string name);
+
+/** Return the name of a huge page mode.
+ */
+const char* huge_pages_name(const huge_page_mode mode);
+
+/** Allocate a buffer backed by huge pages, falling back to smaller pages if they aren't available.
+ *
+ * The fallback order is 1 GiB, 2 MiB, then transparent huge pages.  The buffer is aligned to at least 2 MiB, which
+ * satisfies FFTW's SIMD alignment requirements.
+ *
+ * @param bytes The size of the buffer
+ * @param mode The largest kind of page to try
+ * @param used Set to the kind of page actually used (`huge_page_mode::off` if nothing could be allocated)
+ * @return The buffer, or nullptr if `mode` is `huge_page_mode::off` or no kind of huge page is available
+ */
+void* allocate_huge(const size_t bytes, const huge_page_mode mode, huge_page_mode& used);
+
+/** Free a buffer returned by `allocate_huge`.
+ *
+ * @param ptr The buffer
+ * @param bytes The size passed to `allocate_huge`
+ * @param used The kind of page returned by `allocate_huge`
+ */
+void free_huge(void* ptr, const size_t bytes, const huge_page_mode used);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include "journal.hpp"
+
+static const char* journal_header = "# regrider journal";
+
+uint64_t checksum(const void* data, const size_t n, const uint64_t hash)
+{
+  const auto bytes = static_cast<const unsigned char*>(data);
+  uint64_t result = hash;
+  for (size_t ii = 0; ii < n; ++ii) {
+    result = (result ^ bytes[ii]) * 0x100000001b3ULL;
+  }
+  return result;
+}
+
+std::string job_signature(const std::string fname_in,
+                          const int new_dim,
+                          const regrid_method method,
+                          const RegridOptions& options,
+                          const size_t scalar_size)
+{
+  struct stat st;
+  if (stat(fname_in.c_str(), &st) != 0) {
+    st.st_size = 0;
+    st.st_mtime = 0;
+  }
+  return fmt::format("{} size={} mtime={} dim={} method={} filter={} encoding={} keep_bits={} deflate={} scalar={}",
+                     fname_in,
+                     (long long)st.st_size,
+                     (long long)st.st_mtime,
+                     new_dim,
+                     method_name(method),
+                     filter_name(options.filter),
+                     encoding_name(options.encoding),
+                     options.keep_bits,
+                     options.deflate,
+                     scalar_size);
+}
+
+/** Format an entry as one line of the journal (the name goes last, as it may contain spaces).
+ */
+static std::string format_entry(const JournalEntry& entry)
+{
+  const auto& stats = entry.stats;
+  return fmt::format("{} {} {:016x} {} {:.17g} {:.17g} {:.17g} {:.17g} {:.17g} {:.17g} {} {} {} {}{}{}\n",
+                     entry.offset,
+                     entry.bytes,
+                     entry.checksum,
+                     stats.n,
+                     stats.min,
+                     stats.max,
+                     stats.mean,
+                     stats.variance,
+                     stats.input_mean,
+                     stats.reference,
+                     stats.n_below,
+                     stats.n_above,
+                     stats.histogram.size(),
+                     fmt::join(stats.histogram, " "),
+                     stats.histogram.empty() ? "" : " ",
+                     entry.name);
+}
+
+/** Parse a line written by `format_entry`.
+ *
+ * @return False if the line is malformed
+ */
+static bool parse_entry(const std::string& line, JournalEntry& entry)
+{
+  std::istringstream iss(line);
+  std::vector<std::string> fields(13);
+  for (auto& field : fields) {
+    if (!(iss >> field)) {
+      return false;
+    }
+  }
+
+  // strtod, unlike operator>>, reads the "nan" written for unknown values
+  auto& stats = entry.stats;
+  entry.offset = std::strtoull(fields[0].c_str(), nullptr, 10);
+  entry.bytes = std::strtoull(fields[1].c_str(), nullptr, 10);
+  entry.checksum = std::strtoull(fields[2].c_str(), nullptr, 16);
+  stats.n = std::strtoll(fields[3].c_str(), nullptr, 10);
+  stats.min = std::strtod(fields[4].c_str(), nullptr);
+  stats.max = std::strtod(fields[5].c_str(), nullptr);
+  stats.mean = std::strtod(fields[6].c_str(), nullptr);
+  stats.variance = std::strtod(fields[7].c_str(), nullptr);
+  stats.input_mean = std::strtod(fields[8].c_str(), nullptr);
+  stats.reference = std::strtod(fields[9].c_str(), nullptr);
+  stats.n_below = std::strtoll(fields[10].c_str(), nullptr, 10);
+  stats.n_above = std::strtoll(fields[11].c_str(), nullptr, 10);
+
+  stats.histogram.resize(std::strtoull(fields[12].c_str(), nullptr, 10));
+  for (auto& count : stats.histogram) {
+    if (!(iss >> count)) {
+      return false;
+    }
+  }
+
+  // The name may be empty
+  std::getline(iss >> std::ws, entry.name);
+  return true;
+}
+
+Journal::Journal(const std::string fname_out, const std::string signature_)
+  : fname(fname_out + ".journal")
+  , signature(signature_)
+{
+  std::ifstream ifs(fname);
+  std::string line;
+  if (!std::getline(ifs, line) || line != journal_header || !std::getline(ifs, line) ||
+      line != "signature " + signature) {
+    return;
+  }
+
+  // A line without its newline was being written when the run was killed
+  while (std::getline(ifs, line) && !ifs.eof()) {
+    JournalEntry entry;
+    if (!parse_entry(line, entry)) {
+      break;
+    }
+    entries.push_back(entry);
+  }
+}
+
+void Journal::start(const size_t n_kept)
+{
+  entries.resize(std::min(n_kept, entries.size()));
+
+  // Replace the journal atomically, so that the entries being kept can't be lost
+  const auto fname_tmp = fname + ".tmp";
+  {
+    std::ofstream tmp(fname_tmp);
+    tmp << journal_header << "\n" << "signature " << signature << "\n";
+    for (const auto& entry : entries) {
+      tmp << format_entry(entry);
+    }
+    if (!tmp.flush()) {
+      throw std::runtime_error(fmt::format("Failed to write the journal {}", fname_tmp));
+    }
+  }
+  if (std::rename(fname_tmp.c_str(), fname.c_str()) != 0) {
+    throw std::runtime_error(fmt::format("Failed to replace the journal {}", fname));
+  }
+
+  ofs.open(fname, std::ios::app);
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to open the journal {}", fname));
+  }
+}
+
+void Journal::record(const JournalEntry& entry)
+{
+  entries.push_back(entry);
+  ofs << format_entry(entry) << std::flush;
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to write the journal {}", fname));
+  }
+}
+
+void Journal::remove()
+{
+  ofs.close();
+  std::remove(fname.c_str());
+}
@@ -0,0 +1,112 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "options.hpp"
+#include "stats.hpp"
+
+/** A grid which has been completely written to the output, as recorded in a `Journal`.
+ */
+struct JournalEntry
+{
+  std::string name;      //< The name of the grid
+  size_t offset = 0;     //< The offset of the grid in the output file (0 for HDF5 datasets, which are found by name)
+  size_t bytes = 0;      //< The number of bytes written
+  uint64_t checksum = 0; //< The `checksum` of the bytes written
+  GridStats stats;       //< The statistics of the grid, which are needed again for the summaries of a resumed run
+};
+
+/** Return the 64 bit FNV-1a hash of a buffer.
+ *
+ * @param data The buffer
+ * @param n The number of bytes
+ * @param hash The hash of any preceding data, so that a checksum can be accumulated over several buffers
+ * @return The hash
+ */
+uint64_t checksum(const void* data, const size_t n, const uint64_t hash = 0xcbf29ce484222325ULL);
+
+/** Return a string identifying a regridding job: the input file (with its size and modification time), and everything
+ * which changes the values written.  A journal is only resumed by a job with the same signature.
+ *
+ * @param fname_in The input file
+ * @param new_dim The output grid dimension
+ * @param method The method used (after planning)
+ * @param options The regridding options
+ * @param scalar_size The size of the in-memory scalar type
+ * @return The signature
+ */
+std::string job_signature(const std::string fname_in,
+                          const int new_dim,
+                          const regrid_method method,
+                          const RegridOptions& options,
+                          const size_t scalar_size);
+
+/** A sidecar file (`<output>.journal`) recording each grid once it has been completely written, so that a run which
+ * is killed part way through can be resumed from the first incomplete grid.
+ *
+ * The journal is loaded on construction.  The caller checks the recorded grids against the output, calls `start` with
+ * the number which are intact, then `record`s each further grid as it is written, and finally `remove`s the journal
+ * once the output is complete.
+ */
+class Journal
+{
+public:
+  std::vector<JournalEntry> entries; //< The grids recorded so far, in the order they were written
+
+  /** Load the journal of an output file, if there is one.
+   *
+   * Entries recorded by a job with a different signature, and any partially written entry, are discarded.
+   *
+   * @param fname_out The output file
+   * @param signature_ The signature of this job (see `job_signature`)
+   */
+  Journal(const std::string fname_out, const std::string signature_);
+
+  /** Rewrite the journal with only the first `n_kept` entries and open it to record further grids.
+   *
+   * @param n_kept The number of entries which were found to be intact in the output
+   */
+  void start(const size_t n_kept);
+
+  /** Record a grid which has been completely written, and flush the journal.
+   *
+   * The output must have been flushed first, so that the journal never gets ahead of it.
+   *
+   * @param entry The grid
+   */
+  void record(const JournalEntry& entry);
+
+  /** Close and delete the journal, once the output is complete.
+   */
+  void remove();
+
+private:
+  std::string fname;     //< The name of the journal file
+  std::string signature; //< The signature of this job
+  std::ofstream ofs;     //< The journal, once `start` has been called
+};
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernels.hpp"
+
+// Each kernel is compiled for several instruction sets, and the best one supported by the CPU is chosen (via cpuid)
+// when the program is loaded, so a single binary runs the wide vector code wherever it is available
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define KERNEL_DISPATCH __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+
+#ifndef KERNEL_DISPATCH
+#define KERNEL_DISPATCH
+#endif
+
+// The shared bodies must be inlined into each clone to be compiled for its instruction set
+#if defined(__GNUC__)
+#define KERNEL_INLINE inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE inline
+#endif
+
+const char* kernel_isa()
+{
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return "avx512f";
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return "avx2";
+  }
+#endif
+  return "default";
+}
+
+template <GridBase::filter_type type, typename T>
+static KERNEL_INLINE void filter_row_with(std::complex<T>* row,
+                                          const int n,
+                                          const double k_xy2,
+                                          const double delta_k,
+                                          const double R)
+{
+#pragma omp simd
+  for (int n_z = 0; n_z < n; ++n_z) {
+    const double k_z = n_z * delta_k;
+    const double k_mag = sqrt(k_xy2 + k_z * k_z);
+    apply_filter(row[n_z], type, k_mag * R);
+  }
+}
+
+template <typename T>
+static KERNEL_INLINE void filter_row_impl(std::complex<T>* row,
+                                          const int n,
+                                          const double k_xy2,
+                                          const double delta_k,
+                                          const double R,
+                                          const GridBase::filter_type type)
+{
+  // The filter type is fixed for the row, so each loop only holds one kernel
+  switch (type) {
+    case GridBase::filter_type::real_top_hat:
+      filter_row_with<GridBase::filter_type::real_top_hat>(row, n, k_xy2, delta_k, R);
+      break;
+    case GridBase::filter_type::k_top_hat:
+      filter_row_with<GridBase::filter_type::k_top_hat>(row, n, k_xy2, delta_k, R);
+      break;
+    case GridBase::filter_type::gaussian:
+      filter_row_with<GridBase::filter_type::gaussian>(row, n, k_xy2, delta_k, R);
+      break;
+  }
+}
+
+KERNEL_DISPATCH void filter_row(std::complex<float>* row,
+                                const int n,
+                                const double k_xy2,
+                                const double delta_k,
+                                const double R,
+                                const GridBase::filter_type type)
+{
+  filter_row_impl(row, n, k_xy2, delta_k, R, type);
+}
+
+KERNEL_DISPATCH void filter_row(std::complex<double>* row,
+                                const int n,
+                                const double k_xy2,
+                                const double delta_k,
+                                const double R,
+                                const GridBase::filter_type type)
+{
+  filter_row_impl(row, n, k_xy2, delta_k, R, type);
+}
+
+KERNEL_DISPATCH void sample_row(const float* row, float* out, const int n, const int stride)
+{
+#pragma omp simd
+  for (int ii = 0; ii < n; ++ii) {
+    out[ii] = row[(size_t)ii * stride];
+  }
+}
+
+KERNEL_DISPATCH void sample_row(const double* row, double* out, const int n, const int stride)
+{
+#pragma omp simd
+  for (int ii = 0; ii < n; ++ii) {
+    out[ii] = row[(size_t)ii * stride];
+  }
+}
+
+KERNEL_DISPATCH void convert(const float* in, double* out, const size_t n)
+{
+#pragma omp simd
+  for (size_t ii = 0; ii < n; ++ii) {
+    out[ii] = static_cast<double>(in[ii]);
+  }
+}
+
+KERNEL_DISPATCH void convert(const double* in, float* out, const size_t n)
+{
+#pragma omp simd
+  for (size_t ii = 0; ii < n; ++ii) {
+    out[ii] = static_cast<float>(in[ii]);
+  }
+}
+
+void convert(const float* in, float* out, const size_t n)
+{
+  std::memcpy(out, in, sizeof(float) * n);
+}
+
+void convert(const double* in, double* out, const size_t n)
+{
+  std::memcpy(out, in, sizeof(double) * n);
+}
@@ -0,0 +1,156 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstring>
+
+#include "grid.hpp"
+
+/** The size of the blocks which `widen_in_place` and `narrow_in_place` convert at a time.
+ */
+const size_t convert_block_size = 4096;
+
+/** Return the instruction set the dispatched kernels use on this CPU (avx512f, avx2 or default).
+ */
+const char* kernel_isa();
+
+/** Multiply a mode by the filter.
+ *
+ * @param value The mode
+ * @param type The filter type
+ * @param kR |k| times the filter size
+ */
+template <typename T>
+inline void apply_filter(std::complex<T>& value, const GridBase::filter_type type, double kR)
+{
+  switch (type) {
+    case GridBase::filter_type::real_top_hat: // Real space top-hat
+      if (kR > 1e-4) {
+        value *= 3.0 * (sin(kR) / pow(kR, 3) - cos(kR) / pow(kR, 2));
+      }
+      break;
+
+    case GridBase::filter_type::k_top_hat: // k-space top hat
+      kR *= 0.413566994;                   // Equates integrated volume to the real space top-hat (9pi/2)^(-1/3)
+      if (kR > 1) {
+        value = 0.0;
+      }
+      break;
+
+    case GridBase::filter_type::gaussian: // Gaussian
+      kR *= 0.643;                        // Equates integrated volume to the real space top-hat
+      value *= pow(M_E, -kR * kR / 2.0);
+      break;
+  }
+}
+
+/** Filter a row of modes along z, i.e. the window multiply of `Grid::convolve`.
+ *
+ * @param row The modes with n_z = 0 ... n - 1
+ * @param n The number of modes
+ * @param k_xy2 The squared magnitude of the x and y components of the wavevector of the row
+ * @param delta_k The spacing of the modes along z
+ * @param R The size (typically radius) of the filter
+ * @param type The filter type
+ */
+void filter_row(std::complex<float>* row,
+                const int n,
+                const double k_xy2,
+                const double delta_k,
+                const double R,
+                const GridBase::filter_type type);
+
+/** The double precision overload of `filter_row`.
+ */
+void filter_row(std::complex<double>* row,
+                const int n,
+                const double k_xy2,
+                const double delta_k,
+                const double R,
+                const GridBase::filter_type type);
+
+/** Gather every `stride`th value of a row, i.e. the inner loop of `Grid::sample`.
+ *
+ * @param row The input row
+ * @param out The `n` sampled values
+ * @param n The number of values to sample
+ * @param stride The spacing of the samples in `row`
+ */
+void sample_row(const float* row, float* out, const int n, const int stride);
+
+/** @copydoc sample_row(const float*, float*, const int, const int)
+ */
+void sample_row(const double* row, double* out, const int n, const int stride);
+
+/** Convert `n` values between float and double (the buffers must not overlap).
+ *
+ * @param in The values to convert
+ * @param out The converted values
+ * @param n The number of values
+ */
+void convert(const float* in, double* out, const size_t n);
+
+/** @copydoc convert(const float*, double*, const size_t)
+ */
+void convert(const double* in, float* out, const size_t n);
+
+/** @copydoc convert(const float*, double*, const size_t)
+ */
+void convert(const float* in, float* out, const size_t n);
+
+/** @copydoc convert(const float*, double*, const size_t)
+ */
+void convert(const double* in, double* out, const size_t n);
+
+/** Move the rows of a grid from logical to padded order, i.e. `Grid::real_to_padded_order`.
+ *
+ * @param data The grid, with `n_rows` rows of `n` values at the start
+ * @param n_rows The number of rows
+ * @param n The number of values in each row
+ * @param n_padded The padded length of each row
+ */
+template <typename T>
+void pad_rows(T* data, const size_t n_rows, const size_t n, const size_t n_padded)
+{
+  // The rows are moved from last to first, and each may overlap its old position, so use memmove
+  for (size_t row = n_rows; row-- > 0;) {
+    std::memmove(data + row * n_padded, data + row * n, sizeof(T) * n);
+  }
+}
+
+/** Move the rows of a grid from padded to logical order, i.e. `Grid::padded_to_real_order`.
+ *
+ * @param data The grid, with `n_rows` padded rows
+ * @param n_rows The number of rows
+ * @param n The number of values in each row
+ * @param n_padded The padded length of each row
+ */
+template <typename T>
+void unpad_rows(T* data, const size_t n_rows, const size_t n, const size_t n_padded)
+{
+  for (size_t row = 0; row < n_rows; ++row) {
+    std::memmove(data + row * n, data + row * n_padded, sizeof(T) * n);
+  }
+}
+
+#endif
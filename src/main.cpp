@@ -16,14 +16,174 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <chrono>
+#include <cstdlib>
 #include <cxxopts.hpp>
 #include <fftw3.h>
 #include <fmt/core.h>
 #include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
 
+#include "encoding.hpp"
 #include "gbptrees.hpp"
+#include "npy.hpp"
+#include "options.hpp"
+#include "planner.hpp"
+#include "profile.hpp"
+#include "report.hpp"
+#include "serve.hpp"
 #include "velociraptor.hpp"
 
+/** Dispatch to the requested input type using a grid of the requested precision.
+ *
+ * @tparam T The scalar type used for the in-memory grid
+ * @param vm The parsed command line options
+ * @return The exit status
+ */
+template <typename T>
+int run(cxxopts::ParseResult& vm)
+{
+  const auto start = std::chrono::steady_clock::now();
+  const auto fname_out = vm.count("output") ? vm["output"].as<std::string>() : std::string();
+  const auto new_dim = vm["dim"].as<int>();
+
+  RegridOptions options;
+  options.method = parse_method(vm["method"].as<std::string>());
+  options.encoding = parse_encoding(vm["encoding"].as<std::string>());
+  options.keep_bits = vm["keep-bits"].as<int>();
+  options.deflate = vm["deflate"].as<int>();
+  options.filter = parse_filter(vm["filter"].as<std::string>());
+  options.dry_run = vm.count("dry-run") > 0;
+  options.calibration = vm["calibration"].as<std::string>();
+  options.grid.first_touch = vm.count("numa") > 0;
+  options.grid.huge_pages = parse_huge_pages(vm["huge-pages"].as<std::string>());
+  options.grid.engine = parse_fft_engine(vm["fft-engine"].as<std::string>());
+  options.power_spectrum = vm.count("power-spectrum") > 0;
+  if (vm.count("derived")) {
+    options.derived = parse_derived(vm["derived"].as<std::string>());
+  }
+  if (vm.count("max-memory")) {
+    options.max_memory = parse_memory_size(vm["max-memory"].as<std::string>());
+  }
+
+  if (fname_out.empty() && !options.dry_run) {
+    throw std::runtime_error("Must specify an output file");
+  }
+  if (options.derived.any() && !vm.count("velociraptor")) {
+    throw std::runtime_error("Derived fields are only available for VELOCIraptor input");
+  }
+
+  if (vm.count("trace")) {
+    enable_tracing();
+  }
+  // The counters are inherited by threads started afterwards, so they must be opened before any parallel regions
+  if (vm.count("counters") && !enable_counters()) {
+    fmt::print(stderr, "Unable to open any hardware counters, continuing without them...\n");
+  }
+
+  RunDescription run;
+  for (const std::string format : { "gbptrees", "velociraptor", "npy", "raw" }) {
+    if (vm.count(format)) {
+      run.input = vm[format].as<std::string>();
+      run.format = format;
+    }
+  }
+
+  if (vm.count("gbptrees")) {
+    regrid_gbptrees<T>(vm["gbptrees"].as<std::string>(), fname_out, new_dim, options);
+  } else if (vm.count("velociraptor")) {
+    regrid_velociraptor<T>(vm["velociraptor"].as<std::string>(), fname_out, new_dim, options);
+  } else if (vm.count("npy")) {
+    regrid_npy<T>(vm["npy"].as<std::string>(), fname_out, new_dim, options);
+  } else if (vm.count("raw")) {
+    regrid_raw<T>(vm["raw"].as<std::string>(), fname_out, new_dim, options);
+  }
+
+  if (!options.dry_run) {
+    print_phase_summary();
+    if (counters_enabled) {
+      print_counter_summary();
+    }
+  }
+  if (vm.count("trace")) {
+    write_trace(vm["trace"].as<std::string>());
+    fmt::print("Trace written to {}\n", vm["trace"].as<std::string>());
+  }
+  if (vm.count("report") && !options.dry_run) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    run.output = fname_out;
+    run.new_dim = new_dim;
+    run.precision = vm["precision"].as<std::string>();
+    run.options = options;
+    run.wall_seconds = elapsed.count();
+    write_report(vm["report"].as<std::string>(), run);
+    fmt::print("Report written to {}\n", vm["report"].as<std::string>());
+  }
+
+  return 0;
+}
+
+/** Check that the options describe a single regridding job, and run it with the requested precision.
+ *
+ * @param vm The parsed command line options
+ * @return The exit status
+ */
+static int run_job(cxxopts::ParseResult& vm)
+{
+  if (vm.count("gbptrees") + vm.count("velociraptor") + vm.count("npy") + vm.count("raw") > 1) {
+    throw std::runtime_error("Must specify only one of gbpTrees, VELOCIraptor, .npy or raw file");
+  }
+
+  if (!vm.count("dim")) {
+    throw std::runtime_error("Must specify new grid dimension");
+  }
+
+  const auto precision = vm["precision"].as<std::string>();
+  if (precision == "double") {
+    return run<double>(vm);
+  } else if (precision == "float") {
+    return run<float>(vm);
+  }
+  throw std::runtime_error("Precision must be either float or double");
+}
+
+/** Run a job submitted to a server started with --serve.
+ *
+ * The job is parsed with the same options as the command line, and starts with fresh phase measurements and run
+ * record.  Options which change the whole process can't be used.
+ *
+ * @param options The command line options
+ * @param args The job's arguments
+ */
+static void run_submitted_job(cxxopts::Options& options, const std::vector<std::string>& args)
+{
+  std::vector<std::string> strings(1, "regrider");
+  strings.insert(strings.end(), args.begin(), args.end());
+  std::vector<char*> argv;
+  for (auto& arg : strings) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+  int argc = static_cast<int>(strings.size());
+  char** argv_ = argv.data();
+
+  auto vm = options.parse(argc, argv_);
+  for (const std::string option :
+       { "serve", "submit", "status", "shutdown", "calibrate", "numa", "counters", "trace", "help" }) {
+    if (vm.count(option)) {
+      throw std::runtime_error(fmt::format("--{} can't be used in a job submitted to a server", option));
+    }
+  }
+
+  reset_phase_stats();
+  run_record() = RunRecord();
+  if (run_job(vm) != 0) {
+    throw std::runtime_error("The job failed");
+  }
+}
+
 int main(int argc, char* argv[])
 {
   cxxopts::Options options("regrider", "Downsample gbpTrees and VELOCIraptor trees using FFTW");
@@ -32,34 +192,108 @@ int main(int argc, char* argv[])
         ("d,dim", "new grid dimension", cxxopts::value<int>())
         ("g,gbptrees", "input gbpTrees grid file", cxxopts::value<std::string>())
         ("v,velociraptor", "input VELOCIraptor grid file", cxxopts::value<std::string>())
+        ("n,npy", "input .npy grid file (output is .npy)", cxxopts::value<std::string>())
+        ("r,raw", "input raw float32 cubic grid file (output is raw)", cxxopts::value<std::string>())
         ("o,output", "output file name", cxxopts::value<std::string>())
+        ("p,precision", "in-memory precision: float or double", cxxopts::value<std::string>()->default_value("float"))
+        ("e,encoding", "output encoding: float32, float16, bfloat16 or bitround", cxxopts::value<std::string>()->default_value("float32"))
+        ("keep-bits", "mantissa bits kept by the bitround encoding", cxxopts::value<int>()->default_value("12"))
+        ("deflate", "HDF5 deflate level for output datasets (0 = off)", cxxopts::value<int>()->default_value("0"))
+        ("m,method", "downsampling method: auto, fft, block-average or gaussian", cxxopts::value<std::string>()->default_value("auto"))
+        ("f,filter", "filter applied before sampling: real-top-hat, k-top-hat or gaussian", cxxopts::value<std::string>()->default_value("real-top-hat"))
+        ("dry-run", "print the estimated cost of each method and exit", cxxopts::value<bool>())
+        ("calibration", "micro-benchmark results used to estimate costs", cxxopts::value<std::string>()->default_value("regrider.calibration"))
+        ("calibrate", "run the micro-benchmarks, store them in the calibration file and exit", cxxopts::value<bool>())
+        ("numa", "first-touch grids in parallel and bind OpenMP threads (OMP_PROC_BIND=spread, OMP_PLACES=cores)", cxxopts::value<bool>())
+        ("huge-pages", "back the full resolution grid with huge pages (off, thp, 2M or 1G; falls back to smaller pages)", cxxopts::value<std::string>()->default_value("off"))
+        ("fft-engine", "how the fft method transforms each grid: auto (out-of-place if it fits in the memory budget, otherwise fftw-3d), fftw-3d (in-place 3D plans), out-of-place (3D plans into a separate complex buffer, so the grid is never reordered) or fused (plane and pencil plans, filtering each pencil while it is in cache)", cxxopts::value<std::string>()->default_value("auto"))
+        ("power-spectrum", "also write the power spectra of the input grids (and density-velocity cross-spectra for VELOCIraptor) to <output>.pk", cxxopts::value<bool>())
+        ("derived", "also write derived VELOCIraptor fields at the target resolution: a comma separated list of divergence, vorticity and density-gradient", cxxopts::value<std::string>())
+        ("max-memory", "memory budget, e.g. 16G (default: the memory available on the node)", cxxopts::value<std::string>())
+        ("counters", "also read hardware counters (cycles, instructions, LLC and dTLB misses) for each phase with perf_event_open", cxxopts::value<bool>())
+        ("trace", "write a Chrome trace of every phase, per grid and per thread, to this JSON file", cxxopts::value<std::string>())
+        ("report", "write a JSON summary of the run (sizes, time and I/O per phase, FFT throughput, peak RSS, threads, wisdom and method) to this file", cxxopts::value<std::string>())
+        ("serve", "run as a server listening on this Unix socket, running submitted jobs one at a time and keeping grids and FFTW plans between them", cxxopts::value<std::string>())
+        ("submit", "submit the job given by the other options to the server listening on this socket and wait for it to finish", cxxopts::value<std::string>())
+        ("status", "print the state of every job submitted to the server listening on this socket", cxxopts::value<std::string>())
+        ("shutdown", "ask the server listening on this socket to stop once the running job has finished", cxxopts::value<std::string>())
         ("h,help", "show help", cxxopts::value<bool>());
 
+    // Parsing consumes the arguments, but we may need them to re-execute
+    std::vector<char*> args(argv, argv + argc + 1);
+
     auto vm = options.parse(argc, argv);
 
     if (vm.count("help")) {
         fmt::print(options.help());
     }
 
-    if (vm.count("gbptrees") && vm.count("velociraptor")) {
-        fmt::print(stderr, "Must specify either gbpTrees or VELOCIraptor file. Not both...\n");
-        return 1;
+    // The OpenMP runtime reads its affinity settings when it is loaded, so set them and start again
+    if (vm.count("numa") && getenv("OMP_PROC_BIND") == nullptr) {
+        setenv("OMP_PROC_BIND", "spread", 1);
+        setenv("OMP_PLACES", "cores", 0);
+        execv("/proc/self/exe", args.data());
+        fmt::print(stderr, "Unable to re-execute with OpenMP affinity set, continuing without it...\n");
     }
 
-    if (!vm.count("dim")) {
-        fmt::print(stderr, "Must specify new grid dimension...\n");
-        return 1;
+    // This must come before any planning, including the threaded plans made by the calibration
+    fftwf_init_threads();
+    fftw_init_threads();
+
+    if (vm.count("calibrate")) {
+        try {
+            save_calibration(vm["calibration"].as<std::string>(), run_calibration());
+        } catch (const std::runtime_error& e) {
+            fmt::print(stderr, "Error: {}\n", e.what());
+            return 1;
+        }
+        return 0;
     }
 
-    fftwf_init_threads();
+    if (vm.count("status") || vm.count("shutdown") || vm.count("submit")) {
+        int status = 0;
+        try {
+            if (vm.count("submit")) {
+                std::vector<std::string> request(1, "submit");
+                for (const auto& arg : submitted_arguments(std::vector<std::string>(args.begin(), args.end() - 1))) {
+                    request.push_back(arg);
+                }
+                const auto reply = send_request(vm["submit"].as<std::string>(), request);
+                status = !reply.empty() && reply.back().compare(0, 5, "done ") == 0 ? 0 : 1;
+                for (const auto& line : reply) {
+                    fmt::print("{}\n", line);
+                }
+            } else {
+                const auto command = vm.count("status") ? "status" : "shutdown";
+                for (const auto& line : send_request(vm[command].as<std::string>(), { command })) {
+                    fmt::print("{}\n", line);
+                }
+            }
+        } catch (const std::runtime_error& e) {
+            fmt::print(stderr, "Error: {}\n", e.what());
+            status = 1;
+        }
+        return status;
+    }
 
-    if (vm.count("gbptrees")) {
-        regrid_gbptrees(vm["gbptrees"].as<std::string>(), vm["output"].as<std::string>(), vm["dim"].as<int>());
-    } else if (vm.count("velociraptor")) {
-        regrid_velociraptor(vm["velociraptor"].as<std::string>(), vm["output"].as<std::string>(), vm["dim"].as<int>());
+    int status = 0;
+    try {
+        if (vm.count("serve")) {
+            // Keep the grid (and so its plans) of each job, in case the next one is the same size
+            enable_grid_pool(true);
+            serve(vm["serve"].as<std::string>(),
+                  [&options](const std::vector<std::string>& job) { run_submitted_job(options, job); });
+            enable_grid_pool(false);
+        } else {
+            status = run_job(vm);
+        }
+    } catch (const std::runtime_error& e) {
+        fmt::print(stderr, "Error: {}\n", e.what());
+        status = 1;
     }
 
+    fftw_cleanup_threads();
     fftwf_cleanup_threads();
 
-    return 0;
+    return status;
 }
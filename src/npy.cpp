@@ -0,0 +1,406 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <fmt/ostream.h>
+#include <limits>
+#include <memory>
+#include <omp.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kernels.hpp"
+#include "npy.hpp"
+#include "planner.hpp"
+#include "power_spectrum.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include "streaming.hpp"
+#include "utils.hpp"
+
+MappedFile::MappedFile(const std::string fname)
+{
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error(fmt::format("Failed to open {}: {}", fname, strerror(errno)));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    const int error = errno;
+    close(fd);
+    throw std::runtime_error(fmt::format("Failed to stat {}: {}", fname, strerror(error)));
+  }
+  size_ = static_cast<size_t>(st.st_size);
+
+  void* ptr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  const int error = errno;
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    throw std::runtime_error(fmt::format("Failed to map {}: {}", fname, strerror(error)));
+  }
+
+  // We stream through the input exactly once
+  madvise(ptr, size_, MADV_SEQUENTIAL);
+  data_ = static_cast<char*>(ptr);
+}
+
+MappedFile::MappedFile(const std::string fname, const size_t size)
+  : size_{ size }
+{
+  int fd = open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error(fmt::format("Failed to create {}: {}", fname, strerror(errno)));
+  }
+
+  if (ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+    const int error = errno;
+    close(fd);
+    throw std::runtime_error(fmt::format("Failed to allocate {} bytes for {}: {}", size_, fname, strerror(error)));
+  }
+
+  void* ptr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  const int error = errno;
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    throw std::runtime_error(fmt::format("Failed to map {}: {}", fname, strerror(error)));
+  }
+
+  data_ = static_cast<char*>(ptr);
+}
+
+void MappedFile::release(const size_t offset, const size_t length)
+{
+  // madvise requires a page aligned start, so only release whole pages within the range
+  const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const size_t start = (offset + page - 1) / page * page;
+  const size_t end = (offset + length) / page * page;
+  if (end > start) {
+    madvise(data_ + start, end - start, MADV_DONTNEED);
+  }
+}
+
+MappedFile::~MappedFile()
+{
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+  }
+}
+
+NpyHeader parse_npy_header(const char* data, const size_t size)
+{
+  if (size < 10 || std::memcmp(data, "\x93NUMPY", 6) != 0) {
+    throw std::runtime_error("Not a .npy file");
+  }
+
+  const auto major = static_cast<uint8_t>(data[6]);
+  size_t header_len = 0;
+  size_t preamble = 0;
+  if (major == 1) {
+    header_len = static_cast<uint8_t>(data[8]) | (static_cast<uint8_t>(data[9]) << 8);
+    preamble = 10;
+  } else {
+    for (int ii = 3; ii >= 0; --ii) {
+      header_len = (header_len << 8) | static_cast<uint8_t>(data[8 + ii]);
+    }
+    preamble = 12;
+  }
+
+  if (preamble + header_len > size) {
+    throw std::runtime_error("Truncated .npy header");
+  }
+
+  const std::string dict(data + preamble, header_len);
+  NpyHeader header;
+  header.data_offset = preamble + header_len;
+
+  auto value_of = [&dict](const std::string key) {
+    auto pos = dict.find("'" + key + "'");
+    if (pos == std::string::npos) {
+      throw std::runtime_error(fmt::format("Missing '{}' in .npy header", key));
+    }
+    return dict.find(':', pos) + 1;
+  };
+
+  {
+    auto start = dict.find('\'', value_of("descr")) + 1;
+    header.descr = dict.substr(start, dict.find('\'', start) - start);
+  }
+
+  if (dict.compare(dict.find_first_not_of(' ', value_of("fortran_order")), 4, "True") == 0) {
+    throw std::runtime_error("Fortran ordered .npy files are not supported");
+  }
+
+  {
+    auto pos = dict.find('(', value_of("shape")) + 1;
+    auto end = dict.find(')', pos);
+    int n_dims = 0;
+    while (pos < end) {
+      auto next = dict.find_first_of(",)", pos);
+      auto token = dict.substr(pos, next - pos);
+      if (token.find_first_not_of(' ') != std::string::npos) {
+        if (n_dims == 3) {
+          throw std::runtime_error("Only 3D .npy arrays are supported");
+        }
+        header.shape[n_dims++] = std::stoi(token);
+      }
+      pos = next + 1;
+    }
+    if (n_dims != 3) {
+      throw std::runtime_error("Only 3D .npy arrays are supported");
+    }
+  }
+
+  if (header.descr != "<f4" && header.descr != "<f8") {
+    throw std::runtime_error(fmt::format("Unsupported .npy dtype {} (expected <f4 or <f8)", header.descr));
+  }
+
+  return header;
+}
+
+std::string make_npy_header(const std::array<int, 3> shape, const std::string descr)
+{
+  auto dict = fmt::format(
+    "{{'descr': '{}', 'fortran_order': False, 'shape': ({}, {}, {}), }}", descr, shape[0], shape[1], shape[2]);
+
+  // magic (6) + version (2) + header_len (2) + dict + '\n', padded to a multiple of 64 bytes
+  const size_t unpadded = 10 + dict.size() + 1;
+  dict.append((64 - unpadded % 64) % 64, ' ');
+  dict.push_back('\n');
+
+  std::string header("\x93NUMPY\x01\x00", 8);
+  header.push_back(static_cast<char>(dict.size() & 0xff));
+  header.push_back(static_cast<char>((dict.size() >> 8) & 0xff));
+  return header + dict;
+}
+
+/** Write a downsampled grid to a new memory mapped file.
+ *
+ * @param fname_out The path to the new output file to be created
+ * @param header The header to prepend to the output (may be empty)
+ * @param values The float32 values to write
+ * @param n_values The number of values
+ * @param options Options controlling the regridding
+ */
+static void write_mapped(const std::string fname_out,
+                         const std::string header,
+                         const float* values,
+                         const size_t n_values,
+                         const RegridOptions& options)
+{
+  ScopedPhase scope(phase::write);
+  fmt::print("Writing subsampled grid... ");
+  MappedFile out(fname_out, header.size() + encoded_size(options.encoding) * n_values);
+  std::memcpy(out.data(), header.data(), header.size());
+  auto error = encode(values, out.data() + header.size(), n_values, options.encoding, options.keep_bits);
+  print_done();
+  print_encoding_error(options.encoding, error);
+}
+
+/** Downsample a memory mapped cube, writing the result into a new memory mapped file.
+ *
+ * @param in The mapped input file
+ * @param data_offset Offset of the first element of the input cube in the mapping
+ * @param descr The numpy dtype string of the input elements
+ * @param n_cell The logical dimensions of the input cube, which must be a multiple of `new_dim`
+ * @param fname_out The path to the new output file to be created
+ * @param new_dim The new size of the grid (assuming cubic dimensions)
+ * @param header The header to prepend to the output (may be empty)
+ * @param options Options controlling the regridding
+ */
+template <typename T>
+static void regrid_mapped(MappedFile& in,
+                          const size_t data_offset,
+                          const std::string descr,
+                          const std::array<int, 3> n_cell,
+                          const std::string fname_out,
+                          const int new_dim,
+                          const std::string header,
+                          const RegridOptions& options)
+{
+  // The grid is filtered and sampled as a cube, in whole cells of the input
+  if (n_cell[0] != n_cell[1] || n_cell[1] != n_cell[2]) {
+    throw std::runtime_error(fmt::format("The input must be a cube, but its shape is [{}]", fmt::join(n_cell, ", ")));
+  }
+  if (new_dim <= 0 || n_cell[0] % new_dim != 0) {
+    throw std::runtime_error(fmt::format("The input dimension {} is not a multiple of {}", n_cell[0], new_dim));
+  }
+
+  std::array<int, 3> new_n_cell = { new_dim, new_dim, new_dim };
+  fmt::print("n_cell = [{}] --> [{}]\n", fmt::join(n_cell, ", "), fmt::join(new_n_cell, ", "));
+
+  const char* data = in.data() + data_offset;
+
+  // There is no box size stored alongside the data, so work in units of the input cell size
+  std::array<double, 3> box_size = { (double)n_cell[0], (double)n_cell[1], (double)n_cell[2] };
+  const double radius = box_size[0] / (double)new_dim * 0.5;
+
+  RegridProblem problem = {
+    n_cell, new_n_cell, box_size, radius, 1, sizeof(T), omp_get_max_threads(), memory_budget(options), 0
+  };
+  const auto plan = plan_method(problem, options);
+  const auto method = plan.method;
+  if (options.dry_run) {
+    return;
+  }
+
+  if (method != regrid_method::fft) {
+    std::unique_ptr<StreamingDownsampler> streamer;
+    {
+      ScopedPhase scope(phase::setup);
+      streamer = make_streaming_downsampler(method, n_cell, new_n_cell, box_size, radius);
+    }
+    const size_t slab_bytes = streamer->slab_size() * (descr == "<f8" ? sizeof(double) : sizeof(float));
+
+    {
+      ScopedPhase scope(phase::stream);
+      fmt::print("Streaming grid through {}... ", method_name(method));
+      for (int i_out = 0; i_out < new_n_cell[0]; ++i_out) {
+        const char* slab = data + i_out * slab_bytes;
+        if (descr == "<f8") {
+          streamer->add_slab(reinterpret_cast<const double*>(slab), i_out);
+        } else {
+          streamer->add_slab(reinterpret_cast<const float*>(slab), i_out);
+        }
+        // Drop the consumed pages so that only one slab of the input is ever resident
+        in.release(data_offset + i_out * slab_bytes, slab_bytes);
+      }
+      print_done();
+    }
+
+    auto stats = compute_stats(streamer->get(), streamer->n_logical(), std::numeric_limits<double>::quiet_NaN());
+    print_stats(stats);
+    write_mapped(fname_out, header, streamer->get(), streamer->n_logical(), options);
+    write_stats(fname_out + ".stats", { "grid" }, { stats });
+    return;
+  }
+
+  auto grid_ptr = acquire_grid<T>(n_cell, box_size, plan.grid);
+  auto& grid = *grid_ptr;
+
+  {
+    ScopedPhase scope(phase::read);
+    fmt::print("Reading grid... ");
+    auto grid_ = grid.get();
+    const size_t n_logical = grid.n_logical;
+    const size_t block_size = convert_block_size;
+    const long n_blocks = (long)((n_logical + block_size - 1) / block_size);
+    const bool is_double = descr == "<f8";
+#pragma omp parallel for default(none) firstprivate(n_logical, block_size, n_blocks, is_double, data, grid_)
+    for (long block = 0; block < n_blocks; ++block) {
+      const size_t start = block * block_size;
+      const size_t count = std::min(n_logical - start, block_size);
+      if (is_double) {
+        convert(reinterpret_cast<const double*>(data) + start, grid_ + start, count);
+      } else {
+        convert(reinterpret_cast<const float*>(data) + start, grid_ + start, count);
+      }
+    }
+    print_done();
+  }
+
+  std::unique_ptr<SpectrumAccumulator> spectra;
+  if (options.power_spectrum) {
+    spectra.reset(new SpectrumAccumulator(n_cell, box_size));
+    spectra->start("grid");
+  }
+
+  grid.filter(options.filter, radius, spectra.get());
+  GridStats stats;
+  grid.sample(new_n_cell, &stats);
+  print_stats(stats);
+
+  write_mapped(fname_out, header, narrow_in_place(grid.get(), grid.n_logical), grid.n_logical, options);
+  write_stats(fname_out + ".stats", { "grid" }, { stats });
+  release_grid(grid_ptr);
+
+  if (spectra) {
+    ScopedPhase scope(phase::write);
+    fmt::print("Writing power spectra to {}.pk... ", fname_out);
+    spectra->write(fname_out + ".pk");
+    print_done();
+  }
+}
+
+template <typename T>
+void regrid_npy(const std::string fname_in,
+                const std::string fname_out,
+                const int new_dim,
+                const RegridOptions& options)
+{
+  if (options.encoding == output_encoding::bfloat16) {
+    throw std::runtime_error(".npy files have no bfloat16 dtype (try --raw output or float16)");
+  }
+
+  fmt::print("Regridding .npy file {}\n", fname_in);
+
+  MappedFile in(fname_in);
+  auto header = parse_npy_header(in.data(), in.size());
+
+  const size_t elem_size = header.descr == "<f8" ? sizeof(double) : sizeof(float);
+  const size_t n_logical = (size_t)header.shape[0] * header.shape[1] * header.shape[2];
+  if (header.data_offset + n_logical * elem_size > in.size()) {
+    throw std::runtime_error(fmt::format("{} is smaller than its header claims", fname_in));
+  }
+
+  regrid_mapped<T>(in,
+                   header.data_offset,
+                   header.descr,
+                   header.shape,
+                   fname_out,
+                   new_dim,
+                   make_npy_header({ new_dim, new_dim, new_dim },
+                                   options.encoding == output_encoding::float16 ? "<f2" : "<f4"),
+                   options);
+
+  print_done();
+}
+
+template <typename T>
+void regrid_raw(const std::string fname_in,
+                const std::string fname_out,
+                const int new_dim,
+                const RegridOptions& options)
+{
+  fmt::print("Regridding raw float32 file {}\n", fname_in);
+
+  MappedFile in(fname_in);
+
+  const size_t n_logical = in.size() / sizeof(float);
+  const int dim = static_cast<int>(std::round(std::cbrt((double)n_logical)));
+  if ((size_t)dim * dim * dim * sizeof(float) != in.size()) {
+    throw std::runtime_error(fmt::format("{} ({} bytes) is not a cube of float32 values", fname_in, in.size()));
+  }
+
+  regrid_mapped<T>(in, 0, "<f4", { dim, dim, dim }, fname_out, new_dim, std::string(), options);
+
+  print_done();
+}
+
+template void regrid_npy<float>(const std::string, const std::string, const int, const RegridOptions&);
+template void regrid_npy<double>(const std::string, const std::string, const int, const RegridOptions&);
+template void regrid_raw<float>(const std::string, const std::string, const int, const RegridOptions&);
+template void regrid_raw<double>(const std::string, const std::string, const int, const RegridOptions&);
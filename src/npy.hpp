@@ -0,0 +1,134 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NPY_H
+#define NPY_H
+
+#include <array>
+#include <cstddef>
+#include <string>
+
+#include "grid.hpp"
+#include "options.hpp"
+
+/** A read-only or read-write memory mapping of a whole file.
+ */
+class MappedFile
+{
+public:
+  /** Map an existing file read-only.
+   *
+   * @param fname The path of the file to map
+   */
+  explicit MappedFile(const std::string fname);
+
+  /** Create (or truncate) a file of the given size and map it read-write.
+   *
+   * @param fname The path of the file to create
+   * @param size The size of the new file in bytes
+   */
+  MappedFile(const std::string fname, const size_t size);
+
+  ~MappedFile(void);
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  /** Return the pointer to the start of the mapping.
+   */
+  char* data() { return data_; }
+
+  /** Return the size of the mapping in bytes.
+   */
+  size_t size() const { return size_; }
+
+  /** Tell the kernel that a range of the mapping is no longer needed, so its pages can be dropped.
+   *
+   * @param offset Offset of the start of the range in bytes
+   * @param length Length of the range in bytes
+   */
+  void release(const size_t offset, const size_t length);
+
+private:
+  char* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/** The parsed header of a 3D `.npy` file.
+ */
+struct NpyHeader
+{
+  std::array<int, 3> shape; //< The shape of the stored array
+  std::string descr;        //< The numpy dtype string (e.g. "<f4")
+  size_t data_offset;       //< Offset of the first array element from the start of the file
+};
+
+/** Parse the header of a `.npy` file held in memory.
+ *
+ * Only little-endian float32 and float64, C ordered, 3D arrays are supported.
+ *
+ * @param data Pointer to the start of the file
+ * @param size Size of the file in bytes
+ * @return The parsed header
+ */
+NpyHeader parse_npy_header(const char* data, const size_t size);
+
+/** Build a `.npy` (version 1.0) header for a C ordered array.
+ *
+ * @param shape The shape of the array
+ * @param descr The numpy dtype string of the array elements
+ * @return The header bytes, padded such that the data which follows is 64 byte aligned
+ */
+std::string make_npy_header(const std::array<int, 3> shape, const std::string descr = "<f4");
+
+/** Regrid a `.npy` file, writing a `.npy` output.
+ *
+ * Both input and output are accessed via memory maps.  As `.npy` files carry no box size, the grid is filtered in
+ * units of the input cell size.  The output is float32, or float16 (`<f2`) if requested; there is no bfloat16 dtype.
+ * The input must be a cube whose dimension is a multiple of `new_dim`.
+ *
+ * @tparam T The scalar type used for the in-memory grid (`float` or `double`)
+ * @param fname_in The path to the input file to be regridded
+ * @param fname_out The path to the new output file to be created
+ * @param new_dim The new size of the grid (assuming cubic dimensions)
+ * @param options Options controlling the regridding
+ */
+template <typename T>
+void regrid_npy(const std::string fname_in,
+                const std::string fname_out,
+                const int new_dim,
+                const RegridOptions& options);
+
+/** Regrid a raw float32 cube, writing a raw cube with the requested encoding.
+ *
+ * The input dimension is inferred from the file size, which must correspond to a cube whose dimension is a multiple of
+ * `new_dim`.  Both input and output are accessed via memory maps.
+ *
+ * @tparam T The scalar type used for the in-memory grid (`float` or `double`)
+ * @param fname_in The path to the input file to be regridded
+ * @param fname_out The path to the new output file to be created
+ * @param new_dim The new size of the grid (assuming cubic dimensions)
+ * @param options Options controlling the regridding
+ */
+template <typename T>
+void regrid_raw(const std::string fname_in,
+                const std::string fname_out,
+                const int new_dim,
+                const RegridOptions& options);
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fmt/core.h>
+#include <stdexcept>
+#include <string>
+
+#include "options.hpp"
+
+regrid_method parse_method(const std::string name)
+{
+  if (name == "auto") {
+    return regrid_method::automatic;
+  } else if (name == "fft") {
+    return regrid_method::fft;
+  } else if (name == "block-average") {
+    return regrid_method::block_average;
+  } else if (name == "gaussian") {
+    return regrid_method::gaussian;
+  }
+  throw std::runtime_error(fmt::format("Unrecognised method '{}'", name));
+}
+
+const char* method_name(const regrid_method method)
+{
+  switch (method) {
+    case regrid_method::automatic:
+      return "auto";
+    case regrid_method::block_average:
+      return "block-average";
+    case regrid_method::gaussian:
+      return "gaussian";
+    default:
+      return "fft";
+  }
+}
+
+GridBase::filter_type parse_filter(const std::string name)
+{
+  if (name == "real-top-hat") {
+    return GridBase::filter_type::real_top_hat;
+  } else if (name == "k-top-hat") {
+    return GridBase::filter_type::k_top_hat;
+  } else if (name == "gaussian") {
+    return GridBase::filter_type::gaussian;
+  }
+  throw std::runtime_error(fmt::format("Unrecognised filter '{}'", name));
+}
+
+const char* filter_name(const GridBase::filter_type filter)
+{
+  switch (filter) {
+    case GridBase::filter_type::k_top_hat:
+      return "k-top-hat";
+    case GridBase::filter_type::gaussian:
+      return "gaussian";
+    default:
+      return "real-top-hat";
+  }
+}
+
+fft_engine parse_fft_engine(const std::string name)
+{
+  if (name == "auto") {
+    return fft_engine::automatic;
+  } else if (name == "fftw-3d") {
+    return fft_engine::fftw_3d;
+  } else if (name == "out-of-place") {
+    return fft_engine::out_of_place;
+  } else if (name == "fused") {
+    return fft_engine::fused;
+  }
+  throw std::runtime_error(fmt::format("Unrecognised FFT engine '{}'", name));
+}
+
+const char* fft_engine_name(const fft_engine engine)
+{
+  switch (engine) {
+    case fft_engine::automatic:
+      return "auto";
+    case fft_engine::out_of_place:
+      return "out-of-place";
+    case fft_engine::fused:
+      return "fused";
+    default:
+      return "fftw-3d";
+  }
+}
+
+size_t parse_memory_size(const std::string size)
+{
+  size_t pos = 0;
+  double value = 0;
+  try {
+    value = std::stod(size, &pos);
+  } catch (const std::exception&) {
+    throw std::runtime_error(fmt::format("Unrecognised memory size '{}'", size));
+  }
+
+  std::string suffix = size.substr(pos);
+  for (auto tail : { "iB", "B" }) {
+    const std::string tail_(tail);
+    if (suffix.size() >= tail_.size() && suffix.compare(suffix.size() - tail_.size(), tail_.size(), tail_) == 0) {
+      suffix.resize(suffix.size() - tail_.size());
+      break;
+    }
+  }
+
+  double scale = 1.0;
+  if (suffix == "K" || suffix == "k") {
+    scale = 1024.0;
+  } else if (suffix == "M" || suffix == "m") {
+    scale = 1024.0 * 1024.0;
+  } else if (suffix == "G" || suffix == "g") {
+    scale = 1024.0 * 1024.0 * 1024.0;
+  } else if (suffix == "T" || suffix == "t") {
+    scale = 1024.0 * 1024.0 * 1024.0 * 1024.0;
+  } else if (!suffix.empty()) {
+    throw std::runtime_error(fmt::format("Unrecognised memory size '{}'", size));
+  }
+
+  if (value <= 0) {
+    throw std::runtime_error(fmt::format("Memory size '{}' must be positive", size));
+  }
+  return static_cast<size_t>(value * scale);
+}
@@ -0,0 +1,96 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstddef>
+#include <string>
+
+#include "derived.hpp"
+#include "encoding.hpp"
+#include "grid.hpp"
+
+/** The method used to downsample each grid.
+ */
+enum class regrid_method
+{
+  automatic,     //< Let the planner pick the cheapest method which reproduces the requested filter
+  fft,           //< Filter with a 3D FFT of the full resolution `Grid`, then sample
+  block_average, //< Average blocks of cells, streaming the input slab by slab (see `BlockAverager`)
+  gaussian       //< Separable Gaussian smoothing, streaming the input slab by slab (see `GaussianSmoother`)
+};
+
+/** Parse a method name (auto, fft, block-average or gaussian).
+ *
+ * @param name The name of the method
+ * @return The corresponding method
+ */
+regrid_method parse_method(const std::string name);
+
+/** Return the name of a method.
+ */
+const char* method_name(const regrid_method method);
+
+/** Parse a filter name (real-top-hat, k-top-hat or gaussian).
+ *
+ * @param name The name of the filter
+ * @return The corresponding filter type
+ */
+GridBase::filter_type parse_filter(const std::string name);
+
+/** Return the name of a filter.
+ */
+const char* filter_name(const GridBase::filter_type filter);
+
+/** Parse an FFT engine name (auto, fftw-3d, out-of-place or fused).
+ *
+ * @param name The name of the engine
+ * @return The corresponding engine
+ */
+fft_engine parse_fft_engine(const std::string name);
+
+/** Return the name of an FFT engine.
+ */
+const char* fft_engine_name(const fft_engine engine);
+
+/** Parse a memory size such as 512M, 16G or 1.5GiB (suffixes are powers of 1024, plain numbers are bytes).
+ *
+ * @param size The memory size
+ * @return The number of bytes
+ */
+size_t parse_memory_size(const std::string size);
+
+/** Options controlling how a file is regridded, shared by all of the input types.
+ */
+struct RegridOptions
+{
+  regrid_method method = regrid_method::automatic;                    //< The method used to downsample each grid
+  GridBase::filter_type filter = GridBase::filter_type::real_top_hat; //< The filter applied before sampling
+  output_encoding encoding = output_encoding::float32;                //< The encoding of the output values
+  int keep_bits = 12;                                                 //< Mantissa bits kept by bitround encoding
+  int deflate = 0;                                                    //< HDF5 deflate level for output (0 = off)
+  bool dry_run = false;                                               //< Only print the plan, don't regrid anything
+  std::string calibration;                                            //< Stored micro-benchmark used by the planner
+  size_t max_memory = 0;                                              //< Memory budget in bytes (0 = available memory)
+  GridOptions grid;                                                   //< How the full resolution `Grid` is allocated
+  bool power_spectrum = false;                                        //< Measure power spectra while filtering
+  DerivedOptions derived;                                             //< Derived fields to compute (VELOCIraptor only)
+};
+
+#endif
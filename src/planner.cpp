@@ -0,0 +1,450 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fftw3.h>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+#include "fftw_traits.hpp"
+#include "gaussian.hpp"
+#include "grid.hpp"
+#include "planner.hpp"
+#include "report.hpp"
+
+/** Format a number of bytes for humans.
+ */
+static std::string format_bytes(const size_t bytes)
+{
+  const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+  double value = (double)bytes;
+  int unit = 0;
+  while (value >= 1024.0 && unit < 4) {
+    value /= 1024.0;
+    ++unit;
+  }
+  return fmt::format("{:.1f} {}", value, units[unit]);
+}
+
+/** Return the number of seconds taken to call `fn` `n_reps` times.
+ */
+template <typename Fn>
+static double time_reps(const int n_reps, Fn fn)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int ii = 0; ii < n_reps; ++ii) {
+    fn();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+Calibration load_calibration(const std::string fname)
+{
+  Calibration calibration;
+  std::ifstream ifs(fname);
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    std::string key;
+    double value = 0;
+    if (!(iss >> key >> value)) {
+      continue;
+    }
+    if (key == "fft_flops") {
+      calibration.fft_flops = value;
+    } else if (key == "stream_flops") {
+      calibration.stream_flops = value;
+    } else if (key == "copy_bandwidth") {
+      calibration.copy_bandwidth = value;
+    } else if (key == "read_bandwidth") {
+      calibration.read_bandwidth = value;
+    } else if (key == "planning_factor") {
+      calibration.planning_factor = value;
+    }
+  }
+  return calibration;
+}
+
+void save_calibration(const std::string fname, const Calibration& calibration)
+{
+  std::ofstream ofs(fname);
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Unable to write calibration file {}", fname));
+  }
+  ofs << fmt::format("fft_flops {:.6e}\n", calibration.fft_flops);
+  ofs << fmt::format("stream_flops {:.6e}\n", calibration.stream_flops);
+  ofs << fmt::format("copy_bandwidth {:.6e}\n", calibration.copy_bandwidth);
+  ofs << fmt::format("read_bandwidth {:.6e}\n", calibration.read_bandwidth);
+  ofs << fmt::format("planning_factor {:.6e}\n", calibration.planning_factor);
+}
+
+Calibration run_calibration()
+{
+  Calibration calibration;
+
+  {
+    fmt::print("Timing FFTs... ");
+    const int n = 64;
+    const size_t n_real = (size_t)n * n * n;
+    const size_t n_complex = (size_t)n * n * (n / 2 + 1);
+    float* real = fftwf_alloc_real(n_real);
+    fftwf_complex* modes = fftwf_alloc_complex(n_complex);
+    std::fill(real, real + n_real, 1.0f);
+    fftwf_plan forward, reverse;
+    {
+      ScopedPlanner<float> scoped_planner(1);
+      forward = fftwf_plan_dft_r2c_3d(n, n, n, real, modes, FFTW_ESTIMATE);
+      reverse = fftwf_plan_dft_c2r_3d(n, n, n, modes, real, FFTW_ESTIMATE);
+    }
+    const int n_reps = 5;
+    const double seconds = time_reps(n_reps, [&]() {
+      fftwf_execute(forward);
+      fftwf_execute(reverse);
+    });
+    calibration.fft_flops = n_reps * 5.0 * n_real * std::log2((double)n_real) / seconds;
+    {
+      std::lock_guard<std::mutex> lock(fftw_planner_mutex());
+      fftwf_destroy_plan(reverse);
+      fftwf_destroy_plan(forward);
+    }
+    fftwf_free(modes);
+    fftwf_free(real);
+    fmt::print("{:.2f} Gflop/s\n", calibration.fft_flops * 1e-9);
+  }
+
+  {
+    fmt::print("Timing direct convolution... ");
+    const int n = 1 << 16;
+    const int n_taps = 31;
+    std::vector<double> in(n + n_taps, 1.0), taps(n_taps, 1.0 / n_taps), out(n);
+    const int n_reps = 20;
+    const double seconds = time_reps(n_reps, [&]() {
+      for (int ii = 0; ii < n; ++ii) {
+        double sum = 0;
+#pragma omp simd reduction(+ : sum)
+        for (int tt = 0; tt < n_taps; ++tt) {
+          sum += taps[tt] * in[ii + tt];
+        }
+        out[ii] = sum;
+      }
+    });
+    calibration.stream_flops = n_reps * 2.0 * n * n_taps / seconds;
+    fmt::print("{:.2f} Gflop/s\n", calibration.stream_flops * 1e-9);
+  }
+
+  {
+    fmt::print("Timing memory copies... ");
+    const size_t n_bytes = (size_t)1 << 27;
+    std::vector<char> from(n_bytes, 1), to(n_bytes, 0);
+    const int n_reps = 5;
+    const double seconds = time_reps(n_reps, [&]() { std::memcpy(to.data(), from.data(), n_bytes); });
+    calibration.copy_bandwidth = n_reps * 2.0 * n_bytes / seconds;
+    fmt::print("{:.2f} GB/s\n", calibration.copy_bandwidth * 1e-9);
+  }
+
+  return calibration;
+}
+
+size_t memory_budget(const RegridOptions& options)
+{
+  // A grid kept for reuse by a server is not counted as available, but it is freed if this job can't use it
+  return options.max_memory > 0 ? options.max_memory : available_memory() + pooled_grid_bytes();
+}
+
+size_t available_memory()
+{
+  std::ifstream ifs("/proc/meminfo");
+  std::string key;
+  size_t value = 0;
+  std::string unit;
+  while (ifs >> key >> value >> unit) {
+    if (key == "MemAvailable:") {
+      return value * 1024;
+    }
+  }
+  return (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGE_SIZE);
+}
+
+/** Estimate the cost of the fft method with a given `Grid` engine.
+ *
+ * `fft_engine::out_of_place` needs a separate complex buffer, but saves the two serial reordering passes.
+ * `fft_engine::fused` needs neither a second buffer nor wisdom, and moves its planes and pencils on every thread.
+ *
+ * @param problem The size of the job
+ * @param grid How the `Grid` is allocated and transformed
+ * @param calibration The machine throughputs
+ * @param read_seconds The estimated time to read every input grid
+ * @return The estimate, which hasn't been checked against the memory budget
+ */
+static MethodEstimate estimate_fft(const RegridProblem& problem,
+                                   const GridOptions& grid,
+                                   const Calibration& calibration,
+                                   const double read_seconds)
+{
+  const auto& n_cell = problem.n_cell;
+  const double n_logical = (double)n_cell[0] * n_cell[1] * n_cell[2];
+  const double n_padded = (double)n_cell[0] * n_cell[1] * 2 * (n_cell[2] / 2 + 1);
+  const double threads = (double)std::max(problem.n_threads, 1);
+  const double n_grids = (double)problem.n_grids;
+  const bool out_of_place = grid.engine == fft_engine::out_of_place;
+  const bool fused = grid.engine == fft_engine::fused;
+
+  MethodEstimate estimate;
+  estimate.method = regrid_method::fft;
+  estimate.equivalent = true;
+  estimate.grid = grid;
+
+  // The out-of-place complex buffer holds the same number of scalars as the padded grid
+  const double buffer_bytes = (out_of_place ? 2.0 : 1.0) * n_padded * problem.scalar_size;
+  estimate.peak_bytes = (size_t)buffer_bytes + problem.extra_fft_bytes;
+  if (fused) {
+    estimate.peak_bytes += problem.scalar_size > sizeof(float)
+                             ? Grid<double>::fused_scratch_bytes(n_cell, problem.n_threads)
+                             : Grid<float>::fused_scratch_bytes(n_cell, problem.n_threads);
+  }
+
+  const double precision_factor = problem.scalar_size > sizeof(float) ? 0.5 : 1.0;
+  const double fft_seconds =
+    5.0 * n_logical * std::log2(n_logical) / (calibration.fft_flops * precision_factor * threads);
+
+  // Serial passes (widen, reorder, reorder, narrow) and threaded ones (normalise, filter, sample), where the
+  // out-of-place transforms don't need reordering.  The fused engine instead copies each plane in and out and gathers
+  // and scatters each pencil on every thread, filtering and normalising the pencils in cache.
+  const double bytes = 2.0 * n_padded * problem.scalar_size;
+  const double serial_passes = fused || out_of_place ? 2.0 : 4.0;
+  const double threaded_passes = fused ? 5.0 : 3.0;
+  const double pass_seconds = serial_passes * bytes / calibration.copy_bandwidth +
+                              threaded_passes * bytes / (calibration.copy_bandwidth * threads);
+
+  estimate.seconds = read_seconds + n_grids * (fft_seconds + pass_seconds);
+
+  if (fused) {
+    // The small plane and pencil plans are measured as each grid is made, which takes a negligible time
+    estimate.note = "fused plane and pencil transforms";
+    return estimate;
+  }
+
+  const bool has_wisdom =
+    std::ifstream(problem.scalar_size > sizeof(float)
+                    ? Grid<double>::wisdom_filename(n_cell, problem.n_threads, grid.engine)
+                    : Grid<float>::wisdom_filename(n_cell, problem.n_threads, grid.engine))
+      .good();
+  if (has_wisdom) {
+    estimate.note = "FFTW wisdom found";
+  } else {
+    // Wisdom is generated on second buffers while the first grid is read
+    const double planning_seconds = calibration.planning_factor * fft_seconds;
+    estimate.seconds += std::max(0.0, planning_seconds - read_seconds / n_grids);
+    estimate.peak_bytes += (size_t)buffer_bytes;
+    estimate.note = "includes generating FFTW wisdom";
+  }
+  return estimate;
+}
+
+std::vector<MethodEstimate> estimate_methods(const RegridProblem& problem,
+                                             const RegridOptions& options,
+                                             const Calibration& calibration)
+{
+  const auto& n_cell = problem.n_cell;
+  const auto& new_n_cell = problem.new_n_cell;
+  const double n_logical = (double)n_cell[0] * n_cell[1] * n_cell[2];
+  const size_t n_out = (size_t)new_n_cell[0] * new_n_cell[1] * new_n_cell[2];
+  const double threads = (double)std::max(problem.n_threads, 1);
+  const double n_grids = (double)problem.n_grids;
+
+  bool integer_ratio = true;
+  for (int ii = 0; ii < 3; ++ii) {
+    integer_ratio = integer_ratio && new_n_cell[ii] > 0 && n_cell[ii] % new_n_cell[ii] == 0;
+  }
+
+  // Every method reads the whole of every float32 input grid
+  const double read_seconds = n_grids * n_logical * sizeof(float) / calibration.read_bandwidth;
+
+  std::vector<MethodEstimate> estimates;
+
+  if (options.grid.engine == fft_engine::automatic) {
+    // Prefer the out-of-place transforms, unless their extra buffer doesn't fit
+    GridOptions grid = options.grid;
+    grid.engine = fft_engine::out_of_place;
+    auto estimate = estimate_fft(problem, grid, calibration, read_seconds);
+    if (estimate.peak_bytes <= problem.memory_budget) {
+      estimate.note += "; out-of-place";
+    } else {
+      const size_t out_of_place_bytes = estimate.peak_bytes;
+      grid.engine = fft_engine::fftw_3d;
+      estimate = estimate_fft(problem, grid, calibration, read_seconds);
+      estimate.note += fmt::format("; in-place, as out-of-place needs {}", format_bytes(out_of_place_bytes));
+    }
+    estimates.push_back(estimate);
+  } else {
+    estimates.push_back(estimate_fft(problem, options.grid, calibration, read_seconds));
+  }
+
+  {
+    MethodEstimate estimate;
+    estimate.method = regrid_method::gaussian;
+    estimate.equivalent = options.filter == GridBase::filter_type::gaussian;
+    if (integer_ratio) {
+      estimate.peak_bytes =
+        GaussianSmoother::estimate_bytes(n_cell, new_n_cell, problem.box_size, problem.R, problem.n_threads);
+      const double flops = GaussianSmoother::estimate_flops(n_cell, new_n_cell, problem.box_size, problem.R);
+      estimate.seconds = read_seconds + n_grids * flops / (calibration.stream_flops * threads);
+    } else {
+      estimate.peak_bytes = 0;
+      estimate.seconds = 0;
+    }
+    estimate.note = estimate.equivalent ? "separable 1D passes" : "only reproduces the gaussian filter";
+    estimates.push_back(estimate);
+  }
+
+  {
+    MethodEstimate estimate;
+    estimate.method = regrid_method::block_average;
+    estimate.equivalent = false;
+    if (integer_ratio) {
+      const size_t slab = (size_t)(n_cell[0] / new_n_cell[0]) * n_cell[1] * n_cell[2];
+      estimate.peak_bytes = (n_out + slab) * sizeof(float);
+      estimate.seconds = read_seconds + n_grids * n_logical / (calibration.stream_flops * threads);
+    } else {
+      estimate.peak_bytes = 0;
+      estimate.seconds = 0;
+    }
+    estimate.note = fmt::format("box kernel rather than {}", filter_name(options.filter));
+    estimates.push_back(estimate);
+  }
+
+  for (auto& estimate : estimates) {
+    if (estimate.method != regrid_method::fft && !integer_ratio) {
+      estimate.feasible = false;
+      estimate.note = "requires an integer ratio";
+    } else if (estimate.method != regrid_method::fft && (options.power_spectrum || options.derived.any())) {
+      estimate.feasible = false;
+      estimate.note =
+        options.power_spectrum ? "needs the full FFT for power spectra" : "needs the full FFT for derived fields";
+    } else if (estimate.peak_bytes > problem.memory_budget) {
+      estimate.feasible = false;
+      estimate.note = fmt::format("exceeds the {} budget", format_bytes(problem.memory_budget));
+    } else {
+      estimate.feasible = true;
+    }
+  }
+
+  return estimates;
+}
+
+MethodEstimate plan_method(const RegridProblem& problem, const RegridOptions& options)
+{
+  const auto calibration = load_calibration(options.calibration);
+  const auto estimates = estimate_methods(problem, options, calibration);
+
+  const MethodEstimate* chosen = nullptr;
+  std::string reason;
+  if (options.method != regrid_method::automatic) {
+    for (const auto& estimate : estimates) {
+      if (estimate.method == options.method) {
+        chosen = &estimate;
+      }
+    }
+    if (chosen->feasible) {
+      reason = chosen->equivalent ? "requested" : "requested; " + chosen->note;
+    } else {
+      reason = fmt::format("the requested {} method {}", method_name(chosen->method), chosen->note);
+      chosen = nullptr;
+    }
+  } else {
+    for (const auto& estimate : estimates) {
+      if (estimate.equivalent && estimate.feasible && (!chosen || estimate.seconds < chosen->seconds)) {
+        chosen = &estimate;
+      }
+    }
+    if (chosen) {
+      reason = fmt::format("fastest feasible method for the {} filter", filter_name(options.filter));
+    } else {
+      // Degrade to the feasible method with the smallest footprint, even though it smooths differently
+      for (const auto& estimate : estimates) {
+        if (estimate.feasible && (!chosen || estimate.peak_bytes < chosen->peak_bytes)) {
+          chosen = &estimate;
+        }
+      }
+      if (chosen) {
+        reason = fmt::format("degraded: nothing reproducing the {} filter fits in {}; {}",
+                             filter_name(options.filter),
+                             format_bytes(problem.memory_budget),
+                             chosen->note);
+      } else {
+        reason = fmt::format("no method fits in {}", format_bytes(problem.memory_budget));
+      }
+    }
+  }
+
+  if (options.dry_run) {
+    fmt::print("Plan for {} grid(s) of [{}] --> [{}] with the {} filter, {} thread(s) and {} of memory:\n",
+               problem.n_grids,
+               fmt::join(problem.n_cell, ", "),
+               fmt::join(problem.new_n_cell, ", "),
+               filter_name(options.filter),
+               problem.n_threads,
+               format_bytes(problem.memory_budget));
+    fmt::print("  {:<14} {:>10} {:>12}  {}\n", "method", "time", "peak memory", "notes");
+    for (const auto& estimate : estimates) {
+      std::string note = estimate.note;
+      if (!estimate.equivalent && estimate.feasible) {
+        note += " (not considered)";
+      }
+      if (estimate.peak_bytes > 0) {
+        fmt::print("  {:<14} {:>8.2f} s {:>12}  {}\n",
+                   method_name(estimate.method),
+                   estimate.seconds,
+                   format_bytes(estimate.peak_bytes),
+                   note);
+      } else {
+        fmt::print("  {:<14} {:>10} {:>12}  {}\n", method_name(estimate.method), "-", "-", note);
+      }
+    }
+  }
+
+  if (!chosen) {
+    throw std::runtime_error(fmt::format("Refusing to run: {}", reason));
+  }
+
+  auto& record = run_record();
+  record.method = method_name(chosen->method);
+  record.n_grids = problem.n_grids;
+  record.n_threads = problem.n_threads;
+  if (chosen->method == regrid_method::fft) {
+    record.engine = fft_engine_name(chosen->grid.engine);
+  }
+
+  fmt::print("Method: {} ({})\n", method_name(chosen->method), reason);
+  if (chosen->method == regrid_method::fft) {
+    fmt::print("FFT engine: {}\n", fft_engine_name(chosen->grid.engine));
+  }
+  fmt::print("Estimated peak memory: {} (budget {})\n",
+             format_bytes(chosen->peak_bytes),
+             format_bytes(problem.memory_budget));
+  return *chosen;
+}
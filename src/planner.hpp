@@ -0,0 +1,131 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "options.hpp"
+
+/** Machine throughputs used by the planner's cost model.
+ *
+ * The defaults are deliberately conservative; `run_calibration` measures the first three on the current machine.
+ */
+struct Calibration
+{
+  double fft_flops = 2.0e9;      //< Single precision FFT throughput of one thread (flop/s)
+  double stream_flops = 1.0e9;   //< Convolution and averaging throughput of one thread (flop/s)
+  double copy_bandwidth = 4.0e9; //< Memory bandwidth of one thread for the reordering passes (bytes/s)
+  double read_bandwidth = 5.0e8; //< Input read rate (bytes/s)
+  double planning_factor = 200;  //< Cost of generating FFTW_PATIENT wisdom, in units of one forward + reverse FFT
+};
+
+/** Load a stored calibration, falling back to the defaults for anything missing.
+ *
+ * @param fname The calibration file (a list of `key value` lines); the defaults are used if it doesn't exist
+ * @return The calibration
+ */
+Calibration load_calibration(const std::string fname);
+
+/** Store a calibration.
+ *
+ * @param fname The calibration file
+ * @param calibration The calibration to store
+ */
+void save_calibration(const std::string fname, const Calibration& calibration);
+
+/** Measure the FFT, streaming and memory throughputs of a single thread with a set of micro-benchmarks.
+ *
+ * @return The measured calibration (the read bandwidth and planning factor keep their defaults)
+ */
+Calibration run_calibration();
+
+/** The size of a regridding job, as seen by the planner.
+ *
+ * This is aggregate initialised, so every field must be given (in C++11 a default member initialiser would stop it
+ * being an aggregate).
+ */
+struct RegridProblem
+{
+  std::array<int, 3> n_cell;      //< The number of input cells in each dimension
+  std::array<int, 3> new_n_cell;  //< The number of output cells in each dimension
+  std::array<double, 3> box_size; //< The size of the simulation volume in input units
+  double R;                       //< The filter radius in input units
+  int n_grids;                    //< The number of grids in the file
+  size_t scalar_size;             //< The size of the in-memory `Grid` scalar type
+  int n_threads;                  //< The number of OpenMP threads
+  size_t memory_budget;           //< The memory available to the job (bytes)
+  size_t extra_fft_bytes;         //< Memory needed by the fft method on top of the `Grid` (e.g. for cross-spectra)
+};
+
+/** The planner's estimate for one method.
+ */
+struct MethodEstimate
+{
+  regrid_method method = regrid_method::fft; //< The method
+  bool equivalent = false;                   //< Does the method reproduce the requested filter?
+  bool feasible = false;                     //< Can the method run on this problem within the memory budget?
+  double seconds = 0;                        //< Estimated run time for the whole file
+  size_t peak_bytes = 0;                     //< Estimated peak allocation
+  std::string note;                          //< Why the method is (or isn't) suitable
+  GridOptions grid;                          //< The `Grid` options, with the engine resolved (fft method only)
+};
+
+/** Return the memory currently available on this node (MemAvailable, or the physical memory if unknown).
+ */
+size_t available_memory();
+
+/** Return the memory budget for a job: `RegridOptions::max_memory` if it was set, otherwise `available_memory()` plus
+ * the memory held by pooled grids (see `enable_grid_pool`).
+ */
+size_t memory_budget(const RegridOptions& options);
+
+/** Estimate the run time and peak memory of every method for a problem.
+ *
+ * @param problem The size of the job
+ * @param options Options controlling the regridding (the filter determines which methods are equivalent)
+ * @param calibration The machine throughputs
+ * @return One estimate per method
+ */
+std::vector<MethodEstimate> estimate_methods(const RegridProblem& problem,
+                                             const RegridOptions& options,
+                                             const Calibration& calibration);
+
+/** Choose the method used for a problem, printing the reasoning.
+ *
+ * An explicitly requested method is used if its estimated peak memory fits in the budget.  Otherwise the fastest
+ * feasible method which reproduces the requested filter is chosen or, if none fits, the feasible method with the
+ * smallest footprint (with a warning, as it smooths differently).  With `RegridOptions::dry_run` the estimates for
+ * every method are printed.
+ *
+ * With `fft_engine::automatic` the fft method uses `fft_engine::out_of_place` if its extra complex buffer fits in the
+ * budget, and `fft_engine::fftw_3d` otherwise.
+ *
+ * @throws std::runtime_error If the requested method, or every method, exceeds the memory budget
+ *
+ * @param problem The size of the job
+ * @param options Options controlling the regridding
+ * @return The estimate for the method to use, including the `Grid` options for the fft method
+ */
+MethodEstimate plan_method(const RegridProblem& problem, const RegridOptions& options);
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fmt/core.h>
+#include <fstream>
+#include <stdexcept>
+
+#include "power_spectrum.hpp"
+
+SpectrumAccumulator::SpectrumAccumulator(const std::array<int, 3> n_cell_, const std::array<double, 3> box_size_)
+  : n_cell{ n_cell_ }
+  , box_size{ box_size_ }
+{
+  delta_k = 2.0 * M_PI / *std::max_element(box_size.begin(), box_size.end());
+
+  // The corner of the box, where each component of k is at the Nyquist frequency
+  double k_max = 0;
+  for (int ii = 0; ii < 3; ++ii) {
+    const double k_nyquist = M_PI * n_cell[ii] / box_size[ii];
+    k_max += k_nyquist * k_nyquist;
+  }
+  n_bins = static_cast<int>(std::sqrt(k_max) / delta_k + 0.5);
+}
+
+void SpectrumAccumulator::start(const std::string name_, const bool reference_)
+{
+  name = name_;
+  mean = 0;
+  reference = reference_;
+  total = shells();
+
+  if (reference) {
+    reference_name = name;
+    reference_modes.assign((size_t)n_cell[0] * n_cell[1] * (n_cell[2] / 2 + 1), std::complex<float>(0));
+  }
+}
+
+SpectrumAccumulator::Shells SpectrumAccumulator::shells() const
+{
+  Shells sums;
+  sums.k.assign(n_bins, 0.0);
+  sums.power.assign(n_bins, 0.0);
+  sums.cross.assign(n_bins, 0.0);
+  sums.n_modes.assign(n_bins, 0);
+  return sums;
+}
+
+void SpectrumAccumulator::merge(const Shells& sums)
+{
+  for (int ii = 0; ii < n_bins; ++ii) {
+    total.k[ii] += sums.k[ii];
+    total.power[ii] += sums.power[ii];
+    total.cross[ii] += sums.cross[ii];
+    total.n_modes[ii] += sums.n_modes[ii];
+  }
+}
+
+void SpectrumAccumulator::finish()
+{
+  const double volume = box_size[0] * box_size[1] * box_size[2];
+
+  // The shells contain the same modes for every field
+  if (k.empty()) {
+    k.resize(n_bins);
+    n_modes = total.n_modes;
+    for (int ii = 0; ii < n_bins; ++ii) {
+      k[ii] = n_modes[ii] > 0 ? total.k[ii] / n_modes[ii] : 0.0;
+    }
+  }
+
+  PowerSpectrum spectrum;
+  spectrum.name = name;
+  spectrum.mean = mean;
+  spectrum.power.resize(n_bins);
+  for (int ii = 0; ii < n_bins; ++ii) {
+    spectrum.power[ii] = n_modes[ii] > 0 ? volume * total.power[ii] / n_modes[ii] : 0.0;
+  }
+  results.push_back(spectrum);
+
+  if (reference) {
+    reference = false;
+    reference_mean = mean;
+  } else if (!reference_modes.empty()) {
+    PowerSpectrum cross;
+    cross.name = fmt::format("{} x {}", reference_name, name);
+    cross.mean = reference_mean;
+    cross.power.resize(n_bins);
+    for (int ii = 0; ii < n_bins; ++ii) {
+      cross.power[ii] = n_modes[ii] > 0 ? volume * total.cross[ii] / n_modes[ii] : 0.0;
+    }
+    results.push_back(cross);
+  }
+}
+
+const std::vector<PowerSpectrum>& SpectrumAccumulator::spectra() const
+{
+  return results;
+}
+
+const std::vector<double>& SpectrumAccumulator::shell_k() const
+{
+  return k;
+}
+
+const std::vector<int64_t>& SpectrumAccumulator::shell_modes() const
+{
+  return n_modes;
+}
+
+void SpectrumAccumulator::write(const std::string fname) const
+{
+  std::ofstream ofs(fname);
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to open {} to write the power spectra", fname));
+  }
+
+  ofs << fmt::format("# Power spectra of [{}, {}, {}] grids in a [{}, {}, {}] box, in shells of width {:.6e}\n",
+                     n_cell[0],
+                     n_cell[1],
+                     n_cell[2],
+                     box_size[0],
+                     box_size[1],
+                     box_size[2],
+                     delta_k);
+  ofs << "# P(k) = V <Re(f_k* g_k)>, where f_k is the DFT of a field divided by the number of cells\n";
+  ofs << "# For the contrast, divide an auto-spectrum by mean^2 and a cross-spectrum by the mean of its first field\n";
+  for (const auto& spectrum : results) {
+    ofs << fmt::format("# mean {}: {:.9e}\n", spectrum.name, spectrum.mean);
+  }
+
+  ofs << "# k n_modes";
+  for (const auto& spectrum : results) {
+    ofs << fmt::format(" \"{}\"", spectrum.name);
+  }
+  ofs << "\n";
+
+  for (size_t ii = 0; ii < n_modes.size(); ++ii) {
+    if (n_modes[ii] == 0) {
+      continue;
+    }
+    ofs << fmt::format("{:.9e} {}", k[ii], n_modes[ii]);
+    for (const auto& spectrum : results) {
+      ofs << fmt::format(" {:.9e}", spectrum.power[ii]);
+    }
+    ofs << "\n";
+  }
+}
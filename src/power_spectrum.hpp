@@ -0,0 +1,158 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POWER_SPECTRUM_H
+#define POWER_SPECTRUM_H
+
+#include <array>
+#include <complex>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/** A power spectrum (or cross-spectrum), binned in the shells of a `SpectrumAccumulator`.
+ */
+struct PowerSpectrum
+{
+  std::string name;          //< The name of the field (e.g. "Density") or fields (e.g. "Density x Vx")
+  double mean = 0;           //< The mean of the field (of the first field for a cross-spectrum)
+  std::vector<double> power; //< The power in each shell, V <Re(f_k* g_k)> (f = g for an auto-spectrum)
+};
+
+/** Bin the Fourier modes of a grid in spherical shells of |k| to measure power spectra.
+ *
+ * The modes are added by `Grid::filter` during the same sweep that applies the window, before the window is applied,
+ * so the spectra are those of the full resolution input.  `f_k` is the discrete Fourier transform of the field
+ * divided by the number of cells, and the power is `V <|f_k|^2>` in each shell, with `V` the box volume.  The spectrum
+ * of the density contrast is therefore `power / mean^2`.
+ *
+ * The modes of one field can be kept as a reference, in which case the cross-spectrum of every later field with it is
+ * also measured (e.g. density-velocity for VELOCIraptor).  This needs one extra single precision complex grid.
+ */
+class SpectrumAccumulator
+{
+public:
+  /** The sums over the modes in each shell, accumulated separately by each thread.
+   */
+  struct Shells
+  {
+    std::vector<double> k;        //< Sum of |k|
+    std::vector<double> power;    //< Sum of |f_k|^2
+    std::vector<double> cross;    //< Sum of Re(r_k* f_k), where r is the reference field
+    std::vector<int64_t> n_modes; //< The number of modes
+  };
+
+  /** Constructor.
+   *
+   * The shells are `2 pi / L` wide, where `L` is the largest side of the box, and centred on multiples of their width.
+   *
+   * @param n_cell_ The number of cells in each dimension
+   * @param box_size_ The size of the simulation volume in input units
+   */
+  SpectrumAccumulator(const std::array<int, 3> n_cell_, const std::array<double, 3> box_size_);
+
+  /** Start measuring the spectrum of a new field.
+   *
+   * @param name_ The name of the field
+   * @param reference_ Keep the modes of this field to cross-correlate with the following fields
+   */
+  void start(const std::string name_, const bool reference_ = false);
+
+  /** Return a set of empty shells for a thread to accumulate into.
+   */
+  Shells shells() const;
+
+  /** Add a mode to a thread's shells.
+   *
+   * Only one thread may add any given `index`.
+   *
+   * @param sums The thread's shells
+   * @param index The (complex Hermitian) index of the mode in the grid
+   * @param k_mag |k| for the mode
+   * @param weight The number of modes this represents (2 for modes whose conjugate isn't stored, otherwise 1)
+   * @param value The normalised Fourier coefficient
+   */
+  void add(Shells& sums, const size_t index, const double k_mag, const int weight, const std::complex<double> value)
+  {
+    if (index == 0) {
+      mean = value.real();
+      return;
+    }
+    if (reference) {
+      reference_modes[index] = std::complex<float>(value);
+    }
+
+    const int bin = static_cast<int>(k_mag / delta_k + 0.5) - 1;
+    if (bin < 0 || bin >= n_bins) {
+      return;
+    }
+    sums.k[bin] += weight * k_mag;
+    sums.power[bin] += weight * std::norm(value);
+    sums.n_modes[bin] += weight;
+    if (!reference && !reference_modes.empty()) {
+      sums.cross[bin] += weight * (std::conj(std::complex<double>(reference_modes[index])) * value).real();
+    }
+  }
+
+  /** Merge a thread's shells into the total (this is not thread safe).
+   */
+  void merge(const Shells& sums);
+
+  /** Finish the current field, storing its spectrum (and cross-spectrum with the reference, if there is one).
+   */
+  void finish(void);
+
+  /** Return the spectra measured so far.
+   */
+  const std::vector<PowerSpectrum>& spectra() const;
+
+  /** Return the mean |k| of the modes in each shell (once a field has been finished).
+   */
+  const std::vector<double>& shell_k() const;
+
+  /** Return the number of modes in each shell (once a field has been finished).
+   */
+  const std::vector<int64_t>& shell_modes() const;
+
+  /** Write the spectra measured so far as a whitespace separated text table.
+   *
+   * The columns are the mean |k| of each shell, the number of modes it contains and then one column per spectrum.
+   * Empty shells are skipped.
+   *
+   * @param fname The name of the file
+   */
+  void write(const std::string fname) const;
+
+private:
+  std::array<int, 3> n_cell;                        //< The number of cells in each dimension
+  std::array<double, 3> box_size;                   //< The size of the simulation volume in input units
+  double delta_k;                                   //< The width of each shell
+  int n_bins;                                       //< The number of shells
+  std::string name;                                 //< The name of the current field
+  double mean = 0;                                  //< The mean of the current field
+  bool reference = false;                           //< Is the current field being kept as the reference?
+  std::string reference_name;                       //< The name of the reference field
+  double reference_mean = 0;                        //< The mean of the reference field
+  std::vector<std::complex<float>> reference_modes; //< The modes of the reference field (empty if there is none)
+  Shells total;                                     //< The sums for the current field
+  std::vector<double> k;                            //< The mean |k| of each shell
+  std::vector<int64_t> n_modes;                     //< The number of modes in each shell
+  std::vector<PowerSpectrum> results;               //< The spectra measured so far
+};
+
+#endif
@@ -0,0 +1,479 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fmt/core.h>
+#include <fstream>
+#include <linux/perf_event.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "profile.hpp"
+#include "utils.hpp"
+
+static std::array<PhaseStats, n_phases> stats;
+static bool peak_resettable = true;
+static std::array<int, n_hw_counters> counter_fds;
+static std::vector<CounterStats> counters;
+static int counter_depth = 0;
+
+// Guards the totals above, since the Python bindings may enter phases from several threads at once
+static std::mutex totals_mutex;
+
+const char* phase_name(const phase p)
+{
+  switch (p) {
+    case phase::setup:
+      return "setup";
+    case phase::read:
+      return "read";
+    case phase::stream:
+      return "stream";
+    case phase::filter:
+      return "filter";
+    case phase::sample:
+      return "sample";
+    case phase::write:
+      return "write";
+    default:
+      return "unknown";
+  }
+}
+
+/** Read a field from a /proc file of the form "key: value".
+ */
+static size_t read_proc_field(const char* fname, const std::string field)
+{
+  std::ifstream ifs(fname);
+  std::string key;
+  while (ifs >> key) {
+    if (key == field) {
+      size_t value = 0;
+      ifs >> value;
+      return value;
+    }
+    ifs.ignore(4096, '\n');
+  }
+  return 0;
+}
+
+/** Read a field (in kB) from /proc/self/status, returning it in bytes.
+ */
+static size_t read_status_field(const std::string field)
+{
+  return read_proc_field("/proc/self/status", field) * 1024;
+}
+
+size_t current_rss()
+{
+  return read_status_field("VmRSS:");
+}
+
+size_t peak_rss()
+{
+  return read_status_field("VmHWM:");
+}
+
+bool reset_peak_rss()
+{
+  std::lock_guard<std::mutex> lock(totals_mutex);
+  if (peak_resettable) {
+    // Writing 5 to clear_refs resets the VmHWM high water mark (Linux >= 4.0)
+    std::ofstream ofs("/proc/self/clear_refs");
+    ofs << "5";
+    ofs.flush();
+    peak_resettable = ofs.good();
+  }
+  return peak_resettable;
+}
+
+std::array<size_t, 2> io_bytes()
+{
+  // rchar and wchar count every read and write call, whether or not it reached the disk
+  return { read_proc_field("/proc/self/io", "rchar:"), read_proc_field("/proc/self/io", "wchar:") };
+}
+
+const std::array<PhaseStats, n_phases>& phase_stats()
+{
+  return stats;
+}
+
+void reset_phase_stats()
+{
+  std::lock_guard<std::mutex> lock(totals_mutex);
+  stats = std::array<PhaseStats, n_phases>();
+  counters.clear();
+}
+
+void print_phase_summary()
+{
+  fmt::print("\n{:<8} {:>6} {:>10} {:>14}\n", "phase", "count", "time", "peak RSS");
+  for (int ii = 0; ii < n_phases; ++ii) {
+    const auto& entry = stats[ii];
+    if (entry.count > 0) {
+      fmt::print("{:<8} {:>6} {:>8.3f} s {:>10.1f} MiB\n",
+                 phase_name(static_cast<phase>(ii)),
+                 entry.count,
+                 entry.seconds,
+                 entry.peak_rss / (1024.0 * 1024.0));
+    }
+  }
+  if (!peak_resettable) {
+    fmt::print("(the peak RSS could not be reset between phases, so it is the peak since the start of the run)\n");
+  }
+}
+
+ScopedPhase::ScopedPhase(const phase p_)
+  : p{ p_ }
+  , span{ phase_name(p_) }
+  , counters{ phase_name(p_) }
+{
+  reset_peak_rss();
+  io = io_bytes();
+  start = std::chrono::steady_clock::now();
+}
+
+ScopedPhase::~ScopedPhase()
+{
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  const auto end_io = io_bytes();
+  const auto peak = peak_rss();
+  std::lock_guard<std::mutex> lock(totals_mutex);
+  auto& entry = stats[static_cast<int>(p)];
+  entry.count += 1;
+  entry.seconds += elapsed.count();
+  entry.peak_rss = std::max(entry.peak_rss, peak);
+  entry.read += end_io[0] - io[0];
+  entry.written += end_io[1] - io[1];
+}
+
+bool counters_enabled = false;
+
+const char* hw_counter_name(const hw_counter counter)
+{
+  switch (counter) {
+    case hw_counter::cycles:
+      return "cycles";
+    case hw_counter::instructions:
+      return "instructions";
+    case hw_counter::llc_misses:
+      return "LLC misses";
+    case hw_counter::dtlb_misses:
+      return "dTLB misses";
+    case hw_counter::page_faults:
+      return "page faults";
+    default:
+      return "unknown";
+  }
+}
+
+/** Return the perf_event_open attributes of a counter.
+ */
+static perf_event_attr counter_attr(const hw_counter counter)
+{
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+
+  switch (counter) {
+    case hw_counter::cycles:
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case hw_counter::instructions:
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case hw_counter::llc_misses:
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case hw_counter::dtlb_misses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config =
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    default:
+      attr.type = PERF_TYPE_SOFTWARE;
+      attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+      break;
+  }
+
+  // Counters can't be grouped when they are inherited, so each one is scaled separately if it was multiplexed
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return attr;
+}
+
+bool enable_counters()
+{
+  if (counters_enabled) {
+    return true;
+  }
+
+  for (int ii = 0; ii < n_hw_counters; ++ii) {
+    auto attr = counter_attr(static_cast<hw_counter>(ii));
+    counter_fds[ii] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    counters_enabled = counters_enabled || counter_fds[ii] >= 0;
+  }
+  return counters_enabled;
+}
+
+bool counter_available(const hw_counter counter)
+{
+  return counters_enabled && counter_fds[static_cast<int>(counter)] >= 0;
+}
+
+std::array<uint64_t, n_hw_counters> read_counters()
+{
+  std::array<uint64_t, n_hw_counters> values{};
+  for (int ii = 0; ii < n_hw_counters; ++ii) {
+    uint64_t buffer[3]; // value, time enabled, time running
+    if (counters_enabled && counter_fds[ii] >= 0 && read(counter_fds[ii], buffer, sizeof(buffer)) == sizeof(buffer)) {
+      const double scale = buffer[2] > 0 ? (double)buffer[1] / (double)buffer[2] : 0.0;
+      values[ii] = static_cast<uint64_t>((double)buffer[0] * scale);
+    }
+  }
+  return values;
+}
+
+const std::vector<CounterStats>& counter_stats()
+{
+  return counters;
+}
+
+/** Format a count with an SI suffix, or a dash if the counter isn't available.
+ */
+static std::string format_count(const double count, const bool available)
+{
+  if (!available) {
+    return "-";
+  }
+  const char* suffixes[] = { "", "k", "M", "G", "T" };
+  int ii = 0;
+  double value = count;
+  while (value >= 1000.0 && ii < 4) {
+    value /= 1000.0;
+    ++ii;
+  }
+  return ii == 0 ? fmt::format("{:.0f}", value) : fmt::format("{:.2f}{}", value, suffixes[ii]);
+}
+
+void print_counter_summary()
+{
+  if (!counters_enabled) {
+    fmt::print("\nNo hardware counters could be opened (see /proc/sys/kernel/perf_event_paranoid)\n");
+    return;
+  }
+
+  const auto cycles = counter_available(hw_counter::cycles);
+  const auto instructions = counter_available(hw_counter::instructions);
+  const auto llc_misses = counter_available(hw_counter::llc_misses);
+
+  fmt::print("\n{:<24} {:>6} {:>10} {:>9} {:>9} {:>5} {:>9} {:>9} {:>9} {:>10}\n",
+             "phase / stage",
+             "count",
+             "time",
+             "cycles",
+             "instr",
+             "IPC",
+             "LLC miss",
+             "dTLB miss",
+             "faults",
+             "LLC GB/s");
+  for (const auto& entry : counters) {
+    const auto& v = entry.values;
+    const double cycle_count = (double)v[static_cast<int>(hw_counter::cycles)];
+    const double instruction_count = (double)v[static_cast<int>(hw_counter::instructions)];
+    const double llc_miss_count = (double)v[static_cast<int>(hw_counter::llc_misses)];
+    const auto ipc = cycles && instructions && cycle_count > 0 ? fmt::format("{:.2f}", instruction_count / cycle_count)
+                                                                : std::string("-");
+    // Every miss in the last level cache is a cache line (64 bytes) read from memory
+    const auto bandwidth = llc_misses && entry.seconds > 0
+                             ? fmt::format("{:.2f}", llc_miss_count * 64.0 / entry.seconds / 1e9)
+                             : std::string("-");
+
+    fmt::print("{:<24} {:>6} {:>8.3f} s {:>9} {:>9} {:>5} {:>9} {:>9} {:>9} {:>10}\n",
+               std::string(2 * entry.depth, ' ') + entry.name,
+               entry.count,
+               entry.seconds,
+               format_count(cycle_count, cycles),
+               format_count(instruction_count, instructions),
+               ipc,
+               format_count(llc_miss_count, llc_misses),
+               format_count((double)v[static_cast<int>(hw_counter::dtlb_misses)],
+                            counter_available(hw_counter::dtlb_misses)),
+               format_count((double)v[static_cast<int>(hw_counter::page_faults)],
+                            counter_available(hw_counter::page_faults)),
+               bandwidth);
+  }
+  fmt::print("(user space counts summed over all threads; LLC GB/s assumes 64 byte cache lines)\n");
+}
+
+ScopedCounters::ScopedCounters(const char* name_)
+  : active{ counters_enabled }
+{
+  if (!active) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(totals_mutex);
+  // Entries are created on entry, so that phases are listed before the stages they contain
+  auto entry = std::find_if(
+    counters.begin(), counters.end(), [name_](const CounterStats& stats) { return stats.name == name_; });
+  if (entry == counters.end()) {
+    counters.emplace_back();
+    entry = counters.end() - 1;
+    entry->name = name_;
+    entry->depth = counter_depth;
+  }
+  index = static_cast<size_t>(entry - counters.begin());
+
+  ++counter_depth;
+  lock.unlock();
+
+  start = std::chrono::steady_clock::now();
+  values = read_counters();
+}
+
+ScopedCounters::~ScopedCounters()
+{
+  if (!active) {
+    return;
+  }
+
+  const auto end_values = read_counters();
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::lock_guard<std::mutex> lock(totals_mutex);
+  --counter_depth;
+
+  auto& entry = counters[index];
+  entry.count += 1;
+  entry.seconds += elapsed.count();
+  for (int ii = 0; ii < n_hw_counters; ++ii) {
+    // Scaled values of multiplexed counters aren't quite monotonic
+    entry.values[ii] += end_values[ii] > values[ii] ? end_values[ii] - values[ii] : 0;
+  }
+}
+
+bool trace_enabled = false;
+
+/** A completed span.
+ */
+struct TraceEvent
+{
+  const char* name;   //< The name of the span
+  std::string detail; //< Optional detail
+  double start;       //< Start time relative to `trace_start` (microseconds)
+  double duration;    //< Duration (microseconds)
+};
+
+/** The spans recorded by one thread.  Buffers are never freed, so they outlive the threads that fill them.
+ */
+struct TraceBuffer
+{
+  int tid;                        //< The thread's number in the trace
+  std::string thread_name;        //< The thread's name in the trace
+  std::vector<TraceEvent> events; //< The recorded spans
+  TraceBuffer* next;              //< The previously registered buffer
+};
+
+static std::chrono::steady_clock::time_point trace_start;
+static std::atomic<TraceBuffer*> trace_buffers{ nullptr };
+static std::atomic<int> n_trace_buffers{ 0 };
+
+/** Return the buffer of the calling thread, registering it with a lock-free push the first time.
+ */
+static TraceBuffer* thread_trace_buffer()
+{
+  static thread_local TraceBuffer* buffer = nullptr;
+  if (buffer == nullptr) {
+    buffer = new TraceBuffer();
+    buffer->tid = n_trace_buffers++;
+    buffer->thread_name = buffer->tid == 0 ? "main" : fmt::format("thread {}", buffer->tid);
+    buffer->events.reserve(1024);
+    buffer->next = trace_buffers.load();
+    while (!trace_buffers.compare_exchange_weak(buffer->next, buffer)) {
+    }
+  }
+  return buffer;
+}
+
+void enable_tracing()
+{
+  trace_start = std::chrono::steady_clock::now();
+  trace_enabled = true;
+  thread_trace_buffer();
+}
+
+void set_trace_thread_name(const std::string name)
+{
+  if (trace_enabled) {
+    thread_trace_buffer()->thread_name = name;
+  }
+}
+
+void TraceSpan::finish()
+{
+  const auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::micro> since = start - trace_start;
+  std::chrono::duration<double, std::micro> duration = end - start;
+  thread_trace_buffer()->events.push_back({ name, detail, since.count(), duration.count() });
+}
+
+void write_trace(const std::string fname)
+{
+  std::ofstream ofs(fname);
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to open {} to write the trace", fname));
+  }
+
+  const int pid = static_cast<int>(getpid());
+  ofs << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  const char* separator = "\n";
+  for (auto buffer = trace_buffers.load(); buffer != nullptr; buffer = buffer->next) {
+    ofs << fmt::format("{}{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": {}, \"tid\": {}, "
+                       "\"args\": {{\"name\": \"{}\"}}}}",
+                       separator,
+                       pid,
+                       buffer->tid,
+                       json_escape(buffer->thread_name));
+    separator = ",\n";
+    for (const auto& event : buffer->events) {
+      ofs << fmt::format("{}{{\"name\": \"{}\", \"cat\": \"regrider\", \"ph\": \"X\", \"pid\": {}, \"tid\": {}, "
+                         "\"ts\": {:.3f}, \"dur\": {:.3f}",
+                         separator,
+                         json_escape(event.name),
+                         pid,
+                         buffer->tid,
+                         event.start,
+                         event.duration);
+      if (!event.detail.empty()) {
+        ofs << fmt::format(", \"args\": {{\"detail\": \"{}\"}}", json_escape(event.detail));
+      }
+      ofs << "}";
+    }
+  }
+  ofs << "\n]}\n";
+}
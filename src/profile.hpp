@@ -0,0 +1,285 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/** The phases of a regridding run which are timed and measured.
+ */
+enum class phase
+{
+  setup,  //< Allocating buffers and planning FFTs
+  read,   //< Reading a full resolution grid
+  stream, //< Reading and downsampling a grid slab by slab
+  filter, //< Filtering the full resolution grid
+  sample, //< Subsampling the filtered grid
+  write   //< Encoding and writing the output
+};
+
+/** The number of entries in `phase`.
+ */
+const int n_phases = static_cast<int>(phase::write) + 1;
+
+/** Return the name of a phase.
+ */
+const char* phase_name(const phase p);
+
+/** Accumulated measurements of a phase.
+ */
+struct PhaseStats
+{
+  int count = 0;       //< The number of times the phase was entered
+  double seconds = 0;  //< The total wall clock time spent in the phase
+  size_t peak_rss = 0; //< The largest resident set size seen during the phase (bytes)
+  size_t read = 0;     //< Bytes read during the phase (including reads served from the page cache)
+  size_t written = 0;  //< Bytes written during the phase
+};
+
+/** Return the current resident set size of the process (bytes).
+ */
+size_t current_rss();
+
+/** Return the peak resident set size of the process since it started, or since the last `reset_peak_rss` (bytes).
+ */
+size_t peak_rss();
+
+/** Reset the peak resident set size to the current value, so that the peak of the next phase can be measured.
+ *
+ * @return False if the kernel doesn't allow this, in which case `peak_rss` is the peak since the process started
+ */
+bool reset_peak_rss();
+
+/** Return the number of bytes read and written by the process so far, from /proc/self/io (0 if unavailable).
+ */
+std::array<size_t, 2> io_bytes();
+
+/** Return the measurements accumulated for every phase so far.
+ */
+const std::array<PhaseStats, n_phases>& phase_stats();
+
+/** Forget the measurements accumulated so far.
+ */
+void reset_phase_stats();
+
+/** Print a table of the time and peak resident set size of every phase that was entered.
+ */
+void print_phase_summary();
+
+/** The hardware (and software) counters which can be read for each phase with `perf_event_open`.
+ */
+enum class hw_counter
+{
+  cycles,       //< CPU cycles
+  instructions, //< Retired instructions
+  llc_misses,   //< Last level cache misses
+  dtlb_misses,  //< Data TLB load misses
+  page_faults   //< Page faults (a software event, so also available in most VMs)
+};
+
+/** The number of entries in `hw_counter`.
+ */
+const int n_hw_counters = static_cast<int>(hw_counter::page_faults) + 1;
+
+/** Return the name of a counter.
+ */
+const char* hw_counter_name(const hw_counter counter);
+
+/** Accumulated counter values of a phase, or of a stage within a phase.
+ */
+struct CounterStats
+{
+  std::string name;                             //< The name of the phase or stage
+  int depth = 0;                                //< How many other measured scopes enclose this one
+  int count = 0;                                //< The number of times it was entered
+  double seconds = 0;                           //< The total wall clock time
+  std::array<uint64_t, n_hw_counters> values{}; //< The total of each counter (scaled if the counters were multiplexed)
+};
+
+/** Are the counters enabled?  Only changed by `enable_counters`.
+ */
+extern bool counters_enabled;
+
+/** Open the counters for the calling process.
+ *
+ * The counters are inherited by threads created afterwards, so this must be called before the OpenMP thread pool
+ * and the FFTW planner thread are started.  Counters which the CPU or kernel don't support (or which
+ * `/proc/sys/kernel/perf_event_paranoid` forbids) are skipped.
+ *
+ * @return False if none of the counters could be opened
+ */
+bool enable_counters();
+
+/** Is a counter being measured?
+ */
+bool counter_available(const hw_counter counter);
+
+/** Return the current total of every counter, summed over all threads (unavailable counters are 0).
+ */
+std::array<uint64_t, n_hw_counters> read_counters();
+
+/** Return the counter totals of every phase and stage measured so far, in the order they were first entered.
+ */
+const std::vector<CounterStats>& counter_stats();
+
+/** Print a table of the counters of every phase and stage, with the derived instructions per cycle and the memory
+ * bandwidth implied by the last level cache misses.
+ */
+void print_counter_summary();
+
+/** Add the counts during the lifetime of the object to the totals of a phase or stage, when the counters are enabled.
+ *
+ * Scopes may be entered from several threads at once (the totals are updated under a lock), but the counts include
+ * every thread, so those of overlapping scopes include each other.
+ */
+class ScopedCounters
+{
+public:
+  /** Start counting.
+   *
+   * @param name_ The name of the phase or stage
+   */
+  explicit ScopedCounters(const char* name_);
+
+  /** Stop counting, adding the differences to the totals of the phase or stage.
+   */
+  ~ScopedCounters();
+
+  ScopedCounters(const ScopedCounters&) = delete;
+  ScopedCounters& operator=(const ScopedCounters&) = delete;
+
+private:
+  bool active;                                 //< Were the counters enabled when the scope started?
+  size_t index;                                //< The index of the totals in `counter_stats()`
+  std::chrono::steady_clock::time_point start; //< When the scope started
+  std::array<uint64_t, n_hw_counters> values;  //< The counters when the scope started
+};
+
+/** Is tracing enabled?  Only changed by `enable_tracing`, before any spans are recorded.
+ */
+extern bool trace_enabled;
+
+/** Start recording `TraceSpan`s, with timestamps relative to now.
+ */
+void enable_tracing();
+
+/** Name the calling thread in the trace (threads are otherwise named by the order they first record a span).
+ */
+void set_trace_thread_name(const std::string name);
+
+/** Write every span recorded so far as a Chrome trace (viewable with chrome://tracing or https://ui.perfetto.dev).
+ *
+ * This must not be called while other threads are recording spans.
+ *
+ * @param fname The name of the JSON file
+ */
+void write_trace(const std::string fname);
+
+/** Record a span of the trace timeline for the lifetime of the object.
+ *
+ * Each thread appends its spans to its own buffer, so recording needs no locks.  When tracing is disabled the only
+ * cost is a test of `trace_enabled` on construction.
+ */
+class TraceSpan
+{
+public:
+  /** Start a span.
+   *
+   * @param name_ The name of the span (must be a string literal, or otherwise outlive the trace)
+   */
+  explicit TraceSpan(const char* name_)
+    : name{ name_ }
+    , active{ trace_enabled }
+  {
+    if (active) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+
+  /** Start a span with a detail shown in its arguments, e.g. the name of the grid being processed.
+   *
+   * @param name_ The name of the span (must be a string literal, or otherwise outlive the trace)
+   * @param detail_ The detail
+   */
+  TraceSpan(const char* name_, const std::string& detail_)
+    : TraceSpan(name_)
+  {
+    if (active) {
+      detail = detail_;
+    }
+  }
+
+  /** End the span, recording it in the buffer of the calling thread.
+   */
+  ~TraceSpan()
+  {
+    if (active) {
+      finish();
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+  const char* name;                            //< The name of the span
+  std::string detail;                          //< Optional detail
+  bool active;                                 //< Was tracing enabled when the span started?
+  std::chrono::steady_clock::time_point start; //< When the span started
+
+  void finish();
+};
+
+/** Measure a phase for the lifetime of the object, also recording it as a `TraceSpan` and counting it with
+ * `ScopedCounters`.
+ *
+ * Phases may be entered from several threads at once, as when the Python bindings release the GIL. The totals are
+ * updated under a lock, but the peak RSS and I/O are those of the whole process, so overlapping phases include each
+ * other's.
+ */
+class ScopedPhase
+{
+public:
+  /** Start measuring a phase.
+   *
+   * @param p_ The phase
+   */
+  explicit ScopedPhase(const phase p_);
+
+  /** Stop measuring the phase, adding the elapsed time, peak resident set size and I/O to its totals.
+   */
+  ~ScopedPhase();
+
+  ScopedPhase(const ScopedPhase&) = delete;
+  ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+private:
+  phase p;                                     //< The phase being measured
+  std::chrono::steady_clock::time_point start; //< When the phase was entered
+  std::array<size_t, 2> io;                    //< The bytes read and written when the phase was entered
+  TraceSpan span;                              //< The phase in the trace
+  ScopedCounters counters;                     //< The hardware counters of the phase
+};
+
+#endif
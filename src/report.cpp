@@ -0,0 +1,150 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <fmt/core.h>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kernels.hpp"
+#include "profile.hpp"
+#include "report.hpp"
+#include "utils.hpp"
+
+static RunRecord record;
+static std::mutex fft_mutex; //< Guards the FFT totals, which concurrent transforms may update
+
+RunRecord& run_record()
+{
+  return record;
+}
+
+void record_fft(const size_t n_logical, const double seconds)
+{
+  // The usual nominal count for a real transform: half of the 5 N log2(N) of a complex one
+  const double n = static_cast<double>(n_logical);
+  std::lock_guard<std::mutex> lock(fft_mutex);
+  record.n_ffts += 1;
+  record.fft_seconds += seconds;
+  record.fft_flops += 2.5 * n * std::log2(n);
+}
+
+/** Return the size of a file in bytes (0 if it doesn't exist).
+ */
+static size_t file_size(const std::string fname)
+{
+  struct stat st;
+  return stat(fname.c_str(), &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+}
+
+/** Return a rate, or 0 if no time was taken.
+ */
+static double rate(const double amount, const double seconds)
+{
+  return seconds > 0 ? amount / seconds : 0.0;
+}
+
+void write_report(const std::string fname, const RunDescription& run)
+{
+  std::ofstream ofs(fname);
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to open {} to write the report", fname));
+  }
+
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  char timestamp[32] = "";
+  const auto now = std::time(nullptr);
+  std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+  const auto& stats = phase_stats();
+  const auto& read_phase = stats[static_cast<int>(phase::read)];
+  const auto& stream_phase = stats[static_cast<int>(phase::stream)];
+  const auto& write_phase = stats[static_cast<int>(phase::write)];
+  const double read_bytes = (double)(read_phase.read + stream_phase.read);
+  const double read_seconds = read_phase.seconds + stream_phase.seconds;
+  size_t peak = 0;
+  for (const auto& entry : stats) {
+    peak = std::max(peak, entry.peak_rss);
+  }
+
+  ofs << "{\n";
+  ofs << fmt::format("  \"timestamp\": \"{}\",\n", timestamp);
+  ofs << fmt::format("  \"host\": \"{}\",\n", json_escape(host));
+  ofs << fmt::format("  \"input\": {{\"file\": \"{}\", \"format\": \"{}\", \"bytes\": {}}},\n",
+                     json_escape(run.input),
+                     run.format,
+                     file_size(run.input));
+  ofs << fmt::format(
+    "  \"output\": {{\"file\": \"{}\", \"bytes\": {}}},\n", json_escape(run.output), file_size(run.output));
+  ofs << fmt::format("  \"dim\": {},\n", run.new_dim);
+  ofs << fmt::format("  \"precision\": \"{}\",\n", run.precision);
+  ofs << fmt::format("  \"method\": \"{}\",\n", record.method);
+  ofs << fmt::format("  \"filter\": \"{}\",\n", filter_name(run.options.filter));
+  ofs << fmt::format("  \"encoding\": \"{}\",\n", encoding_name(run.options.encoding));
+  if (record.engine.empty()) {
+    ofs << "  \"fft_engine\": null,\n";
+  } else {
+    ofs << fmt::format("  \"fft_engine\": \"{}\",\n", record.engine);
+  }
+  ofs << fmt::format("  \"kernel_isa\": \"{}\",\n", kernel_isa());
+  ofs << fmt::format("  \"n_grids\": {},\n", record.n_grids);
+  ofs << fmt::format("  \"n_threads\": {},\n", record.n_threads);
+  ofs << fmt::format("  \"wall_seconds\": {:.6f},\n", run.wall_seconds);
+  ofs << fmt::format("  \"peak_rss\": {},\n", peak);
+
+  ofs << "  \"phases\": {";
+  const char* separator = "\n";
+  for (int ii = 0; ii < n_phases; ++ii) {
+    const auto& entry = stats[ii];
+    if (entry.count > 0) {
+      ofs << fmt::format("{}    \"{}\": {{\"count\": {}, \"seconds\": {:.6f}, \"peak_rss\": {}, \"read_bytes\": {}, "
+                         "\"write_bytes\": {}}}",
+                         separator,
+                         phase_name(static_cast<phase>(ii)),
+                         entry.count,
+                         entry.seconds,
+                         entry.peak_rss,
+                         entry.read,
+                         entry.written);
+      separator = ",\n";
+    }
+  }
+  ofs << "\n  },\n";
+
+  ofs << fmt::format("  \"io\": {{\"read_bytes\": {:.0f}, \"read_seconds\": {:.6f}, \"read_bandwidth\": {:.6g}, "
+                     "\"write_bytes\": {}, \"write_seconds\": {:.6f}, \"write_bandwidth\": {:.6g}}},\n",
+                     read_bytes,
+                     read_seconds,
+                     rate(read_bytes, read_seconds),
+                     write_phase.written,
+                     write_phase.seconds,
+                     rate((double)write_phase.written, write_phase.seconds));
+  ofs << fmt::format("  \"fft\": {{\"count\": {}, \"seconds\": {:.6f}, \"gflops\": {:.6g}}},\n",
+                     record.n_ffts,
+                     record.fft_seconds,
+                     rate(record.fft_flops, record.fft_seconds) * 1e-9);
+  ofs << fmt::format(
+    "  \"wisdom\": {{\"hits\": {}, \"misses\": {}}}\n", record.wisdom_hits, record.wisdom_misses);
+  ofs << "}\n";
+}
@@ -0,0 +1,73 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <cstddef>
+#include <string>
+
+#include "options.hpp"
+
+/** Counts of what happened during a run which aren't measured by `ScopedPhase`.
+ */
+struct RunRecord
+{
+  std::string method;     //< The method chosen by the planner
+  std::string engine;     //< The FFT engine chosen by the planner (fft method only)
+  int n_grids = 0;        //< The number of grids in the input
+  int n_threads = 0;      //< The number of OpenMP threads
+  int wisdom_hits = 0;    //< FFT plans made from stored wisdom
+  int wisdom_misses = 0;  //< FFT plans which needed new wisdom to be generated
+  int n_ffts = 0;         //< The number of 3D FFTs executed
+  double fft_seconds = 0; //< The time spent executing them
+  double fft_flops = 0;   //< Their nominal number of floating point operations
+};
+
+/** Return the record of the current run.
+ */
+RunRecord& run_record();
+
+/** Add an executed 3D real FFT to the run record. This may be called from several threads at once.
+ *
+ * @param n_logical The number of real values transformed
+ * @param seconds The time taken
+ */
+void record_fft(const size_t n_logical, const double seconds);
+
+/** What was asked of a run, for the report.
+ */
+struct RunDescription
+{
+  std::string input;       //< The input file
+  std::string format;      //< The input format (gbptrees, velociraptor, npy or raw)
+  std::string output;      //< The output file
+  int new_dim = 0;         //< The output grid dimension
+  std::string precision;   //< The in-memory precision (float or double)
+  RegridOptions options;   //< The options used
+  double wall_seconds = 0; //< The wall clock time of the whole run
+};
+
+/** Write a JSON report of a run, combining its description, the run record and the phase measurements.
+ *
+ * @param fname The name of the JSON file
+ * @param run The description of the run
+ */
+void write_report(const std::string fname, const RunDescription& run);
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <mutex>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "serve.hpp"
+
+/** A job submitted to the server.
+ */
+struct Job
+{
+  int id;                        //< The number of the job, counting from 1
+  std::vector<std::string> args; //< The job's command line arguments
+  std::string state;             //< queued, running, done or failed
+  double seconds = 0;            //< The time taken to run the job
+  int client = -1;               //< The connection waiting for the result (-1 once it has been sent)
+};
+
+/** The jobs, shared by the thread accepting requests and the thread running them.
+ */
+struct JobQueue
+{
+  std::mutex mutex;                //< Protects everything else
+  std::condition_variable changed; //< Notified when a job is queued or the server is stopping
+  std::vector<Job> jobs;           //< Every job, in the order they were submitted
+  size_t next = 0;                 //< The index of the next job to run
+  bool stopping = false;           //< Has the server been asked to shut down?
+};
+
+/** Return the address of a Unix socket.
+ */
+static sockaddr_un socket_address(const std::string socket_path)
+{
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error(fmt::format("Socket path {} is too long", socket_path));
+  }
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+  return address;
+}
+
+/** Connect to a Unix socket.
+ *
+ * @return The connected socket, or -1 with `errno` set
+ */
+static int connect_to(const std::string socket_path)
+{
+  const auto address = socket_address(socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (const sockaddr*)&address, sizeof(address)) != 0) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    fd = -1;
+  }
+  return fd;
+}
+
+/** Send all of a buffer, returning false if the peer has gone away.
+ */
+static bool send_all(const int fd, const std::string& data)
+{
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+/** Read until the peer shuts down its side of the connection.
+ */
+static std::string receive_all(const int fd)
+{
+  std::string data;
+  char buffer[4096];
+  while (true) {
+    const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    data.append(buffer, n);
+  }
+  return data;
+}
+
+/** Split a string at each occurrence of a separator, dropping the empty string after a trailing separator.
+ */
+static std::vector<std::string> split(const std::string& data, const char separator)
+{
+  std::vector<std::string> parts;
+  size_t start = 0;
+  while (start < data.size()) {
+    auto end = data.find(separator, start);
+    if (end == std::string::npos) {
+      end = data.size();
+    }
+    parts.push_back(data.substr(start, end - start));
+    start = end + 1;
+  }
+  return parts;
+}
+
+/** Send the result of a finished job to the client that submitted it, and close the connection.
+ */
+static void reply_finished(Job& job, const std::string& error)
+{
+  if (error.empty()) {
+    send_all(job.client, fmt::format("done {} {:.3f}\n", job.id, job.seconds));
+  } else {
+    send_all(job.client, fmt::format("failed {} {}\n", job.id, error));
+  }
+  close(job.client);
+  job.client = -1;
+}
+
+/** Accept and answer requests until the server is asked to shut down.
+ */
+static void accept_requests(const int listener, JobQueue& queue)
+{
+  while (true) {
+    const int client = accept(listener, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fmt::print(stderr, "Failed to accept a connection: {}\n", strerror(errno));
+      break;
+    }
+
+    const auto request = split(receive_all(client), '\0');
+    const std::string command = request.empty() ? std::string() : request[0];
+
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (command == "submit") {
+      Job job;
+      job.id = static_cast<int>(queue.jobs.size()) + 1;
+      job.args.assign(request.begin() + 1, request.end());
+      job.state = "queued";
+      job.client = client;
+      send_all(client, fmt::format("queued {}\n", job.id));
+      queue.jobs.push_back(job);
+      queue.changed.notify_all();
+      continue;
+    }
+
+    if (command == "status") {
+      std::string reply;
+      for (const auto& job : queue.jobs) {
+        reply += fmt::format("{} {} {:.3f} {}\n", job.id, job.state, job.seconds, fmt::join(job.args, " "));
+      }
+      send_all(client, reply);
+    } else if (command == "shutdown") {
+      send_all(client, "stopping\n");
+    } else {
+      send_all(client, fmt::format("error unknown command '{}'\n", command));
+    }
+    close(client);
+
+    if (command == "shutdown") {
+      break;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  queue.stopping = true;
+  queue.changed.notify_all();
+}
+
+void serve(const std::string socket_path, JobRunner runner)
+{
+  const auto address = socket_address(socket_path);
+
+  // A socket left behind by a server which was killed refuses connections, and can be replaced
+  if (access(socket_path.c_str(), F_OK) == 0) {
+    const int fd = connect_to(socket_path);
+    if (fd >= 0) {
+      close(fd);
+      throw std::runtime_error(fmt::format("A server is already listening on {}", socket_path));
+    }
+    unlink(socket_path.c_str());
+  }
+
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+    const std::string error = strerror(errno);
+    if (listener >= 0) {
+      close(listener);
+    }
+    throw std::runtime_error(fmt::format("Failed to listen on {}: {}", socket_path, error));
+  }
+  fmt::print("Listening on {}\n", socket_path);
+
+  JobQueue queue;
+  std::thread acceptor(accept_requests, listener, std::ref(queue));
+
+  std::unique_lock<std::mutex> lock(queue.mutex);
+  while (true) {
+    // A timed wait, since condition_variable::wait needs a newer libstdc++ than some conda environments provide
+    while (!queue.stopping && queue.next == queue.jobs.size()) {
+      queue.changed.wait_for(lock, std::chrono::seconds(1));
+    }
+    if (queue.stopping) {
+      break;
+    }
+
+    const size_t index = queue.next++;
+    queue.jobs[index].state = "running";
+    const int id = queue.jobs[index].id;
+    const auto args = queue.jobs[index].args;
+    lock.unlock();
+
+    fmt::print("\nJob {}: {}\n", id, fmt::join(args, " "));
+    const auto start = std::chrono::steady_clock::now();
+    std::string error;
+    try {
+      runner(args);
+    } catch (const std::exception& e) {
+      error = e.what();
+    } catch (...) {
+      error = "unknown error";
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (!error.empty()) {
+      fmt::print(stderr, "Job {} failed: {}\n", id, error);
+    }
+
+    lock.lock();
+    auto& job = queue.jobs[index];
+    job.seconds = elapsed.count();
+    job.state = error.empty() ? "done" : "failed";
+    reply_finished(job, error);
+  }
+
+  for (; queue.next < queue.jobs.size(); ++queue.next) {
+    auto& job = queue.jobs[queue.next];
+    job.state = "failed";
+    reply_finished(job, "the server is shutting down");
+  }
+  lock.unlock();
+
+  acceptor.join();
+  close(listener);
+  unlink(socket_path.c_str());
+  fmt::print("Server stopped\n");
+}
+
+std::vector<std::string> send_request(const std::string socket_path, const std::vector<std::string>& request)
+{
+  const int fd = connect_to(socket_path);
+  if (fd < 0) {
+    throw std::runtime_error(fmt::format("Failed to connect to {}: {}", socket_path, strerror(errno)));
+  }
+
+  std::string data;
+  for (const auto& part : request) {
+    data += part;
+    data.push_back('\0');
+  }
+  if (!send_all(fd, data)) {
+    close(fd);
+    throw std::runtime_error(fmt::format("Failed to send the request to {}", socket_path));
+  }
+  shutdown(fd, SHUT_WR);
+
+  const auto reply = split(receive_all(fd), '\n');
+  close(fd);
+  return reply;
+}
+
+/** Return a path made absolute against the current directory, with symbolic links resolved if it exists.
+ */
+static std::string absolute_path(const std::string& path)
+{
+  char resolved[PATH_MAX];
+  if (realpath(path.c_str(), resolved) != nullptr) {
+    return resolved;
+  }
+
+  // Output files don't exist yet
+  if (path.empty() || path[0] == '/') {
+    return path;
+  }
+  if (getcwd(resolved, sizeof(resolved)) == nullptr) {
+    throw std::runtime_error(fmt::format("Failed to get the current directory: {}", strerror(errno)));
+  }
+  return std::string(resolved) + "/" + path;
+}
+
+std::vector<std::string> submitted_arguments(const std::vector<std::string>& args)
+{
+  static const char* path_options[] = { "-g", "--gbptrees", "-v", "--velociraptor", "-n",       "--npy",
+                                        "-r", "--raw",      "-o", "--output",       "--report", "--calibration" };
+
+  std::vector<std::string> job;
+  for (size_t ii = 1; ii < args.size(); ++ii) {
+    const auto& arg = args[ii];
+    if (arg == "--submit") {
+      ++ii;
+      continue;
+    } else if (arg.compare(0, 9, "--submit=") == 0) {
+      continue;
+    }
+
+    bool is_path = false;
+    for (const std::string option : path_options) {
+      // The value is either the next argument, or attached as -gfile or --gbptrees=file
+      const std::string prefix = option.size() == 2 ? option : option + "=";
+      if (arg == option && ii + 1 < args.size()) {
+        job.push_back(arg);
+        job.push_back(absolute_path(args[++ii]));
+        is_path = true;
+      } else if (arg.size() > prefix.size() && arg.compare(0, prefix.size(), prefix) == 0) {
+        job.push_back(prefix + absolute_path(arg.substr(prefix.size())));
+        is_path = true;
+      }
+      if (is_path) {
+        break;
+      }
+    }
+    if (!is_path) {
+      job.push_back(arg);
+    }
+  }
+  return job;
+}
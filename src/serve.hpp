@@ -0,0 +1,67 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/** Runs one job, given its command line arguments (without the program name).  Failures are thrown as exceptions,
+ * whose message is returned to the client.
+ */
+typedef std::function<void(const std::vector<std::string>& args)> JobRunner;
+
+/** Listen for requests on a Unix socket, running the submitted jobs one at a time until asked to shut down.
+ *
+ * Each request is a sequence of NUL terminated strings, ended by the client shutting down its side of the
+ * connection.  The first string is the command:
+ *
+ * - `submit`, followed by the job's arguments: the reply is `queued <id>`, then `done <id> <seconds>` or
+ *   `failed <id> <message>` once the job has finished.
+ * - `status`: one line for each job, giving its id, state (queued, running, done or failed), run time and arguments.
+ * - `shutdown`: the reply is `stopping`.  The running job is finished, but queued jobs fail.
+ *
+ * Jobs are run on the calling thread, while a second thread accepts requests, so the process (and anything it keeps
+ * between jobs, such as pooled grids) belongs to one job at a time.
+ *
+ * @param socket_path The path of the socket, which must not already exist (it is removed on shut down)
+ * @param runner The function which runs a job
+ */
+void serve(const std::string socket_path, JobRunner runner);
+
+/** Send a request to a server started with `serve` and wait for the complete reply.
+ *
+ * @param socket_path The path of the server's socket
+ * @param request The command, followed by its arguments
+ * @return The lines of the reply
+ */
+std::vector<std::string> send_request(const std::string socket_path, const std::vector<std::string>& request);
+
+/** Return the arguments of a job to submit to a server, i.e. the command line without the program name or --submit.
+ *
+ * The server may be running in another directory, so the values of the options naming files (`-g`, `-v`, `-n`, `-r`,
+ * `-o`, `--report` and `--calibration`) are made absolute against the current directory.
+ *
+ * @param args The command line
+ * @return The job's arguments
+ */
+std::vector<std::string> submitted_arguments(const std::vector<std::string>& args);
+
+#endif
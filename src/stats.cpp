@@ -0,0 +1,177 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fmt/core.h>
+#include <fstream>
+#include <stdexcept>
+
+#include "stats.hpp"
+
+const int StatsAccumulator::n_bins;
+constexpr double StatsAccumulator::lowest;
+constexpr double StatsAccumulator::bin_width;
+
+StatsAccumulator::StatsAccumulator(const double input_mean_, const double reference_)
+  : input_mean{ input_mean_ }
+  , reference{ reference_ }
+  , shift{ std::isfinite(input_mean_) ? input_mean_ : 0.0 }
+  , log_reference{ 0.0 }
+  , min{ std::numeric_limits<double>::infinity() }
+  , max{ -std::numeric_limits<double>::infinity() }
+{
+  if (reference > 0 && std::isfinite(reference)) {
+    log_reference = std::log10(reference);
+    histogram.assign(n_bins, 0);
+  }
+}
+
+void StatsAccumulator::merge(const StatsAccumulator& other)
+{
+  n += other.n;
+  sum += other.sum;
+  sum_sq += other.sum_sq;
+  min = std::min(min, other.min);
+  max = std::max(max, other.max);
+  for (size_t ii = 0; ii < histogram.size(); ++ii) {
+    histogram[ii] += other.histogram[ii];
+  }
+  n_below += other.n_below;
+  n_above += other.n_above;
+}
+
+GridStats StatsAccumulator::result() const
+{
+  GridStats stats;
+  stats.n = n;
+  stats.input_mean = input_mean;
+  stats.reference = histogram.empty() ? std::numeric_limits<double>::quiet_NaN() : reference;
+  stats.histogram = histogram;
+  stats.n_below = n_below;
+  stats.n_above = n_above;
+
+  if (n > 0) {
+    const double shifted_mean = sum / n;
+    stats.min = min;
+    stats.max = max;
+    stats.mean = shift + shifted_mean;
+    stats.variance = std::max(0.0, sum_sq / n - shifted_mean * shifted_mean);
+  }
+
+  return stats;
+}
+
+GridStats compute_stats(const float* values, const size_t n, const double input_mean)
+{
+  const long n_ = static_cast<long>(n);
+
+  double reference = input_mean;
+  if (!std::isfinite(reference)) {
+    double sum = 0;
+#pragma omp parallel for reduction(+ : sum)
+    for (long ii = 0; ii < n_; ++ii) {
+      sum += values[ii];
+    }
+    reference = n > 0 ? sum / n : 0.0;
+  }
+
+  StatsAccumulator total(input_mean, reference);
+#pragma omp parallel default(none) firstprivate(values, n_, input_mean, reference) shared(total)
+  {
+    StatsAccumulator local(input_mean, reference);
+#pragma omp for schedule(static)
+    for (long ii = 0; ii < n_; ++ii) {
+      local.add(values[ii]);
+    }
+#pragma omp critical
+    total.merge(local);
+  }
+
+  return total.result();
+}
+
+void print_stats(const GridStats& stats)
+{
+  fmt::print("Statistics: min = {:.6g}, max = {:.6g}, mean = {:.6g}, variance = {:.6g}",
+             stats.min,
+             stats.max,
+             stats.mean,
+             stats.variance);
+  if (std::isfinite(stats.input_mean)) {
+    fmt::print(", output / input mean = {:.6f}", stats.mass_ratio());
+  }
+  fmt::print("\n");
+}
+
+void write_stats(const std::string fname, const std::vector<std::string>& names, const std::vector<GridStats>& stats)
+{
+  std::ofstream ofs(fname);
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to open {} to write the grid statistics", fname));
+  }
+
+  ofs << "# grid n min max mean variance input_mean mass_ratio\n";
+  for (size_t ii = 0; ii < stats.size(); ++ii) {
+    const auto& entry = stats[ii];
+    ofs << fmt::format("\"{}\" {} {:.9e} {:.9e} {:.9e} {:.9e} {:.9e} {:.9e}\n",
+                       names[ii],
+                       entry.n,
+                       entry.min,
+                       entry.max,
+                       entry.mean,
+                       entry.variance,
+                       entry.input_mean,
+                       entry.mass_ratio());
+  }
+
+  // One column per grid with a histogram
+  std::vector<size_t> with_histogram;
+  for (size_t ii = 0; ii < stats.size(); ++ii) {
+    if (!stats[ii].histogram.empty()) {
+      with_histogram.push_back(ii);
+    }
+  }
+  if (with_histogram.empty()) {
+    return;
+  }
+
+  ofs << "\n# Histogram of log10(value / reference)\n";
+  for (const auto ii : with_histogram) {
+    ofs << fmt::format("# reference \"{}\": {:.9e}\n", names[ii], stats[ii].reference);
+  }
+  ofs << "# lower_edge";
+  for (const auto ii : with_histogram) {
+    ofs << fmt::format(" \"{}\"", names[ii]);
+  }
+  ofs << "\n-inf";
+  for (const auto ii : with_histogram) {
+    ofs << " " << stats[ii].n_below;
+  }
+  ofs << "\n";
+  for (int bin = 0; bin < StatsAccumulator::n_bins; ++bin) {
+    ofs << fmt::format("{:.2f}", StatsAccumulator::lowest + bin * StatsAccumulator::bin_width);
+    for (const auto ii : with_histogram) {
+      ofs << " " << stats[ii].histogram[bin];
+    }
+    ofs << "\n";
+  }
+  ofs << fmt::format("{:.2f}", StatsAccumulator::lowest + StatsAccumulator::n_bins * StatsAccumulator::bin_width);
+  for (const auto ii : with_histogram) {
+    ofs << " " << stats[ii].n_above;
+  }
+  ofs << "\n";
+}
@@ -0,0 +1,144 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+/** Summary statistics of a regridded grid.
+ */
+struct GridStats
+{
+  int64_t n = 0;                                                //< The number of cells
+  double min = std::numeric_limits<double>::quiet_NaN();        //< The minimum value
+  double max = std::numeric_limits<double>::quiet_NaN();        //< The maximum value
+  double mean = std::numeric_limits<double>::quiet_NaN();       //< The mean value
+  double variance = std::numeric_limits<double>::quiet_NaN();   //< The (population) variance
+  double input_mean = std::numeric_limits<double>::quiet_NaN(); //< The mean of the full resolution grid (if known)
+  double reference = std::numeric_limits<double>::quiet_NaN();  //< The value the histogram is relative to
+
+  std::vector<int64_t> histogram; //< Counts of log10(value / reference) (empty if there is no usable reference)
+  int64_t n_below = 0;            //< Values below the histogram range (including any <= 0)
+  int64_t n_above = 0;            //< Values above the histogram range
+
+  /** The ratio of the output and input means, which is 1 when mass is conserved.
+   */
+  double mass_ratio() const { return mean / input_mean; }
+};
+
+/** Accumulate `GridStats` one value at a time, e.g. separately in each thread before merging.
+ *
+ * The histogram is of log10(value / reference) in `n_bins` bins of width `bin_width` dex starting at `lowest`, where
+ * the reference is the input mean if it is known and positive.  This is the distribution of the overdensity for a
+ * density grid.  No histogram is accumulated if the reference isn't positive (e.g. for a velocity grid).
+ */
+class StatsAccumulator
+{
+public:
+  static const int n_bins = 80;            //< The number of histogram bins
+  static constexpr double lowest = -4.0;   //< The lower edge of the first bin, in log10(value / reference)
+  static constexpr double bin_width = 0.1; //< The width of each bin, in dex
+
+  /** Constructor.
+   *
+   * @param input_mean_ The mean of the full resolution grid (NaN if unknown)
+   * @param reference_ The value the histogram is relative to (NaN for none)
+   */
+  StatsAccumulator(const double input_mean_, const double reference_);
+
+  /** Add a value.
+   */
+  void add(const double value)
+  {
+    ++n;
+    const double shifted = value - shift;
+    sum += shifted;
+    sum_sq += shifted * shifted;
+    min = std::min(min, value);
+    max = std::max(max, value);
+
+    if (!histogram.empty()) {
+      if (value <= 0) {
+        ++n_below;
+      } else {
+        const double bin = std::floor((std::log10(value) - log_reference - lowest) / bin_width);
+        if (bin < 0) {
+          ++n_below;
+        } else if (bin >= n_bins) {
+          ++n_above;
+        } else {
+          ++histogram[static_cast<int>(bin)];
+        }
+      }
+    }
+  }
+
+  /** Add the values accumulated by another instance (with the same means).
+   */
+  void merge(const StatsAccumulator& other);
+
+  /** Return the statistics of the values added so far.
+   */
+  GridStats result() const;
+
+private:
+  double input_mean;              //< The mean of the full resolution grid
+  double reference;               //< The value the histogram is relative to
+  double shift;                   //< Subtracted from each value before summing, to limit cancellation
+  double log_reference;           //< log10(reference)
+  int64_t n = 0;                  //< The number of values
+  double sum = 0;                 //< The sum of the shifted values
+  double sum_sq = 0;              //< The sum of the squared shifted values
+  double min;                     //< The minimum value
+  double max;                     //< The maximum value
+  std::vector<int64_t> histogram; //< The histogram counts (empty if there is no usable reference)
+  int64_t n_below = 0;            //< Values below the histogram range
+  int64_t n_above = 0;            //< Values above the histogram range
+};
+
+/** Compute the statistics of an output grid in parallel, e.g. one produced by a streaming method.
+ *
+ * If the input mean is unknown the histogram is relative to the output mean.
+ *
+ * @param values The values
+ * @param n The number of values
+ * @param input_mean The mean of the full resolution grid (NaN if unknown)
+ * @return The statistics
+ */
+GridStats compute_stats(const float* values, const size_t n, const double input_mean);
+
+/** Print a one line summary of a grid's statistics.
+ */
+void print_stats(const GridStats& stats);
+
+/** Write the statistics of each grid as a whitespace separated text table.
+ *
+ * @param fname The name of the file
+ * @param names The name of each grid
+ * @param stats The statistics of each grid
+ */
+void write_stats(const std::string fname, const std::vector<std::string>& names, const std::vector<GridStats>& stats);
+
+#endif
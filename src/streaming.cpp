@@ -0,0 +1,58 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <stdexcept>
+
+#include "block_average.hpp"
+#include "gaussian.hpp"
+#include "streaming.hpp"
+
+StreamingDownsampler::StreamingDownsampler(const std::array<int, 3> n_cell_, const std::array<int, 3> new_n_cell_)
+  : n_cell{ n_cell_ }
+  , new_n_cell{ new_n_cell_ }
+{
+  for (int ii = 0; ii < 3; ++ii) {
+    if (new_n_cell[ii] <= 0 || n_cell[ii] % new_n_cell[ii] != 0) {
+      throw std::runtime_error(
+        fmt::format("Streaming methods require integer ratios, but [{}] is not a multiple of [{}]",
+                    fmt::join(n_cell, ", "),
+                    fmt::join(new_n_cell, ", ")));
+    }
+    ratio[ii] = n_cell[ii] / new_n_cell[ii];
+  }
+
+  output.resize((size_t)new_n_cell[0] * new_n_cell[1] * new_n_cell[2]);
+}
+
+std::unique_ptr<StreamingDownsampler> make_streaming_downsampler(const regrid_method method,
+                                                                 const std::array<int, 3> n_cell,
+                                                                 const std::array<int, 3> new_n_cell,
+                                                                 const std::array<double, 3> box_size,
+                                                                 const double R)
+{
+  switch (method) {
+    case regrid_method::block_average:
+      return std::unique_ptr<StreamingDownsampler>(new BlockAverager(n_cell, new_n_cell));
+    case regrid_method::gaussian:
+      return std::unique_ptr<StreamingDownsampler>(new GaussianSmoother(n_cell, new_n_cell, box_size, R));
+    default:
+      return nullptr;
+  }
+}
@@ -0,0 +1,97 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "options.hpp"
+
+/** Interface shared by the downsampling methods that consume the input one slab at a time.
+ *
+ * A slab is the `slab_thickness()` consecutive planes (in the first dimension) of the input which map onto a single
+ * plane of the output, so only the output and a single slab ever need to be in memory and the full resolution `Grid`
+ * is never allocated.  Slabs must be added in order, starting from zero, for each grid.
+ */
+class StreamingDownsampler
+{
+public:
+  std::array<int, 3> n_cell;     //< The number of input cells in each dimension
+  std::array<int, 3> new_n_cell; //< The number of output cells in each dimension
+  std::array<int, 3> ratio;      //< The number of input cells per output cell in each dimension
+
+  /** Constructor.
+   *
+   * @param n_cell_ The number of input cells in each dimension
+   * @param new_n_cell_ The number of output cells in each dimension (each must divide the input dimension exactly)
+   */
+  StreamingDownsampler(const std::array<int, 3> n_cell_, const std::array<int, 3> new_n_cell_);
+
+  virtual ~StreamingDownsampler() = default;
+
+  /** Return the number of input planes (in the first dimension) making up a slab.
+   */
+  int slab_thickness() const { return ratio[0]; }
+
+  /** Return the number of input values making up a slab.
+   */
+  size_t slab_size() const { return (size_t)ratio[0] * n_cell[1] * n_cell[2]; }
+
+  /** Return the number of output values.
+   */
+  size_t n_logical() const { return output.size(); }
+
+  /** Process a slab of input values.
+   *
+   * @param slab Pointer to `slab_size()` values, in C order
+   * @param i_out The index of the output plane (i.e. the slab number)
+   */
+  virtual void add_slab(const float* slab, const int i_out) = 0;
+
+  /** @copydoc add_slab(const float*, const int)
+   */
+  virtual void add_slab(const double* slab, const int i_out) = 0;
+
+  /** Return the pointer to the downsampled output grid, once all of the slabs have been added.
+   */
+  virtual float* get() { return output.data(); }
+
+protected:
+  std::vector<float> output; //< The output grid
+};
+
+/** Create the streaming downsampler for a method.
+ *
+ * @param method The downsampling method
+ * @param n_cell The number of input cells in each dimension
+ * @param new_n_cell The number of output cells in each dimension
+ * @param box_size The size of the simulation volume in input units
+ * @param R The filter radius in input units (used by `regrid_method::gaussian`)
+ * @return The downsampler, or nullptr if the method requires the full resolution `Grid`
+ */
+std::unique_ptr<StreamingDownsampler> make_streaming_downsampler(const regrid_method method,
+                                                                 const std::array<int, 3> n_cell,
+                                                                 const std::array<int, 3> new_n_cell,
+                                                                 const std::array<double, 3> box_size,
+                                                                 const double R);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <H5Cpp.h>
+#include <cstdint>
+#include <cstring>
+#include <fmt/core.h>
+#include <fstream>
+#include <stdexcept>
+
+#include "npy.hpp"
+#include "synthetic.hpp"
+
+void write_synthetic_gbptrees(const std::string fname,
+                              const std::array<int, 3> n_cell,
+                              const std::array<double, 3> box_size,
+                              const std::vector<std::string>& names,
+                              const plane_filler& fill)
+{
+  std::ofstream ofs(fname, std::ios::binary | std::ios::out);
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to open {} to write a gbpTrees grid", fname));
+  }
+
+  const int32_t n_grids = static_cast<int32_t>(names.size());
+  const int32_t ma_scheme = 0;
+  ofs.write((char*)(n_cell.data()), sizeof(int) * 3);
+  ofs.write((char*)(box_size.data()), sizeof(double) * 3);
+  ofs.write((char*)(&n_grids), sizeof(int));
+  ofs.write((char*)(&ma_scheme), sizeof(int));
+
+  std::vector<float> plane((size_t)n_cell[1] * n_cell[2]);
+  for (int i_grid = 0; i_grid < n_grids; ++i_grid) {
+    char ident[32] = { 0 };
+    std::strncpy(ident, names[i_grid].c_str(), sizeof(ident) - 1);
+    ofs.write(ident, sizeof(ident));
+
+    for (int ii = 0; ii < n_cell[0]; ++ii) {
+      fill(i_grid, ii, plane.data());
+      ofs.write((char*)plane.data(), sizeof(float) * plane.size());
+    }
+  }
+
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to write {}", fname));
+  }
+}
+
+void write_synthetic_npy(const std::string fname, const std::array<int, 3> n_cell, const plane_filler& fill)
+{
+  std::ofstream ofs(fname, std::ios::binary | std::ios::out);
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to open {} to write a .npy grid", fname));
+  }
+
+  const std::string header = make_npy_header(n_cell);
+  ofs.write(header.data(), header.size());
+
+  std::vector<float> plane((size_t)n_cell[1] * n_cell[2]);
+  for (int ii = 0; ii < n_cell[0]; ++ii) {
+    fill(0, ii, plane.data());
+    ofs.write((char*)plane.data(), sizeof(float) * plane.size());
+  }
+
+  if (!ofs) {
+    throw std::runtime_error(fmt::format("Failed to write {}", fname));
+  }
+}
+
+const std::vector<std::string>& velociraptor_grid_names()
+{
+  static const std::vector<std::string> names = { "Vx", "Vy", "Vz", "Density" };
+  return names;
+}
+
+/** Create the /Parameters group with the grid dimension attributes read and updated by `regrid_velociraptor`.
+ */
+static void write_velociraptor_parameters(H5::H5File& file, const int dim)
+{
+  auto group = file.createGroup("/Parameters");
+  H5::StrType str_type(H5::PredType::C_S1, H5T_VARIABLE);
+  for (const auto name : { "DensityGrids:grid_dim", "Snapshots:grid_dim" }) {
+    auto attr = group.createAttribute(name, str_type, H5::DataSpace(H5S_SCALAR));
+    attr.write(str_type, fmt::format("{}", dim));
+  }
+}
+
+void write_synthetic_velociraptor(const std::string fname,
+                                  const std::array<int, 3> n_cell,
+                                  const std::array<double, 3> box_size,
+                                  const plane_filler& fill)
+{
+  if (n_cell[0] != n_cell[1] || n_cell[0] != n_cell[2]) {
+    throw std::runtime_error("VELOCIraptor grids must be cubic");
+  }
+
+  auto file = H5::H5File(fname, H5F_ACC_TRUNC);
+  write_velociraptor_parameters(file, n_cell[0]);
+
+  {
+    auto header = file.createGroup("/Header");
+    const hsize_t three = 3;
+    auto attr = header.createAttribute("BoxSize", H5::PredType::NATIVE_DOUBLE, H5::DataSpace(1, &three));
+    attr.write(H5::PredType::NATIVE_DOUBLE, box_size.data());
+  }
+
+  file.createGroup("/PartType1");
+  auto group = file.createGroup("/PartType1/Grids");
+
+  std::array<hsize_t, 3> dims = { static_cast<hsize_t>(n_cell[0]),
+                                  static_cast<hsize_t>(n_cell[1]),
+                                  static_cast<hsize_t>(n_cell[2]) };
+  std::array<hsize_t, 3> count = { 1, dims[1], dims[2] };
+  H5::DataSpace mem_space(3, count.data());
+  std::vector<float> plane((size_t)n_cell[1] * n_cell[2]);
+
+  const auto& names = velociraptor_grid_names();
+  for (int i_grid = 0; i_grid < static_cast<int>(names.size()); ++i_grid) {
+    H5::DataSpace file_space(3, dims.data());
+    auto dset = group.createDataSet(names[i_grid], H5::PredType::IEEE_F32LE, file_space);
+    for (int ii = 0; ii < n_cell[0]; ++ii) {
+      fill(i_grid, ii, plane.data());
+      std::array<hsize_t, 3> start = { static_cast<hsize_t>(ii), 0, 0 };
+      file_space.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+      dset.write(plane.data(), H5::PredType::NATIVE_FLOAT, mem_space, file_space);
+    }
+  }
+}
+
+void create_velociraptor_output(const std::string fname, const int dim)
+{
+  auto file = H5::H5File(fname, H5F_ACC_TRUNC);
+  write_velociraptor_parameters(file, dim);
+}
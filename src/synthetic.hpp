@@ -0,0 +1,82 @@
+/*
+ * regrider: Downsample gbpTrees and VELOCIraptor grids using FFTW
+ * Copyright © 2021 Simon Mutch
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <array>
+#include <functional>
+#include <string>
+#include <vector>
+
+/** Fill one plane of constant first index of a grid being written.
+ *
+ * @param i_grid The index of the grid in the file
+ * @param i The index of the plane in the first dimension
+ * @param plane The n_cell[1] * n_cell[2] values of the plane, in C order
+ */
+typedef std::function<void(const int i_grid, const int i, float* plane)> plane_filler;
+
+/** Write a gbpTrees grid file, one plane at a time so that grids larger than memory can be written.
+ *
+ * @param fname The name of the file to create
+ * @param n_cell The number of cells in each dimension
+ * @param box_size The size of the simulation volume
+ * @param names The identifier of each grid (at most 31 characters)
+ * @param fill Called for each plane of each grid, in file order
+ */
+void write_synthetic_gbptrees(const std::string fname,
+                              const std::array<int, 3> n_cell,
+                              const std::array<double, 3> box_size,
+                              const std::vector<std::string>& names,
+                              const plane_filler& fill);
+
+/** Write a single float32 grid as a `.npy` file, one plane at a time.
+ *
+ * @param fname The name of the file to create
+ * @param n_cell The number of cells in each dimension
+ * @param fill Called for each plane of the grid (with `i_grid = 0`)
+ */
+void write_synthetic_npy(const std::string fname, const std::array<int, 3> n_cell, const plane_filler& fill);
+
+/** The names of the grids in a VELOCIraptor file, in the order they are passed to a `plane_filler`.
+ */
+const std::vector<std::string>& velociraptor_grid_names();
+
+/** Write a VELOCIraptor grid file, one plane at a time.
+ *
+ * Only the groups, datasets and attributes read by `regrid_velociraptor` are created.
+ *
+ * @param fname The name of the file to create
+ * @param n_cell The number of cells in each dimension (only cubic grids can be described by the file)
+ * @param box_size The size of the simulation volume
+ * @param fill Called for each plane of each of the grids named by `velociraptor_grid_names`
+ */
+void write_synthetic_velociraptor(const std::string fname,
+                                  const std::array<int, 3> n_cell,
+                                  const std::array<double, 3> box_size,
+                                  const plane_filler& fill);
+
+/** Create the output file for `regrid_velociraptor`, which expects the parameters of the input to be present.
+ *
+ * @param fname The name of the file to create (any existing file is truncated)
+ * @param dim The input grid dimension
+ */
+void create_velociraptor_output(const std::string fname, const int dim);
+
+#endif
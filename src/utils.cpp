@@ -1,7 +1,24 @@
 #include <fmt/color.h>
 #include <fmt/core.h>
+#include <string>
 
 void print_done(const std::string message = "done\n")
 {
   fmt::print(fmt::fg(fmt::color::green), message);
 }
+
+std::string json_escape(const std::string in)
+{
+  std::string out;
+  for (const char c : in) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+      out.push_back(c);
+    } else if ((unsigned char)c < 0x20) {
+      out += fmt::format("\\u{:04x}", (int)c);
+    } else {
+      out.push_back(c);
+    }
+  }
+  return out;
+}
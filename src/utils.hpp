@@ -1,12 +1,77 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 #include <string>
 
+#include "kernels.hpp"
+
 /** Print a simple "done" message in green.
  *
  * @param message Optional message to print (default: "done\n")
  */
 void print_done(const std::string message = "done\n");
 
+/** Escape a string for use in JSON.
+ */
+std::string json_escape(const std::string in);
+
+/** Convert `n` float values stored at the start of `data` to type `T` in place.
+ *
+ * This allows float32 input to be read straight into the grid allocation, with the (larger) converted values written
+ * back to front so no extra buffer is needed.  This is a no-op for `T = float`.
+ *
+ * @param data Pointer to the buffer, large enough to hold `n` values of type `T`
+ * @param n The number of values
+ */
+template <typename T>
+void widen_in_place(T* data, const size_t n)
+{
+  // Each block is copied out before it is converted, so it only overwrites floats which have already been read.  The
+  // copy also keeps us clear of strict aliasing.
+  const char* in = reinterpret_cast<const char*>(data);
+  float block[convert_block_size];
+  for (size_t end = n; end > 0;) {
+    const size_t start = end - std::min(end, convert_block_size);
+    std::memcpy(block, in + start * sizeof(float), sizeof(float) * (end - start));
+    convert(block, data + start, end - start);
+    end = start;
+  }
+}
+
+template <>
+inline void widen_in_place<float>(float*, const size_t)
+{
+}
+
+/** Convert `n` values of type `T` to float in place, packing them at the start of `data`.
+ *
+ * This is the inverse of `widen_in_place` and is a no-op for `T = float`.
+ *
+ * @param data Pointer to the buffer of `n` values of type `T`
+ * @param n The number of values
+ * @return Pointer to the packed float values (aliasing `data`)
+ */
+template <typename T>
+float* narrow_in_place(T* data, const size_t n)
+{
+  // Each block is converted before it is written, and only overwrites values which have already been read
+  char* out = reinterpret_cast<char*>(data);
+  float block[convert_block_size];
+  for (size_t start = 0; start < n; start += convert_block_size) {
+    const size_t count = std::min(n - start, convert_block_size);
+    convert(data + start, block, count);
+    std::memcpy(out + start * sizeof(float), block, sizeof(float) * count);
+  }
+  return reinterpret_cast<float*>(data);
+}
+
+template <>
+inline float* narrow_in_place<float>(float* data, const size_t)
+{
+  return data;
+}
+
 #endif
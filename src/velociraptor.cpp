@@ -18,10 +18,22 @@
 
 #include <H5Cpp.h>
 #include <array>
+#include <complex>
+#include <cstdint>
 #include <fmt/core.h>
 #include <fmt/ostream.h>
+#include <limits>
+#include <memory>
+#include <omp.h>
 #include <vector>
 
+#include "derived.hpp"
+#include "journal.hpp"
+#include "planner.hpp"
+#include "power_spectrum.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include "streaming.hpp"
 #include "utils.hpp"
 #include "velociraptor.hpp"
 
@@ -33,12 +45,196 @@ enum property
   DENSITY
 };
 
-void regrid_velociraptor(const std::string fname_in, const std::string fname_out, const int new_dim)
+/** Return the name of the dataset holding a property.
+ */
+static std::string dataset_name(const int property)
+{
+  switch (property) {
+    case X_VELOCITY:
+      return "Vx";
+    case Y_VELOCITY:
+      return "Vy";
+    case Z_VELOCITY:
+      return "Vz";
+    case DENSITY:
+      return "Density";
+    default:
+      fmt::print(stderr, "Unrecognised grid property!");
+      return "";
+  }
+}
+
+/** The HDF5 memory type corresponding to `T`.
+ */
+template <typename T>
+static const H5::PredType& native_type();
+
+template <>
+const H5::PredType& native_type<float>()
+{
+  return H5::PredType::NATIVE_FLOAT;
+}
+
+template <>
+const H5::PredType& native_type<double>()
+{
+  return H5::PredType::NATIVE_DOUBLE;
+}
+
+/** The HDF5 file type used to store values with the given encoding.
+ */
+static H5::DataType encoding_type(const output_encoding encoding)
+{
+  H5::FloatType type(H5::PredType::IEEE_F32LE);
+
+  // Sign position, exponent position & size, mantissa position & size, then exponent bias
+  switch (encoding) {
+    case output_encoding::float16:
+      type.setFields(15, 10, 5, 0, 10);
+      type.setSize(2);
+      type.setEbias(15);
+      break;
+    case output_encoding::bfloat16:
+      type.setFields(15, 7, 8, 0, 7);
+      type.setSize(2);
+      type.setEbias(127);
+      break;
+    default:
+      break;
+  }
+
+  return type;
+}
+
+/** Write a scalar attribute.
+ */
+template <typename T>
+static void write_attribute(H5::DataSet& ds, const std::string name, const T value, const H5::PredType& type)
+{
+  auto attr = ds.createAttribute(name, type, H5::DataSpace(H5S_SCALAR));
+  attr.write(type, &value);
+}
+
+/** Store the statistics of a grid as attributes of its dataset.
+ */
+static void write_stats_attributes(H5::DataSet& ds, const GridStats& stats)
+{
+  write_attribute(ds, "Min", stats.min, H5::PredType::NATIVE_DOUBLE);
+  write_attribute(ds, "Max", stats.max, H5::PredType::NATIVE_DOUBLE);
+  write_attribute(ds, "Mean", stats.mean, H5::PredType::NATIVE_DOUBLE);
+  write_attribute(ds, "Variance", stats.variance, H5::PredType::NATIVE_DOUBLE);
+  write_attribute(ds, "InputMean", stats.input_mean, H5::PredType::NATIVE_DOUBLE);
+  write_attribute(ds, "MassRatio", stats.mass_ratio(), H5::PredType::NATIVE_DOUBLE);
+
+  if (!stats.histogram.empty()) {
+    hsize_t n_bins = stats.histogram.size();
+    auto attr = ds.createAttribute("HistogramLog10Overdensity", H5::PredType::NATIVE_INT64, H5::DataSpace(1, &n_bins));
+    attr.write(H5::PredType::NATIVE_INT64, stats.histogram.data());
+    write_attribute(ds, "HistogramLowestEdge", StatsAccumulator::lowest, H5::PredType::NATIVE_DOUBLE);
+    write_attribute(ds, "HistogramBinWidth", StatsAccumulator::bin_width, H5::PredType::NATIVE_DOUBLE);
+    write_attribute(ds, "HistogramReference", stats.reference, H5::PredType::NATIVE_DOUBLE);
+    write_attribute(ds, "HistogramBelow", stats.n_below, H5::PredType::NATIVE_INT64);
+    write_attribute(ds, "HistogramAbove", stats.n_above, H5::PredType::NATIVE_INT64);
+  }
+}
+
+/** Encode a subsampled grid and write it to a new dataset, replacing any left by an earlier run.
+ *
+ * @param group The group to create the dataset in
+ * @param dset_name The name of the dataset
+ * @param values The values, which may be encoded in place
+ * @param n_values The number of values
+ * @param new_n_cell The dimensions of the grid
+ * @param options The encoding options
+ * @param stats If not null, the statistics of the grid, which are stored as attributes of the dataset
+ * @return The `checksum` of the encoded values
+ */
+static uint64_t write_grid(H5::Group& group,
+                           const std::string dset_name,
+                           float* values,
+                           const int n_values,
+                           const std::array<int, 3> new_n_cell,
+                           const RegridOptions& options,
+                           const GridStats* stats = nullptr)
+{
+  fmt::print("Writing subsampled grid {}... ", dset_name);
+  std::array<hsize_t, 3> dims = { static_cast<unsigned long long>(new_n_cell[0]),
+                                  static_cast<unsigned long long>(new_n_cell[1]),
+                                  static_cast<unsigned long long>(new_n_cell[2]) };
+
+  std::vector<uint16_t> packed;
+  void* encoded = values;
+  if (encoded_size(options.encoding) != sizeof(float)) {
+    packed.resize(n_values);
+    encoded = packed.data();
+  }
+  auto error = encode(values, encoded, n_values, options.encoding, options.keep_bits);
+
+  H5::DSetCreatPropList plist;
+  if (options.deflate > 0) {
+    std::array<hsize_t, 3> chunk = { 1, dims[1], dims[2] };
+    plist.setChunk(3, chunk.data());
+    plist.setShuffle();
+    plist.setDeflate(options.deflate);
+  }
+
+  if (H5Lexists(group.getId(), dset_name.c_str(), H5P_DEFAULT) > 0) {
+    group.unlink(dset_name);
+  }
+  auto file_type = encoding_type(options.encoding);
+  auto ds = group.createDataSet(dset_name, file_type, H5::DataSpace(3, dims.data()), plist);
+  ds.write(encoded, file_type);
+
+  if (stats != nullptr) {
+    write_stats_attributes(ds, *stats);
+  }
+
+  print_done();
+  print_encoding_error(options.encoding, error);
+  return checksum(encoded, n_values * encoded_size(options.encoding));
+}
+
+/** Return the number of fields recorded by a journal which are intact in the output file.
+ *
+ * @param group The output group
+ * @param journal The journal
+ * @param order The order the fields are written in
+ * @return The number of leading entries whose dataset matches the checksum
+ */
+static int count_intact_fields(H5::Group& group, const Journal& journal, const std::array<int, 4>& order)
+{
+  int n_intact = 0;
+  for (const auto& entry : journal.entries) {
+    if (n_intact == (int)order.size() || entry.name != dataset_name(order[n_intact]) ||
+        H5Lexists(group.getId(), entry.name.c_str(), H5P_DEFAULT) <= 0) {
+      break;
+    }
+
+    // Read the stored bytes without conversion, as they were encoded
+    auto ds = group.openDataSet(entry.name);
+    auto type = ds.getDataType();
+    if ((size_t)ds.getSpace().getSimpleExtentNpoints() * type.getSize() != entry.bytes) {
+      break;
+    }
+    std::vector<char> buffer(entry.bytes);
+    ds.read(buffer.data(), type);
+    if (checksum(buffer.data(), buffer.size()) != entry.checksum) {
+      break;
+    }
+    ++n_intact;
+  }
+  return n_intact;
+}
+
+template <typename T>
+void regrid_velociraptor(const std::string fname_in,
+                         const std::string fname_out,
+                         const int new_dim,
+                         const RegridOptions& options)
 {
   fmt::print("Regridding VELOCIraptor file {}\n", fname_in);
 
   auto file_in = H5::H5File(fname_in, H5F_ACC_RDONLY);
-  auto file_out = H5::H5File(fname_out, H5F_ACC_RDWR);
 
   int _dim = 0;
   std::array<int, 3> new_n_cell = { new_dim, new_dim, new_dim };
@@ -59,54 +255,174 @@ void regrid_velociraptor(const std::string fname_in, const std::string fname_out
   fmt::print("n_cell = [{}] --> [{}]\n", fmt::join(n_cell, ", "), fmt::join(new_n_cell, ", "));
   fmt::print("box_size = {:.2f}\n", fmt::join(box_size, ", "));
 
-  auto grid = Grid(n_cell, box_size);
-  const double radius = (double)grid.box_size[0] / (double)new_dim * 0.5;
+  const double radius = box_size[0] / (double)new_dim * 0.5;
+
+  RegridProblem problem = {
+    n_cell, new_n_cell, box_size, radius, DENSITY + 1, sizeof(T), omp_get_max_threads(), memory_budget(options), 0
+  };
+  if (options.power_spectrum) {
+    // The density modes are kept for the density-velocity cross-spectra
+    problem.extra_fft_bytes = (size_t)n_cell[0] * n_cell[1] * (n_cell[2] / 2 + 1) * sizeof(std::complex<float>);
+  }
+  problem.extra_fft_bytes += DerivedFields::estimate_bytes(new_n_cell, options.derived);
+  const auto plan = plan_method(problem, options);
+  const auto method = plan.method;
+  if (options.dry_run) {
+    return;
+  }
+
+  auto file_out = H5::H5File(fname_out, H5F_ACC_RDWR);
 
-  file_out.createGroup("/PartType1");
-  auto group_out = file_out.createGroup("/PartType1/Grids");
+  // Only one of these is allocated, depending on the method
+  std::unique_ptr<Grid<T>> grid;
+  std::unique_ptr<StreamingDownsampler> streamer;
+  std::vector<float> slab;
+  std::unique_ptr<SpectrumAccumulator> spectra;
+  if (method == regrid_method::fft) {
+    grid = acquire_grid<T>(n_cell, box_size, plan.grid);
+    if (options.power_spectrum) {
+      spectra.reset(new SpectrumAccumulator(n_cell, box_size));
+    }
+  } else {
+    ScopedPhase scope(phase::setup);
+    streamer = make_streaming_downsampler(method, n_cell, new_n_cell, box_size, radius);
+    slab.resize(streamer->slab_size());
+  }
+  std::unique_ptr<DerivedFields> derived;
+  if (method == regrid_method::fft && options.derived.any()) {
+    derived.reset(new DerivedFields(n_cell, new_n_cell, options.derived));
+  }
+
+  // The groups already exist if an earlier run was killed
+  if (H5Lexists(file_out.getId(), "/PartType1", H5P_DEFAULT) <= 0) {
+    file_out.createGroup("/PartType1");
+  }
+  auto group_out = H5Lexists(file_out.getId(), "/PartType1/Grids", H5P_DEFAULT) > 0
+                     ? file_out.openGroup("/PartType1/Grids")
+                     : file_out.createGroup("/PartType1/Grids");
   auto group_in = file_in.openGroup("/PartType1/Grids");
 
-  for (int property = X_VELOCITY; property <= DENSITY; ++property) {
-    std::string dset_name;
-    switch (property) {
-      case X_VELOCITY:
-        dset_name = "Vx";
-        break;
-      case Y_VELOCITY:
-        dset_name = "Vy";
-        break;
-      case Z_VELOCITY:
-        dset_name = "Vz";
-        break;
-      case DENSITY:
-        dset_name = "Density";
-        break;
-      default:
-        fmt::print(stderr, "Unrecognised grid property!");
-        break;
+  // The density goes first when measuring spectra, so that it can be cross-correlated with the velocities
+  std::array<int, 4> order = { X_VELOCITY, Y_VELOCITY, Z_VELOCITY, DENSITY };
+  if (spectra) {
+    order = { DENSITY, X_VELOCITY, Y_VELOCITY, Z_VELOCITY };
+  }
+
+  // Each field is journalled once written, so that a killed run can resume after the last intact one.  The spectra
+  // and derived fields need every field, so can't be resumed.
+  std::unique_ptr<Journal> journal;
+  int first_field = 0;
+  if (!spectra && !derived) {
+    journal.reset(new Journal(fname_out, job_signature(fname_in, new_dim, method, options, sizeof(T))));
+    if (!journal->entries.empty()) {
+      ScopedPhase scope(phase::read);
+      fmt::print("Verifying {} journalled fields... ", journal->entries.size());
+      first_field = count_intact_fields(group_out, *journal, order);
+      print_done();
+    }
+    journal->start(first_field);
+    if (first_field > 0) {
+      fmt::print("Resuming from field {} of {}\n", first_field + 1, order.size());
     }
+  }
 
-    // We do this here as the Grid may have already been subsampled in a
-    // previous iteration.
-    grid.update_properties(n_cell);
+  for (int i_field = first_field; i_field < (int)order.size(); ++i_field) {
+    const int property = order[i_field];
+    const std::string dset_name = dataset_name(property);
+    TraceSpan grid_span("grid", dset_name);
 
-    {
-      fmt::print("Reading grid {}... ", dset_name);
+    float* values = nullptr;
+    int n_values = 0;
+    GridStats stats;
+
+    if (streamer) {
+      ScopedPhase scope(phase::stream);
+      fmt::print("Streaming grid {} through {}... ", dset_name, method_name(method));
       auto dset = group_in.openDataSet(dset_name);
-      dset.read(grid.get(), dset.getDataType());
+      auto file_space = dset.getSpace();
+      std::array<hsize_t, 3> count = { static_cast<hsize_t>(streamer->slab_thickness()),
+                                       static_cast<hsize_t>(n_cell[1]),
+                                       static_cast<hsize_t>(n_cell[2]) };
+      H5::DataSpace mem_space(3, count.data());
+      for (int i_out = 0; i_out < streamer->new_n_cell[0]; ++i_out) {
+        std::array<hsize_t, 3> start = { static_cast<hsize_t>(i_out) * count[0], 0, 0 };
+        file_space.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+        dset.read(slab.data(), H5::PredType::NATIVE_FLOAT, mem_space, file_space);
+        streamer->add_slab(slab.data(), i_out);
+      }
       print_done();
+
+      values = streamer->get();
+      n_values = static_cast<int>(streamer->n_logical());
+      stats = compute_stats(values, n_values, std::numeric_limits<double>::quiet_NaN());
+    } else {
+      // We do this here as the Grid may have already been subsampled in a
+      // previous iteration.
+      grid->update_properties(n_cell);
+
+      {
+        ScopedPhase scope(phase::read);
+        fmt::print("Reading grid {}... ", dset_name);
+        auto dset = group_in.openDataSet(dset_name);
+        dset.read(grid->get(), native_type<T>());
+        print_done();
+      }
+
+      if (spectra) {
+        spectra->start(dset_name, property == DENSITY);
+      }
+      if (derived) {
+        typedef DerivedFields::source source;
+        const source sources[] = { source::vx, source::vy, source::vz, source::density };
+        derived->start(sources[property]);
+      }
+      grid->filter(options.filter, radius, spectra.get(), derived.get());
+      grid->sample(new_n_cell, &stats);
+
+      values = narrow_in_place(grid->get(), grid->n_logical);
+      n_values = grid->n_logical;
+    }
+
+    // The histogram is of the overdensity, so only makes sense for the density
+    print_stats(stats);
+    if (property != DENSITY) {
+      stats.histogram.clear();
     }
 
-    grid.filter(Grid::filter_type::real_top_hat, radius);
-    grid.sample(new_n_cell);
+    ScopedPhase write_scope(phase::write);
+    const auto sum = write_grid(group_out, dset_name, values, n_values, new_n_cell, options, &stats);
 
-    fmt::print("Writing subsampled grid {}... ", dset_name);
-    std::array<hsize_t, 3> dims = { static_cast<unsigned long long>(new_n_cell[0]),
-                                    static_cast<unsigned long long>(new_n_cell[1]),
-                                    static_cast<unsigned long long>(new_n_cell[2]) };
-    auto ds = group_out.createDataSet(dset_name, H5::PredType::NATIVE_FLOAT, H5::DataSpace(3, dims.data()));
-    ds.write(grid.get(), H5::PredType::NATIVE_FLOAT);
+    if (journal) {
+      JournalEntry entry;
+      entry.name = dset_name;
+      entry.bytes = n_values * encoded_size(options.encoding);
+      entry.checksum = sum;
+      entry.stats = stats;
+      file_out.flush(H5F_SCOPE_GLOBAL);
+      journal->record(entry);
+    }
+  }
+  release_grid(grid);
 
+  if (derived) {
+    fmt::print("\nDerived fields\n=================\n");
+    {
+      ScopedPhase scope(phase::filter);
+      fmt::print("Transforming derived fields... ");
+      derived->finish();
+      print_done();
+    }
+    ScopedPhase scope(phase::write);
+    for (const auto& name : derived->names()) {
+      auto& values = derived->get(name);
+      write_grid(group_out, name, values.data(), static_cast<int>(values.size()), new_n_cell, options);
+    }
+  }
+
+  if (spectra) {
+    ScopedPhase scope(phase::write);
+    fmt::print("Writing power spectra to {}.pk... ", fname_out);
+    spectra->write(fname_out + ".pk");
     print_done();
   }
 
@@ -121,4 +437,12 @@ void regrid_velociraptor(const std::string fname_in, const std::string fname_out
     auto attr = group_out.openAttribute("Snapshots:grid_dim");
     attr.write(attr.getStrType(), fmt::format("{}", new_dim));
   }
+
+  if (journal) {
+    file_out.flush(H5F_SCOPE_GLOBAL);
+    journal->remove();
+  }
 }
+
+template void regrid_velociraptor<float>(const std::string, const std::string, const int, const RegridOptions&);
+template void regrid_velociraptor<double>(const std::string, const std::string, const int, const RegridOptions&);
@@ -20,14 +20,23 @@
 #define VELOCIRAPTOR_H
 
 #include "grid.hpp"
+#include "options.hpp"
 #include <string>
 
 /** Regrid a VELOCIraptor file.
  *
+ * The output datasets are float32 unless a 16 bit encoding is requested in `options`.
+ *
+ * @tparam T The scalar type used for the in-memory grid (`float` or `double`)
  * @param fname_in The path to the input file to be regridded
  * @param fname_out The path to the new output file to be created
  * @param new_dim The new size of the grid (assuming cubic dimensions)
+ * @param options Options controlling the regridding
  */
-void regrid_velociraptor(const std::string fname_in, const std::string fname_out, const int new_dim);
+template <typename T>
+void regrid_velociraptor(const std::string fname_in,
+                         const std::string fname_out,
+                         const int new_dim,
+                         const RegridOptions& options);
 
 #endif
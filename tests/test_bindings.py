@@ -0,0 +1,42 @@
+"""Smoke test of the Python bindings, run by ctest when the extension is built."""
+
+import threading
+
+import numpy as np
+
+import regrider
+
+
+def test_downsample():
+    grid = regrider.Grid((16, 16, 16), (10.0, 10.0, 10.0))
+    field = np.asarray(grid)
+    assert field.shape == (16, 16, 16)
+    assert field.dtype == np.float32
+
+    field[...] = 2.0
+    grid.downsample(8)
+
+    small = np.asarray(grid)
+    assert small.shape == (8, 8, 8)
+    assert np.allclose(small, 2.0, atol=1e-4)
+
+
+def test_threads():
+    grids = [regrider.Grid((16, 16, 16), (10.0, 10.0, 10.0)) for _ in range(4)]
+    for ii, grid in enumerate(grids):
+        np.asarray(grid)[...] = ii
+
+    threads = [threading.Thread(target=grid.downsample, args=(8,)) for grid in grids]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    for ii, grid in enumerate(grids):
+        assert np.allclose(np.asarray(grid), ii, atol=1e-4)
+
+
+if __name__ == "__main__":
+    test_downsample()
+    test_threads()
+    print("OK")
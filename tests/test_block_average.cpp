@@ -0,0 +1,53 @@
+#include <array>
+#include <block_average.hpp>
+#include <criterion/criterion.h>
+#include <stdexcept>
+#include <vector>
+
+Test(block_average, conserves_mean)
+{
+  const float tolerance = 1e-5;
+
+  std::array<int, 3> n_cell = { 8, 12, 16 };
+  std::array<int, 3> new_n_cell = { 4, 3, 4 };
+
+  std::vector<float> grid(n_cell[0] * n_cell[1] * n_cell[2]);
+  double total = 0.0;
+  for (size_t ii = 0; ii < grid.size(); ++ii) {
+    grid[ii] = (float)((ii * 7919) % 101);
+    total += grid[ii];
+  }
+
+  BlockAverager averager(n_cell, new_n_cell);
+  cr_assert_eq(averager.slab_thickness(), 2);
+
+  for (int i_out = 0; i_out < new_n_cell[0]; ++i_out) {
+    averager.add_slab(grid.data() + i_out * averager.slab_size(), i_out);
+  }
+
+  double new_total = 0.0;
+  auto out = averager.get();
+  for (size_t ii = 0; ii < averager.n_logical(); ++ii) {
+    new_total += out[ii];
+  }
+  cr_assert_float_eq(new_total / averager.n_logical(), total / grid.size(), tolerance);
+
+  // The first output cell is the mean of the first 2x4x4 block
+  double first = 0.0;
+  for (int ii = 0; ii < 2; ++ii)
+    for (int jj = 0; jj < 4; ++jj)
+      for (int kk = 0; kk < 4; ++kk)
+        first += grid[kk + n_cell[2] * (jj + n_cell[1] * ii)];
+  cr_assert_float_eq(out[0], first / 32.0, tolerance);
+}
+
+Test(block_average, rejects_non_integer_ratio)
+{
+  bool thrown = false;
+  try {
+    BlockAverager averager({ 16, 16, 16 }, { 5, 5, 5 });
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  cr_assert(thrown);
+}
@@ -0,0 +1,46 @@
+#include <criterion/criterion.h>
+#include <cstring>
+#include <profile.hpp>
+#include <vector>
+
+Test(counters, nested_scopes)
+{
+  // Nothing is measured before the counters are enabled
+  {
+    ScopedCounters scope("before");
+  }
+  cr_assert(counter_stats().empty());
+
+  if (!enable_counters()) {
+    // perf_event_open isn't allowed here, so there is nothing more to test
+    return;
+  }
+
+  for (int ii = 0; ii < 2; ++ii) {
+    ScopedCounters outer("outer");
+    {
+      // Touch fresh pages so that there are page faults to count
+      ScopedCounters inner("inner");
+      std::vector<char> buffer(16 << 20);
+      std::memset(buffer.data(), ii + 1, buffer.size());
+      cr_assert(buffer[buffer.size() - 1] == ii + 1);
+    }
+  }
+
+  const auto& stats = counter_stats();
+  cr_assert_eq(stats.size(), 2);
+  cr_assert(stats[0].name == "outer");
+  cr_assert_eq(stats[0].depth, 0);
+  cr_assert_eq(stats[0].count, 2);
+  cr_assert(stats[1].name == "inner");
+  cr_assert_eq(stats[1].depth, 1);
+  cr_assert_eq(stats[1].count, 2);
+  cr_assert(stats[0].seconds >= stats[1].seconds);
+
+  if (counter_available(hw_counter::page_faults)) {
+    cr_assert_gt(stats[1].values[static_cast<int>(hw_counter::page_faults)], 0);
+  }
+
+  reset_phase_stats();
+  cr_assert(counter_stats().empty());
+}
@@ -0,0 +1,85 @@
+#include <array>
+#include <cmath>
+#include <criterion/criterion.h>
+#include <derived.hpp>
+#include <functional>
+#include <grid.hpp>
+
+static const std::array<int32_t, 3> n_cell = { 16, 16, 16 };
+static const std::array<int32_t, 3> new_n_cell = { 8, 8, 8 };
+static const std::array<double, 3> box_size = { 10., 10., 10. };
+static const double R = 1.0;
+
+/** The Gaussian window applied by `Grid::filter`.
+ */
+static double window(const double k)
+{
+  const double kR = 0.643 * k * R;
+  return std::exp(-kR * kR / 2.0);
+}
+
+/** Fill a grid from a function of position, then filter it into `derived`.
+ */
+static void add_field(DerivedFields& derived,
+                      const DerivedFields::source source,
+                      std::function<double(double, double, double)> field)
+{
+  Grid<double> grid(n_cell, box_size);
+  const double dx = box_size[0] / n_cell[0];
+  for (int ii = 0; ii < n_cell[0]; ++ii) {
+    for (int jj = 0; jj < n_cell[1]; ++jj) {
+      for (int kk = 0; kk < n_cell[2]; ++kk) {
+        grid.get()[(ii * n_cell[1] + jj) * n_cell[2] + kk] = field(ii * dx, jj * dx, kk * dx);
+      }
+    }
+  }
+  derived.start(source);
+  grid.filter(GridBase::filter_type::gaussian, R, nullptr, &derived);
+}
+
+Test(derived, plane_waves)
+{
+  const double k1 = 2.0 * M_PI / box_size[0];
+  const double k2 = 2.0 * k1;
+  const double k3 = 3.0 * k1;
+  const double k5 = 5.0 * k1; // Above the target Nyquist frequency, so it aliases
+
+  DerivedOptions options;
+  options.divergence = options.vorticity = options.density_gradient = true;
+  DerivedFields derived(n_cell, new_n_cell, options);
+
+  // A shear flow with no divergence, and a density wave along z
+  add_field(derived, DerivedFields::source::density, [=](double, double, double z) { return 1.0 + std::cos(k3 * z); });
+  add_field(derived, DerivedFields::source::vx, [=](double, double y, double) {
+    return std::sin(k2 * y) + std::sin(k5 * y);
+  });
+  add_field(derived, DerivedFields::source::vy, [=](double x, double, double) { return std::cos(k1 * x); });
+  add_field(derived, DerivedFields::source::vz, [](double, double, double) { return 0.5; });
+  derived.finish();
+
+  cr_assert_eq(derived.names().size(), 5);
+  const auto& divergence = derived.get("VelocityDivergence");
+  const auto& vorticity = derived.get("VorticityMagnitude");
+  const auto& gradient_x = derived.get("DensityGradientX");
+  const auto& gradient_z = derived.get("DensityGradientZ");
+
+  const double dx = box_size[0] / new_n_cell[0];
+  for (int ii = 0; ii < new_n_cell[0]; ++ii) {
+    for (int jj = 0; jj < new_n_cell[1]; ++jj) {
+      for (int kk = 0; kk < new_n_cell[2]; ++kk) {
+        const int idx = (ii * new_n_cell[1] + jj) * new_n_cell[2] + kk;
+        const double x = ii * dx, y = jj * dx, z = kk * dx;
+
+        // curl_z = d(vy)/dx - d(vx)/dy
+        const double curl = -window(k1) * k1 * std::sin(k1 * x) - window(k2) * k2 * std::cos(k2 * y) -
+                            window(k5) * k5 * std::cos(k5 * y);
+        const double grad_z = -window(k3) * k3 * std::sin(k3 * z);
+
+        cr_assert(std::fabs(divergence[idx]) < 1e-5, "cell %d: %g", idx, divergence[idx]);
+        cr_assert(std::fabs(vorticity[idx] - std::fabs(curl)) < 1e-5, "cell %d: %g != %g", idx, vorticity[idx], curl);
+        cr_assert(std::fabs(gradient_x[idx]) < 1e-5, "cell %d: %g", idx, gradient_x[idx]);
+        cr_assert(std::fabs(gradient_z[idx] - grad_z) < 1e-5, "cell %d: %g != %g", idx, gradient_z[idx], grad_z);
+      }
+    }
+  }
+}
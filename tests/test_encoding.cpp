@@ -0,0 +1,50 @@
+#include <cmath>
+#include <criterion/criterion.h>
+#include <encoding.hpp>
+#include <vector>
+
+Test(encoding, half)
+{
+  cr_assert_eq(float_to_half(1.0f), 0x3c00);
+  cr_assert_eq(float_to_half(-2.0f), 0xc000);
+  cr_assert_eq(float_to_half(65504.0f), 0x7bff);
+  cr_assert_eq(float_to_half(1e6f), 0x7c00);
+  cr_assert_eq(float_to_half(5.9604645e-8f), 0x0001);
+  cr_assert_eq(half_to_float(0x3555), 0.333251953125f);
+  cr_assert_eq(half_to_float(0x0001), 5.9604645e-8f);
+
+  // Ties round to even
+  cr_assert_eq(float_to_half(1.0f + std::ldexp(1.0f, -11)), 0x3c00);
+  cr_assert_eq(float_to_half(1.0f + 3.0f * std::ldexp(1.0f, -11)), 0x3c02);
+}
+
+Test(encoding, bfloat16)
+{
+  cr_assert_eq(float_to_bfloat16(1.0f), 0x3f80);
+  cr_assert_eq(bfloat16_to_float(0x3f80), 1.0f);
+  cr_assert_eq(float_to_bfloat16(1.0f + std::ldexp(1.0f, -8)), 0x3f80);
+  cr_assert_eq(float_to_bfloat16(1.0f + 3.0f * std::ldexp(1.0f, -8)), 0x3f82);
+  cr_assert(std::isnan(bfloat16_to_float(float_to_bfloat16(NAN))));
+}
+
+Test(encoding, bitround)
+{
+  cr_assert_eq(bitround(1.0f + std::ldexp(1.0f, -10), 10), 1.0f + std::ldexp(1.0f, -10));
+  cr_assert_eq(bitround(1.0f + std::ldexp(1.0f, -11), 10), 1.0f);
+  cr_assert_eq(bitround(1.0f + 3.0f * std::ldexp(1.0f, -11), 10), 1.0f + std::ldexp(1.0f, -9));
+  cr_assert_eq(bitround(INFINITY, 4), INFINITY);
+}
+
+Test(encoding, error)
+{
+  std::vector<float> in = { 0.1f, 0.2f, 0.3f, 0.4f };
+  std::vector<uint16_t> out(in.size());
+
+  auto error = encode(in.data(), out.data(), in.size(), output_encoding::float16, 0);
+  cr_assert_gt(error.max_abs, 0.0);
+  cr_assert_leq(error.max_abs, 0.4 * std::ldexp(1.0, -11));
+  cr_assert_leq(error.rms, error.max_abs);
+
+  error = encode(in.data(), in.data(), in.size(), output_encoding::float32, 0);
+  cr_assert_eq(error.max_abs, 0.0);
+}
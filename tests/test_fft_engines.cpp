@@ -0,0 +1,107 @@
+#include <array>
+#include <cmath>
+#include <criterion/criterion.h>
+#include <grid.hpp>
+#include <stdexcept>
+#include <string>
+
+// 16 cells give 9 complex values along z, so the last batch of fused pencils is only partly filled
+static const std::array<int32_t, 3> n_cell = { 16, 16, 16 };
+static const std::array<double, 3> box_size = { 10., 10., 10. };
+
+template <typename T>
+static void fill(Grid<T>& grid)
+{
+  for (int ii = 0; ii < grid.n_logical; ++ii) {
+    grid.get()[ii] = 1.0 + 0.5 * std::sin(0.37 * ii) + 0.25 * std::cos(1.3 * ii);
+  }
+}
+
+/** Check that filtering with `engine` matches the in-place 3D transforms, in both precisions.
+ */
+template <typename T>
+static void check_engine_agrees(const fft_engine engine, const GridBase::filter_type type, const double tolerance)
+{
+  GridOptions options;
+  options.engine = engine;
+
+  Grid<T> reference(n_cell, box_size);
+  Grid<T> grid(n_cell, box_size, options);
+  fill(reference);
+  fill(grid);
+
+  reference.filter(type, 1.5);
+  grid.filter(type, 1.5);
+
+  cr_assert_float_eq(grid.mean, reference.mean, tolerance);
+  double max_diff = 0;
+  for (int ii = 0; ii < reference.n_logical; ++ii) {
+    max_diff = std::fmax(max_diff, std::fabs((double)grid.get()[ii] - (double)reference.get()[ii]));
+  }
+  cr_assert_lt(max_diff, tolerance);
+}
+
+static void check_engines_agree(const GridBase::filter_type type)
+{
+  for (const auto engine : { fft_engine::out_of_place, fft_engine::fused }) {
+    check_engine_agrees<double>(engine, type, 1e-10);
+    check_engine_agrees<float>(engine, type, 1e-5);
+  }
+}
+
+Test(fft_engines, real_top_hat)
+{
+  check_engines_agree(GridBase::filter_type::real_top_hat);
+}
+
+Test(fft_engines, k_top_hat)
+{
+  check_engines_agree(GridBase::filter_type::k_top_hat);
+}
+
+Test(fft_engines, gaussian)
+{
+  check_engines_agree(GridBase::filter_type::gaussian);
+}
+
+Test(fft_engines, out_of_place_input_survives)
+{
+  GridOptions options;
+  options.engine = fft_engine::out_of_place;
+  Grid<double> grid(n_cell, box_size, options);
+  Grid<double> original(n_cell, box_size, options);
+  fill(grid);
+  fill(original);
+
+  // The modes go to the separate buffer, leaving the real field in logical order
+  grid.forward_fft();
+  cr_assert(!grid.flag_padded);
+  cr_assert((void*)grid.get_complex() != (void*)grid.get());
+  for (int ii = 0; ii < grid.n_logical; ++ii) {
+    cr_assert_eq(grid.get()[ii], original.get()[ii]);
+  }
+
+  // Without filtering the round trip recovers the field
+  grid.reverse_fft();
+  for (int ii = 0; ii < grid.n_logical; ++ii) {
+    cr_assert_float_eq(grid.get()[ii], original.get()[ii], 1e-12);
+  }
+}
+
+Test(fft_engines, fused_no_3d_transforms)
+{
+  GridOptions options;
+  options.engine = fft_engine::fused;
+  Grid<float> grid({ 8, 8, 8 }, box_size, options);
+
+  // Only filter can transform a fused grid, and the 3D transforms say so rather than failing to find their plans
+  for (const bool forward : { true, false }) {
+    std::string message;
+    try {
+      forward ? grid.forward_fft() : grid.reverse_fft();
+    } catch (const std::runtime_error& error) {
+      message = error.what();
+    }
+    cr_assert(message.find("only filter") != std::string::npos);
+  }
+}
@@ -1,8 +1,20 @@
 #include <array>
+#include <cmath>
 #include <criterion/criterion.h>
+#include <cstdio>
+#include <fstream>
+#include <gaussian.hpp>
 #include <grid.hpp>
+#include <memory>
+#include <omp.h>
+#include <profile.hpp>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
-Test(filter, basic)
+template <typename T>
+static void check_filter_basic()
 {
 
   const float tolerance = 1e-5;
@@ -10,7 +22,7 @@ Test(filter, basic)
   std::array<int32_t, 3> n_cell = { 32, 32, 32 };
   std::array<double, 3> box_size = { 10., 10., 10. };
 
-  auto grid = Grid(n_cell, box_size);
+  auto grid = Grid<T>(n_cell, box_size);
   cr_assert(true);
 
   auto rgrid = grid.get();
@@ -19,11 +31,11 @@ Test(filter, basic)
     rgrid[ii] = 0.0;
   }
 
-  auto center = grid.index(n_cell[0] / 2, n_cell[1] / 2, n_cell[2] / 2, Grid::index_type::real);
+  auto center = grid.index(n_cell[0] / 2, n_cell[1] / 2, n_cell[2] / 2, GridBase::index_type::real);
   rgrid[center] = 10.0;
 
   auto radius = 2.0;
-  grid.filter(Grid::filter_type::real_top_hat, radius);
+  grid.filter(GridBase::filter_type::real_top_hat, radius);
 
   auto rgrid_total = 0.0;
   for (int ii = 0; ii < grid.n_logical; ++ii) {
@@ -33,3 +45,127 @@ Test(filter, basic)
   cr_assert_float_eq(rgrid_total, 10.0, tolerance);
   cr_assert_float_eq(rgrid[0], 0.0, tolerance);
 }
+
+Test(filter, basic)
+{
+  check_filter_basic<float>();
+}
+
+Test(filter, basic_double)
+{
+  check_filter_basic<double>();
+}
+
+static void fill_wave(float* values, const std::array<int32_t, 3> n_cell)
+{
+  for (int ii = 0; ii < n_cell[0] * n_cell[1] * n_cell[2]; ++ii) {
+    values[ii] = 1.0f + std::sin(0.37f * ii);
+  }
+}
+
+Test(filter, background_planning)
+{
+  const std::array<int32_t, 3> n_cell = { 16, 16, 16 };
+  const std::array<double, 3> box_size = { 10., 10., 10. };
+  const double radius = 1.25;
+
+  // Synchronous planning: the grid is only written once the plans are ready
+  auto reference = Grid<float>(n_cell, box_size);
+  reference.wait_for_plans();
+  fill_wave(reference.get(), n_cell);
+  reference.filter(GridBase::filter_type::real_top_hat, radius);
+
+  // Without wisdom the plans are made in the background, so write into the grids while that is running.  Several
+  // grids and a smoother plan at once, all of which must share the FFTW planner.
+  std::remove(Grid<float>::wisdom_filename(n_cell, omp_get_max_threads()).c_str());
+  std::vector<std::unique_ptr<Grid<float>>> grids(3);
+  std::vector<std::thread> threads;
+  for (auto& grid : grids) {
+    threads.emplace_back([&grid, n_cell, box_size]() {
+      grid.reset(new Grid<float>(n_cell, box_size));
+      fill_wave(grid->get(), n_cell);
+    });
+  }
+  threads.emplace_back([n_cell, box_size, radius]() {
+    GaussianSmoother smoother(n_cell, { 8, 8, 8 }, box_size, radius, GaussianSmoother::convolution::fft);
+  });
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (auto& grid : grids) {
+    grid->filter(GridBase::filter_type::real_top_hat, radius);
+    for (int ii = 0; ii < grid->n_logical; ++ii) {
+      cr_assert_float_eq(grid->get()[ii], reference.get()[ii], 1e-5);
+    }
+  }
+}
+
+Test(filter, first_touch)
+{
+  const std::array<int32_t, 3> n_cell = { 16, 16, 16 };
+  const std::array<double, 3> box_size = { 10., 10., 10. };
+
+  // A first-touched grid is only placed differently, so it filters identically
+  for (const auto engine : { fft_engine::fftw_3d, fft_engine::out_of_place, fft_engine::fused }) {
+    GridOptions options;
+    options.engine = engine;
+    auto reference = Grid<float>(n_cell, box_size, options);
+    options.first_touch = true;
+    auto touched = Grid<float>(n_cell, box_size, options);
+
+    fill_wave(reference.get(), n_cell);
+    fill_wave(touched.get(), n_cell);
+    reference.filter(GridBase::filter_type::real_top_hat, 1.25);
+    touched.filter(GridBase::filter_type::real_top_hat, 1.25);
+    for (int ii = 0; ii < reference.n_logical; ++ii) {
+      cr_assert_float_eq(touched.get()[ii], reference.get()[ii], 1e-6);
+    }
+  }
+}
+
+/** Return the start and end time (in us) of the latest span with the given name in a trace.
+ */
+static std::array<double, 2> last_span(const std::string& trace, const std::string& name)
+{
+  std::array<double, 2> times = { -1, -1 };
+  const std::string key = "\"name\": \"" + name + "\", \"cat\"";
+  for (size_t event = trace.find(key); event != std::string::npos; event = trace.find(key, event + 1)) {
+    const double start = std::stod(trace.substr(trace.find("\"ts\": ", event) + 6));
+    if (start > times[0]) {
+      times = { start, start + std::stod(trace.substr(trace.find("\"dur\": ", event) + 7)) };
+    }
+  }
+  cr_assert(times[0] >= 0);
+  return times;
+}
+
+Test(filter, first_touch_before_planning)
+{
+  const std::array<int32_t, 3> n_cell = { 16, 16, 16 };
+  const std::string fname = "test_filter_first_touch.json";
+  enable_tracing();
+
+  // The planner writes to the buffers it is given, so the pages must already have been placed by then.  The fused
+  // plans are made in the constructor, while the others are made in the background without wisdom.
+  for (const auto engine : { fft_engine::fused, fft_engine::fftw_3d }) {
+    GridOptions options;
+    options.engine = engine;
+    options.first_touch = true;
+    {
+      // Destroying the grid waits for any background planning
+      Grid<float> grid(n_cell, { 10., 10., 10. }, options);
+    }
+
+    write_trace(fname);
+    std::ifstream ifs(fname);
+    std::stringstream buffer;
+    buffer << ifs.rdbuf();
+    const auto trace = buffer.str();
+
+    const auto touch = last_span(trace, "first touch");
+    const auto plan = last_span(trace, "plan");
+    cr_assert_leq(touch[1], plan[0]);
+  }
+  std::remove(fname.c_str());
+}
@@ -0,0 +1,77 @@
+#include <array>
+#include <cmath>
+#include <criterion/criterion.h>
+#include <gaussian.hpp>
+#include <grid.hpp>
+#include <vector>
+
+/** Check the streamed separable smoothing against the 3D FFT filter and sample.
+ */
+static void check_against_grid(const double R, const GaussianSmoother::convolution mode)
+{
+  const double tolerance = 1e-6;
+
+  const std::array<int, 3> n_cell = { 24, 24, 24 };
+  const std::array<int, 3> new_n_cell = { 6, 6, 6 };
+  const std::array<double, 3> box_size = { 12.0, 12.0, 12.0 };
+
+  Grid<double> grid(n_cell, box_size);
+  std::vector<float> values(grid.n_logical);
+  for (int ii = 0; ii < grid.n_logical; ++ii) {
+    values[ii] = (float)((ii * 7919) % 101) / 101.0f;
+    grid.get()[ii] = values[ii];
+  }
+
+  grid.filter(GridBase::filter_type::gaussian, R);
+  grid.sample(new_n_cell);
+
+  GaussianSmoother smoother(n_cell, new_n_cell, box_size, R, mode);
+  for (int i_out = 0; i_out < new_n_cell[0]; ++i_out) {
+    smoother.add_slab(values.data() + i_out * smoother.slab_size(), i_out);
+  }
+  auto out = smoother.get();
+
+  for (int ii = 0; ii < grid.n_logical; ++ii) {
+    cr_assert(std::fabs(out[ii] - grid.get()[ii]) < tolerance, "cell %d: %g != %g", ii, out[ii], grid.get()[ii]);
+  }
+}
+
+Test(gaussian, direct)
+{
+  check_against_grid(1.0, GaussianSmoother::convolution::direct);
+}
+
+Test(gaussian, fft)
+{
+  check_against_grid(1.0, GaussianSmoother::convolution::fft);
+}
+
+Test(gaussian, wide_kernel)
+{
+  // The kernel wraps around the whole box
+  check_against_grid(8.0, GaussianSmoother::convolution::direct);
+  check_against_grid(8.0, GaussianSmoother::convolution::automatic);
+}
+
+Test(gaussian, estimate_bytes)
+{
+  const std::array<int, 3> n_cell = { 256, 256, 256 };
+  const std::array<int, 3> new_n_cell = { 64, 64, 64 };
+  const std::array<double, 3> box_size = { 100.0, 100.0, 100.0 };
+  const size_t n_out = (size_t)64 * 64 * 64;
+
+  // A narrow kernel is convolved directly, accumulating the output in double precision
+  GaussianSmoother narrow(n_cell, new_n_cell, box_size, 2.0);
+  cr_assert(!narrow.use_fft[0]);
+  const size_t narrow_bytes = GaussianSmoother::estimate_bytes(n_cell, new_n_cell, box_size, 2.0, 1);
+  cr_assert_gt(narrow_bytes, n_out * (sizeof(float) + sizeof(double)));
+
+  // A wide kernel is done with FFTs along the 1st dimension, which hold every reduced input plane
+  GaussianSmoother wide(n_cell, new_n_cell, box_size, 20.0);
+  cr_assert(wide.use_fft[0]);
+  const size_t wide_bytes = GaussianSmoother::estimate_bytes(n_cell, new_n_cell, box_size, 20.0, 1);
+  cr_assert_gt(wide_bytes, (size_t)n_cell[0] * 64 * 64 * sizeof(double));
+
+  // Each thread has its own scratch
+  cr_assert_gt(GaussianSmoother::estimate_bytes(n_cell, new_n_cell, box_size, 20.0, 8), wide_bytes);
+}
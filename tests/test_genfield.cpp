@@ -0,0 +1,76 @@
+#include <array>
+#include <cmath>
+#include <criterion/criterion.h>
+#include <cstdio>
+#include <fstream>
+#include <genfield.hpp>
+#include <omp.h>
+#include <vector>
+
+static std::vector<float> generate(const int n_threads, const std::string scratch_fname, const int i_grid = 0)
+{
+  const std::array<int, 3> n_cell = { 16, 12, 10 };
+  const std::array<double, 3> box_size = { 10., 8., 6. };
+  const size_t plane_size = (size_t)n_cell[1] * n_cell[2];
+
+  omp_set_num_threads(n_threads);
+  GaussianRandomField field(n_cell, box_size, power_law(0.5, -1.5), 42, scratch_fname);
+  std::vector<float> values(n_cell[0] * plane_size);
+  for (int ii = 0; ii < n_cell[0]; ++ii) {
+    field.fill(i_grid, ii, values.data() + ii * plane_size);
+  }
+  return values;
+}
+
+Test(genfield, deterministic)
+{
+  const auto reference = generate(1, "");
+  cr_assert(generate(3, "") == reference);
+  cr_assert(generate(2, "test_genfield.scratch") == reference);
+  cr_assert(generate(1, "", 1) != reference);
+
+  std::ifstream ifs("test_genfield.scratch");
+  cr_assert(!ifs.good());
+}
+
+Test(genfield, white_noise)
+{
+  // Every mode but the zero mode has variance P / V, so the variance of the field is (N - 1) P / V
+  const std::array<int, 3> n_cell = { 32, 32, 32 };
+  const std::array<double, 3> box_size = { 4., 4., 4. };
+  const double p = 2.0;
+  const int n_logical = n_cell[0] * n_cell[1] * n_cell[2];
+
+  GaussianRandomField field(n_cell, box_size, [p](const double) { return p; }, 1);
+  std::vector<float> plane(n_cell[1] * n_cell[2]);
+  double sum = 0, sum_sq = 0;
+  for (int ii = 0; ii < n_cell[0]; ++ii) {
+    field.fill(0, ii, plane.data());
+    for (const auto value : plane) {
+      sum += value;
+      sum_sq += (double)value * value;
+    }
+  }
+
+  const double expected = (n_logical - 1) * p / 64.0;
+  cr_assert(std::fabs(sum / n_logical) < 1e-4);
+  cr_assert(std::fabs(sum_sq / n_logical / expected - 1.0) < 0.05);
+}
+
+Test(genfield, tabulated_power)
+{
+  const std::string fname = "test_genfield.pk";
+  {
+    std::ofstream ofs(fname);
+    ofs << "# k n_modes P\n0.1 10 100\n1.0 20 1\n2.0 30 0\n";
+  }
+
+  auto power = read_power_spectrum(fname, 3);
+  cr_assert(std::fabs(power(0.1) - 100) < 1e-9);
+  cr_assert(std::fabs(power(std::sqrt(0.1)) - 10) < 1e-9);
+  cr_assert(std::fabs(power(1.5) - 0.5) < 1e-9);
+  cr_assert_eq(power(0.05), 0);
+  cr_assert_eq(power(3.0), 0);
+
+  std::remove(fname.c_str());
+}
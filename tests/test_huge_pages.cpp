@@ -0,0 +1,53 @@
+#include <array>
+#include <cmath>
+#include <criterion/criterion.h>
+#include <cstdint>
+#include <grid.hpp>
+#include <huge_pages.hpp>
+
+Test(huge_pages, off)
+{
+  huge_page_mode used = huge_page_mode::huge_2m;
+  cr_assert(allocate_huge(1 << 20, huge_page_mode::off, used) == nullptr);
+  cr_assert_eq(used, huge_page_mode::off);
+}
+
+Test(huge_pages, fallback)
+{
+  // Whatever is available on this machine, the buffer must be usable and at least 2 MiB aligned
+  const size_t bytes = 3 << 20;
+  huge_page_mode used;
+  auto ptr = static_cast<char*>(allocate_huge(bytes, huge_page_mode::huge_1g, used));
+
+  if (ptr == nullptr) {
+    cr_assert_eq(used, huge_page_mode::off);
+    return;
+  }
+
+  cr_assert(used != huge_page_mode::off);
+  cr_assert_eq((uintptr_t)ptr % (1 << 21), 0);
+  for (size_t ii = 0; ii < bytes; ii += 4096) {
+    ptr[ii] = 1;
+  }
+  free_huge(ptr, bytes, used);
+}
+
+Test(huge_pages, grid)
+{
+  std::array<int32_t, 3> n_cell = { 16, 16, 16 };
+  std::array<double, 3> box_size = { 10., 10., 10. };
+  GridOptions options;
+  options.huge_pages = huge_page_mode::huge_1g;
+
+  Grid<float> plain(n_cell, box_size);
+  Grid<float> huge(n_cell, box_size, options);
+  for (int ii = 0; ii < plain.n_logical; ++ii) {
+    plain.get()[ii] = huge.get()[ii] = (float)((ii * 7919) % 101);
+  }
+
+  plain.filter(GridBase::filter_type::real_top_hat, 1.5);
+  huge.filter(GridBase::filter_type::real_top_hat, 1.5);
+  for (int ii = 0; ii < plain.n_logical; ++ii) {
+    cr_assert(std::fabs(plain.get()[ii] - huge.get()[ii]) < 1e-5);
+  }
+}
@@ -0,0 +1,284 @@
+#include <H5Cpp.h>
+#include <cmath>
+#include <criterion/criterion.h>
+#include <cstdio>
+#include <fstream>
+#include <gbptrees.hpp>
+#include <journal.hpp>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <synthetic.hpp>
+#include <vector>
+#include <velociraptor.hpp>
+
+static std::string read_file(const std::string fname)
+{
+  std::ifstream ifs(fname, std::ios::binary);
+  std::stringstream buffer;
+  buffer << ifs.rdbuf();
+  return buffer.str();
+}
+
+static bool exists(const std::string fname)
+{
+  return std::ifstream(fname).good();
+}
+
+static JournalEntry make_entry(const std::string name, const size_t offset)
+{
+  JournalEntry entry;
+  entry.name = name;
+  entry.offset = offset;
+  entry.bytes = 4096;
+  entry.checksum = checksum(name.data(), name.size());
+  entry.stats.n = 1024;
+  entry.stats.min = 0.25;
+  entry.stats.max = 1.0 / 3.0;
+  entry.stats.histogram = { 1, 2, 3 };
+  return entry;
+}
+
+Test(journal, checksum)
+{
+  // The published FNV-1a test vectors
+  cr_assert_eq(checksum("", 0), 0xcbf29ce484222325ULL);
+  cr_assert_eq(checksum("a", 1), 0xaf63dc4c8601ec8cULL);
+  cr_assert_eq(checksum("bar", 3, checksum("foo", 3)), checksum("foobar", 6));
+}
+
+Test(journal, round_trip)
+{
+  const std::string fname_out = "test_journal.out";
+  std::remove((fname_out + ".journal").c_str());
+  {
+    Journal journal(fname_out, "job a");
+    cr_assert(journal.entries.empty());
+    journal.start(0);
+    journal.record(make_entry("density", 44));
+    journal.record(make_entry("grid with spaces", 4140));
+  }
+
+  {
+    Journal journal(fname_out, "job a");
+    cr_assert_eq(journal.entries.size(), 2);
+    const auto& entry = journal.entries[1];
+    cr_assert(entry.name == "grid with spaces");
+    cr_assert_eq(entry.offset, 4140);
+    cr_assert_eq(entry.bytes, 4096);
+    cr_assert_eq(entry.checksum, checksum(entry.name.data(), entry.name.size()));
+    cr_assert_eq(entry.stats.n, 1024);
+    cr_assert_eq(entry.stats.max, 1.0 / 3.0);
+    cr_assert(std::isnan(entry.stats.mean));
+    cr_assert(entry.stats.histogram == std::vector<int64_t>({ 1, 2, 3 }));
+
+    // Keeping only the first entry rewrites the file
+    journal.start(1);
+  }
+  cr_assert_eq(Journal(fname_out, "job a").entries.size(), 1);
+
+  // A partially written line is ignored
+  {
+    std::ofstream ofs(fname_out + ".journal", std::ios::app);
+    ofs << "4140 4096 00";
+  }
+  cr_assert_eq(Journal(fname_out, "job a").entries.size(), 1);
+
+  // As is a journal written by a different job
+  cr_assert(Journal(fname_out, "job b").entries.empty());
+
+  Journal journal(fname_out, "job a");
+  journal.start(1);
+  journal.remove();
+  cr_assert(!exists(fname_out + ".journal"));
+}
+
+/** Write a gbpTrees file of `n_grids` grids of 8^3 cells.
+ */
+static void write_gbptrees(const std::string fname, const int n_grids, const float offset)
+{
+  std::ofstream ofs(fname, std::ios::binary);
+  const int n_cell[3] = { 8, 8, 8 };
+  const double box_size[3] = { 10., 10., 10. };
+  const int ma_scheme = 0;
+  ofs.write((const char*)n_cell, sizeof(n_cell));
+  ofs.write((const char*)box_size, sizeof(box_size));
+  ofs.write((const char*)&n_grids, sizeof(int));
+  ofs.write((const char*)&ma_scheme, sizeof(int));
+  for (int ii = 0; ii < n_grids; ++ii) {
+    std::string ident(32, '\0');
+    ident.replace(0, 5, "grid" + std::to_string(ii));
+    ofs.write(ident.data(), 32);
+    for (int jj = 0; jj < 512; ++jj) {
+      const float value = offset + 1.0f + 0.5f * std::sin(0.37f * jj + ii);
+      ofs.write((const char*)&value, sizeof(float));
+    }
+  }
+}
+
+Test(journal, resume_gbptrees)
+{
+  const std::string fname_in = "test_journal.gbp";
+  const std::string fname_ref = "test_journal_ref.gbp";
+  const std::string fname_out = "test_journal_out.gbp";
+  RegridOptions options;
+  options.method = regrid_method::block_average;
+
+  write_gbptrees(fname_in, 3, 0.0f);
+  regrid_gbptrees<float>(fname_in, fname_ref, 4, options);
+  cr_assert(!exists(fname_ref + ".journal"));
+  const auto reference = read_file(fname_ref);
+  const size_t header_bytes = 44;
+  const size_t grid_bytes = 32 + 64 * sizeof(float);
+  cr_assert_eq(reference.size(), header_bytes + 3 * grid_bytes);
+
+  // Simulate a run which was killed while writing the second grid.  The first grid of the input is changed, so that
+  // the output only matches the reference if that grid is not recomputed.
+  write_gbptrees(fname_in, 3, 1.0f);
+  {
+    std::ofstream ofs(fname_out, std::ios::binary);
+    ofs << reference.substr(0, header_bytes + grid_bytes + 100);
+  }
+  {
+    Journal journal(fname_out, job_signature(fname_in, 4, options.method, options, sizeof(float)));
+    journal.start(0);
+    JournalEntry entry;
+    entry.name = "grid0";
+    entry.offset = header_bytes;
+    entry.bytes = grid_bytes;
+    entry.checksum = checksum(reference.data() + header_bytes, grid_bytes);
+    entry.stats = compute_stats(
+      (const float*)(reference.data() + header_bytes + 32), 64, std::numeric_limits<double>::quiet_NaN());
+    journal.record(entry);
+  }
+
+  regrid_gbptrees<float>(fname_in, fname_out, 4, options);
+  const auto resumed = read_file(fname_out);
+  cr_assert(resumed.substr(0, header_bytes + grid_bytes) == reference.substr(0, header_bytes + grid_bytes));
+  cr_assert(resumed.substr(header_bytes + grid_bytes) != reference.substr(header_bytes + grid_bytes));
+  cr_assert(!exists(fname_out + ".journal"));
+
+  // A journal which doesn't match the output is ignored, so every grid is recomputed
+  {
+    Journal journal(fname_out, job_signature(fname_in, 4, options.method, options, sizeof(float)));
+    journal.start(0);
+    JournalEntry entry;
+    entry.name = "grid0";
+    entry.offset = header_bytes;
+    entry.bytes = grid_bytes;
+    entry.checksum = 42;
+    journal.record(entry);
+  }
+  regrid_gbptrees<float>(fname_in, fname_out, 4, options);
+  regrid_gbptrees<float>(fname_in, fname_ref, 4, options);
+  cr_assert(read_file(fname_out) == read_file(fname_ref));
+  cr_assert(read_file(fname_out + ".stats") == read_file(fname_ref + ".stats"));
+}
+
+// Added to every value of the synthetic VELOCIraptor grids, so that recomputed fields can be told apart
+static float velociraptor_offset = 0.0f;
+
+static void fill_velociraptor(const int i_grid, const int i, float* plane)
+{
+  for (int jj = 0; jj < 64; ++jj) {
+    plane[jj] = velociraptor_offset + 1.0f + 0.5f * std::sin(0.37f * (i * 64 + jj) + i_grid);
+  }
+}
+
+static void write_velociraptor(const std::string fname, const float offset)
+{
+  velociraptor_offset = offset;
+  write_synthetic_velociraptor(fname, { 8, 8, 8 }, { 10., 10., 10. }, fill_velociraptor);
+}
+
+static std::vector<float> read_field(const std::string fname, const std::string name)
+{
+  auto ds = H5::H5File(fname, H5F_ACC_RDONLY).openDataSet("/PartType1/Grids/" + name);
+  std::vector<float> values(ds.getSpace().getSimpleExtentNpoints());
+  ds.read(values.data(), H5::PredType::NATIVE_FLOAT);
+  return values;
+}
+
+static JournalEntry field_entry(const std::string fname, const std::string name)
+{
+  const auto values = read_field(fname, name);
+  JournalEntry entry;
+  entry.name = name;
+  entry.bytes = values.size() * sizeof(float);
+  entry.checksum = checksum(values.data(), entry.bytes);
+  entry.stats = compute_stats(values.data(), values.size(), std::numeric_limits<double>::quiet_NaN());
+  return entry;
+}
+
+static void regrid_velociraptor_to(const std::string fname_in,
+                                   const std::string fname_out,
+                                   const RegridOptions& options)
+{
+  create_velociraptor_output(fname_out, 8);
+  regrid_velociraptor<float>(fname_in, fname_out, 4, options);
+}
+
+Test(journal, resume_velociraptor)
+{
+  const std::string fname_in = "test_journal_vr.h5";
+  const std::string fname_ref = "test_journal_vr_ref.h5";
+  const std::string fname_out = "test_journal_vr_out.h5";
+  RegridOptions options;
+  options.method = regrid_method::block_average;
+
+  write_velociraptor(fname_in, 0.0f);
+  regrid_velociraptor_to(fname_in, fname_ref, options);
+  cr_assert(!exists(fname_ref + ".journal"));
+
+  // Simulate a run which was killed while writing Vz: Vx and Vy are journalled, Vz is in the output but its journal
+  // entry was cut short, and Density was never written.  The input is changed, so that the output only matches the
+  // reference where a field is not recomputed.
+  {
+    std::ofstream ofs(fname_out, std::ios::binary);
+    ofs << read_file(fname_ref);
+  }
+  H5::H5File(fname_out, H5F_ACC_RDWR).openGroup("/PartType1/Grids").unlink("Density");
+  write_velociraptor(fname_in, 1.0f);
+  {
+    Journal journal(fname_out, job_signature(fname_in, 4, options.method, options, sizeof(float)));
+    journal.start(0);
+    journal.record(field_entry(fname_out, "Vx"));
+    journal.record(field_entry(fname_out, "Vy"));
+  }
+  {
+    std::ofstream ofs(fname_out + ".journal", std::ios::app);
+    ofs << "0 256 00";
+  }
+
+  regrid_velociraptor<float>(fname_in, fname_out, 4, options);
+  cr_assert(!exists(fname_out + ".journal"));
+  cr_assert(read_field(fname_out, "Vx") == read_field(fname_ref, "Vx"));
+  cr_assert(read_field(fname_out, "Vy") == read_field(fname_ref, "Vy"));
+  cr_assert(read_field(fname_out, "Vz") != read_field(fname_ref, "Vz"));
+  cr_assert(read_field(fname_out, "Density") != read_field(fname_ref, "Density"));
+
+  // The recomputed fields replace the stale Vz dataset, and match a fresh run on the new input
+  regrid_velociraptor_to(fname_in, fname_ref, options);
+  cr_assert(read_field(fname_out, "Vz") == read_field(fname_ref, "Vz"));
+  cr_assert(read_field(fname_out, "Density") == read_field(fname_ref, "Density"));
+
+  // A journal whose checksum doesn't match the output forces every field to be recomputed
+  write_velociraptor(fname_in, 2.0f);
+  {
+    Journal journal(fname_out, job_signature(fname_in, 4, options.method, options, sizeof(float)));
+    journal.start(0);
+    auto entry = field_entry(fname_out, "Vx");
+    entry.checksum ^= 1;
+    journal.record(entry);
+  }
+  regrid_velociraptor<float>(fname_in, fname_out, 4, options);
+  regrid_velociraptor_to(fname_in, fname_ref, options);
+  for (const auto& name : velociraptor_grid_names()) {
+    cr_assert(read_field(fname_out, name) == read_field(fname_ref, name));
+  }
+  cr_assert(!exists(fname_out + ".journal"));
+
+  std::remove(fname_in.c_str());
+  std::remove(fname_ref.c_str());
+  std::remove(fname_out.c_str());
+}
@@ -0,0 +1,108 @@
+#include <array>
+#include <cmath>
+#include <complex>
+#include <criterion/criterion.h>
+#include <cstring>
+#include <kernels.hpp>
+#include <string>
+#include <utils.hpp>
+#include <vector>
+
+Test(kernels, isa)
+{
+  const std::string isa = kernel_isa();
+  cr_assert(isa == "avx512f" || isa == "avx2" || isa == "default");
+}
+
+Test(kernels, filter_row)
+{
+  // Each row must match filtering the modes one at a time
+  const int n = 37;
+  const double k_xy2 = 0.7;
+  const double delta_k = 0.15;
+  const double R = 2.5;
+  for (const auto type : { GridBase::filter_type::real_top_hat,
+                           GridBase::filter_type::k_top_hat,
+                           GridBase::filter_type::gaussian }) {
+    std::vector<std::complex<double>> row(n);
+    std::vector<std::complex<float>> row_float(n);
+    for (int ii = 0; ii < n; ++ii) {
+      row[ii] = std::complex<double>(1.0 + 0.1 * ii, 0.5 - 0.2 * ii);
+      row_float[ii] = std::complex<float>(1.0f + 0.1f * ii, 0.5f - 0.2f * ii);
+    }
+    auto expected = row;
+    auto expected_float = row_float;
+    for (int ii = 0; ii < n; ++ii) {
+      const double k_z = ii * delta_k;
+      apply_filter(expected[ii], type, sqrt(k_xy2 + k_z * k_z) * R);
+      apply_filter(expected_float[ii], type, sqrt(k_xy2 + k_z * k_z) * R);
+    }
+
+    filter_row(row.data(), n, k_xy2, delta_k, R, type);
+    filter_row(row_float.data(), n, k_xy2, delta_k, R, type);
+    for (int ii = 0; ii < n; ++ii) {
+      cr_assert_float_eq(row[ii].real(), expected[ii].real(), 1e-15);
+      cr_assert_float_eq(row[ii].imag(), expected[ii].imag(), 1e-15);
+      cr_assert_float_eq(row_float[ii].real(), expected_float[ii].real(), 1e-6);
+      cr_assert_float_eq(row_float[ii].imag(), expected_float[ii].imag(), 1e-6);
+    }
+  }
+}
+
+Test(kernels, sample_row)
+{
+  std::vector<double> row(64);
+  for (int ii = 0; ii < 64; ++ii) {
+    row[ii] = ii;
+  }
+  std::vector<double> out(16);
+  sample_row(row.data(), out.data(), 16, 4);
+  for (int ii = 0; ii < 16; ++ii) {
+    cr_assert_eq(out[ii], 4.0 * ii);
+  }
+}
+
+Test(kernels, widen_narrow)
+{
+  // Not a multiple of the block size, so the last block is partial
+  const size_t n = 3 * convert_block_size + 123;
+  std::vector<double> data(n);
+  std::vector<float> values(n);
+  for (size_t ii = 0; ii < n; ++ii) {
+    values[ii] = 0.25f * ii - 17.0f;
+  }
+  std::memcpy(data.data(), values.data(), sizeof(float) * n);
+
+  widen_in_place(data.data(), n);
+  for (size_t ii = 0; ii < n; ++ii) {
+    cr_assert_eq(data[ii], (double)values[ii]);
+  }
+
+  const float* narrowed = narrow_in_place(data.data(), n);
+  for (size_t ii = 0; ii < n; ++ii) {
+    cr_assert_eq(narrowed[ii], values[ii]);
+  }
+}
+
+Test(kernels, pad_rows)
+{
+  const size_t n_rows = 6;
+  const size_t n = 5;
+  const size_t n_padded = 2 * (n / 2 + 1);
+  std::vector<float> data(n_rows * n_padded);
+  for (size_t ii = 0; ii < n_rows * n; ++ii) {
+    data[ii] = (float)ii;
+  }
+
+  pad_rows(data.data(), n_rows, n, n_padded);
+  for (size_t row = 0; row < n_rows; ++row) {
+    for (size_t ii = 0; ii < n; ++ii) {
+      cr_assert_eq(data[row * n_padded + ii], (float)(row * n + ii));
+    }
+  }
+
+  unpad_rows(data.data(), n_rows, n, n_padded);
+  for (size_t ii = 0; ii < n_rows * n; ++ii) {
+    cr_assert_eq(data[ii], (float)ii);
+  }
+}
@@ -0,0 +1,254 @@
+#include <array>
+#include <cmath>
+#include <criterion/criterion.h>
+#include <cstdio>
+#include <fstream>
+#include <npy.hpp>
+#include <stdexcept>
+#include <string>
+#include <synthetic.hpp>
+#include <vector>
+
+/** Does parsing the header throw?
+ */
+static bool header_throws(const std::string& header)
+{
+  try {
+    parse_npy_header(header.data(), header.size());
+  } catch (const std::runtime_error&) {
+    return true;
+  }
+  return false;
+}
+
+/** Return a version 1.0 header with the given dictionary.
+ */
+static std::string v1_header(const std::string& dict)
+{
+  std::string header("\x93NUMPY\x01\x00", 8);
+  header.push_back(static_cast<char>(dict.size() & 0xff));
+  header.push_back(static_cast<char>((dict.size() >> 8) & 0xff));
+  return header + dict;
+}
+
+static void fill(const int, const int, float* plane)
+{
+  for (int ii = 0; ii < 8 * 8; ++ii) {
+    plane[ii] = 2.0f;
+  }
+}
+
+Test(npy, header_v1)
+{
+  const auto header = make_npy_header({ 4, 8, 16 });
+  cr_assert_eq(header.size() % 64, 0);
+
+  const auto parsed = parse_npy_header(header.data(), header.size());
+  cr_assert(parsed.descr == "<f4");
+  cr_assert_eq(parsed.shape[0], 4);
+  cr_assert_eq(parsed.shape[1], 8);
+  cr_assert_eq(parsed.shape[2], 16);
+  cr_assert_eq(parsed.data_offset, header.size());
+}
+
+Test(npy, header_v2)
+{
+  const std::string dict = "{'descr': '<f8', 'fortran_order': False, 'shape': (32, 16, 8), }\n";
+  std::string header("\x93NUMPY\x02\x00", 8);
+  for (int ii = 0; ii < 4; ++ii) {
+    header.push_back(static_cast<char>((dict.size() >> (8 * ii)) & 0xff));
+  }
+  header += dict;
+
+  const auto parsed = parse_npy_header(header.data(), header.size());
+  cr_assert(parsed.descr == "<f8");
+  cr_assert_eq(parsed.shape[0], 32);
+  cr_assert_eq(parsed.shape[1], 16);
+  cr_assert_eq(parsed.shape[2], 8);
+  cr_assert_eq(parsed.data_offset, 12 + dict.size());
+}
+
+Test(npy, header_round_trip)
+{
+  for (const std::string descr : { "<f4", "<f8" }) {
+    const auto header = make_npy_header({ 5, 3, 7 }, descr);
+    const auto parsed = parse_npy_header(header.data(), header.size());
+    cr_assert(parsed.descr == descr);
+    cr_assert_eq(parsed.shape[0], 5);
+    cr_assert_eq(parsed.shape[1], 3);
+    cr_assert_eq(parsed.shape[2], 7);
+    cr_assert_eq(parsed.data_offset, header.size());
+  }
+}
+
+Test(npy, header_rejected)
+{
+  cr_assert(header_throws(v1_header("{'descr': '<f4', 'fortran_order': True, 'shape': (4, 4, 4), }\n")));
+  cr_assert(header_throws(v1_header("{'descr': '<i4', 'fortran_order': False, 'shape': (4, 4, 4), }\n")));
+  cr_assert(header_throws(v1_header("{'descr': '>f4', 'fortran_order': False, 'shape': (4, 4, 4), }\n")));
+  cr_assert(header_throws(v1_header("{'descr': '<f4', 'fortran_order': False, 'shape': (4, 4), }\n")));
+  cr_assert(header_throws(v1_header("{'descr': '<f4', 'fortran_order': False, 'shape': (4, 4, 4, 4), }\n")));
+  cr_assert(header_throws(v1_header("{'fortran_order': False, 'shape': (4, 4, 4), }\n")));
+  cr_assert(header_throws(std::string("\x93NUMPY\x01\x00\xff\x00{'descr'", 18)));
+  cr_assert(header_throws("not a numpy file"));
+
+  // The same header is fine in C order
+  cr_assert(!header_throws(v1_header("{'descr': '<f4', 'fortran_order': False, 'shape': (4, 4, 4), }\n")));
+}
+
+Test(npy, regrid_npy)
+{
+  const std::string fname_in = "test_npy_in.npy";
+  const std::string fname_out = "test_npy_out.npy";
+  write_synthetic_npy(fname_in, { 8, 8, 8 }, fill);
+
+  for (const auto method : { regrid_method::fft, regrid_method::block_average }) {
+    RegridOptions options;
+    options.method = method;
+    regrid_npy<float>(fname_in, fname_out, 4, options);
+
+    MappedFile out(fname_out);
+    const auto header = parse_npy_header(out.data(), out.size());
+    cr_assert(header.descr == "<f4");
+    cr_assert_eq(header.shape[0], 4);
+    cr_assert_eq(header.shape[1], 4);
+    cr_assert_eq(header.shape[2], 4);
+    cr_assert_eq(out.size(), header.data_offset + 4 * 4 * 4 * sizeof(float));
+    const float* values = reinterpret_cast<const float*>(out.data() + header.data_offset);
+    for (int ii = 0; ii < 4 * 4 * 4; ++ii) {
+      cr_assert_float_eq(values[ii], 2.0f, 1e-5);
+    }
+  }
+
+  std::remove(fname_in.c_str());
+  std::remove(fname_out.c_str());
+  std::remove((fname_out + ".stats").c_str());
+}
+
+/** Does regridding a `.npy` file of the given shape throw?
+ */
+static bool regrid_throws(const std::array<int, 3> shape, const int new_dim)
+{
+  const std::string fname_in = "test_npy_in_shape.npy";
+  const std::string fname_out = "test_npy_out_shape.npy";
+  {
+    std::ofstream ofs(fname_in, std::ios::binary);
+    const auto header = make_npy_header(shape);
+    ofs.write(header.data(), header.size());
+    const std::vector<float> values((size_t)shape[0] * shape[1] * shape[2], 1.0f);
+    ofs.write(reinterpret_cast<const char*>(values.data()), sizeof(float) * values.size());
+  }
+
+  bool threw = false;
+  try {
+    regrid_npy<float>(fname_in, fname_out, new_dim, RegridOptions());
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+
+  std::remove(fname_in.c_str());
+  std::remove(fname_out.c_str());
+  std::remove((fname_out + ".stats").c_str());
+  return threw;
+}
+
+Test(npy, regrid_npy_shape_rejected)
+{
+  // Only a cube whose dimension is a multiple of the new one is regridded
+  cr_assert(regrid_throws({ 8, 8, 4 }, 4));
+  cr_assert(regrid_throws({ 4, 8, 8 }, 4));
+  cr_assert(regrid_throws({ 8, 8, 8 }, 3));
+  cr_assert(regrid_throws({ 8, 8, 8 }, 0));
+  cr_assert(!regrid_throws({ 8, 8, 8 }, 4));
+}
+
+Test(npy, regrid_npy_double)
+{
+  const std::string fname_in = "test_npy_in_f8.npy";
+  const std::string fname_out = "test_npy_out_f8.npy";
+  {
+    std::ofstream ofs(fname_in, std::ios::binary);
+    const auto header = make_npy_header({ 8, 8, 8 }, "<f8");
+    ofs.write(header.data(), header.size());
+    const std::vector<double> values(8 * 8 * 8, 3.0);
+    ofs.write(reinterpret_cast<const char*>(values.data()), sizeof(double) * values.size());
+  }
+
+  RegridOptions options;
+  options.method = regrid_method::block_average;
+  regrid_npy<double>(fname_in, fname_out, 2, options);
+
+  MappedFile out(fname_out);
+  const auto header = parse_npy_header(out.data(), out.size());
+  cr_assert_eq(header.shape[0], 2);
+  const float* values = reinterpret_cast<const float*>(out.data() + header.data_offset);
+  for (int ii = 0; ii < 2 * 2 * 2; ++ii) {
+    cr_assert_float_eq(values[ii], 3.0f, 1e-5);
+  }
+
+  std::remove(fname_in.c_str());
+  std::remove(fname_out.c_str());
+  std::remove((fname_out + ".stats").c_str());
+}
+
+Test(npy, regrid_raw)
+{
+  const std::string fname_in = "test_npy_in.raw";
+  const std::string fname_out = "test_npy_out.raw";
+  {
+    std::ofstream ofs(fname_in, std::ios::binary);
+    const std::vector<float> values(8 * 8 * 8, 2.0f);
+    ofs.write(reinterpret_cast<const char*>(values.data()), sizeof(float) * values.size());
+  }
+
+  RegridOptions options;
+  options.method = regrid_method::fft;
+  regrid_raw<float>(fname_in, fname_out, 4, options);
+
+  MappedFile out(fname_out);
+  cr_assert_eq(out.size(), 4 * 4 * 4 * sizeof(float));
+  const float* values = reinterpret_cast<const float*>(out.data());
+  for (int ii = 0; ii < 4 * 4 * 4; ++ii) {
+    cr_assert_float_eq(values[ii], 2.0f, 1e-5);
+  }
+
+  // A file which isn't a cube is rejected
+  {
+    std::ofstream ofs(fname_in, std::ios::binary);
+    const std::vector<float> values(7, 1.0f);
+    ofs.write(reinterpret_cast<const char*>(values.data()), sizeof(float) * values.size());
+  }
+  bool threw = false;
+  try {
+    regrid_raw<float>(fname_in, fname_out, 4, options);
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  cr_assert(threw);
+
+  // As is a cube which isn't a multiple of the new dimension
+  {
+    std::ofstream ofs(fname_in, std::ios::binary);
+    const std::vector<float> values(8 * 8 * 8, 1.0f);
+    ofs.write(reinterpret_cast<const char*>(values.data()), sizeof(float) * values.size());
+  }
+  threw = false;
+  try {
+    regrid_raw<float>(fname_in, fname_out, 3, options);
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  cr_assert(threw);
+
+  bool missing = false;
+  try {
+    MappedFile("test_npy_missing.raw");
+  } catch (const std::runtime_error&) {
+    missing = true;
+  }
+  cr_assert(missing);
+
+  std::remove(fname_in.c_str());
+  std::remove(fname_out.c_str());
+  std::remove((fname_out + ".stats").c_str());
+}
@@ -0,0 +1,153 @@
+#include <criterion/criterion.h>
+#include <grid.hpp>
+#include <planner.hpp>
+#include <stdexcept>
+
+static RegridProblem make_problem(const int dim, const int new_dim, const size_t memory_budget)
+{
+  RegridProblem problem = { { dim, dim, dim },
+                            { new_dim, new_dim, new_dim },
+                            { 100.0, 100.0, 100.0 },
+                            100.0 / new_dim * 0.5,
+                            1,
+                            sizeof(float),
+                            4,
+                            memory_budget,
+                            0 };
+  return problem;
+}
+
+Test(planner, equivalence)
+{
+  RegridOptions options;
+  auto estimates = estimate_methods(make_problem(64, 16, (size_t)1 << 40), options, Calibration());
+  cr_assert_eq(estimates.size(), 3);
+  for (const auto& estimate : estimates) {
+    cr_assert(estimate.feasible);
+    cr_assert_eq(estimate.equivalent, estimate.method == regrid_method::fft);
+  }
+
+  // Only the full FFT reproduces the default filter
+  cr_assert_eq(plan_method(make_problem(64, 16, (size_t)1 << 40), options).method, regrid_method::fft);
+}
+
+Test(planner, memory_budget)
+{
+  RegridOptions options;
+  options.filter = GridBase::filter_type::gaussian;
+
+  // The padded 512^3 grid needs 514 MiB, but the streaming path only needs a few MiB
+  auto problem = make_problem(512, 64, (size_t)256 << 20);
+  for (const auto& estimate : estimate_methods(problem, options, Calibration())) {
+    cr_assert_eq(estimate.feasible, estimate.method != regrid_method::fft);
+  }
+  cr_assert_eq(plan_method(problem, options).method, regrid_method::gaussian);
+}
+
+Test(planner, non_integer_ratio)
+{
+  RegridOptions options;
+  options.filter = GridBase::filter_type::gaussian;
+  auto problem = make_problem(64, 20, (size_t)1 << 40);
+  for (const auto& estimate : estimate_methods(problem, options, Calibration())) {
+    cr_assert_eq(estimate.feasible, estimate.method == regrid_method::fft);
+  }
+  cr_assert_eq(plan_method(problem, options).method, regrid_method::fft);
+}
+
+Test(planner, degrade)
+{
+  // Nothing reproducing the top-hat fits, so fall back to the smallest footprint
+  RegridOptions options;
+  auto problem = make_problem(512, 64, (size_t)256 << 20);
+  cr_assert_eq(plan_method(problem, options).method, regrid_method::block_average);
+}
+
+Test(planner, fft_engine)
+{
+  RegridOptions options;
+  options.grid.engine = fft_engine::automatic;
+
+  // The out-of-place transforms are preferred when their complex buffer fits
+  auto problem = make_problem(64, 16, (size_t)1 << 40);
+  auto plan = plan_method(problem, options);
+  cr_assert_eq(plan.method, regrid_method::fft);
+  cr_assert_eq(plan.grid.engine, fft_engine::out_of_place);
+
+  // The padded 64^3 grid needs 1 MiB, or 2 MiB with a planning buffer, which is half of the out-of-place footprint
+  problem.memory_budget = (size_t)3 << 20;
+  plan = plan_method(problem, options);
+  cr_assert_eq(plan.method, regrid_method::fft);
+  cr_assert_eq(plan.grid.engine, fft_engine::fftw_3d);
+
+  // An explicit engine is left alone
+  options.grid.engine = fft_engine::fused;
+  cr_assert_eq(plan_method(problem, options).grid.engine, fft_engine::fused);
+}
+
+Test(planner, fused_engine)
+{
+  RegridOptions options;
+  auto problem = make_problem(64, 16, (size_t)1 << 40);
+  problem.extra_fft_bytes = 1024;
+
+  options.grid.engine = fft_engine::fftw_3d;
+  const auto in_place = estimate_methods(problem, options, Calibration())[0];
+  options.grid.engine = fft_engine::fused;
+  const auto fused = estimate_methods(problem, options, Calibration())[0];
+
+  // One padded grid and the per-thread scratch, with neither a planning buffer nor the cost of planning
+  const size_t padded_bytes = (size_t)64 * 64 * 66 * sizeof(float);
+  cr_assert_eq(fused.method, regrid_method::fft);
+  cr_assert_eq(fused.peak_bytes, padded_bytes + Grid<float>::fused_scratch_bytes(problem.n_cell, 4) + 1024);
+  cr_assert_lt(fused.peak_bytes, in_place.peak_bytes);
+  cr_assert_lt(fused.seconds, in_place.seconds);
+  cr_assert(fused.note.find("wisdom") == std::string::npos);
+
+  // So the fused engine fits a budget which the in-place one, planning on a second buffer, doesn't
+  options.method = regrid_method::fft;
+  problem.memory_budget = (size_t)5 << 18;
+  cr_assert_eq(plan_method(problem, options).grid.engine, fft_engine::fused);
+  options.grid.engine = fft_engine::fftw_3d;
+  bool thrown = false;
+  try {
+    plan_method(problem, options);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  cr_assert(thrown);
+}
+
+Test(planner, refuse)
+{
+  RegridOptions options;
+  options.method = regrid_method::fft;
+  auto problem = make_problem(512, 64, (size_t)256 << 20);
+
+  bool thrown = false;
+  try {
+    plan_method(problem, options);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  cr_assert(thrown);
+
+  // Nothing fits in a tiny budget
+  options.method = regrid_method::automatic;
+  problem.memory_budget = 1024;
+  thrown = false;
+  try {
+    plan_method(problem, options);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  cr_assert(thrown);
+}
+
+Test(planner, memory_size)
+{
+  cr_assert_eq(parse_memory_size("1024"), 1024);
+  cr_assert_eq(parse_memory_size("512M"), (size_t)512 << 20);
+  cr_assert_eq(parse_memory_size("16G"), (size_t)16 << 30);
+  cr_assert_eq(parse_memory_size("1.5GiB"), (size_t)3 << 29);
+}
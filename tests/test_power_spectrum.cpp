@@ -0,0 +1,74 @@
+#include <array>
+#include <cmath>
+#include <criterion/criterion.h>
+#include <grid.hpp>
+#include <power_spectrum.hpp>
+
+static const std::array<int32_t, 3> n_cell = { 16, 16, 16 };
+static const std::array<double, 3> box_size = { 10., 10., 10. };
+static const double volume = 1000.;
+
+Test(power_spectrum, parseval)
+{
+  Grid<double> grid(n_cell, box_size);
+  double mean_sq = 0;
+  for (int ii = 0; ii < grid.n_logical; ++ii) {
+    grid.get()[ii] = (double)((ii * 7919) % 101) / 101.0;
+    mean_sq += grid.get()[ii] * grid.get()[ii] / grid.n_logical;
+  }
+
+  SpectrumAccumulator spectra(n_cell, box_size);
+  spectra.start("noise");
+  grid.filter(GridBase::filter_type::gaussian, 1.0, &spectra);
+
+  // Every mode other than k = 0 lands in a shell, so the spectrum sums to the variance
+  const auto& spectrum = spectra.spectra()[0];
+  const auto& n_modes = spectra.shell_modes();
+  double total = spectrum.mean * spectrum.mean;
+  int64_t total_modes = 1;
+  for (size_t ii = 0; ii < n_modes.size(); ++ii) {
+    total += spectrum.power[ii] * n_modes[ii] / volume;
+    total_modes += n_modes[ii];
+  }
+  cr_assert_eq(total_modes, grid.n_logical);
+  cr_assert(std::fabs(total - mean_sq) < 1e-10, "%g != %g", total, mean_sq);
+}
+
+Test(power_spectrum, plane_wave_cross)
+{
+  // Two waves along x with wavenumber 3 (2 pi / L), 90 degrees out of phase with each other
+  Grid<double> density(n_cell, box_size);
+  Grid<double> velocity(n_cell, box_size);
+  for (int ii = 0; ii < n_cell[0]; ++ii) {
+    for (int jj = 0; jj < n_cell[1] * n_cell[2]; ++jj) {
+      const double phase = 2.0 * M_PI * 3 * ii / n_cell[0];
+      density.get()[ii * n_cell[1] * n_cell[2] + jj] = 1.0 + 0.5 * std::cos(phase);
+      velocity.get()[ii * n_cell[1] * n_cell[2] + jj] = 2.0 * std::cos(phase) + std::sin(phase);
+    }
+  }
+
+  SpectrumAccumulator spectra(n_cell, box_size);
+  spectra.start("Density", true);
+  density.filter(GridBase::filter_type::real_top_hat, 1.0, &spectra);
+  spectra.start("Vx");
+  velocity.filter(GridBase::filter_type::real_top_hat, 1.0, &spectra);
+
+  const auto& results = spectra.spectra();
+  cr_assert_eq(results.size(), 3);
+  cr_assert(results[2].name == "Density x Vx");
+  cr_assert(std::fabs(results[0].mean - 1.0) < 1e-12);
+
+  // All of the power is in the shell at k = 3 (2 pi / L), which is bin 2; only the in-phase part correlates
+  const auto& n_modes = spectra.shell_modes();
+  for (size_t ii = 0; ii < n_modes.size(); ++ii) {
+    const double density_power = results[0].power[ii] * n_modes[ii] / volume;
+    const double velocity_power = results[1].power[ii] * n_modes[ii] / volume;
+    const double cross_power = results[2].power[ii] * n_modes[ii] / volume;
+    const bool wave = ii == 2;
+    cr_assert(std::fabs(density_power - (wave ? 0.125 : 0.0)) < 1e-10, "shell %zu: %g", ii, density_power);
+    cr_assert(std::fabs(velocity_power - (wave ? 2.5 : 0.0)) < 1e-10, "shell %zu: %g", ii, velocity_power);
+    cr_assert(std::fabs(cross_power - (wave ? 0.5 : 0.0)) < 1e-10, "shell %zu: %g", ii, cross_power);
+  }
+  const double delta_k = 2.0 * M_PI / box_size[0];
+  cr_assert(std::fabs(spectra.shell_k()[2] - 3 * delta_k) < 0.5 * delta_k);
+}
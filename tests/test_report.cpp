@@ -0,0 +1,94 @@
+#include <criterion/criterion.h>
+#include <cstdio>
+#include <fstream>
+#include <profile.hpp>
+#include <report.hpp>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+Test(report, json)
+{
+  reset_phase_stats();
+  run_record() = RunRecord();
+
+  // Write then read back a file, so that the phases see some I/O
+  const std::string fname_data = "test_report.dat";
+  {
+    ScopedPhase scope(phase::write);
+    std::ofstream ofs(fname_data, std::ios::binary);
+    ofs << std::string(1 << 16, 'x');
+  }
+  {
+    ScopedPhase scope(phase::read);
+    std::ifstream ifs(fname_data, std::ios::binary);
+    std::stringstream buffer;
+    buffer << ifs.rdbuf();
+    cr_assert_eq(buffer.str().size(), 1 << 16);
+  }
+  const auto& stats = phase_stats();
+  cr_assert(stats[static_cast<int>(phase::write)].written >= (1 << 16));
+  cr_assert(stats[static_cast<int>(phase::read)].read >= (1 << 16));
+
+  run_record().method = "fft";
+  run_record().n_grids = 3;
+  run_record().wisdom_misses = 1;
+  record_fft(1 << 15, 0.5);
+  record_fft(1 << 15, 0.5);
+  cr_assert_eq(run_record().n_ffts, 2);
+  cr_assert_float_eq(run_record().fft_flops, 2 * 2.5 * (1 << 15) * 15, 1e-6);
+
+  RunDescription run;
+  run.input = fname_data;
+  run.format = "raw";
+  run.output = "a \"quoted\" name";
+  run.new_dim = 8;
+  run.precision = "float";
+  run.wall_seconds = 1.5;
+
+  const std::string fname = "test_report.json";
+  write_report(fname, run);
+  std::ifstream ifs(fname);
+  std::stringstream buffer;
+  buffer << ifs.rdbuf();
+  const auto report = buffer.str();
+
+  cr_assert(report.find("\"bytes\": 65536") != std::string::npos);
+  cr_assert(report.find("a \\\"quoted\\\" name") != std::string::npos);
+  cr_assert(report.find("\"method\": \"fft\"") != std::string::npos);
+  cr_assert(report.find("\"n_grids\": 3") != std::string::npos);
+  cr_assert(report.find("\"read\": {\"count\": 1") != std::string::npos);
+  cr_assert(report.find("\"stream\"") == std::string::npos);
+  cr_assert(report.find("\"fft\": {\"count\": 2, \"seconds\": 1.000000, \"gflops\": 0.0024576}") != std::string::npos);
+  cr_assert(report.find("\"wisdom\": {\"hits\": 0, \"misses\": 1}") != std::string::npos);
+
+  std::remove(fname.c_str());
+  std::remove(fname_data.c_str());
+}
+
+Test(report, concurrent_phases)
+{
+  reset_phase_stats();
+  run_record() = RunRecord();
+
+  // Phases entered and FFTs recorded from several threads at once all reach the totals
+  const int n_threads = 4;
+  const int n_phases_per_thread = 200;
+  std::vector<std::thread> threads;
+  for (int ii = 0; ii < n_threads; ++ii) {
+    threads.emplace_back([]() {
+      for (int jj = 0; jj < n_phases_per_thread; ++jj) {
+        ScopedPhase scope(phase::filter);
+        record_fft(8, 1e-3);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  cr_assert_eq(phase_stats()[static_cast<int>(phase::filter)].count, n_threads * n_phases_per_thread);
+  cr_assert_eq(run_record().n_ffts, n_threads * n_phases_per_thread);
+  cr_assert_float_eq(run_record().fft_flops, n_threads * n_phases_per_thread * 2.5 * 8 * 3, 1e-6);
+}
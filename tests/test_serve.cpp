@@ -0,0 +1,166 @@
+#include <chrono>
+#include <climits>
+#include <criterion/criterion.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <grid.hpp>
+#include <serve.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/** Send a request, retrying while the server starts listening.
+ */
+static std::vector<std::string> request(const std::string socket_path, const std::vector<std::string>& request)
+{
+  for (int attempt = 0;; ++attempt) {
+    try {
+      return send_request(socket_path, request);
+    } catch (const std::runtime_error&) {
+      if (attempt == 100) {
+        throw;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  }
+}
+
+Test(serve, round_trip)
+{
+  const std::string socket_path = "test_serve.sock";
+  std::vector<std::vector<std::string>> received;
+  std::thread server([&]() {
+    serve(socket_path, [&](const std::vector<std::string>& args) {
+      received.push_back(args);
+      if (args.size() > 0 && args[0] == "fail") {
+        throw std::runtime_error("asked to fail");
+      }
+    });
+  });
+
+  auto reply = request(socket_path, { "submit", "-g", "in.gbp", "-d", "8" });
+  cr_assert_eq(reply.size(), 2);
+  cr_assert(reply[0] == "queued 1");
+  cr_assert(reply[1].compare(0, 7, "done 1 ") == 0);
+
+  reply = request(socket_path, { "submit", "fail" });
+  cr_assert_eq(reply.size(), 2);
+  cr_assert(reply[0] == "queued 2");
+  cr_assert(reply[1] == "failed 2 asked to fail");
+
+  reply = request(socket_path, { "status" });
+  cr_assert_eq(reply.size(), 2);
+  cr_assert(reply[0].compare(0, 7, "1 done ") == 0);
+  cr_assert(reply[0].find("-g in.gbp -d 8") != std::string::npos);
+  cr_assert(reply[1].compare(0, 9, "2 failed ") == 0);
+
+  reply = request(socket_path, { "frobnicate" });
+  cr_assert_eq(reply.size(), 1);
+  cr_assert(reply[0].compare(0, 6, "error ") == 0);
+
+  reply = request(socket_path, { "shutdown" });
+  cr_assert_eq(reply.size(), 1);
+  cr_assert(reply[0] == "stopping");
+  server.join();
+
+  // The jobs arrive with their arguments intact, and the socket is removed
+  cr_assert_eq(received.size(), 2);
+  cr_assert(received[0] == std::vector<std::string>({ "-g", "in.gbp", "-d", "8" }));
+  bool refused = false;
+  try {
+    send_request(socket_path, { "status" });
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  cr_assert(refused);
+}
+
+Test(serve, grid_pool)
+{
+  const std::array<int32_t, 3> n_cell = { 8, 8, 8 };
+  const std::array<double, 3> box_size = { 10., 10., 10. };
+  GridOptions options;
+  options.engine = fft_engine::fused;
+
+  // Without pooling released grids are freed
+  auto grid = acquire_grid<float>(n_cell, box_size, options);
+  release_grid(grid);
+  cr_assert(!grid);
+  cr_assert_eq(pooled_grid_bytes(), 0);
+
+  enable_grid_pool(true);
+  grid = acquire_grid<float>(n_cell, box_size, options);
+  const Grid<float>* first = grid.get();
+  grid->sample({ 4, 4, 4 });
+  release_grid(grid);
+  cr_assert_eq(pooled_grid_bytes(), sizeof(float) * 8 * 8 * 10);
+
+  // A job of the same size gets the same grid back, restored to full size
+  grid = acquire_grid<float>(n_cell, { 20., 20., 20. }, options);
+  cr_assert_eq(grid.get(), first);
+  cr_assert_eq(grid->n_logical, 8 * 8 * 8);
+  cr_assert_float_eq(grid->box_size[0], 20., 1e-12);
+  cr_assert_eq(pooled_grid_bytes(), 0);
+  release_grid(grid);
+
+  // A different size or engine gets a new grid
+  grid = acquire_grid<float>({ 8, 8, 4 }, box_size, options);
+  cr_assert_eq(grid->n_logical, 8 * 8 * 4);
+  release_grid(grid);
+  options.engine = fft_engine::fftw_3d;
+  auto other = acquire_grid<float>({ 8, 8, 4 }, box_size, options);
+  cr_assert_eq(pooled_grid_bytes(), 0);
+  release_grid(other);
+
+  enable_grid_pool(false);
+  cr_assert_eq(pooled_grid_bytes(), 0);
+}
+
+Test(serve, submit_from_other_directory)
+{
+  const std::string socket_path = "test_serve_dir.sock";
+  std::vector<std::string> received;
+  std::thread server([&]() {
+    serve(socket_path, [&](const std::vector<std::string>& args) {
+      received = args;
+      if (!std::ifstream(args[1]).good()) {
+        throw std::runtime_error("can't open " + args[1]);
+      }
+    });
+  });
+
+  // The client runs in a subdirectory, where its input is
+  mkdir("test_serve_client", 0755);
+  std::ofstream("test_serve_client/in.gbp") << "grid";
+  char dir[PATH_MAX];
+  cr_assert(realpath("test_serve_client", dir) != nullptr);
+  cr_assert_eq(chdir("test_serve_client"), 0);
+  const auto job = submitted_arguments(
+    { "regrider", "-g", "in.gbp", "--submit", socket_path, "-d", "8", "--output=out.gbp", "-r./in.gbp" });
+  cr_assert_eq(chdir(".."), 0);
+
+  const std::string prefix(dir);
+  cr_assert(job == std::vector<std::string>({ "-g",
+                                               prefix + "/in.gbp",
+                                               "-d",
+                                               "8",
+                                               "--output=" + prefix + "/out.gbp",
+                                               "-r" + prefix + "/in.gbp" }));
+
+  // The server, running in the parent directory, finds the client's input
+  auto request_args = job;
+  request_args.insert(request_args.begin(), "submit");
+  auto reply = request(socket_path, request_args);
+  cr_assert_eq(reply.size(), 2);
+  cr_assert(reply[1].compare(0, 7, "done 1 ") == 0);
+  cr_assert(received == job);
+
+  request(socket_path, { "shutdown" });
+  server.join();
+  std::remove("test_serve_client/in.gbp");
+  rmdir("test_serve_client");
+}
@@ -0,0 +1,74 @@
+#include <array>
+#include <cmath>
+#include <criterion/criterion.h>
+#include <grid.hpp>
+#include <stats.hpp>
+#include <vector>
+
+Test(stats, sample)
+{
+  std::array<int32_t, 3> n_cell = { 16, 16, 16 };
+  std::array<int32_t, 3> new_n_cell = { 4, 4, 4 };
+  std::array<double, 3> box_size = { 10., 10., 10. };
+
+  Grid<double> grid(n_cell, box_size);
+  std::vector<double> values(grid.n_logical);
+  double input_sum = 0;
+  for (int ii = 0; ii < grid.n_logical; ++ii) {
+    values[ii] = grid.get()[ii] = 0.5 + (double)((ii * 7919) % 101) / 101.0;
+    input_sum += values[ii];
+  }
+
+  GridStats stats;
+  grid.sample(new_n_cell, &stats);
+
+  // Compare with a serial sample of every fourth cell
+  double sum = 0, sum_sq = 0, min = 1e30, max = -1e30;
+  int idx = 0;
+  for (int ii = 0; ii < 16; ii += 4) {
+    for (int jj = 0; jj < 16; jj += 4) {
+      for (int kk = 0; kk < 16; kk += 4, ++idx) {
+        const double value = values[(ii * 16 + jj) * 16 + kk];
+        cr_assert_eq(grid.get()[idx], value);
+        sum += value;
+        sum_sq += value * value;
+        min = std::fmin(min, value);
+        max = std::fmax(max, value);
+      }
+    }
+  }
+
+  const double mean = sum / 64;
+  cr_assert_eq(stats.n, 64);
+  cr_assert_eq(stats.min, min);
+  cr_assert_eq(stats.max, max);
+  cr_assert(std::fabs(stats.mean - mean) < 1e-12);
+  cr_assert(std::fabs(stats.variance - (sum_sq / 64 - mean * mean)) < 1e-12);
+  cr_assert(std::fabs(stats.input_mean - input_sum / 4096) < 1e-12);
+  cr_assert(std::fabs(stats.mass_ratio() - mean / (input_sum / 4096)) < 1e-12);
+
+  int64_t total = stats.n_below + stats.n_above;
+  for (const auto count : stats.histogram) {
+    total += count;
+  }
+  cr_assert_eq(total, 64);
+}
+
+Test(stats, histogram)
+{
+  // Values of 0, 0.1, 1 and 10 times the reference, plus one far above the range
+  const float values[] = { 0.0f, 0.2f, 2.0f, 20.0f, 2e10f };
+  auto stats = compute_stats(values, 5, 2.0);
+
+  cr_assert_eq(stats.n_below, 1);
+  cr_assert_eq(stats.n_above, 1);
+  const int zero = static_cast<int>(-StatsAccumulator::lowest / StatsAccumulator::bin_width + 0.5);
+  cr_assert_eq(stats.histogram[zero - 10], 1);
+  cr_assert_eq(stats.histogram[zero], 1);
+  cr_assert_eq(stats.histogram[zero + 10], 1);
+
+  // Without an input mean the histogram is relative to the output mean, and mass conservation is unknown
+  stats = compute_stats(values, 4, std::nan(""));
+  cr_assert(std::fabs(stats.reference - 5.55) < 1e-6);
+  cr_assert(std::isnan(stats.mass_ratio()));
+}
@@ -0,0 +1,70 @@
+#include <H5Cpp.h>
+#include <array>
+#include <criterion/criterion.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <synthetic.hpp>
+#include <vector>
+
+static void fill(const int i_grid, const int i, float* plane)
+{
+  for (int jj = 0; jj < 4; ++jj) {
+    for (int kk = 0; kk < 4; ++kk) {
+      plane[jj * 4 + kk] = (float)(i_grid * 1000 + i * 100 + jj * 10 + kk);
+    }
+  }
+}
+
+Test(synthetic, gbptrees)
+{
+  const std::string fname = "test_synthetic.gbp";
+  write_synthetic_gbptrees(fname, { 4, 4, 4 }, { 10., 10., 10. }, { "density", "vx" }, fill);
+
+  std::ifstream ifs(fname, std::ios::binary | std::ios::in);
+  std::array<int, 3> n_cell;
+  std::array<double, 3> box_size;
+  int32_t n_grids, ma_scheme;
+  ifs.read((char*)n_cell.data(), sizeof(int) * 3);
+  ifs.read((char*)box_size.data(), sizeof(double) * 3);
+  ifs.read((char*)&n_grids, sizeof(int));
+  ifs.read((char*)&ma_scheme, sizeof(int));
+  cr_assert_eq(n_cell[0], 4);
+  cr_assert_eq(box_size[2], 10.);
+  cr_assert_eq(n_grids, 2);
+
+  for (int i_grid = 0; i_grid < n_grids; ++i_grid) {
+    char ident[32];
+    ifs.read(ident, sizeof(ident));
+    cr_assert(std::strcmp(ident, i_grid == 0 ? "density" : "vx") == 0);
+
+    std::vector<float> values(64);
+    ifs.read((char*)values.data(), sizeof(float) * values.size());
+    cr_assert_eq(values[(2 * 4 + 1) * 4 + 3], (float)(i_grid * 1000 + 213));
+  }
+  cr_assert(ifs.good());
+
+  std::remove(fname.c_str());
+}
+
+Test(synthetic, velociraptor)
+{
+  const std::string fname = "test_synthetic.h5";
+  write_synthetic_velociraptor(fname, { 4, 4, 4 }, { 10., 10., 10. }, fill);
+
+  auto file = H5::H5File(fname, H5F_ACC_RDONLY);
+  auto attr = file.openGroup("/Parameters").openAttribute("DensityGrids:grid_dim");
+  std::string dim;
+  attr.read(attr.getDataType(), dim);
+  cr_assert(dim == "4");
+
+  const auto& names = velociraptor_grid_names();
+  cr_assert_eq(names.size(), 4);
+  std::vector<float> values(64);
+  file.openGroup("/PartType1/Grids").openDataSet("Density").read(values.data(), H5::PredType::NATIVE_FLOAT);
+  cr_assert_eq(values[(3 * 4 + 2) * 4 + 1], 3321.f);
+
+  file.close();
+  std::remove(fname.c_str());
+}
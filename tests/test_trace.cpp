@@ -0,0 +1,56 @@
+#include <criterion/criterion.h>
+#include <cstdio>
+#include <fstream>
+#include <profile.hpp>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int count(const std::string& haystack, const std::string& needle)
+{
+  int n = 0;
+  for (size_t pos = haystack.find(needle); pos != std::string::npos; pos = haystack.find(needle, pos + 1)) {
+    ++n;
+  }
+  return n;
+}
+
+Test(trace, spans)
+{
+  // Nothing is recorded before tracing is enabled
+  {
+    TraceSpan span("before");
+  }
+
+  enable_tracing();
+  {
+    TraceSpan span("grid", "a \"quoted\" name");
+    ScopedPhase scope(phase::filter);
+
+    std::vector<std::thread> threads;
+    for (int ii = 0; ii < 3; ++ii) {
+      threads.emplace_back([]() { TraceSpan thread_span("work"); });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  const std::string fname = "test_trace.json";
+  write_trace(fname);
+  std::ifstream ifs(fname);
+  std::stringstream buffer;
+  buffer << ifs.rdbuf();
+  const auto trace = buffer.str();
+
+  cr_assert_eq(count(trace, "\"before\""), 0);
+  cr_assert_eq(count(trace, "\"name\": \"grid\""), 1);
+  cr_assert_eq(count(trace, "a \\\"quoted\\\" name"), 1);
+  cr_assert_eq(count(trace, "\"name\": \"filter\""), 1);
+  cr_assert_eq(count(trace, "\"name\": \"work\""), 3);
+  cr_assert_eq(count(trace, "\"name\": \"main\""), 1);
+  cr_assert(count(trace, "\"thread_name\"") >= 3);
+
+  std::remove(fname.c_str());
+}
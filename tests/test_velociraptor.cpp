@@ -0,0 +1,162 @@
+#include <H5Cpp.h>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <criterion/criterion.h>
+#include <cstdio>
+#include <grid.hpp>
+#include <string>
+#include <synthetic.hpp>
+#include <vector>
+#include <velociraptor.hpp>
+
+static const std::array<int, 3> n_cell = { 8, 8, 8 };
+static const std::array<double, 3> box_size = { 10., 10., 10. };
+static const int new_dim = 4;
+
+static float value(const int i_grid, const int i, const int j, const int k)
+{
+  return 1.0f + 0.5f * std::sin(0.7f * i + 0.3f * j + 1.1f * k + i_grid);
+}
+
+static void fill(const int i_grid, const int i, float* plane)
+{
+  for (int jj = 0; jj < n_cell[1]; ++jj) {
+    for (int kk = 0; kk < n_cell[2]; ++kk) {
+      plane[jj * n_cell[2] + kk] = value(i_grid, i, jj, kk);
+    }
+  }
+}
+
+/** Filter and sample grid `i_grid` directly, as `regrid_velociraptor` should.
+ */
+static std::vector<float> expected(const int i_grid)
+{
+  Grid<float> grid(n_cell, box_size);
+  for (int ii = 0; ii < n_cell[0]; ++ii) {
+    fill(i_grid, ii, grid.get() + ii * n_cell[1] * n_cell[2]);
+  }
+  grid.filter(GridBase::filter_type::real_top_hat, box_size[0] / new_dim * 0.5);
+  grid.sample({ new_dim, new_dim, new_dim });
+  return std::vector<float>(grid.get(), grid.get() + grid.n_logical);
+}
+
+/** Compute the divergence of the filtered velocity grids at the sampled points directly, summing i k . v(k) over
+ * every mode except the Nyquist ones.
+ */
+static std::vector<double> expected_divergence()
+{
+  const int middle = n_cell[2] / 2;
+  const int n_every = n_cell[0] / new_dim;
+  std::vector<std::complex<double>> sums(new_dim * new_dim * new_dim);
+
+  for (int i_grid = 0; i_grid < 3; ++i_grid) {
+    Grid<double> grid(n_cell, box_size);
+    for (int ii = 0; ii < n_cell[0]; ++ii) {
+      for (int jj = 0; jj < n_cell[1]; ++jj) {
+        for (int kk = 0; kk < n_cell[2]; ++kk) {
+          grid.get()[grid.index(ii, jj, kk, GridBase::index_type::real)] = value(i_grid, ii, jj, kk);
+        }
+      }
+    }
+    grid.forward_fft();
+    grid.convolve(GridBase::filter_type::real_top_hat, box_size[0] / new_dim * 0.5);
+
+    for (int n_x = 0; n_x < n_cell[0]; ++n_x) {
+      for (int n_y = 0; n_y < n_cell[1]; ++n_y) {
+        for (int n_z = 0; n_z < middle; ++n_z) {
+          if (n_x == middle || n_y == middle) {
+            continue;
+          }
+          const std::array<int, 3> n = { n_x > middle ? n_x - n_cell[0] : n_x,
+                                         n_y > middle ? n_y - n_cell[1] : n_y,
+                                         n_z };
+          const double k = 2.0 * M_PI * n[i_grid] / box_size[i_grid];
+          const std::complex<double> mode =
+            grid.get_complex()[grid.index(n_x, n_y, n_z, GridBase::index_type::complex_herm)];
+          // The modes with n_z > 0 also stand in for their (unstored) conjugates
+          const double weight = n_z == 0 ? 1.0 : 2.0;
+
+          for (int ii = 0; ii < new_dim; ++ii) {
+            for (int jj = 0; jj < new_dim; ++jj) {
+              for (int kk = 0; kk < new_dim; ++kk) {
+                const double phase = 2.0 * M_PI * (n[0] * ii + n[1] * jj + n[2] * kk) * n_every / n_cell[0];
+                sums[(ii * new_dim + jj) * new_dim + kk] +=
+                  weight * std::complex<double>(0, k) * mode * std::polar(1.0, phase);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // The imaginary parts of the n_z = 0 modes cancel, as do those of the doubled ones once their conjugates are added
+  std::vector<double> divergence(sums.size());
+  for (size_t ii = 0; ii < sums.size(); ++ii) {
+    divergence[ii] = sums[ii].real();
+  }
+  return divergence;
+}
+
+static void check_fft_run(const DerivedOptions derived)
+{
+  const std::string fname_in = "test_velociraptor_in.h5";
+  const std::string fname_out = "test_velociraptor_out.h5";
+  write_synthetic_velociraptor(fname_in, n_cell, box_size, fill);
+  create_velociraptor_output(fname_out, n_cell[0]);
+
+  RegridOptions options;
+  options.method = regrid_method::fft;
+  options.derived = derived;
+  regrid_velociraptor<float>(fname_in, fname_out, new_dim, options);
+
+  auto file = H5::H5File(fname_out, H5F_ACC_RDONLY);
+  auto attr = file.openGroup("/Parameters").openAttribute("DensityGrids:grid_dim");
+  std::string dim;
+  attr.read(attr.getDataType(), dim);
+  cr_assert(dim == "4");
+
+  auto group = file.openGroup("/PartType1/Grids");
+  const auto& names = velociraptor_grid_names();
+  for (int i_grid = 0; i_grid < (int)names.size(); ++i_grid) {
+    auto ds = group.openDataSet(names[i_grid]);
+    cr_assert_eq(ds.getSpace().getSimpleExtentNpoints(), new_dim * new_dim * new_dim);
+    std::vector<float> values(new_dim * new_dim * new_dim);
+    ds.read(values.data(), H5::PredType::NATIVE_FLOAT);
+    const auto reference = expected(i_grid);
+    for (size_t ii = 0; ii < values.size(); ++ii) {
+      cr_assert_float_eq(values[ii], reference[ii], 1e-5);
+    }
+  }
+  if (derived.divergence) {
+    cr_assert(H5Lexists(group.getId(), "VelocityDivergence", H5P_DEFAULT) > 0);
+    auto ds = group.openDataSet("VelocityDivergence");
+    std::vector<float> values(new_dim * new_dim * new_dim);
+    ds.read(values.data(), H5::PredType::NATIVE_FLOAT);
+    const auto reference = expected_divergence();
+    double max_abs = 0;
+    for (size_t ii = 0; ii < values.size(); ++ii) {
+      cr_assert_float_eq(values[ii], reference[ii], 1e-4);
+      max_abs = std::fmax(max_abs, std::fabs(reference[ii]));
+    }
+    // The comparison means nothing if the filtered fields have no divergence
+    cr_assert_gt(max_abs, 1e-2);
+  }
+
+  file.close();
+  std::remove(fname_in.c_str());
+  std::remove(fname_out.c_str());
+}
+
+Test(velociraptor, fft)
+{
+  check_fft_run(DerivedOptions());
+}
+
+Test(velociraptor, fft_derived)
+{
+  DerivedOptions derived;
+  derived.divergence = true;
+  check_fft_run(derived);
+}